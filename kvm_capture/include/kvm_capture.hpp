@@ -12,6 +12,8 @@
 #include <memory>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 namespace kvm {
 
@@ -53,13 +55,12 @@ struct FormatInfo
     int Height = 0;
 };
 
+class V4L2Capture;
+
 struct CameraFrame
 {
     // Returns frame to V4L2Capture object when it goes out of scope
-    ~CameraFrame()
-    {
-        ReleaseFunc();
-    }
+    ~CameraFrame();
 
     // Metadata
     uint64_t FrameNumber = 0;
@@ -69,7 +70,9 @@ struct CameraFrame
     uint8_t* Image = nullptr;
     unsigned ImageBytes = 0;
 
-    std::function<void()> ReleaseFunc;
+    // Capture buffer to return
+    V4L2Capture* Owner = nullptr;
+    unsigned BufferIndex = 0;
 
     FormatInfo Format;
 };
@@ -89,6 +92,8 @@ public:
     }
 
     bool Initialize(FrameHandler handler);
+
+    // Waits for the application to release all frames before returning
     void Shutdown();
 
     bool Start();
@@ -111,13 +116,20 @@ protected:
 
     FormatInfo Format;
 
+    // Signalled when the application releases a frame
+    std::mutex ReturnLock;
+    std::condition_variable ReturnCondition;
+
     void Loop();
 
     bool ReadFormat();
     bool RequestBuffers(unsigned count);
     bool QueueBuffer(unsigned index);
+    void ReturnBuffer(unsigned index);
     bool AcquireFrame();
     int GetAppOwnedCount() const;
+
+    friend struct CameraFrame;
 };
 
 
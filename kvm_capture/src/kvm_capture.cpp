@@ -2,6 +2,8 @@
 
 #include "kvm_capture.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_pool.hpp"
+#include "kvm_trace.hpp"
 
 #include <poll.h>
 #include <errno.h>
@@ -48,6 +50,27 @@ static std::string PixelFormatToString(uint32_t pf)
 }
 
 
+//------------------------------------------------------------------------------
+// CameraFrame
+
+/*
+    Frames and their reference counts come from a static pool so capturing
+    does not allocate.  The pool is static because the block is freed after
+    ~CameraFrame() returns the buffer, and by then Shutdown() may have let
+    the V4L2Capture object go.  Room for two sets of buffers covers a
+    restart while the old frames are still being released.
+*/
+typedef BlockPool<sizeof(CameraFrame) + 64, kCameraBufferCount * 2> CameraFramePool;
+static CameraFramePool FramePool;
+
+CameraFrame::~CameraFrame()
+{
+    if (Owner) {
+        Owner->ReturnBuffer(BufferIndex);
+    }
+}
+
+
 //------------------------------------------------------------------------------
 // V4L2
 
@@ -221,18 +244,15 @@ void V4L2Capture::Shutdown()
 
     Stop();
 
-    for (;;)
     {
-        const int count = GetAppOwnedCount();
-        if (count > 0) {
-            Logger.Warn("Waiting for ", count, " buffers to be returned by application");
-            ThreadSleepForMsec(250);
-            continue;
+        std::unique_lock<std::mutex> locker(ReturnLock);
+        while (GetAppOwnedCount() > 0) {
+            if (ReturnCondition.wait_for(locker, std::chrono::seconds(1)) == std::cv_status::timeout) {
+                Logger.Warn("Waiting for ", GetAppOwnedCount(), " buffers to be returned by application");
+            }
         }
-
-        Logger.Info("Application has returned all buffers");
-        break;
     }
+    Logger.Info("Application has returned all buffers");
 
     Logger.Info("Unmapping buffers");
 
@@ -318,6 +338,15 @@ bool V4L2Capture::QueueBuffer(unsigned index)
     return true;
 }
 
+void V4L2Capture::ReturnBuffer(unsigned index)
+{
+    QueueBuffer(index);
+
+    // Wake up Shutdown() if it is waiting for this buffer
+    std::lock_guard<std::mutex> locker(ReturnLock);
+    ReturnCondition.notify_all();
+}
+
 bool V4L2Capture::Start()
 {
     if (fd < 0) {
@@ -366,6 +395,8 @@ bool V4L2Capture::AcquireFrame()
         return false; // Timeout
     }
 
+    TraceScope trace_scope("Capture");
+
     struct v4l2_buffer buf{};
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     buf.memory = V4L2_MEMORY_MMAP;
@@ -398,16 +429,18 @@ bool V4L2Capture::AcquireFrame()
     buffer.AppOwns = true;
     buffer.Queued = false;
 
-    std::shared_ptr<CameraFrame> frame = std::make_shared<CameraFrame>();
+    std::shared_ptr<CameraFrame> frame = std::allocate_shared<CameraFrame>(
+        PoolAllocator<CameraFrame, CameraFramePool>(&FramePool));
     frame->FrameNumber = buf.sequence;
     frame->ShutterUsec = buf.timestamp.tv_sec * UINT64_C(1000000) + buf.timestamp.tv_usec;
     frame->Image = buffer.Image;
     frame->ImageBytes = buf.bytesused;
-    frame->ReleaseFunc = [this, index]() {
-        QueueBuffer(index);
-    };
+    frame->Owner = this;
+    frame->BufferIndex = index;
     frame->Format = Format;
 
+    TraceCounter("Capture bytes", buf.bytesused);
+
     Handler(frame);
     return true;
 }
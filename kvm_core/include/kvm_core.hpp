@@ -8,6 +8,7 @@
 
 #include <cstdint>      // uint8_t etc types
 #include <cstring>
+#include <atomic>       // std::atomic_thread_fence
 #include <memory>       // std::unique_ptr, std::shared_ptr
 #include <new>          // std::nothrow
 #include <mutex>        // std::mutex
@@ -89,6 +90,26 @@ public:
     }
 };
 
+/*
+    Returns true if `ptr` holds the only reference to its object, so a pool
+    can reuse the object.  Only meaningful if no other thread can add a
+    reference meanwhile, for example when only the caller hands out copies.
+
+    use_count() is a relaxed load, so on its own it does not order the reuse
+    after what other threads did with the object before dropping their
+    references.  The acquire fence pairs with the release in the reference
+    count decrement to provide that ordering.
+*/
+template<typename T>
+inline bool IsOnlyReference(const std::shared_ptr<T>& ptr)
+{
+    if (!ptr || ptr.use_count() != 1) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
 /// Join a std::shared_ptr<std::thread>
 inline void JoinThread(std::shared_ptr<std::thread>& th)
 {
@@ -116,7 +137,8 @@ uint64_t GetTimeMsec();
 //------------------------------------------------------------------------------
 // Thread Tools
 
-/// Set the current thread name
+/// Set the current thread name, and apply any policy registered for the
+/// name with SetThreadPolicy() (see kvm_thread.hpp)
 void SetCurrentThreadName(const char* name);
 
 /// Sleep for a number of milliseconds
@@ -133,6 +155,14 @@ std::string HexDump(const uint8_t* data, int bytes);
 std::string HexString(uint64_t value);
 
 
+//------------------------------------------------------------------------------
+// Hashing
+
+/// Fast non-cryptographic 64-bit hash of a buffer (MurmurHash64A).
+/// Used to detect changes between frames, not for security.
+uint64_t HashBytes(const void* data, int bytes, uint64_t seed = 0);
+
+
 //------------------------------------------------------------------------------
 // Copy Strings
 
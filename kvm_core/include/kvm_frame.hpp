@@ -33,6 +33,9 @@ enum class PixelFormat
     RGB24,
 };
 
+// Width of the tiles in Frame::DirtyTiles, matching the encoder macroblocks
+static const int kDirtyTileWidth = 16;
+
 
 //------------------------------------------------------------------------------
 // Frame
@@ -42,14 +45,71 @@ struct Frame
     Frame();
     ~Frame();
 
+    // Allocated size, padded up to the encoder macroblock alignment
     int Width = 0;
     int Height = 0;
+
+    // Size of the image within the padded frame
+    int VisibleWidth = 0;
+    int VisibleHeight = 0;
+
     PixelFormat Format = PixelFormat::YUV422P;
     int AllocatedBytes = 0;
 
     uint8_t* Planes[3];
+
+    /*
+        Change tracking filled in by the decoder.
+
+        DirtyRows: One entry per DirtyRowHeight rows of the image: Nonzero if
+        those rows changed since the previous frame from the same source.
+        Empty means that the whole image should be treated as changed.
+
+        DirtyTiles: Finer detail when the pixels were compared with the
+        previous frame.  One entry per kDirtyTileWidth x DirtyRowHeight tile,
+        with DirtyTilesWide tiles per row: Nonzero if any pixel in the tile
+        changed.  Empty if only DirtyRows is known.
+    */
+    std::vector<uint8_t> DirtyRows;
+    int DirtyRowHeight = 0;
+    std::vector<uint8_t> DirtyTiles;
+    int DirtyTilesWide = 0;
+
+    // Mark the whole image as changed
+    void SetAllDirty()
+    {
+        DirtyRows.clear();
+        DirtyRowHeight = 0;
+        DirtyTiles.clear();
+        DirtyTilesWide = 0;
+    }
+
+    // Start tracking changes per tile, with all tiles unchanged
+    void ClearDirtyTiles(int row_height);
+
+    // True unless change tracking shows that no rows changed
+    bool IsChanged() const;
+
+    // True if the chroma planes are known to contain only neutral grey,
+    // so luma-only decoding does not need to write them again.
+    // Must be cleared by anything that writes chroma into the frame
+    bool NeutralChroma = false;
+
+    // Fill the chroma planes with neutral grey (128) unless already done
+    void SetNeutralChroma();
 };
 
+/*
+    Compare one row of tiles between two YUV420P frames of the same size, and
+    mark the tiles that differ in next.DirtyTiles and next.DirtyRows.
+    ClearDirtyTiles() must have been called on `next` first.
+
+    Different rows of tiles can be compared in parallel.  This is meant to run
+    on each band of the image right after it is decoded, while it is still in
+    cache, rather than as a separate pass over the whole frame.
+*/
+void DiffFrameTileRow(const Frame& prev, Frame& next, int row);
+
 
 //------------------------------------------------------------------------------
 // FramePool
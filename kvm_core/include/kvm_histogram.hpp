@@ -0,0 +1,110 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Latency histogram
+
+    Averages and maximums hide the shape of a latency distribution: A stage
+    that usually takes 5 msec but takes 60 msec once a second looks fine on
+    average.  LatencyHistogram keeps the whole distribution, so percentiles
+    like p99 can be reported.
+
+    Buckets are log-linear like HdrHistogram: Values below 64 get a bucket
+    each, and every power of two above that is split into 32 equal buckets.
+    Every value is kept to within about 3%, from 1 usec up to more than an
+    hour, in a fixed array.  Recording a value is a few instructions and
+    never allocates.
+
+    LatencyHistogram is not thread-safe.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Each power of two is split into 2^kHistogramSubBucketBits buckets
+static const int kHistogramSubBucketBits = 5;
+static const int kHistogramSubBuckets = 1 << kHistogramSubBucketBits;
+
+// Values at or above 2^kHistogramValueBits are counted in the last bucket
+static const int kHistogramValueBits = 32;
+
+static const int kHistogramBucketCount =
+    (kHistogramValueBits - kHistogramSubBucketBits + 1) * kHistogramSubBuckets;
+
+// Bucket that holds a value
+int GetHistogramBucket(uint64_t value);
+
+// Smallest and largest values that land in a bucket
+uint64_t GetHistogramBucketLow(int bucket);
+uint64_t GetHistogramBucketHigh(int bucket);
+
+
+//------------------------------------------------------------------------------
+// LatencyHistogram
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        Reset();
+    }
+
+    void Reset();
+
+    void Record(uint64_t value)
+    {
+        Counts[GetHistogramBucket(value)]++;
+        if (Count == 0 || MinValue > value) {
+            MinValue = value;
+        }
+        if (MaxValue < value) {
+            MaxValue = value;
+        }
+        Total += value;
+        Count++;
+    }
+
+    // Add the values recorded in another histogram
+    void Merge(const LatencyHistogram& other);
+
+    uint64_t GetCount() const
+    {
+        return Count;
+    }
+    uint64_t GetMin() const
+    {
+        return MinValue;
+    }
+    uint64_t GetMax() const
+    {
+        return MaxValue;
+    }
+    float GetMean() const
+    {
+        return Count > 0 ? Total / (float)Count : 0.f;
+    }
+
+    /*
+        Returns the value that percentile (0..100) percent of the recorded
+        values are at or below, rounded up to the top of its bucket.
+        Returns 0 if nothing was recorded.
+    */
+    uint64_t GetPercentile(float percentile) const;
+
+protected:
+    uint32_t Counts[kHistogramBucketCount];
+    uint64_t Count = 0;
+    uint64_t Total = 0;
+    uint64_t MinValue = 0;
+    uint64_t MaxValue = 0;
+};
+
+
+} // namespace kvm
@@ -0,0 +1,235 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Metrics registry
+
+    Counters, gauges and histograms that any thread can update without
+    locks, and a Prometheus text exposition of all of them, so monitoring
+    can scrape every KVM and graph rates and percentiles over time.
+
+    Metrics are registered once, usually at startup, and the registry owns
+    them for the life of the process, so the returned pointer can be kept
+    and updated from the hot path.  Updates are relaxed atomic adds and
+    stores.  A scrape reads the atomics while they are being updated, so a
+    histogram count may be off by the few values recorded during the scrape,
+    which Prometheus tolerates.
+
+    Naming follows Prometheus conventions: Counters end in _total, and
+    times are exported in seconds.  Metrics with the same name and
+    different labels are one family, for example:
+
+        GetMetricsRegistry().GetCounter("kvm_video_dropped_frames_total",
+            "Frames dropped before delivery", "reason=\"backpressure\"");
+
+    MetricsServer answers HTTP GET /metrics on a TCP port with the
+    exposition text.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_histogram.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Metrics
+
+// Value that only goes up, such as frames or bytes sent
+class MetricCounter
+{
+public:
+    void Add(uint64_t count = 1)
+    {
+        Value.fetch_add(count, std::memory_order_relaxed);
+    }
+    uint64_t Get() const
+    {
+        return Value.load(std::memory_order_relaxed);
+    }
+
+protected:
+    std::atomic<uint64_t> Value = ATOMIC_VAR_INIT(0);
+};
+
+// Value that goes up and down, such as a queue depth
+class MetricGauge
+{
+public:
+    void Set(double value)
+    {
+        Value.store(value, std::memory_order_relaxed);
+    }
+    double Get() const
+    {
+        return Value.load(std::memory_order_relaxed);
+    }
+
+protected:
+    std::atomic<double> Value = ATOMIC_VAR_INIT(0.);
+};
+
+/*
+    Distribution of integer values, such as encode times in microseconds or
+    frame sizes in bytes, in the log-linear buckets of kvm_histogram.hpp.
+
+    The exposition merges them into power-of-two buckets, multiplied by the
+    scale given at registration, for example 1e-6 to export microseconds as
+    seconds.  The values below 2^N are exported with the bound
+    le="(2^N - 1) * scale", since Prometheus bounds include equal values.
+*/
+class MetricHistogram
+{
+public:
+    MetricHistogram();
+
+    void Record(uint64_t value)
+    {
+        Counts[GetHistogramBucket(value)].fetch_add(1, std::memory_order_relaxed);
+        Sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Snapshot of the counts and sum
+    uint64_t GetCount() const;
+    uint64_t GetSum() const
+    {
+        return Sum.load(std::memory_order_relaxed);
+    }
+
+    // Value at the percentile (0..100), within the bucket precision
+    uint64_t GetPercentile(float percentile) const;
+
+    // Values below 2^bits
+    uint64_t GetCountBelowPowerOfTwo(int bits) const;
+
+protected:
+    std::atomic<uint64_t> Counts[kHistogramBucketCount];
+    std::atomic<uint64_t> Sum = ATOMIC_VAR_INIT(0);
+};
+
+
+//------------------------------------------------------------------------------
+// MetricsRegistry
+
+enum class MetricType
+{
+    Counter,
+    Gauge,
+    Histogram
+};
+
+class MetricsRegistry
+{
+public:
+    /*
+        Returns the metric with this name and labels, registering it the
+        first time.  Labels are written as-is inside the braces, for example
+        `stage="decoder"`, or empty for none.  The help text and scale of
+        the first registration are kept.
+
+        Returns nullptr if the name is already registered with another type.
+        Thread-safe.
+    */
+    MetricCounter* GetCounter(const std::string& name, const std::string& help, const std::string& labels = "");
+    MetricGauge* GetGauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    MetricHistogram* GetHistogram(const std::string& name, const std::string& help,
+        const std::string& labels = "", double scale = 1.);
+
+    // Write every metric in the Prometheus text format.  Thread-safe
+    void WritePrometheus(std::ostream& out) const;
+
+protected:
+    struct Metric
+    {
+        std::string Labels;
+        std::unique_ptr<MetricCounter> Counter;
+        std::unique_ptr<MetricGauge> Gauge;
+        std::unique_ptr<MetricHistogram> Histogram;
+    };
+
+    struct Family
+    {
+        std::string Name;
+        std::string Help;
+        MetricType Type = MetricType::Counter;
+        double Scale = 1.;
+        std::vector<std::unique_ptr<Metric>> Metrics;
+    };
+
+    mutable std::mutex Lock;
+    std::vector<std::unique_ptr<Family>> Families;
+
+    Metric* GetMetric(MetricType type, const std::string& name, const std::string& help,
+        const std::string& labels, double scale);
+};
+
+// Process-wide registry
+MetricsRegistry& GetMetricsRegistry();
+
+
+//------------------------------------------------------------------------------
+// MetricsServer
+
+// Default port for the exposition
+static const int kDefaultMetricsPort = 9110;
+
+/*
+    Minimal HTTP server for Prometheus to scrape.  Answers GET /metrics with
+    the registry in the text format, one connection at a time, from its own
+    thread.
+
+    Sockets are never waited on without a deadline, and the waits are cut
+    short by Shutdown(), so a stuck scraper cannot hold up the thread.
+*/
+class MetricsServer
+{
+public:
+    ~MetricsServer()
+    {
+        Shutdown();
+    }
+
+    // Listen on the address, such as "127.0.0.1" for local scrapes only or
+    // "0.0.0.0" for all interfaces.  Returns false if the port is not available
+    bool Start(
+        const std::string& address = "127.0.0.1",
+        int port = kDefaultMetricsPort,
+        MetricsRegistry* registry = &GetMetricsRegistry());
+    void Shutdown();
+
+    // Port being listened on, which is chosen by the OS if 0 was requested
+    int GetPort() const
+    {
+        return Port;
+    }
+
+protected:
+    MetricsRegistry* Registry = nullptr;
+    int ListenSocket = -1;
+    int Port = 0;
+
+    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
+    std::shared_ptr<std::thread> Thread;
+
+    void Loop();
+    void HandleConnection(int fd);
+
+    // Wait until the socket is ready for the poll() events.  Returns false
+    // on error, at the deadline, or on Shutdown()
+    bool WaitForSocket(int fd, short events, uint64_t deadline_msec);
+
+    // Returns false if the scraper did not take the data in time
+    bool SendAll(int fd, const std::string& data);
+};
+
+
+} // namespace kvm
@@ -0,0 +1,137 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Fixed block pool for objects handed out through std::shared_ptr
+
+    std::make_shared allocates the object and its reference counts from the
+    heap every time.  For objects created once per frame, BlockPool holds a
+    fixed number of blocks up front, and PoolAllocator plugs it into
+    std::allocate_shared so the object and its reference counts land in one
+    of those blocks instead.
+
+    Blocks are claimed and freed with one atomic flag each, so objects can be
+    released from any thread.  If every block is in use, or the allocation
+    is larger than a block, it falls back to the heap and counts it, so a
+    pool that is too small shows up in GetFallbackCount().
+
+    The pool must outlive every object allocated from it, including the time
+    after the object destructor runs and before its block is freed, so pools
+    are usually static.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// BlockPool
+
+template<size_t kBlockBytes, int kBlockCount>
+class BlockPool
+{
+public:
+    BlockPool()
+    {
+        for (auto& in_use : InUse) {
+            in_use = false;
+        }
+    }
+
+    void* Allocate(size_t bytes)
+    {
+        if (bytes <= kBlockBytes) {
+            for (int i = 0; i < kBlockCount; ++i) {
+                bool expected = false;
+                if (!InUse[i].load(std::memory_order_relaxed) &&
+                    InUse[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    return &Blocks[i];
+                }
+            }
+        }
+
+        ++FallbackCount;
+        return ::operator new(bytes);
+    }
+
+    void Free(void* ptr)
+    {
+        const uintptr_t offset = (uintptr_t)ptr - (uintptr_t)&Blocks[0];
+        if (offset < sizeof(Blocks)) {
+            InUse[offset / sizeof(Blocks[0])].store(false, std::memory_order_release);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    // Number of allocations that did not fit in the pool
+    uint64_t GetFallbackCount() const
+    {
+        return FallbackCount;
+    }
+
+protected:
+    typename std::aligned_storage<kBlockBytes>::type Blocks[kBlockCount];
+    std::atomic<bool> InUse[kBlockCount];
+    std::atomic<uint64_t> FallbackCount = ATOMIC_VAR_INIT(0);
+};
+
+
+//------------------------------------------------------------------------------
+// PoolAllocator
+
+// Allocator for std::allocate_shared() that takes its memory from a BlockPool
+template<typename T, typename PoolT>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolT* Pool = nullptr;
+
+    explicit PoolAllocator(PoolT* pool)
+        : Pool(pool)
+    {
+    }
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U, PoolT>& other)
+        : Pool(other.Pool)
+    {
+    }
+
+    template<typename U>
+    struct rebind
+    {
+        typedef PoolAllocator<U, PoolT> other;
+    };
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>( Pool->Allocate(n * sizeof(T)) );
+    }
+    void deallocate(T* ptr, size_t /*n*/)
+    {
+        Pool->Free(ptr);
+    }
+};
+
+template<typename T, typename U, typename PoolT>
+bool operator==(const PoolAllocator<T, PoolT>& a, const PoolAllocator<U, PoolT>& b)
+{
+    return a.Pool == b.Pool;
+}
+
+template<typename T, typename U, typename PoolT>
+bool operator!=(const PoolAllocator<T, PoolT>& a, const PoolAllocator<U, PoolT>& b)
+{
+    return a.Pool != b.Pool;
+}
+
+
+} // namespace kvm
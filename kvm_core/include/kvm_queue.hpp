@@ -0,0 +1,122 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Lock-free message queues between pipeline threads
+
+    SpscQueue is a fixed-size ring buffer for exactly one producer thread and
+    one consumer thread.  Push and Pop only touch two atomic indices, so the
+    steady state takes no locks and allocates nothing.
+
+    WakeEvent lets the consumer sleep while its queue is empty.  It is built on
+    a Linux futex, so Signal() only makes a system call if the consumer is
+    actually asleep.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <atomic>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Cache line size used to keep producer and consumer state apart
+static const int kCacheLineBytes = 64;
+
+
+//------------------------------------------------------------------------------
+// WakeEvent
+
+class WakeEvent
+{
+public:
+    // Wake the thread blocked in Wait(), or make its next Wait() return early
+    void Signal();
+
+    // Wait until Signal() is called or the timeout expires.
+    // Only one thread may wait at a time
+    void Wait(int timeout_msec);
+
+protected:
+    // Futex word: 1 if signalled
+    std::atomic<int> State = ATOMIC_VAR_INIT(0);
+
+    // 1 while a thread may be blocked in the futex
+    std::atomic<int> Sleeping = ATOMIC_VAR_INIT(0);
+};
+
+
+//------------------------------------------------------------------------------
+// SpscQueue
+
+/*
+    Single-producer single-consumer ring buffer of kCapacity items.
+
+    T must be default-constructible and movable.  Popped items are moved out
+    of the ring, so smart pointers do not stay referenced by the queue.
+*/
+template<typename T, int kCapacity>
+class SpscQueue
+{
+    static_assert((kCapacity & (kCapacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // Producer thread: Returns false if the queue is full
+    bool Push(T&& item)
+    {
+        const uint32_t tail = Tail.load(std::memory_order_relaxed);
+        if (tail - Head.load(std::memory_order_acquire) >= (uint32_t)kCapacity) {
+            return false;
+        }
+        Items[tail & kMask] = std::move(item);
+        Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread: Returns false if the queue is empty
+    bool Pop(T& item)
+    {
+        const uint32_t head = Head.load(std::memory_order_relaxed);
+        if (head == Tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(Items[head & kMask]);
+        Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread: Discard all queued items
+    void Clear()
+    {
+        T item;
+        while (Pop(item)) {
+            item = T();
+        }
+    }
+
+    // Approximate number of queued items
+    int Size() const
+    {
+        return static_cast<int>( Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire) );
+    }
+
+protected:
+    static const uint32_t kMask = kCapacity - 1;
+
+    // Written by the consumer
+    std::atomic<uint32_t> Head = ATOMIC_VAR_INIT(0);
+    uint8_t HeadPadding[kCacheLineBytes - sizeof(std::atomic<uint32_t>)];
+
+    // Written by the producer
+    std::atomic<uint32_t> Tail = ATOMIC_VAR_INIT(0);
+    uint8_t TailPadding[kCacheLineBytes - sizeof(std::atomic<uint32_t>)];
+
+    T Items[kCapacity];
+};
+
+
+} // namespace kvm
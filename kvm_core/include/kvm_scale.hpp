@@ -0,0 +1,84 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Image downscaler for YUV420P (I420) and NV12 frames
+
+    Exact 2:1 reductions use a 2x2 box filter.  Larger reductions halve the
+    image with the box filter until less than 2:1 remains, which averages
+    every source pixel like an area filter, and any remaining ratio is
+    handled with a bilinear filter.  For example 1920x1080 to 960x540 is a
+    single box filter pass, and 1920x1080 to 1280x720 is bilinear.
+
+    The box filter and the vertical half of the bilinear filter are
+    vectorized with NEON on ARM and SSE2 on x86.  The horizontal half of the
+    bilinear filter uses precomputed tables.  The NV12 chroma plane uses
+    the scalar box filter because its samples are interleaved.
+*/
+
+#pragma once
+
+#include "kvm_frame.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// FrameScaler
+
+class FrameScaler
+{
+public:
+    /*
+        Scale the visible image of src into the visible image of dst.
+        The padding of dst repeats the last visible column and row.
+        Both frames must be YUV420P, or both NV12.
+        Returns false if the formats are not supported.
+    */
+    bool Scale(const Frame& src, Frame& dst);
+
+    /*
+        Scale one 8-bit plane.  Strides are in bytes, and widths are in
+        samples of `channels` bytes each: 1 for the Y, U and V planes, and 2
+        for the interleaved UV plane of NV12.
+    */
+    void ScalePlane(
+        const uint8_t* src, int src_stride, int src_w, int src_h,
+        uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+        int channels);
+
+    // Disable the SIMD code paths, to compare against them in benchmarks
+    void SetSimd(bool enabled)
+    {
+        Simd = enabled;
+    }
+
+protected:
+    bool Simd = true;
+
+    // Intermediate images for reductions larger than 2:1
+    std::vector<uint8_t> HalfBuffers[2];
+
+    // Vertically interpolated row for the bilinear filter
+    std::vector<uint8_t> RowBuffer;
+
+    // Horizontal bilinear table: Source byte offset and 7-bit weight of the
+    // right sample for each destination sample
+    int TableSrcWidth = 0, TableDstWidth = 0, TableChannels = 0;
+    std::vector<int> TableOffsets;
+    std::vector<uint8_t> TableWeights;
+
+    void BoxHalf(
+        const uint8_t* src, int src_stride,
+        uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+        int channels);
+
+    void Bilinear(
+        const uint8_t* src, int src_stride, int src_w, int src_h,
+        uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+        int channels);
+
+    void UpdateTable(int src_w, int dst_w, int channels);
+};
+
+
+} // namespace kvm
@@ -0,0 +1,112 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Thread placement and scheduling policies
+
+    Policies are registered by thread name, and applied when a thread names
+    itself with SetCurrentThreadName().  Threads that named themselves before
+    their policy was registered, like the logger thread, keep their old
+    policy until ReapplyThreadPolicies() is called, so call it after
+    registering policies at startup.
+
+    Policies can be given as a string, for example in the KVM_THREAD_POLICY
+    environment variable:
+
+        Input sched=fifo prio=90 cpus=0; Decoder cpus=2,3; Encoder nice=-5
+
+    Entries are separated by semicolons.  Each starts with a thread name
+    followed by any of these fields:
+
+    + cpus=2,3 or cpus=2-3 : CPUs the thread may run on.
+    + sched=other|fifo|rr  : Scheduling policy.
+    + prio=1..99           : Realtime priority for fifo and rr.
+    + nice=-20..19         : Nice level for the other policy.
+
+    Threads created by a thread inherit its CPU affinity, so the OpenMP
+    workers started by the decoder run on the decoder's CPUs.
+
+    Realtime policies and negative nice levels require root or CAP_SYS_NICE.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Environment variable read by LoadThreadPoliciesFromEnvironment()
+static const char* const kThreadPolicyEnv = "KVM_THREAD_POLICY";
+
+enum class ThreadScheduler
+{
+    Default,    // Leave the scheduling policy unchanged
+    Other,      // SCHED_OTHER, with an optional nice level
+    Fifo,       // SCHED_FIFO realtime
+    RoundRobin, // SCHED_RR realtime
+};
+
+const char* ThreadSchedulerToString(ThreadScheduler scheduler);
+
+
+//------------------------------------------------------------------------------
+// ThreadPolicy
+
+struct ThreadPolicy
+{
+    // CPUs the thread may run on, or empty for any CPU
+    std::vector<int> Cpus;
+
+    ThreadScheduler Scheduler = ThreadScheduler::Default;
+
+    // Realtime priority for Fifo and RoundRobin
+    int Priority = 0;
+
+    // Nice level, applied if SetNice is true
+    bool SetNice = false;
+    int Nice = 0;
+};
+
+// Register the policy for threads with the given name
+void SetThreadPolicy(const std::string& name, const ThreadPolicy& policy);
+
+// Remove all registered policies
+void ClearThreadPolicies();
+
+// Returns false if no policy is registered for the name
+bool GetThreadPolicy(const std::string& name, ThreadPolicy& policy);
+
+/*
+    Register policies from a string in the format described above.
+    Returns false if the string is invalid, in which case no policies are
+    registered.
+*/
+bool ParseThreadPolicies(const char* spec);
+
+/*
+    Register policies from the KVM_THREAD_POLICY environment variable.
+    Returns false if it is set but invalid.
+*/
+bool LoadThreadPoliciesFromEnvironment();
+
+/*
+    Apply the policy registered for the name to the current thread.
+    Called by SetCurrentThreadName().
+
+    Returns false if a policy is registered but could not be fully applied.
+*/
+bool ApplyThreadPolicy(const char* name);
+
+/*
+    Apply the registered policies to running threads that named themselves
+    with SetCurrentThreadName() before the policies were registered.
+
+    Returns false if a policy could not be fully applied to a thread.
+*/
+bool ReapplyThreadPolicies();
+
+
+} // namespace kvm
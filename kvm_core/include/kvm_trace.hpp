@@ -0,0 +1,157 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Timeline tracing
+
+    Averages do not explain a stutter, but a timeline usually does: Which
+    thread was busy, what it was waiting on, and how deep the queues were
+    at the time.  Each thread records what it is doing into its own ring
+    buffer, and the last few seconds of every ring can be written out as
+    Chrome Trace Event JSON, which chrome://tracing and ui.perfetto.dev both
+    open, with every thread on one timeline.
+
+    Events:
+
+    + TraceScope, or TraceBegin() and TraceEnd(): A span of work
+    + TraceCounter(): A value over time, such as a queue depth or frame size
+    + TraceInstant(): Something that happened at one point in time
+
+    Names must be string literals, because only the pointer is stored.
+
+    Recording an event takes no locks and does not allocate, except for the
+    first event on each thread, which sets up its ring.  Each ring holds the
+    last kTraceRingEvents events of its thread, and older events are
+    overwritten.  A slot is published with a sequence number after it is
+    written, so a dump taken while threads are running skips slots that were
+    being overwritten instead of reading torn events.
+
+    Dumps can be requested from a signal handler, for example with
+    `kill -USR2 <pid>` after InstallTraceSignalHandler().  The request is
+    written out by the next call to TryWriteRequestedTrace(), which the video
+    pipeline makes from its monitor thread.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Events kept per thread.  At a few events per frame this covers well over
+// a minute of video
+static const int kTraceRingEvents = 8192;
+
+// Length of the timeline written by a dump
+static const int kDefaultTraceSeconds = 10;
+
+// Longest timeline a dump may ask for.  The rings rarely hold more, and a
+// longer dump only holds up new threads for longer
+static const int kMaxTraceSeconds = 60;
+
+// Where requested dumps are written
+static const char* const kDefaultTraceDir = "/tmp";
+
+enum class TracePhase : char
+{
+    Begin = 'B',
+    End = 'E',
+    Counter = 'C',
+    Instant = 'i'
+};
+
+
+//------------------------------------------------------------------------------
+// Recording
+
+// Tracing is enabled by default, so the history is there when it is needed
+void SetTraceEnabled(bool enabled);
+bool IsTraceEnabled();
+
+// Record an event on the calling thread's ring
+void RecordTraceEvent(TracePhase phase, const char* name, int64_t value);
+
+inline void TraceBegin(const char* name)
+{
+    if (IsTraceEnabled()) {
+        RecordTraceEvent(TracePhase::Begin, name, 0);
+    }
+}
+
+inline void TraceEnd(const char* name)
+{
+    if (IsTraceEnabled()) {
+        RecordTraceEvent(TracePhase::End, name, 0);
+    }
+}
+
+inline void TraceCounter(const char* name, int64_t value)
+{
+    if (IsTraceEnabled()) {
+        RecordTraceEvent(TracePhase::Counter, name, value);
+    }
+}
+
+inline void TraceInstant(const char* name)
+{
+    if (IsTraceEnabled()) {
+        RecordTraceEvent(TracePhase::Instant, name, 0);
+    }
+}
+
+// Records a span from construction to destruction
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* name)
+        : Name(name)
+    {
+        TraceBegin(Name);
+    }
+    ~TraceScope()
+    {
+        TraceEnd(Name);
+    }
+
+protected:
+    const char* Name;
+};
+
+
+//------------------------------------------------------------------------------
+// Dumps
+
+// Write the events of the last `seconds` as Chrome Trace Event JSON.
+// Returns the number of events written
+int WriteTraceJson(std::ostream& out, int seconds = kDefaultTraceSeconds);
+
+/*
+    Write a dump to dir/kvm_trace_<time>.json.  Returns the path, or an empty
+    string on failure, or if another dump is being written.
+    seconds is clamped to kMaxTraceSeconds.
+*/
+std::string WriteTraceFile(const std::string& dir = kDefaultTraceDir, int seconds = kDefaultTraceSeconds);
+
+// Ask for a dump.  Safe to call from a signal handler
+void RequestTraceDump();
+
+// True while WriteTraceFile() is writing a dump
+bool IsTraceDumpRunning();
+
+// Call RequestTraceDump() when the process receives the signal.
+// Only supported on Linux
+bool InstallTraceSignalHandler(int signum);
+
+// If a dump was requested, write it and return its path.  Otherwise returns
+// an empty string
+std::string TryWriteRequestedTrace(const std::string& dir = kDefaultTraceDir);
+
+
+} // namespace kvm
@@ -1,6 +1,7 @@
 // Copyright 2020 Christopher A. Taylor
 
 #include "kvm_core.hpp"
+#include "kvm_thread.hpp"
 #include "kvm_serializer.hpp"
 #include "kvm_logger.hpp"
 
@@ -155,11 +156,13 @@ void SetCurrentThreadName(const char* threadName)
 void SetCurrentThreadName(const char* threadName)
 {
     pthread_setname_np(threadName);
+    ApplyThreadPolicy(threadName);
 }
 #else
 void SetCurrentThreadName(const char* threadName)
 {
     pthread_setname_np(pthread_self(), threadName);
+    ApplyThreadPolicy(threadName);
 }
 #endif
 
@@ -240,6 +243,43 @@ std::string HexDump(const uint8_t* data, int bytes)
 }
 
 
+//------------------------------------------------------------------------------
+// Hashing
+
+uint64_t HashBytes(const void* data, int bytes, uint64_t seed)
+{
+    const uint64_t m = UINT64_C(0xc6a4a7935bd1e995);
+    const int r = 47;
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>( data );
+    uint64_t h = seed ^ (static_cast<uint64_t>(bytes) * m);
+
+    while (bytes >= 8)
+    {
+        uint64_t k = ReadU64_LE(p);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        p += 8;
+        bytes -= 8;
+    }
+
+    if (bytes > 0) {
+        h ^= ReadBytes64_LE(p, bytes);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+
 //------------------------------------------------------------------------------
 // Aligned Allocation
 
@@ -22,6 +22,102 @@ Frame::~Frame()
     Planes[0] = nullptr;
 }
 
+void Frame::ClearDirtyTiles(int row_height)
+{
+    DirtyRowHeight = row_height;
+    DirtyRows.assign((Height + row_height - 1) / row_height, 0);
+    DirtyTilesWide = Width / kDirtyTileWidth;
+    DirtyTiles.assign(DirtyRows.size() * DirtyTilesWide, 0);
+}
+
+bool Frame::IsChanged() const
+{
+    if (DirtyRows.empty()) {
+        return true;
+    }
+    for (uint8_t dirty : DirtyRows) {
+        if (dirty) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Frame::SetNeutralChroma()
+{
+    if (NeutralChroma) {
+        return;
+    }
+
+    int chroma_bytes = 0;
+    if (Format == PixelFormat::YUV420P) {
+        chroma_bytes = Width * Height / 4;
+    } else if (Format == PixelFormat::YUV422P) {
+        chroma_bytes = Width * Height / 2;
+    } else {
+        Logger.Error("FIXME: SetNeutralChroma unsupported for format");
+        return;
+    }
+
+    memset(Planes[1], 128, chroma_bytes);
+    memset(Planes[2], 128, chroma_bytes);
+    NeutralChroma = true;
+}
+
+
+//------------------------------------------------------------------------------
+// Frame Differencing
+
+static CORE_INLINE uint64_t LoadU64(const uint8_t* p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+void DiffFrameTileRow(const Frame& prev, Frame& next, int row)
+{
+    const int tiles_wide = next.DirtyTilesWide;
+    uint8_t* tiles = next.DirtyTiles.data() + row * tiles_wide;
+
+    const int y0 = row * next.DirtyRowHeight;
+    int y1 = y0 + next.DirtyRowHeight;
+    if (y1 > next.Height) {
+        y1 = next.Height;
+    }
+
+    // Luma: 16 bytes per tile on each row
+    const int luma_stride = next.Width;
+    for (int y = y0; y < y1; ++y)
+    {
+        const uint8_t* a = prev.Planes[0] + y * luma_stride;
+        const uint8_t* b = next.Planes[0] + y * luma_stride;
+        for (int x = 0; x < tiles_wide; ++x, a += 16, b += 16) {
+            const uint64_t diff = (LoadU64(a) ^ LoadU64(b)) | (LoadU64(a + 8) ^ LoadU64(b + 8));
+            tiles[x] |= (diff != 0) ? 1 : 0;
+        }
+    }
+
+    // Chroma: 8 bytes per tile on every other row
+    const int chroma_stride = next.Width / 2;
+    for (int c = 1; c <= 2; ++c) {
+        for (int y = y0 / 2; y < (y1 + 1) / 2; ++y)
+        {
+            const uint8_t* a = prev.Planes[c] + y * chroma_stride;
+            const uint8_t* b = next.Planes[c] + y * chroma_stride;
+            for (int x = 0; x < tiles_wide; ++x, a += 8, b += 8) {
+                tiles[x] |= (LoadU64(a) != LoadU64(b)) ? 1 : 0;
+            }
+        }
+    }
+
+    uint8_t dirty = 0;
+    for (int x = 0; x < tiles_wide; ++x) {
+        dirty |= tiles[x];
+    }
+    next.DirtyRows[row] = dirty;
+}
+
 
 //------------------------------------------------------------------------------
 // FramePool
@@ -38,6 +134,8 @@ static int RoundUp16(int x)
 
 std::shared_ptr<Frame> FramePool::Allocate(int w, int h, PixelFormat format)
 {
+    const int visible_w = w, visible_h = h;
+
     // Designed for ingest into MMAL encoder
     w = RoundUp32(w);
     h = RoundUp16(h);
@@ -45,16 +143,31 @@ std::shared_ptr<Frame> FramePool::Allocate(int w, int h, PixelFormat format)
     // Check if we can use one from the pool:
     {
         std::lock_guard<std::mutex> locker(Lock);
-        if (!Freed.empty()) {
-            auto frame = Freed.back();
-            Freed.pop_back();
-            return frame;
+        for (size_t i = Freed.size(); i-- > 0;)
+        {
+            // Skip frames that are still referenced elsewhere, such as the
+            // previous frame kept by the decoder to detect changes
+            if (!IsOnlyReference(Freed[i])) {
+                continue;
+            }
+
+            auto frame = Freed[i];
+            Freed.erase(Freed.begin() + i);
+
+            // Discard frames left over from a different resolution or format
+            if (frame->Width == w && frame->Height == h && frame->Format == format) {
+                frame->VisibleWidth = visible_w;
+                frame->VisibleHeight = visible_h;
+                return frame;
+            }
         }
     }
 
     auto frame = std::make_shared<Frame>();
     frame->Width = w;
     frame->Height = h;
+    frame->VisibleWidth = visible_w;
+    frame->VisibleHeight = visible_h;
     frame->Format = format;
 
     if (format == PixelFormat::RGB24) {
@@ -81,6 +194,20 @@ std::shared_ptr<Frame> FramePool::Allocate(int w, int h, PixelFormat format)
         return frame;
     }
 
+    if (format == PixelFormat::NV12) {
+        // Interleaved UV plane at half resolution
+        frame->AllocatedBytes = w * h * 3 / 2;
+        uint8_t* data = AlignedAllocate(frame->AllocatedBytes);
+        if (!data) {
+            Logger.Error("Out of memory: Unable to allocate more raw frames");
+            return nullptr;
+        }
+        frame->Planes[0] = data;
+        frame->Planes[1] = data + w * h;
+        frame->Planes[2] = nullptr;
+        return frame;
+    }
+
     int y_plane_bytes = w * h, uv_plane_bytes = 0;
     if (format == PixelFormat::YUV420P) {
         uv_plane_bytes = y_plane_bytes / 4;
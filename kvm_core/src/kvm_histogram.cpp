@@ -0,0 +1,119 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_histogram.hpp"
+
+#include <cstring>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Buckets
+
+// Values below this get one bucket each
+static const uint64_t kHistogramLinearLimit = kHistogramSubBuckets * 2;
+
+static int GetHighestBit(uint64_t value)
+{
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+int GetHistogramBucket(uint64_t value)
+{
+    if (value < kHistogramLinearLimit) {
+        return static_cast<int>( value );
+    }
+    if (value >= (UINT64_C(1) << kHistogramValueBits)) {
+        return kHistogramBucketCount - 1;
+    }
+
+    // The top kHistogramSubBucketBits + 1 bits select the bucket
+    const int shift = GetHighestBit(value) - kHistogramSubBucketBits;
+    return shift * kHistogramSubBuckets + static_cast<int>( value >> shift );
+}
+
+uint64_t GetHistogramBucketLow(int bucket)
+{
+    if (bucket < (int)kHistogramLinearLimit) {
+        return static_cast<uint64_t>( bucket );
+    }
+
+    const int shift = bucket / kHistogramSubBuckets - 1;
+    const uint64_t top = bucket % kHistogramSubBuckets + kHistogramSubBuckets;
+    return top << shift;
+}
+
+uint64_t GetHistogramBucketHigh(int bucket)
+{
+    if (bucket < (int)kHistogramLinearLimit) {
+        return static_cast<uint64_t>( bucket );
+    }
+
+    const int shift = bucket / kHistogramSubBuckets - 1;
+    return GetHistogramBucketLow(bucket) + (UINT64_C(1) << shift) - 1;
+}
+
+
+//------------------------------------------------------------------------------
+// LatencyHistogram
+
+void LatencyHistogram::Reset()
+{
+    memset(Counts, 0, sizeof(Counts));
+    Count = 0;
+    Total = 0;
+    MinValue = 0;
+    MaxValue = 0;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+    if (other.Count == 0) {
+        return;
+    }
+
+    for (int i = 0; i < kHistogramBucketCount; ++i) {
+        Counts[i] += other.Counts[i];
+    }
+    if (Count == 0 || MinValue > other.MinValue) {
+        MinValue = other.MinValue;
+    }
+    if (MaxValue < other.MaxValue) {
+        MaxValue = other.MaxValue;
+    }
+    Total += other.Total;
+    Count += other.Count;
+}
+
+uint64_t LatencyHistogram::GetPercentile(float percentile) const
+{
+    if (Count == 0) {
+        return 0;
+    }
+
+    // Rank of the value to find, counting from 1
+    uint64_t rank = static_cast<uint64_t>( percentile / 100.f * Count + 0.5f );
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > Count) {
+        rank = Count;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBucketCount; ++i) {
+        seen += Counts[i];
+        if (seen >= rank) {
+            const uint64_t high = GetHistogramBucketHigh(i);
+            return high < MaxValue ? high : MaxValue;
+        }
+    }
+    return MaxValue;
+}
+
+
+} // namespace kvm
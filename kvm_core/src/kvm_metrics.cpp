@@ -0,0 +1,440 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_metrics.hpp"
+#include "kvm_logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace kvm {
+
+static logger::Channel Logger("Metrics");
+
+
+//------------------------------------------------------------------------------
+// MetricHistogram
+
+MetricHistogram::MetricHistogram()
+{
+    for (auto& count : Counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+uint64_t MetricHistogram::GetCount() const
+{
+    uint64_t total = 0;
+    for (const auto& count : Counts) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t MetricHistogram::GetCountBelowPowerOfTwo(int bits) const
+{
+    if (bits >= kHistogramValueBits) {
+        return GetCount();
+    }
+
+    // Every bucket before the one holding 2^bits is below it
+    const int end = GetHistogramBucket(UINT64_C(1) << bits);
+    uint64_t total = 0;
+    for (int i = 0; i < end; ++i) {
+        total += Counts[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t MetricHistogram::GetPercentile(float percentile) const
+{
+    uint64_t counts[kHistogramBucketCount];
+    uint64_t total = 0;
+    for (int i = 0; i < kHistogramBucketCount; ++i) {
+        counts[i] = Counts[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // Rank of the value to find, counting from 1
+    uint64_t rank = static_cast<uint64_t>( percentile / 100.f * total + 0.5f );
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > total) {
+        rank = total;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBucketCount; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return GetHistogramBucketHigh(i);
+        }
+    }
+    return GetHistogramBucketHigh(kHistogramBucketCount - 1);
+}
+
+
+//------------------------------------------------------------------------------
+// MetricsRegistry
+
+static const char* MetricTypeToString(MetricType type)
+{
+    switch (type)
+    {
+    case MetricType::Counter: return "counter";
+    case MetricType::Gauge: return "gauge";
+    case MetricType::Histogram: return "histogram";
+    default: break;
+    }
+    return "untyped";
+}
+
+MetricsRegistry::Metric* MetricsRegistry::GetMetric(
+    MetricType type,
+    const std::string& name,
+    const std::string& help,
+    const std::string& labels,
+    double scale)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    Family* family = nullptr;
+    for (auto& candidate : Families) {
+        if (candidate->Name == name) {
+            family = candidate.get();
+            break;
+        }
+    }
+
+    if (!family) {
+        family = new Family;
+        family->Name = name;
+        family->Help = help;
+        family->Type = type;
+        family->Scale = scale;
+        Families.emplace_back(family);
+    } else if (family->Type != type) {
+        Logger.Error("Metric ", name, " is already registered as a ", MetricTypeToString(family->Type));
+        return nullptr;
+    }
+
+    for (auto& metric : family->Metrics) {
+        if (metric->Labels == labels) {
+            return metric.get();
+        }
+    }
+
+    Metric* metric = new Metric;
+    metric->Labels = labels;
+    switch (type)
+    {
+    case MetricType::Counter: metric->Counter.reset(new MetricCounter); break;
+    case MetricType::Gauge: metric->Gauge.reset(new MetricGauge); break;
+    case MetricType::Histogram: metric->Histogram.reset(new MetricHistogram); break;
+    }
+    family->Metrics.emplace_back(metric);
+    return metric;
+}
+
+MetricCounter* MetricsRegistry::GetCounter(const std::string& name, const std::string& help, const std::string& labels)
+{
+    Metric* metric = GetMetric(MetricType::Counter, name, help, labels, 1.);
+    return metric ? metric->Counter.get() : nullptr;
+}
+
+MetricGauge* MetricsRegistry::GetGauge(const std::string& name, const std::string& help, const std::string& labels)
+{
+    Metric* metric = GetMetric(MetricType::Gauge, name, help, labels, 1.);
+    return metric ? metric->Gauge.get() : nullptr;
+}
+
+MetricHistogram* MetricsRegistry::GetHistogram(
+    const std::string& name,
+    const std::string& help,
+    const std::string& labels,
+    double scale)
+{
+    Metric* metric = GetMetric(MetricType::Histogram, name, help, labels, scale);
+    return metric ? metric->Histogram.get() : nullptr;
+}
+
+// Write name{labels,extra} with the braces left out when both are empty
+static void WriteSeriesName(std::ostream& out, const std::string& name, const char* suffix,
+    const std::string& labels, const std::string& extra)
+{
+    out << name << suffix;
+    if (labels.empty() && extra.empty()) {
+        return;
+    }
+    out << '{' << labels;
+    if (!labels.empty() && !extra.empty()) {
+        out << ',';
+    }
+    out << extra << '}';
+}
+
+void MetricsRegistry::WritePrometheus(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    out.precision(9);
+
+    for (const auto& family_ptr : Families)
+    {
+        const Family& family = *family_ptr;
+
+        out << "# HELP " << family.Name << ' ' << family.Help << '\n';
+        out << "# TYPE " << family.Name << ' ' << MetricTypeToString(family.Type) << '\n';
+
+        for (const auto& metric : family.Metrics)
+        {
+            if (metric->Counter) {
+                WriteSeriesName(out, family.Name, "", metric->Labels, "");
+                out << ' ' << metric->Counter->Get() << '\n';
+            } else if (metric->Gauge) {
+                WriteSeriesName(out, family.Name, "", metric->Labels, "");
+                out << ' ' << metric->Gauge->Get() << '\n';
+            } else if (metric->Histogram) {
+                const MetricHistogram& histogram = *metric->Histogram;
+
+                // Cumulative power-of-two buckets.  Values are integers, so
+                // the count below 2^bits is the count up to 2^bits - 1
+                uint64_t count = 0;
+                for (int bits = 0; bits < kHistogramValueBits; ++bits) {
+                    count = histogram.GetCountBelowPowerOfTwo(bits);
+                    std::ostringstream le;
+                    le.precision(9);
+                    le << "le=\"" << ((UINT64_C(1) << bits) - 1) * family.Scale << '"';
+                    WriteSeriesName(out, family.Name, "_bucket", metric->Labels, le.str());
+                    out << ' ' << count << '\n';
+                }
+                count = histogram.GetCount();
+                WriteSeriesName(out, family.Name, "_bucket", metric->Labels, "le=\"+Inf\"");
+                out << ' ' << count << '\n';
+
+                WriteSeriesName(out, family.Name, "_sum", metric->Labels, "");
+                out << ' ' << histogram.GetSum() * family.Scale << '\n';
+                WriteSeriesName(out, family.Name, "_count", metric->Labels, "");
+                out << ' ' << count << '\n';
+            }
+        }
+    }
+}
+
+MetricsRegistry& GetMetricsRegistry()
+{
+    // Never destroyed, because threads may update metrics while the process exits
+    static MetricsRegistry* registry = new MetricsRegistry;
+    return *registry;
+}
+
+
+//------------------------------------------------------------------------------
+// MetricsServer
+
+// Requests larger than this are rejected
+static const int kMaxRequestBytes = 4096;
+
+// Time to wait for a scraper to send its request
+static const int kRequestTimeoutMsec = 2000;
+
+// Time to wait for a scraper to read the response
+static const int kResponseTimeoutMsec = 5000;
+
+// Longest wait on a socket before checking for shutdown
+static const int kShutdownCheckMsec = 100;
+
+bool MetricsServer::Start(const std::string& address, int port, MetricsRegistry* registry)
+{
+    Shutdown();
+
+    Registry = registry;
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>( port ));
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        Logger.Error("Invalid metrics address: ", address);
+        return false;
+    }
+
+    ListenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenSocket < 0) {
+        Logger.Error("socket failed: errno=", errno);
+        return false;
+    }
+
+    const int reuse = 1;
+    setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(ListenSocket, (const sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(ListenSocket, 4) != 0)
+    {
+        Logger.Error("Failed to listen for metrics on ", address, ":", port, ": errno=", errno);
+        close(ListenSocket);
+        ListenSocket = -1;
+        return false;
+    }
+
+    socklen_t addr_len = sizeof(addr);
+    getsockname(ListenSocket, (sockaddr*)&addr, &addr_len);
+    Port = ntohs(addr.sin_port);
+
+    Logger.Info("Serving metrics at http://", address, ":", Port, "/metrics");
+
+    Terminated = false;
+    Thread = std::make_shared<std::thread>(&MetricsServer::Loop, this);
+    return true;
+}
+
+void MetricsServer::Shutdown()
+{
+    Terminated = true;
+    JoinThread(Thread);
+
+    if (ListenSocket >= 0) {
+        close(ListenSocket);
+        ListenSocket = -1;
+    }
+}
+
+void MetricsServer::Loop()
+{
+    SetCurrentThreadName("Metrics");
+
+    while (!Terminated)
+    {
+        struct pollfd desc{};
+        desc.fd = ListenSocket;
+        desc.events = POLLIN;
+
+        // Use a short timeout to check for shutdown
+        const int r = poll(&desc, 1, kShutdownCheckMsec);
+        if (r < 0 && errno != EINTR) {
+            Logger.Error("poll failed: errno=", errno);
+            break;
+        }
+        if (r <= 0) {
+            continue;
+        }
+
+        const int fd = accept4(ListenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        HandleConnection(fd);
+        close(fd);
+    }
+}
+
+bool MetricsServer::WaitForSocket(int fd, short events, uint64_t deadline_msec)
+{
+    while (!Terminated)
+    {
+        const int64_t remaining_msec = (int64_t)(deadline_msec - GetTimeMsec());
+        if (remaining_msec <= 0) {
+            return false;
+        }
+
+        struct pollfd desc{};
+        desc.fd = fd;
+        desc.events = events;
+        const int r = poll(&desc, 1, (int)std::min<int64_t>(remaining_msec, kShutdownCheckMsec));
+        if (r < 0 && errno != EINTR) {
+            return false;
+        }
+        if (r > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MetricsServer::SendAll(int fd, const std::string& data)
+{
+    // Never block in send(): A scraper that stops reading would otherwise
+    // hold up the thread, and Shutdown() with it
+    const uint64_t deadline_msec = GetTimeMsec() + kResponseTimeoutMsec;
+
+    size_t sent = 0;
+    while (sent < data.size()) {
+        const ssize_t r = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!WaitForSocket(fd, POLLOUT, deadline_msec)) {
+                return false;
+            }
+            continue;
+        }
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += static_cast<size_t>( r );
+    }
+    return true;
+}
+
+void MetricsServer::HandleConnection(int fd)
+{
+    // Read until the end of the request headers
+    std::string request;
+    char buffer[1024];
+    const uint64_t deadline_msec = GetTimeMsec() + kRequestTimeoutMsec;
+
+    while (request.find("\r\n\r\n") == std::string::npos)
+    {
+        if ((int)request.size() > kMaxRequestBytes ||
+            !WaitForSocket(fd, POLLIN, deadline_msec))
+        {
+            return;
+        }
+
+        const ssize_t r = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        if (r <= 0) {
+            return;
+        }
+        request.append(buffer, static_cast<size_t>( r ));
+    }
+
+    const bool is_metrics = request.compare(0, 13, "GET /metrics ") == 0 ||
+        request.compare(0, 13, "GET /metrics?") == 0;
+
+    std::ostringstream body;
+    const char* status = "200 OK";
+    if (is_metrics) {
+        Registry->WritePrometheus(body);
+    } else {
+        status = "404 Not Found";
+        body << "Metrics are at /metrics\n";
+    }
+    const std::string content = body.str();
+
+    std::ostringstream response;
+    response << "HTTP/1.0 " << status << "\r\n"
+        << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        << "Content-Length: " << content.size() << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << content;
+    if (!SendAll(fd, response.str()) && !Terminated) {
+        Logger.Warn("Scraper did not read the metrics within ", kResponseTimeoutMsec, " msec");
+    }
+}
+
+
+} // namespace kvm
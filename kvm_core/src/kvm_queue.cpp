@@ -0,0 +1,57 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_queue.hpp"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// WakeEvent
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int), "Futex word must be an int");
+
+static int* FutexWord(std::atomic<int>& state)
+{
+    return reinterpret_cast<int*>( &state );
+}
+
+void WakeEvent::Signal()
+{
+    // Only enter the kernel if the consumer went to sleep before seeing this
+    if (State.exchange(1) == 0 && Sleeping.load() != 0) {
+        syscall(SYS_futex, FutexWord(State), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
+
+void WakeEvent::Wait(int timeout_msec)
+{
+    if (State.exchange(0) != 0) {
+        return;
+    }
+
+    Sleeping = 1;
+
+    // Check again after announcing that we are going to sleep, so a Signal()
+    // racing with us either sees Sleeping or we see its State
+    if (State.exchange(0) == 0)
+    {
+        struct timespec timeout;
+        timeout.tv_sec = timeout_msec / 1000;
+        timeout.tv_nsec = (timeout_msec % 1000) * 1000000;
+
+        // Returns immediately if State is no longer 0
+        syscall(SYS_futex, FutexWord(State), FUTEX_WAIT_PRIVATE, 0, &timeout, nullptr, 0);
+
+        State = 0;
+    }
+
+    Sleeping = 0;
+}
+
+
+} // namespace kvm
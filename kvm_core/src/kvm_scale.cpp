@@ -0,0 +1,339 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_scale.hpp"
+#include "kvm_logger.hpp"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #define KVM_SCALE_NEON
+    #include <arm_neon.h>
+#elif defined(__SSE2__)
+    #define KVM_SCALE_SSE2
+    #include <emmintrin.h>
+#endif
+
+namespace kvm {
+
+static logger::Channel Logger("Scale");
+
+// Bilinear weights are 7 bits so the products fit in 16 bits
+static const int kWeightBits = 7;
+static const int kWeightOne = 1 << kWeightBits;
+
+
+//------------------------------------------------------------------------------
+// Row Kernels
+
+// Average each 2x2 block of single channel samples from two rows
+static void BoxRow1(const uint8_t* r0, const uint8_t* r1, uint8_t* dst, int dst_w, bool simd)
+{
+    int x = 0;
+
+#if defined(KVM_SCALE_NEON)
+    if (simd) {
+        for (; x + 16 <= dst_w; x += 16) {
+            const uint8_t* a = r0 + x * 2;
+            const uint8_t* b = r1 + x * 2;
+            const uint16x8_t s0 = vaddq_u16(vpaddlq_u8(vld1q_u8(a)), vpaddlq_u8(vld1q_u8(b)));
+            const uint16x8_t s1 = vaddq_u16(vpaddlq_u8(vld1q_u8(a + 16)), vpaddlq_u8(vld1q_u8(b + 16)));
+            vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+        }
+    }
+#elif defined(KVM_SCALE_SSE2)
+    if (simd) {
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        const __m128i two = _mm_set1_epi16(2);
+        for (; x + 16 <= dst_w; x += 16) {
+            const uint8_t* a = r0 + x * 2;
+            const uint8_t* b = r1 + x * 2;
+            __m128i out[2];
+            for (int i = 0; i < 2; ++i) {
+                const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>( a + i * 16 ));
+                const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>( b + i * 16 ));
+                __m128i sum = _mm_add_epi16(
+                    _mm_add_epi16(_mm_and_si128(va, mask), _mm_srli_epi16(va, 8)),
+                    _mm_add_epi16(_mm_and_si128(vb, mask), _mm_srli_epi16(vb, 8)));
+                out[i] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>( dst + x ), _mm_packus_epi16(out[0], out[1]));
+        }
+    }
+#else
+    CORE_UNUSED(simd);
+#endif
+
+    for (; x < dst_w; ++x) {
+        const unsigned sum = r0[x * 2] + r0[x * 2 + 1] + r1[x * 2] + r1[x * 2 + 1];
+        dst[x] = static_cast<uint8_t>( (sum + 2) >> 2 );
+    }
+}
+
+// Average each 2x2 block of interleaved two channel samples from two rows
+static void BoxRow2(const uint8_t* r0, const uint8_t* r1, uint8_t* dst, int dst_w)
+{
+    for (int x = 0; x < dst_w; ++x) {
+        for (int c = 0; c < 2; ++c) {
+            const int i = x * 4 + c;
+            const unsigned sum = r0[i] + r0[i + 2] + r1[i] + r1[i + 2];
+            dst[x * 2 + c] = static_cast<uint8_t>( (sum + 2) >> 2 );
+        }
+    }
+}
+
+// Blend two rows: dst = (r0 * (128 - f) + r1 * f) / 128, rounded
+static void BlendRows(const uint8_t* r0, const uint8_t* r1, int f, uint8_t* dst, int bytes, bool simd)
+{
+    int i = 0;
+
+#if defined(KVM_SCALE_NEON)
+    if (simd) {
+        const uint8x8_t w0 = vdup_n_u8(static_cast<uint8_t>( kWeightOne - f ));
+        const uint8x8_t w1 = vdup_n_u8(static_cast<uint8_t>( f ));
+        for (; i + 16 <= bytes; i += 16) {
+            const uint8x16_t a = vld1q_u8(r0 + i);
+            const uint8x16_t b = vld1q_u8(r1 + i);
+            const uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), w0), vget_low_u8(b), w1);
+            const uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), w0), vget_high_u8(b), w1);
+            vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, kWeightBits), vrshrn_n_u16(hi, kWeightBits)));
+        }
+    }
+#elif defined(KVM_SCALE_SSE2)
+    if (simd) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i w0 = _mm_set1_epi16(static_cast<int16_t>( kWeightOne - f ));
+        const __m128i w1 = _mm_set1_epi16(static_cast<int16_t>( f ));
+        const __m128i round = _mm_set1_epi16(kWeightOne / 2);
+        for (; i + 16 <= bytes; i += 16) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>( r0 + i ));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>( r1 + i ));
+            __m128i lo = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+            __m128i hi = _mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, round), kWeightBits);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, round), kWeightBits);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>( dst + i ), _mm_packus_epi16(lo, hi));
+        }
+    }
+#else
+    CORE_UNUSED(simd);
+#endif
+
+    const unsigned w0 = kWeightOne - f;
+    for (; i < bytes; ++i) {
+        dst[i] = static_cast<uint8_t>( (r0[i] * w0 + r1[i] * f + kWeightOne / 2) >> kWeightBits );
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// FrameScaler
+
+/*
+    Repeat the last visible column and row of a plane into its padding.
+    The encoder codes the whole padded frame, so this keeps stale pixels
+    out of the edge macroblocks.  Widths are in samples of `channels` bytes.
+*/
+static void PadPlane(
+    uint8_t* plane, int stride,
+    int visible_w, int visible_h, int w, int h,
+    int channels)
+{
+    if (visible_w <= 0 || visible_h <= 0) {
+        return;
+    }
+
+    if (visible_w < w) {
+        for (int y = 0; y < visible_h; ++y) {
+            uint8_t* row = plane + y * stride;
+            for (int x = visible_w * channels; x < w * channels; ++x) {
+                row[x] = row[x - channels];
+            }
+        }
+    }
+
+    const uint8_t* last_row = plane + (visible_h - 1) * stride;
+    for (int y = visible_h; y < h; ++y) {
+        memcpy(plane + y * stride, last_row, w * channels);
+    }
+}
+
+bool FrameScaler::Scale(const Frame& src, Frame& dst)
+{
+    if (src.Format != dst.Format) {
+        Logger.Error("Scale: Source and destination formats differ");
+        return false;
+    }
+
+    // Scale the visible image, not the padding below and to the right of it
+    const int sw = src.VisibleWidth, sh = src.VisibleHeight;
+    const int dw = dst.VisibleWidth, dh = dst.VisibleHeight;
+    const int src_stride = src.Width, dst_stride = dst.Width;
+
+    if (src.Format == PixelFormat::YUV420P) {
+        ScalePlane(src.Planes[0], src_stride, sw, sh, dst.Planes[0], dst_stride, dw, dh, 1);
+        PadPlane(dst.Planes[0], dst_stride, dw, dh, dst.Width, dst.Height, 1);
+        for (int i = 1; i <= 2; ++i) {
+            ScalePlane(src.Planes[i], src_stride / 2, (sw + 1) / 2, (sh + 1) / 2,
+                dst.Planes[i], dst_stride / 2, (dw + 1) / 2, (dh + 1) / 2, 1);
+            PadPlane(dst.Planes[i], dst_stride / 2, (dw + 1) / 2, (dh + 1) / 2, dst.Width / 2, dst.Height / 2, 1);
+        }
+    } else if (src.Format == PixelFormat::NV12) {
+        ScalePlane(src.Planes[0], src_stride, sw, sh, dst.Planes[0], dst_stride, dw, dh, 1);
+        PadPlane(dst.Planes[0], dst_stride, dw, dh, dst.Width, dst.Height, 1);
+        ScalePlane(src.Planes[1], src_stride, (sw + 1) / 2, (sh + 1) / 2,
+            dst.Planes[1], dst_stride, (dw + 1) / 2, (dh + 1) / 2, 2);
+        PadPlane(dst.Planes[1], dst_stride, (dw + 1) / 2, (dh + 1) / 2, dst.Width / 2, dst.Height / 2, 2);
+    } else {
+        Logger.Error("FIXME: Scale unsupported for format");
+        return false;
+    }
+
+    dst.NeutralChroma = src.NeutralChroma;
+    return true;
+}
+
+void FrameScaler::ScalePlane(
+    const uint8_t* src, int src_stride, int src_w, int src_h,
+    uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+    int channels)
+{
+    // Halve with the box filter while the reduction is at least 2:1
+    int half_index = 0;
+    while (src_w >= dst_w * 2 && src_h >= dst_h * 2)
+    {
+        const int half_w = src_w / 2, half_h = src_h / 2;
+
+        if (half_w == dst_w && half_h == dst_h) {
+            BoxHalf(src, src_stride, dst, dst_stride, dst_w, dst_h, channels);
+            return;
+        }
+
+        std::vector<uint8_t>& half = HalfBuffers[half_index];
+        half_index ^= 1;
+
+        const int half_stride = half_w * channels;
+        half.resize(half_stride * half_h);
+        BoxHalf(src, src_stride, half.data(), half_stride, half_w, half_h, channels);
+
+        src = half.data();
+        src_stride = half_stride;
+        src_w = half_w;
+        src_h = half_h;
+    }
+
+    Bilinear(src, src_stride, src_w, src_h, dst, dst_stride, dst_w, dst_h, channels);
+}
+
+void FrameScaler::BoxHalf(
+    const uint8_t* src, int src_stride,
+    uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+    int channels)
+{
+    for (int y = 0; y < dst_h; ++y)
+    {
+        const uint8_t* r0 = src + y * 2 * src_stride;
+        const uint8_t* r1 = r0 + src_stride;
+        if (channels == 1) {
+            BoxRow1(r0, r1, dst, dst_w, Simd);
+        } else {
+            BoxRow2(r0, r1, dst, dst_w);
+        }
+        dst += dst_stride;
+    }
+}
+
+void FrameScaler::UpdateTable(int src_w, int dst_w, int channels)
+{
+    if (TableSrcWidth == src_w && TableDstWidth == dst_w && TableChannels == channels) {
+        return;
+    }
+    TableSrcWidth = src_w;
+    TableDstWidth = dst_w;
+    TableChannels = channels;
+
+    TableOffsets.resize(dst_w);
+    TableWeights.resize(dst_w);
+
+    // Sample centers line up: sx = (x + 0.5) * src_w / dst_w - 0.5
+    const int64_t step = (static_cast<int64_t>( src_w ) << 16) / dst_w;
+    int64_t sx = step / 2 - (1 << 15);
+    for (int x = 0; x < dst_w; ++x, sx += step)
+    {
+        int x0 = 0, f = 0;
+        if (sx > 0) {
+            x0 = static_cast<int>( sx >> 16 );
+            f = static_cast<int>( (sx >> (16 - kWeightBits)) & (kWeightOne - 1) );
+        }
+        if (x0 >= src_w - 1) {
+            x0 = src_w - 1;
+            f = 0;
+        }
+        TableOffsets[x] = x0 * channels;
+        TableWeights[x] = static_cast<uint8_t>( f );
+    }
+}
+
+void FrameScaler::Bilinear(
+    const uint8_t* src, int src_stride, int src_w, int src_h,
+    uint8_t* dst, int dst_stride, int dst_w, int dst_h,
+    int channels)
+{
+    UpdateTable(src_w, dst_w, channels);
+
+    const int row_bytes = src_w * channels;
+    RowBuffer.resize(row_bytes + channels);
+    uint8_t* row = RowBuffer.data();
+
+    const int64_t step = (static_cast<int64_t>( src_h ) << 16) / dst_h;
+    int64_t sy = step / 2 - (1 << 15);
+    for (int y = 0; y < dst_h; ++y, sy += step)
+    {
+        int y0 = 0, f = 0;
+        if (sy > 0) {
+            y0 = static_cast<int>( sy >> 16 );
+            f = static_cast<int>( (sy >> (16 - kWeightBits)) & (kWeightOne - 1) );
+        }
+        if (y0 >= src_h - 1) {
+            y0 = src_h - 1;
+            f = 0;
+        }
+
+        // Vertical pass into the row buffer
+        const uint8_t* r0 = src + y0 * src_stride;
+        if (f == 0) {
+            memcpy(row, r0, row_bytes);
+        } else {
+            BlendRows(r0, r0 + src_stride, f, row, row_bytes, Simd);
+        }
+        // Repeat the last sample so the right edge needs no special case
+        memcpy(row + row_bytes, row + row_bytes - channels, channels);
+
+        // Horizontal pass
+        const int* offsets = TableOffsets.data();
+        const uint8_t* weights = TableWeights.data();
+        uint8_t* out = dst + y * dst_stride;
+        if (channels == 1) {
+            for (int x = 0; x < dst_w; ++x) {
+                const uint8_t* p = row + offsets[x];
+                const unsigned fx = weights[x];
+                out[x] = static_cast<uint8_t>(
+                    (p[0] * (kWeightOne - fx) + p[1] * fx + kWeightOne / 2) >> kWeightBits );
+            }
+        } else {
+            for (int x = 0; x < dst_w; ++x) {
+                const uint8_t* p = row + offsets[x];
+                const unsigned fx = weights[x];
+                const unsigned w0 = kWeightOne - fx;
+                out[x * 2] = static_cast<uint8_t>(
+                    (p[0] * w0 + p[2] * fx + kWeightOne / 2) >> kWeightBits );
+                out[x * 2 + 1] = static_cast<uint8_t>(
+                    (p[1] * w0 + p[3] * fx + kWeightOne / 2) >> kWeightBits );
+            }
+        }
+    }
+}
+
+
+} // namespace kvm
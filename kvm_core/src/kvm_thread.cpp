@@ -0,0 +1,357 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_thread.hpp"
+#include "kvm_logger.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#if defined(__linux__)
+    #include <errno.h>
+    #include <sched.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif // __linux__
+
+namespace kvm {
+
+static logger::Channel Logger("Thread");
+
+// Largest CPU index accepted by the parser
+static const int kMaxCpuIndex = 1023;
+
+
+//------------------------------------------------------------------------------
+// Registry
+
+static std::mutex PolicyLock;
+static std::map<std::string, ThreadPolicy> Policies;
+
+const char* ThreadSchedulerToString(ThreadScheduler scheduler)
+{
+    switch (scheduler)
+    {
+    case ThreadScheduler::Default: return "Default";
+    case ThreadScheduler::Other: return "Other";
+    case ThreadScheduler::Fifo: return "Fifo";
+    case ThreadScheduler::RoundRobin: return "RoundRobin";
+    default: break;
+    }
+    return "Unknown";
+}
+
+void SetThreadPolicy(const std::string& name, const ThreadPolicy& policy)
+{
+    std::lock_guard<std::mutex> locker(PolicyLock);
+    Policies[name] = policy;
+}
+
+void ClearThreadPolicies()
+{
+    std::lock_guard<std::mutex> locker(PolicyLock);
+    Policies.clear();
+}
+
+bool GetThreadPolicy(const std::string& name, ThreadPolicy& policy)
+{
+    std::lock_guard<std::mutex> locker(PolicyLock);
+    auto it = Policies.find(name);
+    if (it == Policies.end()) {
+        return false;
+    }
+    policy = it->second;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Parser
+
+static bool ParseInt(const std::string& str, int& value)
+{
+    if (str.empty()) {
+        return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    const long result = strtol(str.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || result < INT_MIN || result > INT_MAX) {
+        return false;
+    }
+    value = static_cast<int>( result );
+    return true;
+}
+
+// Parse "2,3" or "2-3" or a mix like "0,2-3"
+static bool ParseCpus(const std::string& str, std::vector<int>& cpus)
+{
+    std::istringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        const size_t dash = item.find('-');
+        int first = 0, last = 0;
+        if (dash == std::string::npos) {
+            if (!ParseInt(item, first)) {
+                return false;
+            }
+            last = first;
+        } else if (!ParseInt(item.substr(0, dash), first) ||
+                   !ParseInt(item.substr(dash + 1), last)) {
+            return false;
+        }
+        if (first < 0 || last < first || last > kMaxCpuIndex) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+static bool ParseField(const std::string& field, ThreadPolicy& policy)
+{
+    const size_t eq = field.find('=');
+    if (eq == std::string::npos) {
+        return false;
+    }
+    const std::string key = field.substr(0, eq);
+    const std::string value = field.substr(eq + 1);
+
+    if (key == "cpus") {
+        return ParseCpus(value, policy.Cpus);
+    }
+    if (key == "sched") {
+        if (value == "other") {
+            policy.Scheduler = ThreadScheduler::Other;
+        } else if (value == "fifo") {
+            policy.Scheduler = ThreadScheduler::Fifo;
+        } else if (value == "rr") {
+            policy.Scheduler = ThreadScheduler::RoundRobin;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (key == "prio") {
+        return ParseInt(value, policy.Priority) &&
+            policy.Priority >= 1 && policy.Priority <= 99;
+    }
+    if (key == "nice") {
+        policy.SetNice = true;
+        return ParseInt(value, policy.Nice) &&
+            policy.Nice >= -20 && policy.Nice <= 19;
+    }
+    return false;
+}
+
+bool ParseThreadPolicies(const char* spec)
+{
+    std::map<std::string, ThreadPolicy> parsed;
+
+    std::istringstream entries(spec ? spec : "");
+    std::string entry;
+    while (std::getline(entries, entry, ';'))
+    {
+        std::istringstream fields(entry);
+        std::string name;
+        if (!(fields >> name)) {
+            continue; // Empty entry
+        }
+
+        ThreadPolicy policy;
+        std::string field;
+        while (fields >> field) {
+            if (!ParseField(field, policy)) {
+                Logger.Error("Invalid thread policy field for ", name, ": ", field);
+                return false;
+            }
+        }
+
+        const bool realtime = policy.Scheduler == ThreadScheduler::Fifo ||
+            policy.Scheduler == ThreadScheduler::RoundRobin;
+        if (realtime && policy.Priority == 0) {
+            Logger.Error("Thread policy for ", name, " needs prio= for sched=fifo or rr");
+            return false;
+        }
+
+        parsed[name] = policy;
+    }
+
+    for (auto& it : parsed) {
+        SetThreadPolicy(it.first, it.second);
+    }
+    return true;
+}
+
+bool LoadThreadPoliciesFromEnvironment()
+{
+    const char* spec = getenv(kThreadPolicyEnv);
+    if (!spec) {
+        return true;
+    }
+    Logger.Info(kThreadPolicyEnv, "=", spec);
+    return ParseThreadPolicies(spec);
+}
+
+
+//------------------------------------------------------------------------------
+// Apply
+
+#if defined(__linux__)
+
+// Threads that named themselves, by kernel thread id, so policies registered
+// afterwards can be applied by ReapplyThreadPolicies()
+static std::map<pid_t, std::string> NamedThreads;
+
+static pid_t GetKernelThreadId()
+{
+    return static_cast<pid_t>( syscall(SYS_gettid) );
+}
+
+// True if the thread is still running in this process with the name.
+// Linux keeps only the first 15 characters of a thread name
+static bool IsThreadNamed(pid_t tid, const std::string& name)
+{
+    std::ostringstream path;
+    path << "/proc/self/task/" << tid << "/comm";
+    std::ifstream file(path.str());
+    std::string comm;
+    if (!std::getline(file, comm)) {
+        return false;
+    }
+    return comm == name.substr(0, 15);
+}
+
+static bool ApplyPolicyToThread(const char* name, pid_t tid, const ThreadPolicy& policy)
+{
+    bool success = true;
+
+    if (!policy.Cpus.empty())
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int cpu : policy.Cpus) {
+            CPU_SET(cpu, &cpuset);
+        }
+        if (sched_setaffinity(tid, sizeof(cpuset), &cpuset) != 0) {
+            Logger.Warn(name, ": Failed to set CPU affinity: errno=", errno);
+            success = false;
+        }
+    }
+
+    if (policy.Scheduler != ThreadScheduler::Default)
+    {
+        int sched_policy = SCHED_OTHER;
+        sched_param param;
+        param.sched_priority = 0;
+        if (policy.Scheduler == ThreadScheduler::Fifo) {
+            sched_policy = SCHED_FIFO;
+            param.sched_priority = policy.Priority;
+        } else if (policy.Scheduler == ThreadScheduler::RoundRobin) {
+            sched_policy = SCHED_RR;
+            param.sched_priority = policy.Priority;
+        }
+
+        // On Linux the scheduling policy is per-thread
+        if (sched_setscheduler(tid, sched_policy, &param) != 0) {
+            Logger.Warn(name, ": Failed to set scheduler ", ThreadSchedulerToString(policy.Scheduler),
+                " priority ", policy.Priority, ": errno=", errno, " (requires CAP_SYS_NICE)");
+            success = false;
+        }
+    }
+
+    if (policy.SetNice)
+    {
+        // On Linux the nice level is per-thread
+        if (setpriority(PRIO_PROCESS, tid, policy.Nice) != 0) {
+            Logger.Warn(name, ": Failed to set nice level ", policy.Nice, ": errno=", errno);
+            success = false;
+        }
+    }
+
+    if (success) {
+        Logger.Debug(name, ": Applied thread policy: cpus=", policy.Cpus.size(),
+            " sched=", ThreadSchedulerToString(policy.Scheduler),
+            " prio=", policy.Priority, " nice=", policy.Nice);
+    }
+    return success;
+}
+
+bool ApplyThreadPolicy(const char* name)
+{
+    if (!name) {
+        return true;
+    }
+    const pid_t tid = GetKernelThreadId();
+
+    {
+        std::lock_guard<std::mutex> locker(PolicyLock);
+
+        // Forget threads that exited or were renamed, so the map stays small
+        for (auto it = NamedThreads.begin(); it != NamedThreads.end();) {
+            if (it->first != tid && !IsThreadNamed(it->first, it->second)) {
+                it = NamedThreads.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        NamedThreads[tid] = name;
+    }
+
+    ThreadPolicy policy;
+    if (!GetThreadPolicy(name, policy)) {
+        return true;
+    }
+    return ApplyPolicyToThread(name, tid, policy);
+}
+
+bool ReapplyThreadPolicies()
+{
+    std::map<pid_t, std::string> threads;
+    {
+        std::lock_guard<std::mutex> locker(PolicyLock);
+        threads = NamedThreads;
+    }
+
+    bool success = true;
+    for (const auto& it : threads)
+    {
+        ThreadPolicy policy;
+        if (!GetThreadPolicy(it.second, policy) || !IsThreadNamed(it.first, it.second)) {
+            continue;
+        }
+        if (!ApplyPolicyToThread(it.second.c_str(), it.first, policy)) {
+            success = false;
+        }
+    }
+    return success;
+}
+
+#else // __linux__
+
+bool ApplyThreadPolicy(const char* name)
+{
+    ThreadPolicy policy;
+    if (!name || !GetThreadPolicy(name, policy)) {
+        return true;
+    }
+    Logger.Warn(name, ": Thread policies are only supported on Linux");
+    return false;
+}
+
+bool ReapplyThreadPolicies()
+{
+    return true;
+}
+
+#endif // __linux__
+
+
+} // namespace kvm
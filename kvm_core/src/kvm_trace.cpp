@@ -0,0 +1,342 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_trace.hpp"
+#include "kvm_logger.hpp"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#if defined(__linux__)
+    #include <signal.h>
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/syscall.h>
+#endif // __linux__
+
+namespace kvm {
+
+static logger::Channel Logger("Trace");
+
+
+//------------------------------------------------------------------------------
+// TraceRing
+
+/*
+    Ring of events written by one thread.
+
+    Slot i of the ring holds event number Sequence - 1, where Sequence is 0
+    while the slot is being written.  The fields are relaxed atomics so a
+    dump reading a slot that is being overwritten is not a data race, and
+    the sequence number tells it to skip the slot.
+*/
+struct TraceSlot
+{
+    std::atomic<uint64_t> Sequence = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> TimeUsec = ATOMIC_VAR_INIT(0);
+    std::atomic<const char*> Name = ATOMIC_VAR_INIT(nullptr);
+    std::atomic<int64_t> Value = ATOMIC_VAR_INIT(0);
+    std::atomic<char> Phase = ATOMIC_VAR_INIT(0);
+};
+
+struct TraceRing
+{
+    // Number of events written
+    std::atomic<uint64_t> Head = ATOMIC_VAR_INIT(0);
+
+    TraceSlot Slots[kTraceRingEvents];
+
+    // Set while a thread owns the ring
+    std::atomic<bool> InUse = ATOMIC_VAR_INIT(false);
+
+    // Written when a thread takes the ring, under RegistryLock
+    long ThreadId = 0;
+    char ThreadName[16] = {};
+};
+
+static std::atomic<bool> m_TraceEnabled = ATOMIC_VAR_INIT(true);
+static std::atomic<bool> m_DumpRequested = ATOMIC_VAR_INIT(false);
+static std::atomic<bool> m_DumpRunning = ATOMIC_VAR_INIT(false);
+
+// Rings are never freed, because a thread may still record an event while
+// the process exits.  New threads reuse the rings of threads that exited
+static std::mutex RegistryLock;
+static std::vector<TraceRing*>& Rings = *new std::vector<TraceRing*>;
+
+// Requires RegistryLock
+static void ReadThreadIdentity(TraceRing& ring)
+{
+#if defined(__linux__)
+    ring.ThreadId = syscall(SYS_gettid);
+    ring.ThreadName[0] = '\0';
+    pthread_getname_np(pthread_self(), ring.ThreadName, sizeof(ring.ThreadName));
+#else // __linux__
+    // Number the threads in the order they first record an event
+    static long next_thread_id = 0;
+    ring.ThreadId = ++next_thread_id;
+    ring.ThreadName[0] = '\0';
+#endif // __linux__
+}
+
+static long GetProcessId()
+{
+#if defined(__linux__)
+    return (long)getpid();
+#else // __linux__
+    return 1;
+#endif // __linux__
+}
+
+static TraceRing* AcquireRing()
+{
+    std::lock_guard<std::mutex> locker(RegistryLock);
+
+    TraceRing* ring = nullptr;
+    for (TraceRing* candidate : Rings) {
+        if (!candidate->InUse) {
+            ring = candidate;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = new TraceRing;
+        Rings.push_back(ring);
+    }
+
+    // Events from the previous thread would show up under the new name
+    for (auto& slot : ring->Slots) {
+        slot.Sequence.store(0, std::memory_order_relaxed);
+    }
+    ring->Head.store(0, std::memory_order_relaxed);
+
+    ReadThreadIdentity(*ring);
+    ring->InUse = true;
+    return ring;
+}
+
+// Returns the calling thread's ring to the registry when the thread exits
+struct ThreadTraceRing
+{
+    TraceRing* Ring = nullptr;
+
+    ~ThreadTraceRing()
+    {
+        if (Ring) {
+            std::lock_guard<std::mutex> locker(RegistryLock);
+            Ring->InUse = false;
+        }
+    }
+};
+
+static thread_local ThreadTraceRing m_ThreadRing;
+
+
+//------------------------------------------------------------------------------
+// Recording
+
+void SetTraceEnabled(bool enabled)
+{
+    m_TraceEnabled = enabled;
+}
+
+bool IsTraceEnabled()
+{
+    return m_TraceEnabled.load(std::memory_order_relaxed);
+}
+
+void RecordTraceEvent(TracePhase phase, const char* name, int64_t value)
+{
+    TraceRing* ring = m_ThreadRing.Ring;
+    if (!ring) {
+        ring = AcquireRing();
+        m_ThreadRing.Ring = ring;
+    }
+
+    const uint64_t index = ring->Head.load(std::memory_order_relaxed);
+    TraceSlot& slot = ring->Slots[index % kTraceRingEvents];
+
+    slot.Sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.TimeUsec.store(GetTimeUsec(), std::memory_order_relaxed);
+    slot.Name.store(name, std::memory_order_relaxed);
+    slot.Value.store(value, std::memory_order_relaxed);
+    slot.Phase.store(static_cast<char>( phase ), std::memory_order_relaxed);
+
+    slot.Sequence.store(index + 1, std::memory_order_release);
+    ring->Head.store(index + 1, std::memory_order_release);
+}
+
+
+//------------------------------------------------------------------------------
+// Dumps
+
+static void WriteJsonString(std::ostream& out, const char* str)
+{
+    out << '"';
+    for (const char* p = str; *p; ++p) {
+        const char c = *p;
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            out << ' ';
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+int WriteTraceJson(std::ostream& out, int seconds)
+{
+    const uint64_t now_usec = GetTimeUsec();
+    const uint64_t window_usec = (uint64_t)seconds * 1000000;
+    const uint64_t start_usec = now_usec > window_usec ? now_usec - window_usec : 0;
+    const long pid = GetProcessId();
+
+    int count = 0;
+    bool first = true;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    std::lock_guard<std::mutex> locker(RegistryLock);
+
+    for (TraceRing* ring_ptr : Rings)
+    {
+        TraceRing& ring = *ring_ptr;
+        const uint64_t head = ring.Head.load(std::memory_order_acquire);
+        if (head == 0) {
+            continue;
+        }
+
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+            << ",\"tid\":" << ring.ThreadId << ",\"args\":{\"name\":";
+        WriteJsonString(out, ring.ThreadName[0] ? ring.ThreadName : "Thread");
+        out << "}}";
+        first = false;
+
+        const uint64_t oldest = head > (uint64_t)kTraceRingEvents ? head - kTraceRingEvents : 0;
+        for (uint64_t index = oldest; index < head; ++index)
+        {
+            const TraceSlot& slot = ring.Slots[index % kTraceRingEvents];
+
+            const uint64_t sequence = slot.Sequence.load(std::memory_order_acquire);
+            const uint64_t time_usec = slot.TimeUsec.load(std::memory_order_relaxed);
+            const char* name = slot.Name.load(std::memory_order_relaxed);
+            const int64_t value = slot.Value.load(std::memory_order_relaxed);
+            const char phase = slot.Phase.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // Skip slots that were overwritten while reading them
+            if (sequence != index + 1 || slot.Sequence.load(std::memory_order_relaxed) != sequence) {
+                continue;
+            }
+            if (time_usec < start_usec || !name) {
+                continue;
+            }
+
+            out << ",\n{\"name\":";
+            WriteJsonString(out, name);
+            out << ",\"ph\":\"" << phase << "\",\"ts\":" << time_usec
+                << ",\"pid\":" << pid << ",\"tid\":" << ring.ThreadId;
+            if (phase == (char)TracePhase::Counter) {
+                out << ",\"args\":{\"value\":" << value << "}";
+            } else if (phase == (char)TracePhase::Instant) {
+                out << ",\"s\":\"t\"";
+            }
+            out << "}";
+            ++count;
+        }
+    }
+
+    out << "\n]}\n";
+    return count;
+}
+
+std::string WriteTraceFile(const std::string& dir, int seconds)
+{
+    if (seconds > kMaxTraceSeconds) {
+        seconds = kMaxTraceSeconds;
+    }
+
+    // One dump at a time: Each holds RegistryLock while it writes
+    if (m_DumpRunning.exchange(true)) {
+        Logger.Warn("Trace dump already running");
+        return std::string();
+    }
+    ScopedFunction running_scope([]() {
+        m_DumpRunning = false;
+    });
+
+    std::ostringstream path;
+    path << dir << "/kvm_trace_" << GetTimeMsec() << ".json";
+
+    std::ofstream file(path.str());
+    if (!file) {
+        Logger.Error("Failed to open trace file ", path.str());
+        return std::string();
+    }
+
+    const int count = WriteTraceJson(file, seconds);
+    file.close();
+    if (!file) {
+        Logger.Error("Failed to write trace file ", path.str());
+        return std::string();
+    }
+
+    Logger.Info("Wrote ", count, " trace events from the last ", seconds, " seconds to ", path.str());
+    return path.str();
+}
+
+bool IsTraceDumpRunning()
+{
+    return m_DumpRunning;
+}
+
+void RequestTraceDump()
+{
+    m_DumpRequested = true;
+}
+
+#if defined(__linux__)
+
+static void TraceSignalHandler(int /*signum*/)
+{
+    RequestTraceDump();
+}
+
+bool InstallTraceSignalHandler(int signum)
+{
+    struct sigaction action{};
+    action.sa_handler = TraceSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+
+    if (sigaction(signum, &action, nullptr) != 0) {
+        Logger.Error("Failed to install trace signal handler for signal ", signum);
+        return false;
+    }
+    return true;
+}
+
+#else // __linux__
+
+bool InstallTraceSignalHandler(int signum)
+{
+    Logger.Warn("Trace signal handler for signal ", signum, " is only supported on Linux");
+    return false;
+}
+
+#endif // __linux__
+
+std::string TryWriteRequestedTrace(const std::string& dir)
+{
+    if (!m_DumpRequested || !m_DumpRequested.exchange(false)) {
+        return std::string();
+    }
+    return WriteTraceFile(dir, kDefaultTraceSeconds);
+}
+
+
+} // namespace kvm
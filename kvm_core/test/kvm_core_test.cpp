@@ -1,11 +1,150 @@
 // Copyright 2020 Christopher A. Taylor
 
+/*
+    Measures the latency of handing a message from one thread to another:
+
+    + SpscQueue with a WakeEvent, as used between pipeline stages
+    + A mutex, condition variable and std::function queue, as the pipeline
+      used before, for comparison
+
+    Messages are sent 1 millisecond apart, so the receiving thread is usually
+    asleep when a message arrives, as it is for video frames.
+*/
+
 #include "kvm_core.hpp"
+#include "kvm_queue.hpp"
 #include "kvm_logger.hpp"
 using namespace kvm;
 
 static logger::Channel Logger("CoreTest");
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+
+
+//------------------------------------------------------------------------------
+// Handoff Latency
+
+static const int kHandoffMessages = 2000;
+static const int kHandoffIntervalMsec = 1;
+
+static void ReportLatency(const char* name, std::vector<uint64_t>& latency_usec)
+{
+    if (latency_usec.empty()) {
+        Logger.Error(name, ": No messages received");
+        return;
+    }
+
+    std::sort(latency_usec.begin(), latency_usec.end());
+
+    uint64_t total = 0;
+    for (uint64_t usec : latency_usec) {
+        total += usec;
+    }
+
+    Logger.Info(name, ": ", latency_usec.size(), " messages, handoff avg=",
+        total / (float)latency_usec.size(), " p99=", latency_usec[latency_usec.size() * 99 / 100],
+        " max=", latency_usec.back(), " (usec)");
+}
+
+struct TimedMessage
+{
+    uint64_t SentUsec = 0;
+};
+
+static void TestSpscHandoff()
+{
+    SpscQueue<TimedMessage, 4> queue;
+    WakeEvent wake;
+    std::atomic<bool> done = ATOMIC_VAR_INIT(false);
+
+    std::vector<uint64_t> latency_usec;
+    latency_usec.reserve(kHandoffMessages);
+
+    std::thread consumer([&]() {
+        TimedMessage message;
+        while (!done || queue.Size() > 0) {
+            if (!queue.Pop(message)) {
+                wake.Wait(100);
+                continue;
+            }
+            latency_usec.push_back(GetTimeUsec() - message.SentUsec);
+        }
+    });
+
+    for (int i = 0; i < kHandoffMessages; ++i) {
+        TimedMessage message;
+        message.SentUsec = GetTimeUsec();
+        if (queue.Push(std::move(message))) {
+            wake.Signal();
+        }
+        ThreadSleepForMsec(kHandoffIntervalMsec);
+    }
+
+    done = true;
+    wake.Signal();
+    consumer.join();
+
+    ReportLatency("SpscQueue + futex", latency_usec);
+}
+
+static void TestMutexHandoff()
+{
+    std::mutex lock;
+    std::condition_variable condition;
+    std::vector<std::function<void()>> queue_public, queue_private;
+    bool done = false;
+
+    std::vector<uint64_t> latency_usec;
+    latency_usec.reserve(kHandoffMessages);
+
+    std::thread consumer([&]() {
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> locker(lock);
+                if (queue_public.empty() && !done) {
+                    condition.wait(locker);
+                }
+                if (queue_public.empty() && done) {
+                    break;
+                }
+                std::swap(queue_public, queue_private);
+            }
+            for (auto& func : queue_private) {
+                func();
+            }
+            queue_private.clear();
+        }
+    });
+
+    for (int i = 0; i < kHandoffMessages; ++i) {
+        const uint64_t sent_usec = GetTimeUsec();
+        {
+            std::unique_lock<std::mutex> locker(lock);
+            queue_public.push_back([&latency_usec, sent_usec]() {
+                latency_usec.push_back(GetTimeUsec() - sent_usec);
+            });
+            condition.notify_all();
+        }
+        ThreadSleepForMsec(kHandoffIntervalMsec);
+    }
+
+    {
+        std::unique_lock<std::mutex> locker(lock);
+        done = true;
+        condition.notify_all();
+    }
+    consumer.join();
+
+    ReportLatency("Mutex + std::function", latency_usec);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
 int main(int argc, char* argv[])
 {
     SetCurrentThreadName("Main");
@@ -13,5 +152,8 @@ int main(int argc, char* argv[])
     CORE_UNUSED(argc);
     CORE_UNUSED(argv);
 
+    TestMutexHandoff();
+    TestSpscHandoff();
+
     return kAppSuccess;
 }
@@ -0,0 +1,273 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the metrics registry:
+
+    + Counters updated from several threads add up exactly
+    + Histogram percentiles and power-of-two buckets
+    + Registering a name again returns the same metric
+    + Prometheus text exposition, with samples at a power of two counted in
+      buckets whose le they do not exceed
+    + The HTTP server answers /metrics
+    + Shutdown() is not held up by a scraper that stops reading
+
+        kvm_metrics_test
+*/
+
+#include "kvm_metrics.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("MetricsTest");
+
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static bool Contains(const std::string& text, const std::string& pattern)
+{
+    return text.find(pattern) != std::string::npos;
+}
+
+// Send an HTTP request to the local port and return the whole response
+static std::string HttpGet(int port, const std::string& path)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return std::string();
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>( port ));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::string response;
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+        const std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        send(fd, request.data(), request.size(), 0);
+
+        char buffer[4096];
+        ssize_t r;
+        while ((r = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, static_cast<size_t>( r ));
+        }
+    }
+    close(fd);
+    return response;
+}
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static void TestCounters()
+{
+    MetricsRegistry registry;
+    MetricCounter* counter = registry.GetCounter("test_frames_total", "Frames");
+    MetricHistogram* histogram = registry.GetHistogram("test_bytes", "Bytes");
+
+    const int kThreads = 4;
+    const int kAdds = 100000;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+        threads.emplace_back([counter, histogram]() {
+            for (int j = 0; j < kAdds; ++j) {
+                counter->Add();
+                histogram->Record(j % 1000);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    bool passed = counter->Get() == (uint64_t)kThreads * kAdds;
+    passed &= histogram->GetCount() == (uint64_t)kThreads * kAdds;
+    passed &= histogram->GetSum() == (uint64_t)kThreads * (kAdds / 1000) * (999 * 1000 / 2);
+    Expect(passed, "Updates from several threads add up");
+}
+
+static void TestHistogram()
+{
+    MetricHistogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        histogram.Record(value);
+    }
+
+    const uint64_t p50 = histogram.GetPercentile(50.f);
+    const uint64_t p99 = histogram.GetPercentile(99.f);
+    bool passed = p50 >= 50000 && p50 <= 50000 + 50000 / kHistogramSubBuckets;
+    passed &= p99 >= 99000 && p99 <= 99000 + 99000 / kHistogramSubBuckets;
+    Logger.Info("Uniform: p50=", p50, " p99=", p99);
+    Expect(passed, "Histogram percentiles");
+
+    passed = histogram.GetCountBelowPowerOfTwo(0) == 0;
+    passed &= histogram.GetCountBelowPowerOfTwo(1) == 1;
+    passed &= histogram.GetCountBelowPowerOfTwo(4) == 15;
+    passed &= histogram.GetCountBelowPowerOfTwo(10) == 1023;
+    passed &= histogram.GetCountBelowPowerOfTwo(16) == 65535;
+    passed &= histogram.GetCountBelowPowerOfTwo(17) == 100000;
+    passed &= histogram.GetCountBelowPowerOfTwo(kHistogramValueBits) == 100000;
+    Expect(passed, "Power-of-two bucket counts");
+
+    MetricHistogram empty;
+    Expect(empty.GetPercentile(99.f) == 0 && empty.GetCount() == 0, "Empty histogram");
+}
+
+static void TestRegistry()
+{
+    MetricsRegistry registry;
+
+    MetricCounter* a = registry.GetCounter("test_drops_total", "Drops", "reason=\"a\"");
+    MetricCounter* b = registry.GetCounter("test_drops_total", "Drops", "reason=\"b\"");
+    bool passed = a && b && a != b;
+    passed &= registry.GetCounter("test_drops_total", "Drops", "reason=\"a\"") == a;
+    passed &= registry.GetGauge("test_drops_total", "Drops") == nullptr;
+    Expect(passed, "Registering again returns the same metric");
+
+    a->Add(3);
+    b->Add(5);
+    registry.GetGauge("test_queue_depth", "Queued frames")->Set(2.5);
+    MetricHistogram* decode = registry.GetHistogram("test_decode_seconds", "Decode time", "", 1e-6);
+    decode->Record(1500);
+    decode->Record(3000000);
+
+    std::ostringstream out;
+    registry.WritePrometheus(out);
+    const std::string text = out.str();
+
+    passed = Contains(text, "# HELP test_drops_total Drops\n# TYPE test_drops_total counter\n");
+    passed &= Contains(text, "test_drops_total{reason=\"a\"} 3\n");
+    passed &= Contains(text, "test_drops_total{reason=\"b\"} 5\n");
+    passed &= Contains(text, "# TYPE test_queue_depth gauge\ntest_queue_depth 2.5\n");
+    passed &= Contains(text, "# TYPE test_decode_seconds histogram\n");
+    passed &= Contains(text, "test_decode_seconds_bucket{le=\"0.001023\"} 0\n");
+    passed &= Contains(text, "test_decode_seconds_bucket{le=\"0.002047\"} 1\n");
+    passed &= Contains(text, "test_decode_seconds_bucket{le=\"+Inf\"} 2\n");
+    passed &= Contains(text, "test_decode_seconds_sum 3.0015\n");
+    passed &= Contains(text, "test_decode_seconds_count 2\n");
+    Expect(passed, "Prometheus text exposition");
+    if (!passed) {
+        Logger.Info(text);
+    }
+}
+
+// Samples on either side of a power of two land in buckets whose le they
+// do not exceed
+static void TestBucketBoundary()
+{
+    MetricsRegistry registry;
+
+    MetricHistogram* bytes = registry.GetHistogram("test_bytes", "Bytes");
+    bytes->Record(1023);
+    bytes->Record(1024);
+    registry.GetHistogram("test_seconds", "Time", "", 1e-6)->Record(2048);
+
+    std::ostringstream out;
+    registry.WritePrometheus(out);
+    const std::string text = out.str();
+
+    bool passed = Contains(text, "test_bytes_bucket{le=\"511\"} 0\n");
+    passed &= Contains(text, "test_bytes_bucket{le=\"1023\"} 1\n");
+    passed &= Contains(text, "test_bytes_bucket{le=\"2047\"} 2\n");
+    passed &= !Contains(text, "le=\"1024\"");
+    passed &= Contains(text, "test_seconds_bucket{le=\"0.002047\"} 0\n");
+    passed &= Contains(text, "test_seconds_bucket{le=\"0.004095\"} 1\n");
+    Expect(passed, "Sample on a bucket boundary");
+    if (!passed) {
+        Logger.Info(text);
+    }
+}
+
+static void TestServer()
+{
+    MetricsRegistry registry;
+    registry.GetCounter("test_scrapes_total", "Scrapes")->Add(7);
+
+    MetricsServer server;
+    if (!server.Start("127.0.0.1", 0, &registry)) {
+        Expect(false, "Start metrics server");
+        return;
+    }
+
+    const std::string response = HttpGet(server.GetPort(), "/metrics");
+    bool passed = Contains(response, "HTTP/1.0 200 OK\r\n");
+    passed &= Contains(response, "Content-Type: text/plain; version=0.0.4");
+    passed &= Contains(response, "\r\n\r\n# HELP test_scrapes_total Scrapes\n");
+    passed &= Contains(response, "test_scrapes_total 7\n");
+    Expect(passed, "Server answers /metrics");
+
+    Expect(Contains(HttpGet(server.GetPort(), "/"), "HTTP/1.0 404 Not Found\r\n"), "Server rejects other paths");
+
+    server.Shutdown();
+    Expect(HttpGet(server.GetPort(), "/metrics").empty(), "Server shuts down");
+}
+
+static void TestStalledScraper()
+{
+    // Response much larger than the socket buffers
+    MetricsRegistry registry;
+    registry.GetCounter("test_large_total", std::string(16 * 1000 * 1000, 'x'));
+
+    MetricsServer server;
+    if (!server.Start("127.0.0.1", 0, &registry)) {
+        Expect(false, "Start metrics server");
+        return;
+    }
+
+    // Scraper that sends its request and never reads the response
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int buffer_bytes = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_bytes, sizeof(buffer_bytes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>( server.GetPort() ));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool passed = connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+
+    const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    passed &= send(fd, request.data(), request.size(), 0) == (ssize_t)request.size();
+
+    // Let the server fill the socket buffers
+    ThreadSleepForMsec(500);
+
+    const uint64_t t0 = GetTimeMsec();
+    server.Shutdown();
+    const uint64_t shutdown_msec = GetTimeMsec() - t0;
+    close(fd);
+
+    Logger.Info("Shutdown with a stalled scraper took ", shutdown_msec, " msec");
+    Expect(passed && shutdown_msec < 1000, "Stalled scraper does not hold up Shutdown");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_metrics_test");
+
+    TestCounters();
+    TestHistogram();
+    TestRegistry();
+    TestBucketBoundary();
+    TestServer();
+    TestStalledScraper();
+
+    return TestResult("Metrics test");
+}
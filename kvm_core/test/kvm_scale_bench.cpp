@@ -0,0 +1,129 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Benchmark the frame scaler on a synthetic 1920x1080 desktop-like image:
+
+    + 1080p to 720p (bilinear)
+    + 1080p to 540p (2:1 box filter)
+
+    Each case runs for I420 and NV12, with and without the SIMD code paths,
+    and checks that both produce identical output.
+
+        kvm_scale_bench [iterations]
+*/
+
+#include "kvm_scale.hpp"
+#include "kvm_logger.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("ScaleBench");
+
+#include <cstdlib>
+
+
+//------------------------------------------------------------------------------
+// Test Image
+
+// Text-like pattern on a gradient, so both flat and detailed areas are scaled
+static void FillImage(Frame& frame)
+{
+    const int w = frame.Width, h = frame.Height;
+
+    uint8_t* y_plane = frame.Planes[0];
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            const bool glyph = ((x / 3) ^ (y / 5)) % 7 == 0 && (y % 20) < 14;
+            y_plane[y * w + x] = glyph ? 16 : static_cast<uint8_t>( 64 + (x + y) * 128 / (w + h) );
+        }
+    }
+
+    if (frame.Format == PixelFormat::NV12) {
+        uint8_t* uv = frame.Planes[1];
+        for (int i = 0; i < w * h / 2; ++i) {
+            uv[i] = static_cast<uint8_t>( 96 + (i * 7) % 64 );
+        }
+    } else {
+        for (int c = 1; c <= 2; ++c) {
+            for (int i = 0; i < w * h / 4; ++i) {
+                frame.Planes[c][i] = static_cast<uint8_t>( 96 + (i * (c + 4)) % 64 );
+            }
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Benchmark
+
+static const char* FormatName(PixelFormat format)
+{
+    return format == PixelFormat::NV12 ? "NV12" : "I420";
+}
+
+static double RunCase(FrameScaler& scaler, const Frame& src, Frame& dst, int iterations)
+{
+    // Warm up the caches and tables
+    scaler.Scale(src, dst);
+
+    const uint64_t t0 = GetTimeUsec();
+    for (int i = 0; i < iterations; ++i) {
+        scaler.Scale(src, dst);
+    }
+    const uint64_t t1 = GetTimeUsec();
+
+    return (t1 - t0) / 1000.0 / iterations;
+}
+
+static bool RunBench(PixelFormat format, int dst_w, int dst_h, int iterations)
+{
+    FramePool pool;
+    std::shared_ptr<Frame> src = pool.Allocate(1920, 1080, format);
+    std::shared_ptr<Frame> simd_dst = pool.Allocate(dst_w, dst_h, format);
+    std::shared_ptr<Frame> ref_dst = pool.Allocate(dst_w, dst_h, format);
+    if (!src || !simd_dst || !ref_dst) {
+        Logger.Error("Allocation failed");
+        return false;
+    }
+    FillImage(*src);
+
+    FrameScaler scaler;
+
+    scaler.SetSimd(true);
+    const double simd_msec = RunCase(scaler, *src, *simd_dst, iterations);
+
+    scaler.SetSimd(false);
+    const double ref_msec = RunCase(scaler, *src, *ref_dst, iterations);
+
+    const int bytes = simd_dst->Width * simd_dst->Height * 3 / 2;
+    const bool match = memcmp(simd_dst->Planes[0], ref_dst->Planes[0], bytes) == 0;
+
+    // Frames are padded to whole macroblocks, but only the visible image is scaled
+    const double megapixels = src->VisibleWidth * src->VisibleHeight / 1000000.0;
+    Logger.Info(FormatName(format), " ", src->VisibleWidth, "x", src->VisibleHeight, " -> ",
+        simd_dst->VisibleWidth, "x", simd_dst->VisibleHeight, ": simd=", simd_msec, " msec (",
+        megapixels / simd_msec * 1000.0, " MP/s) scalar=", ref_msec, " msec, speedup=",
+        ref_msec / simd_msec, "x", match ? "" : " OUTPUT MISMATCH");
+
+    return match;
+}
+
+int main(int argc, char* argv[])
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_scale_bench");
+
+    const int iterations = (argc >= 2) ? std::max(1, atoi(argv[1])) : 100;
+
+    bool success = true;
+    for (PixelFormat format : { PixelFormat::YUV420P, PixelFormat::NV12 }) {
+        success &= RunBench(format, 1280, 720, iterations);
+        success &= RunBench(format, 960, 540, iterations);
+    }
+
+    if (!success) {
+        Logger.Error("SIMD and scalar output differ");
+        return kAppFail;
+    }
+    return kAppSuccess;
+}
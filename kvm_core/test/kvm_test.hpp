@@ -0,0 +1,59 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Checks for the self-checking tests that CTest runs
+
+    Each check is logged as it runs, and main() returns TestResult(), which
+    fails the test if any check failed:
+
+        Expect(queue.IsEmpty(), "Queue is empty after draining");
+        ...
+        return TestResult("Queue test");
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_logger.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Checks
+
+inline logger::Channel& GetTestLogger()
+{
+    static logger::Channel channel("Test");
+    return channel;
+}
+
+// True until a check fails
+inline bool& TestsPassed()
+{
+    static bool passed = true;
+    return passed;
+}
+
+// Log the result of a check, and fail the test if it did not pass
+inline void Expect(bool passed, const char* name)
+{
+    GetTestLogger().Info(passed ? "Passed: " : "FAILED: ", name);
+    if (!passed) {
+        TestsPassed() = false;
+    }
+}
+
+// Returns the exit code for main(): kAppSuccess if every check passed
+inline int TestResult(const char* test_name)
+{
+    if (!TestsPassed()) {
+        GetTestLogger().Error(test_name, " failed");
+        return kAppFail;
+    }
+    GetTestLogger().Info(test_name, " passed");
+    return kAppSuccess;
+}
+
+
+} // namespace kvm
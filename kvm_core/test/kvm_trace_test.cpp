@@ -0,0 +1,207 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test timeline tracing:
+
+    + Events from several threads land in one dump, under their thread names
+    + Only the last kTraceRingEvents events of a thread are kept
+    + Dumping while threads are recording only writes whole events
+    + A signal requests a dump, which TryWriteRequestedTrace() writes out
+
+    Pass a path to also write the dump from the threads to a file, which can
+    be opened in chrome://tracing or ui.perfetto.dev:
+
+        kvm_trace_test [trace.json]
+*/
+
+#include "kvm_trace.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("TraceTest");
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static int CountOf(const std::string& text, const std::string& pattern)
+{
+    int count = 0;
+    for (size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+// Returns true if every brace and bracket outside of strings is matched
+static bool IsBalanced(const std::string& json)
+{
+    std::vector<char> stack;
+    bool in_string = false;
+    for (size_t i = 0; i < json.size(); ++i) {
+        const char c = json[i];
+        if (in_string) {
+            if (c == '\\') {
+                ++i;
+            } else if (c == '"') {
+                in_string = false;
+            }
+            continue;
+        }
+        if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            stack.push_back(c == '{' ? '}' : ']');
+        } else if (c == '}' || c == ']') {
+            if (stack.empty() || stack.back() != c) {
+                return false;
+            }
+            stack.pop_back();
+        }
+    }
+    return stack.empty() && !in_string;
+}
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static void TestThreads(const char* output_path)
+{
+    std::atomic<bool> stop = ATOMIC_VAR_INIT(false);
+    std::atomic<int> started = ATOMIC_VAR_INIT(0);
+
+    auto worker = [&](const char* thread_name, const char* span_name) {
+        SetCurrentThreadName(thread_name);
+        ++started;
+        int64_t frame = 0;
+        while (!stop) {
+            TraceScope scope(span_name);
+            TraceCounter("Queue depth", frame % 4);
+            ++frame;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    };
+
+    std::thread decoder(worker, "Decoder", "Decode");
+    std::thread encoder(worker, "Encoder", "Encode");
+    while (started < 2) {
+        ThreadSleepForMsec(1);
+    }
+    ThreadSleepForMsec(100);
+
+    // Dump while both threads are still recording
+    std::ostringstream live;
+    const int live_count = WriteTraceJson(live, 60);
+
+    stop = true;
+    decoder.join();
+    encoder.join();
+
+    const std::string json = live.str();
+    bool passed = live_count > 100 && IsBalanced(json);
+    passed &= CountOf(json, "\"name\":\"Decoder\"") == 1 && CountOf(json, "\"name\":\"Encoder\"") == 1;
+    passed &= CountOf(json, "\"name\":\"Decode\"") > 0 && CountOf(json, "\"name\":\"Encode\"") > 0;
+    passed &= CountOf(json, "\"ph\":\"C\"") > 0 && CountOf(json, "\"args\":{\"value\":") > 0;
+    Logger.Info("Live dump: ", live_count, " events, ", json.size(), " bytes");
+    Expect(passed, "Dump while threads are recording");
+
+    if (output_path) {
+        std::ofstream file(output_path);
+        file << json;
+        Logger.Info("Wrote ", output_path);
+    }
+}
+
+static void TestRingLimit()
+{
+    std::thread thread([]() {
+        SetCurrentThreadName("Busy");
+        for (int i = 0; i < kTraceRingEvents * 3; ++i) {
+            TraceInstant("Tick");
+        }
+    });
+    thread.join();
+
+    std::ostringstream out;
+    WriteTraceJson(out, 60);
+    const std::string json = out.str();
+
+    // The ring of the exited thread is kept until another thread takes it
+    const int ticks = CountOf(json, "\"name\":\"Tick\"");
+    Logger.Info("Ticks kept: ", ticks);
+    Expect(ticks == kTraceRingEvents, "Ring keeps the latest events");
+}
+
+static void TestWindow()
+{
+    SetCurrentThreadName("Main");
+    TraceInstant("Old");
+    ThreadSleepForMsec(1100);
+    TraceInstant("New");
+
+    std::ostringstream out;
+    WriteTraceJson(out, 1);
+    const std::string json = out.str();
+    Expect(CountOf(json, "\"name\":\"Old\"") == 0 && CountOf(json, "\"name\":\"New\"") == 1,
+        "Dump covers only the requested seconds");
+}
+
+static void TestSignal()
+{
+    char dir[] = "/tmp/kvm_trace_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        Expect(false, "Create temporary directory");
+        return;
+    }
+
+    bool passed = TryWriteRequestedTrace(dir).empty();
+
+    passed &= InstallTraceSignalHandler(SIGUSR2);
+    raise(SIGUSR2);
+
+    const std::string path = TryWriteRequestedTrace(dir);
+    passed &= !path.empty() && !IsTraceDumpRunning();
+    passed &= TryWriteRequestedTrace(dir).empty();
+
+    if (!path.empty()) {
+        std::ifstream file(path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        passed &= IsBalanced(contents.str()) && CountOf(contents.str(), "\"name\":\"New\"") == 1;
+        std::remove(path.c_str());
+    }
+    rmdir(dir);
+
+    Expect(passed, "Signal requests a dump");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv)
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_trace_test");
+
+    TestThreads(argc >= 2 ? argv[1] : nullptr);
+    TestRingLimit();
+    TestWindow();
+    TestSignal();
+
+    return TestResult("Trace test");
+}
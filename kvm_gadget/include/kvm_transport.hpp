@@ -38,6 +38,13 @@ public:
     KeyboardEmulator* Keyboard = nullptr;
     MouseEmulator* Mouse = nullptr;
 
+    // Optional: Called with the absolute position from each mouse report
+    std::function<void(uint16_t x, uint16_t y)> OnMousePosition;
+
+    // Optional: Called after each report is written to the HID device,
+    // with the time the write took
+    std::function<void(bool is_mouse, int bytes, uint64_t write_usec, bool success)> OnReportWritten;
+
     /*
         Send a set of reports generated by Javascript
 
@@ -2,6 +2,8 @@
 
 #include "kvm_keyboard.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_trace.hpp"
+#include "kvm_metrics.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,6 +15,11 @@ namespace kvm {
 
 static logger::Channel Logger("Gadget");
 
+static MetricHistogram* WriteUsec = GetMetricsRegistry().GetHistogram("kvm_hid_write_seconds",
+    "Time to write a report to the HID device", "device=\"keyboard\"", 1e-6);
+static MetricCounter* WriteErrors = GetMetricsRegistry().GetCounter("kvm_hid_write_errors_total",
+    "Reports that failed to write to the HID device", "device=\"keyboard\"");
+
 
 //------------------------------------------------------------------------------
 // KeyboardEmulator
@@ -51,8 +58,13 @@ bool KeyboardEmulator::SendReport(uint8_t modifier_keys, const uint8_t* keypress
 
     //Logger.Info("SendReport: ", HexDump((const uint8_t*)buffer, 8));
 
+    TraceBegin("Keyboard write");
+    const uint64_t t0 = GetTimeUsec();
     ssize_t written = write(fd, buffer, 8);
+    WriteUsec->Record(GetTimeUsec() - t0);
+    TraceEnd("Keyboard write");
     if (written != 8) {
+        WriteErrors->Add();
         Logger.Error("Failed to write keyboard device: errno=", errno);
         return false;
     }
@@ -3,6 +3,8 @@
 #include "kvm_mouse.hpp"
 #include "kvm_serializer.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_trace.hpp"
+#include "kvm_metrics.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -14,6 +16,11 @@ namespace kvm {
 
 static logger::Channel Logger("Gadget");
 
+static MetricHistogram* WriteUsec = GetMetricsRegistry().GetHistogram("kvm_hid_write_seconds",
+    "Time to write a report to the HID device", "device=\"mouse\"", 1e-6);
+static MetricCounter* WriteErrors = GetMetricsRegistry().GetCounter("kvm_hid_write_errors_total",
+    "Reports that failed to write to the HID device", "device=\"mouse\"");
+
 
 //------------------------------------------------------------------------------
 // MouseEmulator
@@ -50,8 +57,13 @@ bool MouseEmulator::SendReport(uint8_t button_status, uint16_t x, uint16_t y)
 
     //Logger.Info("Writing report: ", HexDump((const uint8_t*)buffer, 5));
 
+    TraceBegin("Mouse write");
+    const uint64_t t0 = GetTimeUsec();
     ssize_t written = write(fd, buffer, 5);
+    WriteUsec->Record(GetTimeUsec() - t0);
+    TraceEnd("Mouse write");
     if (written != 5) {
+        WriteErrors->Add();
         Logger.Error("Failed to write mouse device: errno=", errno);
         return false;
     }
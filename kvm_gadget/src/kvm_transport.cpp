@@ -72,11 +72,26 @@ bool InputTransport::ParseReports(const uint8_t* data, int bytes)
             // If this is a mouse:
             if (is_mouse) {
                 if (count >= 5) {
-                    success &= Mouse->SendReport(data[2], ReadU16_LE(data + 3), ReadU16_LE(data + 5));
+                    const uint16_t x = ReadU16_LE(data + 3);
+                    const uint16_t y = ReadU16_LE(data + 5);
+                    const uint64_t t0 = GetTimeUsec();
+                    const bool sent = Mouse->SendReport(data[2], x, y);
+                    if (OnReportWritten) {
+                        OnReportWritten(true, count, GetTimeUsec() - t0, sent);
+                    }
+                    success &= sent;
+                    if (OnMousePosition) {
+                        OnMousePosition(x, y);
+                    }
                 }
             } else { // keyboard:
                 if (count >= 1) {
-                    success &= Keyboard->SendReport(data[2], data + 3, count - 1);
+                    const uint64_t t0 = GetTimeUsec();
+                    const bool sent = Keyboard->SendReport(data[2], data + 3, count - 1);
+                    if (OnReportWritten) {
+                        OnReportWritten(false, count, GetTimeUsec() - t0, sent);
+                    }
+                    success &= sent;
                 }
             }
         }
@@ -16,10 +16,16 @@
 #include <mutex>
 #include <vector>
 #include <sstream>
+#include <climits>
+
+#include <signal.h>
 
 #include "kvm_pipeline.hpp"
+#include "kvm_thread.hpp"
 #include "kvm_transport.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_trace.hpp"
+#include "kvm_metrics.hpp"
 using namespace kvm;
 
 static logger::Channel Logger("plugin");
@@ -30,6 +36,11 @@ static VideoPipeline m_Pipeline;
 static KeyboardEmulator m_Keyboard;
 static MouseEmulator m_Mouse;
 
+// Prometheus endpoint, disabled by setting the port to 0
+static MetricsServer m_MetricsServer;
+static std::string m_MetricsAddress = "127.0.0.1";
+static int m_MetricsPort = kDefaultMetricsPort;
+
 struct ClientData
 {
     janus_plugin_session* handle = nullptr;
@@ -42,31 +53,275 @@ static std::vector<std::shared_ptr<ClientData>> m_Clients;
 
 static janus_callbacks* m_Callbacks = nullptr;
 
+// Suspend the video pipeline while no client is receiving video.
+// Called with m_Lock held
+static void UpdateViewerCount()
+{
+    int count = 0;
+    for (auto& client : m_Clients) {
+        if (client->transmit) {
+            ++count;
+        }
+    }
+    m_Pipeline.SetViewerCount(count);
+}
+
 static RtpPayloader m_Payloader;
 
-static PipelineNode m_WorkerNode;
+// Message from the Janus core, handled on the worker thread
+struct JanusMessage
+{
+    janus_plugin_session* Handle = nullptr;
+    std::string Transaction;
+    json_t* Message = nullptr;
+    json_t* Jsep = nullptr;
+};
+
+static void HandleJanusMessage(JanusMessage& message);
+
+// Janus calls plugin_handle_message() from several threads, so pushes to the
+// single-producer worker queue are serialized by this lock
+static std::mutex m_WorkerLock;
+static PipelineStage<JanusMessage> m_WorkerNode;
+
+// Input reports from a client, written to the HID devices on the input thread
+struct InputMessage
+{
+    std::shared_ptr<ClientData> Client;
+    std::vector<uint8_t> Reports;
+};
+
+static void HandleInputMessage(InputMessage& message);
+
+/*
+    HID writes run on a thread the plugin owns, named "Input", so its thread
+    policy (for example realtime priority) applies only to them and not to
+    the Janus thread that delivers data-channel messages.  The Block policy
+    waits for room rather than dropping keystrokes.  Janus may deliver from
+    several threads, so pushes are serialized by this lock
+*/
+static std::mutex m_InputLock;
+static PipelineStage<InputMessage> m_InputNode;
 
 extern janus_plugin m_Plugin;
 
+
+//------------------------------------------------------------------------------
+// Settings
+
+// Plugin settings file in the Janus configuration folder
+static const char* kSettingsFileName = "janus.plugin.kvm.json";
+
+// Admin requests may arrive on several Janus threads, so changes to the
+// settings are serialized by this lock
+static std::mutex m_SettingsLock;
+
+static bool ReadSettingsInt(json_t* obj, const char* key, int& value)
+{
+    json_t* item = json_object_get(obj, key);
+    if (!item) {
+        return true; // Keep the current value
+    }
+    if (!json_is_integer(item)) {
+        Logger.Error("Setting ", key, " must be an integer");
+        return false;
+    }
+    const json_int_t integer = json_integer_value(item);
+    if (integer < INT_MIN || integer > INT_MAX) {
+        Logger.Error("Setting ", key, " is out of range: ", static_cast<int64_t>( integer ));
+        return false;
+    }
+    value = static_cast<int>( integer );
+    return true;
+}
+
+static bool ReadSettingsBool(json_t* obj, const char* key, bool& value)
+{
+    json_t* item = json_object_get(obj, key);
+    if (!item) {
+        return true; // Keep the current value
+    }
+    if (!json_is_boolean(item)) {
+        Logger.Error("Setting ", key, " must be true or false");
+        return false;
+    }
+    value = json_is_true(item);
+    return true;
+}
+
+/*
+    Read encoder settings from a JSON object, for example:
+    { "kbps": 4000, "framerate": 30, "gop": 60, "min_qp": 16, "max_qp": 34 }
+
+    Missing fields keep their values from `settings`.
+*/
+static bool ReadEncoderSettings(json_t* obj, MmalEncoderSettings& settings)
+{
+    return ReadSettingsInt(obj, "kbps", settings.Kbps) &&
+        ReadSettingsInt(obj, "framerate", settings.Framerate) &&
+        ReadSettingsInt(obj, "gop", settings.GopSize) &&
+        ReadSettingsInt(obj, "min_qp", settings.MinQuant) &&
+        ReadSettingsInt(obj, "max_qp", settings.MaxQuant);
+}
+
+static json_t* WriteEncoderSettings(const MmalEncoderSettings& settings)
+{
+    json_t* obj = json_object();
+    json_object_set_new(obj, "kbps", json_integer(settings.Kbps));
+    json_object_set_new(obj, "framerate", json_integer(settings.Framerate));
+    json_object_set_new(obj, "gop", json_integer(settings.GopSize));
+    json_object_set_new(obj, "min_qp", json_integer(settings.MinQuant));
+    json_object_set_new(obj, "max_qp", json_integer(settings.MaxQuant));
+    return obj;
+}
+
+/*
+    Read the metrics endpoint from a JSON object, for example:
+    { "address": "0.0.0.0", "port": 9110 }
+
+    Missing fields keep their current values.
+*/
+static bool ReadMetricsSettings(json_t* obj, std::string& address, int& port)
+{
+    json_t* address_obj = json_object_get(obj, "address");
+    if (address_obj) {
+        const char* address_str = json_string_value(address_obj);
+        if (!address_str) {
+            Logger.Error("Setting address must be a string");
+            return false;
+        }
+        address = address_str;
+    }
+    if (!ReadSettingsInt(obj, "port", port)) {
+        return false;
+    }
+    return port >= 0 && port <= 65535;
+}
+
+/*
+    Load the settings file from the Janus configuration folder:
+    {
+        "encoder": { "kbps": 4000, ... },
+        "thread_policy": "Input sched=fifo prio=90 cpus=0; Decoder cpus=2,3",
+        "metrics": { "address": "127.0.0.1", "port": 9110 },
+        "jpeg": { "specialized": false },
+        "luma_only": false
+    }
+
+    Metrics are served for Prometheus at http://address:port/metrics, only
+    on the loopback interface by default.  Set the port to 0 to disable it.
+
+    jpeg.specialized decodes capture card JPEGs with the baseline decoder
+    instead of turbojpeg.  It is off until validated on the Pi.
+
+    luma_only streams in greyscale, for BIOS screens and text consoles.
+
+    The file is optional.  The KVM_THREAD_POLICY environment variable is
+    applied after the file, so it can override the thread policy.
+*/
+static void LoadSettings(const char* config_path)
+{
+    if (!config_path) {
+        return;
+    }
+    const std::string path = std::string(config_path) + "/" + kSettingsFileName;
+
+    json_error_t error;
+    json_t* root = json_load_file(path.c_str(), 0, &error);
+    if (!root) {
+        Logger.Info("No settings loaded from ", path, ": ", error.text);
+        return;
+    }
+    ScopedFunction root_scope([root]() {
+        json_decref(root);
+    });
+
+    Logger.Info("Loading settings from ", path);
+
+    json_t* encoder = json_object_get(root, "encoder");
+    if (encoder) {
+        MmalEncoderSettings settings = m_Pipeline.GetEncoderSettings();
+        if (!ReadEncoderSettings(encoder, settings) || !m_Pipeline.SetEncoderSettings(settings)) {
+            Logger.Error("Ignoring invalid encoder settings in ", path);
+        }
+    }
+
+    json_t* thread_policy = json_object_get(root, "thread_policy");
+    if (thread_policy) {
+        const char* spec = json_string_value(thread_policy);
+        if (!spec || !ParseThreadPolicies(spec)) {
+            Logger.Error("Ignoring invalid thread_policy in ", path);
+        }
+    }
+
+    json_t* metrics = json_object_get(root, "metrics");
+    if (metrics) {
+        std::string address = m_MetricsAddress;
+        int port = m_MetricsPort;
+        if (!ReadMetricsSettings(metrics, address, port)) {
+            Logger.Error("Ignoring invalid metrics settings in ", path);
+        } else {
+            m_MetricsAddress = address;
+            m_MetricsPort = port;
+        }
+    }
+
+    json_t* jpeg = json_object_get(root, "jpeg");
+    if (jpeg) {
+        bool specialized = m_Pipeline.IsSpecializedJpegDecoder();
+        if (!ReadSettingsBool(jpeg, "specialized", specialized)) {
+            Logger.Error("Ignoring invalid jpeg settings in ", path);
+        } else {
+            m_Pipeline.SetSpecializedJpegDecoder(specialized);
+        }
+    }
+
+    bool luma_only = m_Pipeline.IsLumaOnly();
+    if (!ReadSettingsBool(root, "luma_only", luma_only)) {
+        Logger.Error("Ignoring invalid luma_only in ", path);
+    } else {
+        m_Pipeline.SetLumaOnly(luma_only);
+    }
+}
+
 /*! \brief Plugin initialization/constructor
     * @param[in] callback The callback instance the plugin can use to contact the Janus core
     * @param[in] config_path Path of the folder where the configuration for this plugin can be found
     * @returns 0 in case of success, a negative integer in case of error */
-int plugin_init(janus_callbacks* callback, const char* /*config_path*/)
+int plugin_init(janus_callbacks* callback, const char* config_path)
 {
     m_Callbacks = callback;
 
-    m_WorkerNode.Initialize("JanusWorker", 4/*max queue depth*/);
+    // Register thread policies before the plugin threads start
+    LoadSettings(config_path);
+    if (!LoadThreadPoliciesFromEnvironment()) {
+        Logger.Error("Ignoring invalid ", kThreadPolicyEnv);
+    }
+
+    // The Logger thread is already running, so it has not had its policy yet
+    if (!ReapplyThreadPolicies()) {
+        Logger.Warn("Some thread policies could not be applied");
+    }
+
+    m_WorkerNode.Initialize("JanusWorker", HandleJanusMessage);
+    m_InputNode.Initialize("Input", HandleInputMessage, QueuePolicy::Block);
+
+    // `kill -USR2 <pid>` writes the last few seconds of the timeline to /tmp
+    InstallTraceSignalHandler(SIGUSR2);
+
+    if (m_MetricsPort > 0 && !m_MetricsServer.Start(m_MetricsAddress, m_MetricsPort)) {
+        Logger.Error("Failed to start the metrics server");
+    }
+
+    // Start suspended until the first client connects
+    m_Pipeline.SetViewerCount(0);
+    m_Pipeline.Initialize([&](const VideoPicture& picture)
+    {
+        TraceScope trace_scope("Packetize");
 
-    m_Pipeline.Initialize([&](
-        uint64_t /*frame_number*/,
-        uint64_t shutter_usec,
-        const uint8_t* data,
-        int bytes
-    ) {
         std::lock_guard<std::mutex> locker(m_Lock);
 
-        m_Payloader.WrapH264Rtp(shutter_usec, data, bytes,
+        m_Payloader.WrapH264Rtp(picture,
             [](const uint8_t* rtp_data, int rtp_bytes)
         {
             for (auto& client : m_Clients) {
@@ -95,9 +350,11 @@ int plugin_init(janus_callbacks* callback, const char* /*config_path*/)
 void plugin_destroy(void)
 {
     m_WorkerNode.Shutdown();
+    m_InputNode.Shutdown();
     m_Pipeline.Shutdown();
     m_Keyboard.Shutdown();
     m_Mouse.Shutdown();
+    m_MetricsServer.Shutdown();
 }
 
 /*! \brief Informative method to request the API version this plugin was compiled against
@@ -158,8 +415,16 @@ void plugin_create_session(janus_plugin_session* handle, int* /*error*/)
     data->handle = handle;
     data->Transport.Keyboard = &m_Keyboard;
     data->Transport.Mouse = &m_Mouse;
+    data->Transport.OnMousePosition = [](uint16_t x, uint16_t y) {
+        m_Pipeline.SetCursorPosition(x, y);
+    };
+    data->Transport.OnReportWritten = [](bool is_mouse, int bytes, uint64_t write_usec, bool success) {
+        m_Pipeline.RecordInput(is_mouse ? FlightEventType::Mouse : FlightEventType::Keyboard,
+            bytes, write_usec, success);
+    };
 
     m_Clients.push_back(data);
+    UpdateViewerCount();
 }
 
 static void post_error(janus_plugin_session* handle, const std::string& transaction, int error_code, const std::string& cause)
@@ -176,6 +441,8 @@ static void post_error(janus_plugin_session* handle, const std::string& transact
 
 static void background_handle_message(janus_plugin_session* handle, const std::string& transaction, json_t* message, json_t* /*jsep*/)
 {
+    TraceScope trace_scope("Janus message");
+
     json_t* request_obj = json_object_get(message, "request");
     if (!request_obj) {
         post_error(handle, transaction, 1, "request missing");
@@ -280,31 +547,151 @@ struct janus_plugin_result* plugin_handle_message(janus_plugin_session* handle,
         return result;
     }
 
-    std::string transaction_str = transaction;
-    m_WorkerNode.Queue([handle, transaction_str, message, jsep]() {
-        ScopedFunction ref_scope([&]() {
-            if (message) {
-                json_decref(message);
-            }
-            if (jsep) {
-                json_decref(jsep);
-            }
-        });
-        background_handle_message(handle, transaction_str.c_str(), message, jsep);
-    });
+    JanusMessage queued;
+    queued.Handle = handle;
+    queued.Transaction = transaction;
+    queued.Message = message;
+    queued.Jsep = jsep;
+
+    {
+        std::lock_guard<std::mutex> locker(m_WorkerLock);
+        if (!m_WorkerNode.Push(std::move(queued))) {
+            result->text = "Too many messages";
+            return result;
+        }
+    }
 
     ref_scope.Cancel();
     result->type = JANUS_PLUGIN_OK_WAIT;
     return result;
 }
 
+static void HandleJanusMessage(JanusMessage& message)
+{
+    ScopedFunction ref_scope([&]() {
+        if (message.Message) {
+            json_decref(message.Message);
+        }
+        if (message.Jsep) {
+            json_decref(message.Jsep);
+        }
+    });
+    background_handle_message(message.Handle, message.Transaction, message.Message, message.Jsep);
+}
+
 /*! \brief Method to handle an incoming Admin API message/request
     * @param[in] message The json_t object containing the message/request JSON
     * @returns A json_t instance containing the response */
-struct json_t *plugin_admin_message(json_t */*message*/)
+static json_t* admin_error(int error_code, const std::string& cause)
 {
-    Logger.Info("plugin_admin_message: Ignored");
-    return json_string("AdminResponseHere");
+    Logger.Error("Admin error: ", cause);
+
+    json_t* response = json_object();
+    json_object_set_new(response, "streaming", json_string("event"));
+    json_object_set_new(response, "error_code", json_integer(error_code));
+    json_object_set_new(response, "error", json_string(cause.c_str()));
+    return response;
+}
+
+struct json_t *plugin_admin_message(json_t* message)
+{
+    TraceScope trace_scope("Janus admin");
+
+    json_t* request_obj = json_object_get(message, "request");
+    if (!request_obj) {
+        return admin_error(1, "request missing");
+    }
+
+    const char* request_str = json_string_value(request_obj);
+    if (!request_str) {
+        return admin_error(2, "request not string");
+    }
+
+    Logger.Info("Admin message: ", request_str);
+
+    /*
+        Write the timeline of the last few seconds to a file on the server:
+        { "request": "trace", "seconds": 10 }
+
+        This is only offered on the Admin API, so viewers cannot make the
+        server write files or stall threads that start while a dump holds
+        the trace registry.  seconds is clamped to kMaxTraceSeconds,
+        and a request is refused while another dump is being written.
+
+        The file opens in chrome://tracing or ui.perfetto.dev.
+    */
+    if (0 == strcmp(request_str, "trace"))
+    {
+        int seconds = kDefaultTraceSeconds;
+        json_t* seconds_obj = json_object_get(message, "seconds");
+        if (seconds_obj) {
+            if (!json_is_integer(seconds_obj) || json_integer_value(seconds_obj) <= 0) {
+                return admin_error(31, "invalid trace seconds");
+            }
+            const json_int_t requested = json_integer_value(seconds_obj);
+            seconds = requested > kMaxTraceSeconds ? kMaxTraceSeconds : static_cast<int>( requested );
+        }
+
+        if (IsTraceDumpRunning()) {
+            return admin_error(32, "trace already running");
+        }
+
+        const std::string path = WriteTraceFile(kDefaultTraceDir, seconds);
+        if (path.empty()) {
+            return admin_error(30, "failed to write trace");
+        }
+
+        json_t* result = json_object();
+        json_object_set_new(result, "status", json_string("traced"));
+        json_object_set_new(result, "path", json_string(path.c_str()));
+        json_object_set_new(result, "seconds", json_integer(seconds));
+
+        json_t* response = json_object();
+        json_object_set_new(response, "streaming", json_string("event"));
+        json_object_set_new(response, "result", result);
+        return response;
+    }
+
+    /*
+        Change encoder settings without restarting the video:
+        { "request": "configure", "encoder": { "kbps": 2000 }, "luma_only": true }
+
+        These apply to every viewer, so like "trace" they are only offered on
+        the Admin API and not to viewer sessions.  Missing fields are left
+        unchanged, so an empty request just returns the current settings.
+    */
+    if (0 == strcmp(request_str, "configure"))
+    {
+        std::lock_guard<std::mutex> locker(m_SettingsLock);
+
+        json_t* encoder = json_object_get(message, "encoder");
+        if (encoder) {
+            MmalEncoderSettings settings = m_Pipeline.GetEncoderSettings();
+            if (!ReadEncoderSettings(encoder, settings) || !m_Pipeline.SetEncoderSettings(settings)) {
+                return admin_error(20, "invalid encoder settings");
+            }
+        }
+
+        bool luma_only = m_Pipeline.IsLumaOnly();
+        if (!ReadSettingsBool(message, "luma_only", luma_only)) {
+            return admin_error(21, "invalid luma_only");
+        }
+        if (luma_only != m_Pipeline.IsLumaOnly()) {
+            m_Pipeline.SetLumaOnly(luma_only);
+        }
+
+        json_t* result = json_object();
+        json_object_set_new(result, "status", json_string("configured"));
+        json_object_set_new(result, "encoder", WriteEncoderSettings(m_Pipeline.GetEncoderSettings()));
+        json_object_set_new(result, "luma_only", json_boolean(m_Pipeline.IsLumaOnly()));
+
+        json_t* response = json_object();
+        json_object_set_new(response, "streaming", json_string("event"));
+        json_object_set_new(response, "result", result);
+        return response;
+    }
+
+    return admin_error(100, std::string("unhandled request: ") + request_str);
 }
 
 /*! \brief Callback to be notified when the associated PeerConnection is up and ready to be used
@@ -317,6 +704,7 @@ void plugin_setup_media(janus_plugin_session* handle)
         if (m_Clients[i]->handle == handle) {
             Logger.Info("plugin_setup_media: Session unmuted");
             m_Clients[i]->transmit = true;
+            UpdateViewerCount();
             return;
         }
     }
@@ -354,6 +742,8 @@ void plugin_incoming_data(janus_plugin_session* handle, janus_plugin_data *packe
         return;
     }
 
+    TraceScope trace_scope("Janus data");
+
     std::shared_ptr<ClientData> client_data;
 
     // Find the client with lock held
@@ -374,11 +764,23 @@ void plugin_incoming_data(janus_plugin_session* handle, janus_plugin_data *packe
     }
 
     // Convert JS string to byte array
-    std::vector<uint8_t> data;
-    Invert_convertUint8ArrayToBinaryString((const char*)buf, len, data);
+    InputMessage message;
+    message.Client = client_data;
+    Invert_convertUint8ArrayToBinaryString((const char*)buf, len, message.Reports);
+
+    std::lock_guard<std::mutex> locker(m_InputLock);
+    if (!m_InputNode.Push(std::move(message))) {
+        Logger.Error("Input thread is not running: Dropped input reports for len=", len);
+    }
+}
+
+static void HandleInputMessage(InputMessage& message)
+{
+    TraceScope trace_scope("HID write");
 
-    if (!client_data->Transport.ParseReports(data.data(), (int)data.size())) {
-        Logger.Error("ParseReports failed for len=", len, ": ", HexDump(data.data(), (int)data.size()));
+    const std::vector<uint8_t>& data = message.Reports;
+    if (!message.Client->Transport.ParseReports(data.data(), (int)data.size())) {
+        Logger.Error("ParseReports failed: ", HexDump(data.data(), (int)data.size()));
     }
 }
 
@@ -422,6 +824,7 @@ void plugin_hangup_media(janus_plugin_session* handle)
         if (m_Clients[i]->handle == handle) {
             Logger.Info("plugin_hangup_media: Session muted");
             m_Clients[i]->transmit = false;
+            UpdateViewerCount();
             return;
         }
     }
@@ -440,6 +843,7 @@ void plugin_destroy_session(janus_plugin_session* handle, int* /*error*/)
             Logger.Info("plugin_destroy_session: Session removed");
             m_Clients[i] = m_Clients[m_Clients.size() - 1];
             m_Clients.resize(m_Clients.size() - 1);
+            UpdateViewerCount();
             return;
         }
     }
@@ -11,6 +11,8 @@
 
 #include "kvm_core.hpp"
 #include "kvm_frame.hpp"
+#include "kvm_jpeg_parser.hpp"
+#include "kvm_jpeg_baseline.hpp"
 
 #include "brcmjpeg.h"
 
@@ -22,6 +24,59 @@ namespace kvm {
 //------------------------------------------------------------------------------
 // JpegDecoder
 
+/*
+    ScaleDenom: Output image is 1/ScaleDenom the size of the JPEG image.
+        Valid values are 1, 2, 4, 8.  Scaling happens inside the IDCT so
+        smaller outputs are also faster to decode: 1920x1080 input produces
+        960x540 output with ScaleDenom = 2, and 480x270 with ScaleDenom = 4.
+
+    Incremental: Re-decode only the MCU rows that changed since the previous
+        frame, and report the changed rows in Frame::DirtyRows.
+        Changes are detected by hashing the entropy-coded segments between
+        restart markers, so this requires the JPEG to contain restart markers.
+        It is also only used with ScaleDenom = 1.  Otherwise the full image
+        is decoded as usual.
+
+    Specialized: Use BaselineJpegDecoder for the 4:2:2 and 4:2:0 baseline
+        JPEGs produced by capture cards, which writes YUV420 directly and
+        decodes restart intervals in parallel.  Other images, and scaled
+        output, fall back to turbojpeg.
+        Disabled by default until it has been validated on the Pi against
+        turbojpeg with kvm_jpeg_compare_test and recorded capture streams
+        with kvm_jpeg_bench.
+
+    DetectChanges: Compare each decoded frame with the previous one, and
+        report the changed 16 pixel wide tiles in Frame::DirtyTiles.
+        With Incremental, only the rows that were re-decoded are compared.
+
+    FusedBands: Run chroma conversion and change detection on each band of
+        rows right after it is decoded, while the band is still in L2 cache.
+        Otherwise each step makes its own pass over the full frame, which
+        streams the frame through DRAM again.  This can be disabled to
+        measure the difference.  The specialized decoder always converts
+        chroma as part of decoding, and turbojpeg decodes the full frame
+        before the remaining steps run together band by band.
+
+    LumaOnly: Decode only the Y plane, for content like BIOS screens and text
+        consoles where color carries no information.  The chroma planes are
+        filled with neutral grey once per frame allocation rather than on
+        every frame, and the encoder spends almost no bits on them.
+        turbojpeg skips the chroma IDCT entirely, and the specialized decoder
+        skips everything except the entropy decoding.
+*/
+struct JpegDecoderSettings
+{
+    int ScaleDenom = 1;
+    bool Incremental = false;
+    bool Specialized = false;
+    bool DetectChanges = false;
+    bool FusedBands = true;
+    bool LumaOnly = false;
+};
+
+// Returns true if the scale denominator is supported by the decoder
+bool IsValidJpegScaleDenom(int scale_denom);
+
 class JpegDecoder
 {
 public:
@@ -30,6 +85,12 @@ public:
         Shutdown();
     }
 
+    // Not thread-safe: Call from the same thread as Decompress()
+    void SetSettings(const JpegDecoderSettings& settings)
+    {
+        Settings = settings;
+    }
+
     std::shared_ptr<Frame> Decompress(const uint8_t* data, int bytes);
 
     void Release(const std::shared_ptr<Frame>& frame)
@@ -38,18 +99,102 @@ public:
     }
 
 protected:
+    JpegDecoderSettings Settings;
+
     // TurboJpeg decoder
     tjhandle Handle = nullptr;
 
+    // Specialized decoder for capture card JPEGs
+    BaselineJpegDecoder Baseline;
+
     // BRCM hw decoder
     BRCMJPEG_T* BroadcomDecoder = nullptr;
 
     FramePool Pool;
 
     std::shared_ptr<Frame> Yuv422TempFrame;
+    int TempWidth = 0, TempHeight = 0;
+
+    // Headers of the current JPEG, when parsed
+    JpegParser Parser;
+
+    // Previous output frame to compare against, for DetectChanges.
+    // The pool does not reuse it while it is referenced here
+    std::shared_ptr<Frame> PreviousFrame;
+
+    // Incremental decoder state:
+
+    // Previous decoded image in the same subsampling format as the decoder
+    // output: YUV420 for the specialized decoder, or the JPEG format
+    std::shared_ptr<Frame> ReferenceFrame;
+
+    // Reference frame contains only luma
+    bool ReferenceLumaOnly = false;
+
+    // Hashes of the previous JPEG headers and entropy-coded segments
+    uint64_t HeaderHash = 0;
+    std::vector<uint64_t> SegmentHashes;
+
+    // One entry per band of MCU rows that can be decoded separately
+    std::vector<uint8_t> DirtyBands;
+
+    // Workspace for standalone JPEG bands
+    std::vector<uint8_t> BandJpeg;
 
     bool Initialize();
     void Shutdown();
+
+    std::shared_ptr<Frame> DecompressImage(const uint8_t* data, int bytes);
+
+    // Returns true if the frame should be compared with PreviousFrame,
+    // after clearing its DirtyTiles.  Otherwise marks it all dirty
+    bool StartChangeDetection(Frame& frame, int row_height);
+
+    // Compare a range of rows of tiles with PreviousFrame in one pass
+    void DiffTileRows(Frame& frame, int first_row, int row_count);
+
+    // Fill neutral chroma for LumaOnly, or note that chroma will be written
+    void PrepareChroma(Frame& frame);
+
+    enum class IncrementalResult
+    {
+        Unsupported, // JPEG cannot be decoded incrementally
+        Success,
+        Failed
+    };
+
+    // Requires Parser to contain the parsed headers of the JPEG.
+    // If `specialized` is true then BaselineJpegDecoder is used
+    IncrementalResult DecompressIncremental(
+        const uint8_t* data,
+        int bytes,
+        bool specialized,
+        int subsamp,
+        Frame& frame);
+
+    // Requires Parser to contain the parsed headers of a supported JPEG
+    std::shared_ptr<Frame> DecompressSpecialized(const uint8_t* data, int bytes);
+
+    void ResetIncremental()
+    {
+        SegmentHashes.clear();
+    }
+
+    bool DecodeToPlanes(
+        const uint8_t* data,
+        int bytes,
+        uint8_t* planes[3],
+        int strides[3],
+        int w,
+        int h);
+
+    bool DecodeToLuma(
+        const uint8_t* data,
+        int bytes,
+        uint8_t* plane,
+        int stride,
+        int w,
+        int h);
 };
 
 
@@ -0,0 +1,185 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Specialized baseline JPEG decoder for capture card MJPEG streams
+
+    Capture cards produce a very narrow subset of JPEG: 8-bit baseline
+    Huffman-coded YCbCr with 4:2:2 or 4:2:0 subsampling, usually with the same
+    quantization and Huffman tables on every frame.  This decoder handles only
+    that subset, so it can skip most of the per-frame setup work a general
+    decoder does:
+
+    + Quantization and Huffman lookup tables are cached across frames, keyed
+      by a hash of the DQT/DHT payloads.
+    + Headers are parsed once by JpegParser, which is also used to split the
+      scan at restart markers.
+    + Short AC codes are decoded together with their coefficient bits in a
+      single table lookup.
+    + Blocks with only a DC coefficient (very common for desktop content)
+      skip the IDCT entirely.  Other blocks use an SSE2 or NEON IDCT.
+    + 4:2:2 chroma is converted to 4:2:0 while each 8x8 block is still in
+      cache, so no full-frame conversion pass is needed.
+
+    The IDCT is the same integer algorithm as libjpeg's "islow" IDCT
+    (TJFLAG_ACCURATEDCT), so the output matches libjpeg-turbo for luma.
+
+    Images this decoder does not support should be decoded with libjpeg-turbo.
+
+    References:
+    [1] https://www.w3.org/Graphics/JPEG/itu-t81.pdf
+    [2] https://github.com/libjpeg-turbo/libjpeg-turbo/blob/master/jidctint.c
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_frame.hpp"
+#include "kvm_jpeg_parser.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Number of bits looked up at once when decoding Huffman codes.
+// Longer codes take a slower path
+static const int kJpegHuffmanLookupBits = 9;
+
+// Number of table sets kept in the cache
+static const int kJpegTableCacheSize = 4;
+
+
+//------------------------------------------------------------------------------
+// Tables
+
+struct JpegHuffmanTable
+{
+    // Indexed by the next kJpegHuffmanLookupBits bits of input:
+    // (code length << 8) | symbol, or 0 if the code is longer
+    uint16_t Lookup[1 << kJpegHuffmanLookupBits];
+
+    // Largest code of each length, or -1 if there are none (index 1..16)
+    int32_t MaxCode[17];
+
+    // Symbol index = code + ValueOffset[length]
+    int32_t ValueOffset[17];
+
+    uint8_t Symbols[256];
+
+    /*
+        AC tables only: Indexed like Lookup, for codes where the Huffman code
+        and the coefficient bits both fit in kJpegHuffmanLookupBits:
+        (coefficient << 8) | (run << 4) | (total bits), or 0 otherwise.
+        End of block is stored with a zero coefficient.
+    */
+    int32_t FastAC[1 << kJpegHuffmanLookupBits];
+
+    // Returns false if the table is invalid
+    bool Initialize(const uint8_t counts[16], const uint8_t* symbols, int symbol_count);
+
+    // Fill in FastAC after Initialize()
+    void InitializeFastAC();
+};
+
+struct JpegTableSet
+{
+    // Hash of all the DQT and DHT payloads
+    uint64_t Hash = 0;
+    bool Valid = false;
+
+    // Quantization tables in zig-zag order
+    uint16_t Quant[4][64];
+    bool QuantDefined[4];
+
+    JpegHuffmanTable DC[4], AC[4];
+    bool DCDefined[4], ACDefined[4];
+
+    // Returns false if the tables are invalid
+    bool Initialize(const JpegParser& parser, const uint8_t* data, uint64_t hash);
+};
+
+
+//------------------------------------------------------------------------------
+// BaselineJpegDecoder
+
+/*
+    Called with the index of each MCU row as soon as it is fully decoded,
+    while it is still in cache.  Rows may be reported out of order, and from
+    two threads at once.
+*/
+typedef std::function<void(int mcu_row)> JpegRowCallback;
+
+class BaselineJpegDecoder
+{
+public:
+    // Returns true if this decoder can handle the parsed image
+    bool IsSupported(const JpegParser& parser) const;
+
+    /*
+        Look up or build the tables for the parsed image.
+        Must be called before DecodeSegments().
+
+        Returns false if the tables are invalid.
+    */
+    bool SetupTables(const JpegParser& parser, const uint8_t* data);
+
+    /*
+        Decode only the luma plane.  Chroma is still entropy-decoded because
+        it is interleaved with luma, but the IDCT and output are skipped, and
+        the chroma planes of the frame are left untouched.
+    */
+    void SetLumaOnly(bool luma_only)
+    {
+        LumaOnly = luma_only;
+    }
+
+    /*
+        Decode a range of entropy-coded segments (restart intervals) into a
+        YUV420P frame allocated for the full image size.  Each segment resets
+        the DC predictors, so any range can be decoded independently.
+
+        If the image has no restart markers there is a single segment.
+
+        If on_row is provided, it is called for each MCU row covered by the
+        decoded segments.
+
+        Returns false if the data is corrupted.
+    */
+    bool DecodeSegments(
+        const JpegParser& parser,
+        const uint8_t* data,
+        int first_segment,
+        int segment_count,
+        Frame& frame,
+        const JpegRowCallback& on_row = nullptr);
+
+    // Decode the full image into a YUV420P frame
+    bool Decode(
+        const JpegParser& parser,
+        const uint8_t* data,
+        Frame& frame,
+        const JpegRowCallback& on_row = nullptr)
+    {
+        return DecodeSegments(parser, data, 0, (int)parser.Segments.size(), frame, on_row);
+    }
+
+protected:
+    JpegTableSet Cache[kJpegTableCacheSize];
+    int NextCacheIndex = 0;
+
+    // Tables selected by SetupTables()
+    const JpegTableSet* Tables = nullptr;
+
+    bool LumaOnly = false;
+
+    bool DecodeSegment(
+        const JpegParser& parser,
+        const uint8_t* data,
+        int segment_index,
+        Frame& frame,
+        const JpegRowCallback& on_row);
+};
+
+
+} // namespace kvm
@@ -0,0 +1,139 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Lightweight JPEG marker parser
+
+    Locates the frame header, restart interval, and the entropy-coded
+    segments between restart markers without decoding any image data.
+    This is fast enough to run on every frame before decoding.
+
+    References:
+    [1] https://www.w3.org/Graphics/JPEG/itu-t81.pdf
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <vector>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Maximum number of image components we parse (Y, Cb, Cr)
+static const int kJpegMaxComponents = 3;
+
+
+//------------------------------------------------------------------------------
+// JpegParser
+
+struct JpegComponentInfo
+{
+    uint8_t Id = 0;
+
+    // Sampling factors
+    uint8_t H = 0, V = 0;
+
+    // Quantization table selector
+    uint8_t Tq = 0;
+
+    // DC and AC Huffman table selectors from the scan header
+    uint8_t Td = 0, Ta = 0;
+};
+
+// Entropy-coded segment between two restart markers
+struct JpegSegment
+{
+    // Offset from start of JPEG data, not including the RSTn marker
+    int Offset = 0;
+    int Bytes = 0;
+
+    JpegSegment()
+    {
+    }
+    JpegSegment(int offset, int bytes)
+        : Offset(offset)
+        , Bytes(bytes)
+    {
+    }
+};
+
+struct JpegParser
+{
+    // Image size in pixels
+    int Width = 0, Height = 0;
+
+    // Baseline sequential DCT (SOF0/SOF1)
+    bool Baseline = false;
+
+    // Bits per sample
+    int Precision = 0;
+
+    int ComponentCount = 0;
+    JpegComponentInfo Components[kJpegMaxComponents];
+
+    // MCU layout for an interleaved scan
+    int McuWidth = 0, McuHeight = 0;
+    int McusPerRow = 0, McuRows = 0;
+
+    // Number of MCUs between restart markers, or 0 if no restart markers
+    int RestartInterval = 0;
+
+    // Offset of the 0xFF byte of the SOF marker
+    int SofOffset = -1;
+
+    // Offset of the first byte of entropy-coded data after the SOS header
+    int ScanOffset = -1;
+
+    // Scan header: Number of components in the first scan, and the
+    // spectral selection and successive approximation parameters
+    int ScanComponentCount = 0;
+    int SpectralStart = 0, SpectralEnd = 0;
+    int SuccessiveApprox = 0;
+
+    // Payloads of the DQT and DHT marker segments, in order
+    std::vector<JpegSegment> QuantTables;
+    std::vector<JpegSegment> HuffmanTables;
+
+    // Entropy-coded segments in the scan, one per restart interval
+    std::vector<JpegSegment> Segments;
+
+    // Returns false if the data is not a JPEG image we can handle
+    bool Parse(const uint8_t* data, int bytes);
+
+protected:
+    bool ParseFrameHeader(const uint8_t* data, int bytes);
+    bool ParseScanHeader(const uint8_t* data, int bytes);
+    void ParseScan(const uint8_t* data, int bytes);
+};
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+/*
+    Write a standalone JPEG image containing a horizontal band of MCU rows
+    from the given image, which must have been successfully parsed.
+
+    The band starts at the given segment, which must be the first segment
+    of an MCU row, and includes segment_count segments.  The band is
+    band_height pixels tall.
+
+    This relies on the fact that the DC predictors are reset at each restart
+    marker, so each segment can be decoded independently of the others.
+
+    Returns false if the parameters are invalid.
+*/
+bool WriteJpegBand(
+    const JpegParser& parser,
+    const uint8_t* data,
+    int first_segment,
+    int segment_count,
+    int band_height,
+    std::vector<uint8_t>& band);
+
+
+} // namespace kvm
@@ -74,6 +74,13 @@ static void ConvertYuv422toYuv420(const uint8_t* src, uint8_t* dest, int w, int
 //------------------------------------------------------------------------------
 // JpegDecoder
 
+bool IsValidJpegScaleDenom(int scale_denom)
+{
+    // libjpeg-turbo supports many more scaling factors, but these are the ones
+    // that are implemented by a reduced-size IDCT rather than a resampler
+    return scale_denom == 1 || scale_denom == 2 || scale_denom == 4 || scale_denom == 8;
+}
+
 bool JpegDecoder::Initialize()
 {
 #ifdef ENABLE_BROADCOM_DECODER
@@ -106,6 +113,55 @@ void JpegDecoder::Shutdown()
 }
 
 std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
+{
+    auto frame = DecompressImage(data, bytes);
+
+    // Keep the latest frame to compare with the next one
+    if (!Settings.DetectChanges) {
+        PreviousFrame = nullptr;
+    } else if (frame) {
+        PreviousFrame = frame;
+    }
+
+    return frame;
+}
+
+bool JpegDecoder::StartChangeDetection(Frame& frame, int row_height)
+{
+    if (!Settings.DetectChanges ||
+        !PreviousFrame ||
+        PreviousFrame.get() == &frame ||
+        PreviousFrame->Width != frame.Width ||
+        PreviousFrame->Height != frame.Height ||
+        PreviousFrame->Format != PixelFormat::YUV420P ||
+        frame.Format != PixelFormat::YUV420P)
+    {
+        frame.SetAllDirty();
+        return false;
+    }
+
+    frame.ClearDirtyTiles(row_height);
+    return true;
+}
+
+void JpegDecoder::DiffTileRows(Frame& frame, int first_row, int row_count)
+{
+#pragma omp parallel for num_threads(2) if(row_count >= 8)
+    for (int i = 0; i < row_count; ++i) {
+        DiffFrameTileRow(*PreviousFrame, frame, first_row + i);
+    }
+}
+
+void JpegDecoder::PrepareChroma(Frame& frame)
+{
+    if (Settings.LumaOnly) {
+        frame.SetNeutralChroma();
+    } else {
+        frame.NeutralChroma = false;
+    }
+}
+
+std::shared_ptr<Frame> JpegDecoder::DecompressImage(const uint8_t* data, int bytes)
 {
     // If TurboJpeg handle is not initialized yet:
     if (!Handle) {
@@ -114,33 +170,69 @@ std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
         }
     }
 
+    int scale_denom = Settings.ScaleDenom;
+    if (!IsValidJpegScaleDenom(scale_denom)) {
+        Logger.Error("Invalid ScaleDenom=", scale_denom, ": Decoding at full size instead");
+        scale_denom = Settings.ScaleDenom = 1;
+    }
+
+    // Parse the headers once for the specialized and incremental decoders
+    bool parsed = false;
+    if (scale_denom == 1 && (Settings.Specialized || Settings.Incremental)) {
+        parsed = Parser.Parse(data, bytes);
+    }
+
+    Baseline.SetLumaOnly(Settings.LumaOnly);
+
+    if (parsed && Settings.Specialized && Baseline.IsSupported(Parser)) {
+        return DecompressSpecialized(data, bytes);
+    }
+
     // Read JPEG header
-    int w = 0, h = 0, subsamp = 0;
+    int jpeg_w = 0, jpeg_h = 0, subsamp = 0;
     int r = tjDecompressHeader2(
         Handle,
         (uint8_t*)data,
         bytes,
-        &w,
-        &h,
+        &jpeg_w,
+        &jpeg_h,
         &subsamp);
     if (r != 0) {
         Logger.Error("tjDecompressHeader2 failed: r=", r, " err=", tjGetErrorStr());
         return nullptr;
     }
 
+    // Output image size after scaling in the IDCT
+    tjscalingfactor scaling_factor;
+    scaling_factor.num = 1;
+    scaling_factor.denom = scale_denom;
+    const int w = TJSCALED(jpeg_w, scaling_factor);
+    const int h = TJSCALED(jpeg_h, scaling_factor);
+
     // Validate subsampling
     PixelFormat format;
-    if (subsamp == TJSAMP_420) {
+    if (Settings.LumaOnly) {
+        // Any subsampling works since chroma is not decoded
+        format = PixelFormat::YUV420P;
+    }
+    else if (subsamp == TJSAMP_420) {
         format = PixelFormat::YUV420P;
     }
     else if (subsamp == TJSAMP_422) {
         // Note: We will convert to YUV420 on CPU below
         format = PixelFormat::YUV420P;
+
+        // Reallocate temporary space if the output resolution changed
+        if (Yuv422TempFrame && (TempWidth != w || TempHeight != h)) {
+            Yuv422TempFrame = nullptr;
+        }
         if (!Yuv422TempFrame) {
             Yuv422TempFrame = Pool.Allocate(w, h, PixelFormat::YUV422P);
             if (!Yuv422TempFrame) {
                 return nullptr;
             }
+            TempWidth = w;
+            TempHeight = h;
         }
     }
     else {
@@ -155,7 +247,29 @@ std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
         return nullptr;
     }
 
-    if (BroadcomDecoder)
+    if (Settings.Incremental && parsed)
+    {
+        IncrementalResult result = DecompressIncremental(data, bytes, false, subsamp, *frame);
+        if (result == IncrementalResult::Success) {
+            return frame;
+        }
+        if (result == IncrementalResult::Failed) {
+            Pool.Release(frame);
+            return nullptr;
+        }
+        // Fall-thru to decode the full image
+    } else {
+        ResetIncremental();
+    }
+
+    // Rows of tiles match the MCU height for 4:2:0
+    const int tile_height = 16;
+    const bool detect_changes = StartChangeDetection(*frame, tile_height);
+
+    PrepareChroma(*frame);
+
+    // The hardware decoder does not support scaling or luma-only output
+    if (BroadcomDecoder && scale_denom == 1 && !Settings.LumaOnly)
     {
         // Decode the JPEG
         BRCMJPEG_REQUEST_T request{};
@@ -170,13 +284,29 @@ std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
             Logger.Error("brcmjpeg_process failed to decode JPEG: len=", bytes);
             return nullptr;
         }
+
+        if (detect_changes) {
+            DiffTileRows(*frame, 0, frame->Height / tile_height);
+        }
+    }
+    else if (Settings.LumaOnly)
+    {
+        if (!DecodeToLuma(data, bytes, frame->Planes[0], frame->Width, w, h)) {
+            Pool.Release(frame);
+            return nullptr;
+        }
+
+        if (detect_changes) {
+            DiffTileRows(*frame, 0, frame->Height / tile_height);
+        }
     }
     else
     {
+        // Note: Frame width is padded for the encoder so it can be used as stride
         int strides[3] = {
-            w,
-            w/2,
-            w/2
+            frame->Width,
+            frame->Width/2,
+            frame->Width/2
         };
 
         uint8_t* planes[3] = {
@@ -191,26 +321,50 @@ std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
             planes[2] = Yuv422TempFrame->Planes[2];
         }
 
-        r = tjDecompressToYUVPlanes(
-            Handle,
-            (uint8_t*)data,
-            bytes,
-            planes,
-            w,
-            strides,
-            h,
-            TJFLAG_ACCURATEDCT);
-        if (r != 0) {
-            Logger.Error("tjDecompressToYUVPlanes failed: r=", r, " err=", tjGetErrorStr(), " inlen=", bytes, " w=", w, " h=", h);
+        if (!DecodeToPlanes(data, bytes, planes, strides, w, h)) {
+            Pool.Release(frame);
             return nullptr;
         }
 
-        if (subsamp == TJSAMP_422) {
-            // Note: Seems to require "num_threads(2)" to actually run operations in parallel.
-            // When they run in parallel, this operation takes about 1.5 milliseconds.
+        const bool convert = (subsamp == TJSAMP_422);
+        const int band_count = frame->Height / tile_height;
+
+        if (Settings.FusedBands && (convert || detect_changes))
+        {
+            // Convert and compare each band while it is in cache
+            const int chroma_stride = frame->Width / 2;
+            const int src_band_bytes = chroma_stride * tile_height;
+            const int dest_band_bytes = src_band_bytes / 2;
+
 #pragma omp parallel for num_threads(2)
-            for (int i = 1; i <= 2; ++i) {
-                ConvertYuv422toYuv420(Yuv422TempFrame->Planes[i], frame->Planes[i], w, h);
+            for (int band = 0; band < band_count; ++band)
+            {
+                if (convert) {
+                    for (int i = 1; i <= 2; ++i) {
+                        ConvertYuv422toYuv420(
+                            Yuv422TempFrame->Planes[i] + band * src_band_bytes,
+                            frame->Planes[i] + band * dest_band_bytes,
+                            frame->Width,
+                            tile_height);
+                    }
+                }
+                if (detect_changes) {
+                    DiffFrameTileRow(*PreviousFrame, *frame, band);
+                }
+            }
+        }
+        else
+        {
+            if (convert) {
+                // Note: Seems to require "num_threads(2)" to actually run operations in parallel.
+                // When they run in parallel, this operation takes about 1.5 milliseconds.
+#pragma omp parallel for num_threads(2)
+                for (int i = 1; i <= 2; ++i) {
+                    ConvertYuv422toYuv420(Yuv422TempFrame->Planes[i], frame->Planes[i], frame->Width, frame->Height);
+                }
+            }
+            if (detect_changes) {
+                DiffTileRows(*frame, 0, band_count);
             }
         }
     }
@@ -218,5 +372,352 @@ std::shared_ptr<Frame> JpegDecoder::Decompress(const uint8_t* data, int bytes)
     return frame;
 }
 
+std::shared_ptr<Frame> JpegDecoder::DecompressSpecialized(const uint8_t* data, int bytes)
+{
+    if (!Baseline.SetupTables(Parser, data)) {
+        ResetIncremental();
+        return nullptr;
+    }
+
+    // Output is always YUV420 so no conversion is needed
+    auto frame = Pool.Allocate(Parser.Width, Parser.Height, PixelFormat::YUV420P);
+    if (!frame) {
+        Logger.Error("Pool.Allocate failed");
+        return nullptr;
+    }
+
+    if (Settings.Incremental)
+    {
+        IncrementalResult result = DecompressIncremental(data, bytes, true, 0, *frame);
+        if (result == IncrementalResult::Success) {
+            return frame;
+        }
+        if (result == IncrementalResult::Failed) {
+            Pool.Release(frame);
+            return nullptr;
+        }
+        // Fall-thru to decode the full image
+    } else {
+        ResetIncremental();
+    }
+
+    PrepareChroma(*frame);
+
+    const bool detect_changes = StartChangeDetection(*frame, Parser.McuHeight);
+
+    JpegRowCallback on_row;
+    if (detect_changes && Settings.FusedBands) {
+        Frame* output = frame.get();
+        on_row = [this, output](int mcu_row) {
+            DiffFrameTileRow(*PreviousFrame, *output, mcu_row);
+        };
+    }
+
+    if (!Baseline.Decode(Parser, data, *frame, on_row)) {
+        Logger.Error("Specialized JPEG decoder failed: len=", bytes);
+        Pool.Release(frame);
+        return nullptr;
+    }
+
+    if (detect_changes && !Settings.FusedBands) {
+        DiffTileRows(*frame, 0, Parser.McuRows);
+    }
+
+    return frame;
+}
+
+bool JpegDecoder::DecodeToPlanes(
+    const uint8_t* data,
+    int bytes,
+    uint8_t* planes[3],
+    int strides[3],
+    int w,
+    int h)
+{
+    int r = tjDecompressToYUVPlanes(
+        Handle,
+        (uint8_t*)data,
+        bytes,
+        planes,
+        w,
+        strides,
+        h,
+        TJFLAG_ACCURATEDCT);
+    if (r != 0) {
+        Logger.Error("tjDecompressToYUVPlanes failed: r=", r, " err=", tjGetErrorStr(), " inlen=", bytes, " w=", w, " h=", h);
+        return false;
+    }
+    return true;
+}
+
+bool JpegDecoder::DecodeToLuma(
+    const uint8_t* data,
+    int bytes,
+    uint8_t* plane,
+    int stride,
+    int w,
+    int h)
+{
+    // Grayscale output skips the chroma components entirely
+    int r = tjDecompress2(
+        Handle,
+        (uint8_t*)data,
+        bytes,
+        plane,
+        w,
+        stride,
+        h,
+        TJPF_GRAY,
+        TJFLAG_ACCURATEDCT);
+    if (r != 0) {
+        Logger.Error("tjDecompress2 failed: r=", r, " err=", tjGetErrorStr(), " inlen=", bytes, " w=", w, " h=", h);
+        return false;
+    }
+    return true;
+}
+
+static int GreatestCommonDivisor(int a, int b)
+{
+    while (b != 0) {
+        const int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+JpegDecoder::IncrementalResult JpegDecoder::DecompressIncremental(
+    const uint8_t* data,
+    int bytes,
+    bool specialized,
+    int subsamp,
+    Frame& frame)
+{
+    // Luma-only bands are only supported by the specialized decoder
+    if (!Parser.Baseline ||
+        (Settings.LumaOnly && !specialized) ||
+        Parser.ComponentCount != 3 ||
+        Parser.ScanComponentCount != Parser.ComponentCount ||
+        Parser.RestartInterval <= 0)
+    {
+        ResetIncremental();
+        return IncrementalResult::Unsupported;
+    }
+
+    const int interval = Parser.RestartInterval;
+    const int mcu_count = Parser.McusPerRow * Parser.McuRows;
+    const int segment_count = (mcu_count + interval - 1) / interval;
+    if ((int)Parser.Segments.size() != segment_count) {
+        Logger.Warn("JPEG has ", Parser.Segments.size(), " restart intervals but expected ", segment_count);
+        ResetIncremental();
+        return IncrementalResult::Unsupported;
+    }
+
+    // Find the smallest band that starts on both an MCU row and a restart
+    // interval boundary.  Usually the restart interval is one MCU row.
+    const int band_mcus = Parser.McusPerRow / GreatestCommonDivisor(Parser.McusPerRow, interval) * interval;
+    const int band_mcu_rows = band_mcus / Parser.McusPerRow;
+    const int band_segments = band_mcus / interval;
+    const int band_count = (Parser.McuRows + band_mcu_rows - 1) / band_mcu_rows;
+
+    // Not worth the overhead if bands are large
+    if (band_count < 4) {
+        ResetIncremental();
+        return IncrementalResult::Unsupported;
+    }
+
+    const int w = Parser.Width;
+    const int h = Parser.Height;
+    const bool reference_422 = !specialized && (subsamp == TJSAMP_422);
+    const PixelFormat reference_format = reference_422 ? PixelFormat::YUV422P : PixelFormat::YUV420P;
+
+    bool full_decode = (SegmentHashes.size() != (size_t)segment_count);
+
+    if (!ReferenceFrame ||
+        ReferenceFrame->Width != frame.Width ||
+        ReferenceFrame->Height != frame.Height ||
+        ReferenceFrame->Format != reference_format)
+    {
+        ReferenceFrame = Pool.Allocate(w, h, reference_format);
+        if (!ReferenceFrame) {
+            return IncrementalResult::Failed;
+        }
+        full_decode = true;
+    }
+
+    // Chroma in the reference frame is stale after luma-only decoding
+    if (ReferenceLumaOnly != Settings.LumaOnly) {
+        full_decode = true;
+        ReferenceLumaOnly = Settings.LumaOnly;
+    }
+
+    // Quantization tables, Huffman tables, and resolution must all match
+    const uint64_t header_hash = HashBytes(data, Parser.ScanOffset);
+    if (header_hash != HeaderHash) {
+        full_decode = true;
+        HeaderHash = header_hash;
+    }
+
+    SegmentHashes.resize(segment_count);
+    DirtyBands.resize(band_count);
+    for (int i = 0; i < band_count; ++i) {
+        DirtyBands[i] = full_decode ? 1 : 0;
+    }
+
+    for (int i = 0; i < segment_count; ++i) {
+        const JpegSegment& segment = Parser.Segments[i];
+        const uint64_t hash = HashBytes(data + segment.Offset, segment.Bytes);
+        if (SegmentHashes[i] != hash) {
+            SegmentHashes[i] = hash;
+            DirtyBands[i / band_segments] = 1;
+        }
+    }
+
+    // Chroma rows per luma row in the reference image
+    const int chroma_row_shift = reference_422 ? 0 : 1;
+
+    int strides[3] = {
+        ReferenceFrame->Width,
+        ReferenceFrame->Width / 2,
+        ReferenceFrame->Width / 2
+    };
+
+    if (full_decode)
+    {
+        const bool success = specialized ?
+            Baseline.Decode(Parser, data, *ReferenceFrame) :
+            DecodeToPlanes(data, bytes, ReferenceFrame->Planes, strides, w, h);
+        if (!success) {
+            ResetIncremental();
+            return IncrementalResult::Failed;
+        }
+    }
+    else
+    {
+        const int band_height = band_mcu_rows * Parser.McuHeight;
+
+        // Decode each run of consecutive dirty bands together
+        for (int band_start = 0; band_start < band_count;)
+        {
+            if (!DirtyBands[band_start]) {
+                ++band_start;
+                continue;
+            }
+            int band_end = band_start + 1;
+            while (band_end < band_count && DirtyBands[band_end]) {
+                ++band_end;
+            }
+
+            const int first_segment = band_start * band_segments;
+            int end_segment = band_end * band_segments;
+            if (end_segment > segment_count) {
+                end_segment = segment_count;
+            }
+
+            const int y0 = band_start * band_height;
+            int y1 = band_end * band_height;
+            if (y1 > h) {
+                y1 = h;
+            }
+
+            band_start = band_end;
+
+            // The specialized decoder decodes the segments in place
+            if (specialized) {
+                if (!Baseline.DecodeSegments(Parser, data, first_segment, end_segment - first_segment, *ReferenceFrame)) {
+                    ResetIncremental();
+                    return IncrementalResult::Failed;
+                }
+                continue;
+            }
+
+            // Otherwise decode the bands as a standalone JPEG image
+            if (!WriteJpegBand(Parser, data, first_segment, end_segment - first_segment, y1 - y0, BandJpeg)) {
+                ResetIncremental();
+                return IncrementalResult::Failed;
+            }
+
+            const int chroma_y0 = y0 >> chroma_row_shift;
+            uint8_t* planes[3] = {
+                ReferenceFrame->Planes[0] + y0 * strides[0],
+                ReferenceFrame->Planes[1] + chroma_y0 * strides[1],
+                ReferenceFrame->Planes[2] + chroma_y0 * strides[2]
+            };
+
+            if (!DecodeToPlanes(BandJpeg.data(), (int)BandJpeg.size(), planes, strides, w, y1 - y0)) {
+                ResetIncremental();
+                return IncrementalResult::Failed;
+            }
+        }
+    }
+
+    // Copy the reference image to the output frame one band of MCU rows at
+    // a time, and compare the changed rows with the previous frame while
+    // they are in cache
+    PrepareChroma(frame);
+
+    const bool luma_only = Settings.LumaOnly;
+    const bool detect_changes = StartChangeDetection(frame, Parser.McuHeight);
+    const int row_height = Parser.McuHeight;
+    const int luma_band_bytes = frame.Width * row_height;
+    const int chroma_band_bytes = luma_band_bytes / 4;
+
+#pragma omp parallel for num_threads(2)
+    for (int row = 0; row < Parser.McuRows; ++row)
+    {
+        memcpy(frame.Planes[0] + row * luma_band_bytes,
+            ReferenceFrame->Planes[0] + row * luma_band_bytes,
+            luma_band_bytes);
+
+        for (int i = 1; i <= 2 && !luma_only; ++i) {
+            uint8_t* dest = frame.Planes[i] + row * chroma_band_bytes;
+            if (reference_422) {
+                ConvertYuv422toYuv420(ReferenceFrame->Planes[i] + row * chroma_band_bytes * 2,
+                    dest, frame.Width, row_height);
+            } else {
+                memcpy(dest, ReferenceFrame->Planes[i] + row * chroma_band_bytes, chroma_band_bytes);
+            }
+        }
+
+        if (detect_changes && DirtyBands[row / band_mcu_rows]) {
+            DiffFrameTileRow(*PreviousFrame, frame, row);
+        }
+    }
+
+    // Copy the padding below the last MCU row
+    const int padding_rows = frame.Height - Parser.McuRows * row_height;
+    if (padding_rows > 0) {
+        const int luma_offset = Parser.McuRows * luma_band_bytes;
+        memcpy(frame.Planes[0] + luma_offset, ReferenceFrame->Planes[0] + luma_offset, frame.Width * padding_rows);
+
+        const int chroma_offset = Parser.McuRows * chroma_band_bytes;
+        for (int i = 1; i <= 2 && !luma_only; ++i) {
+            uint8_t* dest = frame.Planes[i] + chroma_offset;
+            if (reference_422) {
+                ConvertYuv422toYuv420(ReferenceFrame->Planes[i] + chroma_offset * 2, dest, frame.Width, padding_rows);
+            } else {
+                memcpy(dest, ReferenceFrame->Planes[i] + chroma_offset, frame.Width * padding_rows / 4);
+            }
+        }
+    }
+
+    // Report which MCU rows changed
+    if (detect_changes) {
+        // Already filled in by comparing with the previous frame
+    } else if (full_decode) {
+        frame.SetAllDirty();
+    } else {
+        frame.DirtyRowHeight = Parser.McuHeight;
+        frame.DirtyRows.resize(Parser.McuRows);
+        for (int i = 0; i < Parser.McuRows; ++i) {
+            frame.DirtyRows[i] = DirtyBands[i / band_mcu_rows];
+        }
+        frame.DirtyTiles.clear();
+        frame.DirtyTilesWide = 0;
+    }
+
+    return IncrementalResult::Success;
+}
+
 
 } // namespace kvm
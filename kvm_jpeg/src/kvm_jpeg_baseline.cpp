@@ -0,0 +1,1276 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_jpeg_baseline.hpp"
+#include "kvm_serializer.hpp"
+#include "kvm_logger.hpp"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #define KVM_JPEG_NEON
+    #include <arm_neon.h>
+#elif defined(__SSE2__)
+    #define KVM_JPEG_SSE2
+    #include <emmintrin.h>
+#endif
+
+namespace kvm {
+
+static logger::Channel Logger("BaselineJpeg");
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Decode restart intervals in parallel when there are at least this many
+static const int kMinParallelSegments = 8;
+
+/*
+    Dequantized coefficients are stored in 16 bits for the IDCT.
+
+    Valid 8-bit baseline images stay within about +/-2200, so saturating at
+    the 16-bit limits only changes the output of corrupted images, or images
+    with 16-bit quantization tables, which would otherwise wrap around.
+    The DC predictor is clamped to the same range so that a long run of
+    corrupted DC differences cannot overflow it.
+*/
+static const int32_t kMaxCoefficient = 32767;
+static const int32_t kMinCoefficient = -32768;
+
+// Zig-zag order index -> natural order index
+static const uint8_t kZigZagToNatural[64] = {
+    0,  1,  8, 16,  9,  2,  3, 10,
+   17, 24, 32, 25, 18, 11,  4,  5,
+   12, 19, 26, 33, 40, 48, 41, 34,
+   27, 20, 13,  6,  7, 14, 21, 28,
+   35, 42, 49, 56, 57, 50, 43, 36,
+   29, 22, 15, 23, 30, 37, 44, 51,
+   58, 59, 52, 45, 38, 31, 39, 46,
+   53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Standard Huffman tables from Annex K.3 of [1].
+// Many capture cards omit the DHT segments from MJPEG frames and expect the
+// decoder to use these instead
+static const uint8_t kStdDCLuminanceCounts[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t kStdDCChrominanceCounts[16] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+static const uint8_t kStdDCSymbols[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+static const uint8_t kStdACLuminanceCounts[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t kStdACLuminanceSymbols[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+static const uint8_t kStdACChrominanceCounts[16] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77
+};
+static const uint8_t kStdACChrominanceSymbols[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+    0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+
+//------------------------------------------------------------------------------
+// Tables
+
+bool JpegHuffmanTable::Initialize(const uint8_t counts[16], const uint8_t* symbols, int symbol_count)
+{
+    if (symbol_count > 256) {
+        return false;
+    }
+
+    memset(Lookup, 0, sizeof(Lookup));
+    memset(Symbols, 0, sizeof(Symbols));
+    memcpy(Symbols, symbols, symbol_count);
+    MaxCode[0] = -1;
+    ValueOffset[0] = 0;
+
+    // Canonical Huffman code assignment from Annex C of [1]
+    int code = 0, k = 0;
+    for (int len = 1; len <= 16; ++len)
+    {
+        const int n = counts[len - 1];
+        ValueOffset[len] = k - code;
+
+        if (n > 0)
+        {
+            if (code + n > (1 << len) || k + n > symbol_count) {
+                return false;
+            }
+
+            if (len <= kJpegHuffmanLookupBits)
+            {
+                const int shift = kJpegHuffmanLookupBits - len;
+                for (int i = 0; i < n; ++i) {
+                    const uint16_t entry = static_cast<uint16_t>( (len << 8) | symbols[k + i] );
+                    const int first = (code + i) << shift;
+                    for (int j = 0; j < (1 << shift); ++j) {
+                        Lookup[first + j] = entry;
+                    }
+                }
+            }
+
+            MaxCode[len] = code + n - 1;
+        }
+        else
+        {
+            MaxCode[len] = -1;
+        }
+
+        code += n;
+        k += n;
+        code <<= 1;
+    }
+
+    return k == symbol_count;
+}
+
+void JpegHuffmanTable::InitializeFastAC()
+{
+    for (int i = 0; i < (1 << kJpegHuffmanLookupBits); ++i)
+    {
+        FastAC[i] = 0;
+
+        const unsigned entry = Lookup[i];
+        if (entry == 0) {
+            continue;
+        }
+        const int code_bits = entry >> 8;
+        const int run = (entry >> 4) & 15;
+        const int bits = entry & 15;
+        if (bits == 0) {
+            if (run == 0) {
+                // End of block: Coefficient is zero
+                FastAC[i] = code_bits;
+            }
+            continue;
+        }
+        if (code_bits + bits > kJpegHuffmanLookupBits) {
+            continue;
+        }
+
+        // Coefficient bits follow the code
+        int value = (i >> (kJpegHuffmanLookupBits - code_bits - bits)) & ((1 << bits) - 1);
+        if (value < (1 << (bits - 1))) {
+            value += 1 - (1 << bits);
+        }
+
+        FastAC[i] = value * 256 + (run << 4) + code_bits + bits;
+    }
+}
+
+bool JpegTableSet::Initialize(const JpegParser& parser, const uint8_t* data, uint64_t hash)
+{
+    Valid = false;
+    Hash = hash;
+    for (int i = 0; i < 4; ++i) {
+        QuantDefined[i] = DCDefined[i] = ACDefined[i] = false;
+    }
+
+    for (const JpegSegment& segment : parser.QuantTables)
+    {
+        const uint8_t* table = data + segment.Offset;
+        int remaining = segment.Bytes;
+
+        while (remaining > 0)
+        {
+            const int precision = table[0] >> 4;
+            const int id = table[0] & 15;
+            const int value_bytes = precision ? 2 : 1;
+            if (id > 3 || remaining < 1 + 64 * value_bytes) {
+                Logger.Error("Invalid DQT segment");
+                return false;
+            }
+
+            for (int i = 0; i < 64; ++i) {
+                if (precision) {
+                    Quant[id][i] = ReadU16_BE(table + 1 + i * 2);
+                } else {
+                    Quant[id][i] = table[1 + i];
+                }
+            }
+            QuantDefined[id] = true;
+
+            table += 1 + 64 * value_bytes;
+            remaining -= 1 + 64 * value_bytes;
+        }
+    }
+
+    for (const JpegSegment& segment : parser.HuffmanTables)
+    {
+        const uint8_t* table = data + segment.Offset;
+        int remaining = segment.Bytes;
+
+        while (remaining > 0)
+        {
+            if (remaining < 17) {
+                Logger.Error("Truncated DHT segment");
+                return false;
+            }
+            const int table_class = table[0] >> 4;
+            const int id = table[0] & 15;
+            const uint8_t* counts = table + 1;
+
+            int symbol_count = 0;
+            for (int i = 0; i < 16; ++i) {
+                symbol_count += counts[i];
+            }
+            if (table_class > 1 || id > 3 || remaining < 17 + symbol_count) {
+                Logger.Error("Invalid DHT segment");
+                return false;
+            }
+
+            JpegHuffmanTable& huffman = table_class ? AC[id] : DC[id];
+            if (!huffman.Initialize(counts, table + 17, symbol_count)) {
+                Logger.Error("Invalid Huffman table: class=", table_class, " id=", id);
+                return false;
+            }
+            if (table_class) {
+                huffman.InitializeFastAC();
+                ACDefined[id] = true;
+            } else {
+                DCDefined[id] = true;
+            }
+
+            table += 17 + symbol_count;
+            remaining -= 17 + symbol_count;
+        }
+    }
+
+    // Fill in any missing Huffman tables with the standard ones
+    if (!DCDefined[0]) {
+        DCDefined[0] = DC[0].Initialize(kStdDCLuminanceCounts, kStdDCSymbols, 12);
+    }
+    if (!DCDefined[1]) {
+        DCDefined[1] = DC[1].Initialize(kStdDCChrominanceCounts, kStdDCSymbols, 12);
+    }
+    if (!ACDefined[0]) {
+        ACDefined[0] = AC[0].Initialize(kStdACLuminanceCounts, kStdACLuminanceSymbols, 162);
+        AC[0].InitializeFastAC();
+    }
+    if (!ACDefined[1]) {
+        ACDefined[1] = AC[1].Initialize(kStdACChrominanceCounts, kStdACChrominanceSymbols, 162);
+        AC[1].InitializeFastAC();
+    }
+
+    Valid = true;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Entropy Decoding
+
+namespace {
+
+/*
+    Reads bits MSB-first from one entropy-coded segment.
+
+    The segment ends before the next marker, so the only 0xFF bytes inside it
+    are followed by a stuffed zero byte.  Reading past the end of the segment
+    returns zero bits, which is detected afterwards by checking PadBytes.
+*/
+struct BitReader
+{
+    const uint8_t* Ptr = nullptr;
+    const uint8_t* End = nullptr;
+
+    // Left-aligned bit buffer
+    uint64_t Bits = 0;
+    int Count = 0;
+
+    // Number of zero bytes appended after the end of the segment
+    int PadBytes = 0;
+
+    BitReader(const uint8_t* data, int bytes)
+        : Ptr(data)
+        , End(data + bytes)
+    {
+    }
+
+    CORE_INLINE void Fill()
+    {
+        // Fast path: Next 8 bytes contain no 0xFF bytes
+        if (End - Ptr >= 8)
+        {
+            const uint64_t word = ReadU64_BE(Ptr);
+            const uint64_t inverted = ~word;
+            const uint64_t has_ff = (inverted - 0x0101010101010101ULL) & ~inverted & 0x8080808080808080ULL;
+            if (has_ff == 0) {
+                const int n = (64 - Count) >> 3;
+                if (n > 0) {
+                    Bits |= (word >> (64 - n * 8)) << (64 - Count - n * 8);
+                    Ptr += n;
+                    Count += n * 8;
+                }
+                return;
+            }
+        }
+
+        while (Count <= 56)
+        {
+            unsigned byte = 0;
+            if (Ptr < End) {
+                byte = *Ptr++;
+                if (byte == 0xff && Ptr < End && *Ptr == 0) {
+                    ++Ptr;
+                }
+            } else {
+                ++PadBytes;
+            }
+            Bits |= static_cast<uint64_t>( byte ) << (56 - Count);
+            Count += 8;
+        }
+    }
+
+    CORE_INLINE void Skip(int n)
+    {
+        Bits <<= n;
+        Count -= n;
+    }
+
+    // Read n = 1..16 bits as a signed coefficient per Figure F.12 of [1]
+    CORE_INLINE int32_t ReceiveExtend(int n)
+    {
+        const int32_t value = static_cast<int32_t>( Bits >> (64 - n) );
+        Skip(n);
+        if (value < (1 << (n - 1))) {
+            return value - (1 << n) + 1;
+        }
+        return value;
+    }
+
+    // Returns true if bits past the end of the segment were consumed
+    bool Overrun() const
+    {
+        return PadBytes * 8 > Count;
+    }
+};
+
+// Returns the decoded symbol, or -1 if the code is invalid.
+// Requires at least 16 bits in the reader
+CORE_INLINE int DecodeHuffman(BitReader& reader, const JpegHuffmanTable& table)
+{
+    const unsigned entry = table.Lookup[reader.Bits >> (64 - kJpegHuffmanLookupBits)];
+    if (entry != 0) {
+        reader.Skip(entry >> 8);
+        return entry & 0xff;
+    }
+
+    for (int len = kJpegHuffmanLookupBits + 1; len <= 16; ++len) {
+        const int32_t code = static_cast<int32_t>( reader.Bits >> (64 - len) );
+        if (code <= table.MaxCode[len]) {
+            reader.Skip(len);
+            return table.Symbols[(code + table.ValueOffset[len]) & 0xff];
+        }
+    }
+
+    return -1;
+}
+
+// Multiply a coefficient in kMinCoefficient..kMaxCoefficient by its
+// quantizer, saturating to 16 bits.  The product fits in 32 bits
+CORE_INLINE int16_t Dequantize(int32_t coefficient, uint16_t quant)
+{
+    const int32_t value = coefficient * static_cast<int32_t>( quant );
+    if (value > kMaxCoefficient) {
+        return static_cast<int16_t>( kMaxCoefficient );
+    }
+    if (value < kMinCoefficient) {
+        return static_cast<int16_t>( kMinCoefficient );
+    }
+    return static_cast<int16_t>( value );
+}
+
+struct BlockDecoder
+{
+    const JpegHuffmanTable* DC;
+    const JpegHuffmanTable* AC;
+    const uint16_t* Quant;
+    int32_t Predictor;
+};
+
+/*
+    Decode one 8x8 block into dequantized coefficients in natural order.
+
+    Coefficients must be zero on input.  The natural indices of nonzero AC
+    coefficients are written to `ac_indices` so the caller can clear them.
+
+    Returns the number of AC coefficients written, or -1 on error.
+*/
+CORE_INLINE int DecodeBlock(
+    BitReader& reader,
+    BlockDecoder& decoder,
+    int16_t* coeffs,
+    uint8_t* ac_indices)
+{
+    if (reader.Count < 32) {
+        reader.Fill();
+    }
+
+    // DC coefficient is coded as a difference from the previous block
+    const int dc_bits = DecodeHuffman(reader, *decoder.DC);
+    if (dc_bits < 0 || dc_bits > 15) {
+        return -1;
+    }
+    if (dc_bits > 0) {
+        int32_t predictor = decoder.Predictor + reader.ReceiveExtend(dc_bits);
+        if (predictor > kMaxCoefficient) {
+            predictor = kMaxCoefficient;
+        } else if (predictor < kMinCoefficient) {
+            predictor = kMinCoefficient;
+        }
+        decoder.Predictor = predictor;
+    }
+    coeffs[0] = Dequantize(decoder.Predictor, decoder.Quant[0]);
+
+    int ac_count = 0;
+    for (int k = 1; k < 64;)
+    {
+        if (reader.Count < 32) {
+            reader.Fill();
+        }
+
+        const int32_t fast = decoder.AC->FastAC[reader.Bits >> (64 - kJpegHuffmanLookupBits)];
+        if (fast != 0) {
+            reader.Skip(fast & 15);
+            if ((fast >> 8) == 0) {
+                break; // End of block
+            }
+            k += (fast >> 4) & 15;
+            if (k > 63) {
+                return -1;
+            }
+            const int index = kZigZagToNatural[k];
+            coeffs[index] = Dequantize(fast >> 8, decoder.Quant[k]);
+            ac_indices[ac_count++] = static_cast<uint8_t>( index );
+            ++k;
+            continue;
+        }
+
+        const int rs = DecodeHuffman(reader, *decoder.AC);
+        if (rs < 0) {
+            return -1;
+        }
+        const int run = rs >> 4;
+        const int bits = rs & 15;
+
+        if (bits == 0) {
+            if (run != 15) {
+                break; // End of block
+            }
+            k += 16; // 16 zeros
+            continue;
+        }
+
+        k += run;
+        if (k > 63) {
+            return -1;
+        }
+
+        const int index = kZigZagToNatural[k];
+        coeffs[index] = Dequantize(reader.ReceiveExtend(bits), decoder.Quant[k]);
+        ac_indices[ac_count++] = static_cast<uint8_t>( index );
+        ++k;
+    }
+
+    return ac_count;
+}
+
+} // namespace
+
+
+//------------------------------------------------------------------------------
+// Inverse DCT
+
+/*
+    Accurate integer IDCT, identical to jpeg_idct_islow() from [2].
+
+    The SIMD versions keep 16-bit values between the passes and use widening
+    multiply-accumulates to form the same 32-bit products as the reference,
+    like the libjpeg-turbo SIMD code does.  Each multiply in the reference
+    is folded into a pair of products with precombined constants.
+*/
+
+static const int kConstBits = 13;
+static const int kPass1Bits = 2;
+
+static const int16_t FIX_0_298631336 = 2446;
+static const int16_t FIX_0_390180644 = 3196;
+static const int16_t FIX_0_541196100 = 4433;
+static const int16_t FIX_0_765366865 = 6270;
+static const int16_t FIX_0_899976223 = 7373;
+static const int16_t FIX_1_175875602 = 9633;
+static const int16_t FIX_1_501321110 = 12299;
+static const int16_t FIX_1_847759065 = 15137;
+static const int16_t FIX_1_961570560 = 16069;
+static const int16_t FIX_2_053119869 = 16819;
+static const int16_t FIX_2_562915447 = 20995;
+static const int16_t FIX_3_072711026 = 25172;
+
+static CORE_INLINE uint8_t ClampSample(int32_t x)
+{
+    x += 128;
+    if (x < 0) {
+        return 0;
+    }
+    if (x > 255) {
+        return 255;
+    }
+    return static_cast<uint8_t>( x );
+}
+
+// Output value of a block with only a DC coefficient
+static CORE_INLINE uint8_t DCOnlySample(int32_t dc)
+{
+    return ClampSample((dc + 4) >> 3);
+}
+
+#if defined(KVM_JPEG_NEON) || defined(KVM_JPEG_SSE2)
+
+#if defined(KVM_JPEG_NEON)
+
+typedef int16x8_t Vec16;
+
+struct Vec32
+{
+    int32x4_t Lo, Hi;
+};
+
+static CORE_INLINE Vec16 Add16(Vec16 a, Vec16 b)
+{
+    return vaddq_s16(a, b);
+}
+
+static CORE_INLINE Vec16 Sub16(Vec16 a, Vec16 b)
+{
+    return vsubq_s16(a, b);
+}
+
+// a * ca + b * cb
+static CORE_INLINE Vec32 MulAdd(Vec16 a, Vec16 b, int16_t ca, int16_t cb)
+{
+    Vec32 r;
+    r.Lo = vmlal_n_s16(vmull_n_s16(vget_low_s16(a), ca), vget_low_s16(b), cb);
+    r.Hi = vmlal_n_s16(vmull_n_s16(vget_high_s16(a), ca), vget_high_s16(b), cb);
+    return r;
+}
+
+// a << kConstBits
+static CORE_INLINE Vec32 WidenScaled(Vec16 a)
+{
+    Vec32 r;
+    r.Lo = vshll_n_s16(vget_low_s16(a), kConstBits);
+    r.Hi = vshll_n_s16(vget_high_s16(a), kConstBits);
+    return r;
+}
+
+static CORE_INLINE Vec32 Add32(Vec32 a, Vec32 b)
+{
+    Vec32 r;
+    r.Lo = vaddq_s32(a.Lo, b.Lo);
+    r.Hi = vaddq_s32(a.Hi, b.Hi);
+    return r;
+}
+
+static CORE_INLINE Vec32 Sub32(Vec32 a, Vec32 b)
+{
+    Vec32 r;
+    r.Lo = vsubq_s32(a.Lo, b.Lo);
+    r.Hi = vsubq_s32(a.Hi, b.Hi);
+    return r;
+}
+
+// Round, shift right, and saturate to 16 bits
+template<int kShift>
+static CORE_INLINE Vec16 Descale(Vec32 a)
+{
+    return vcombine_s16(
+        vqmovn_s32(vrshrq_n_s32(a.Lo, kShift)),
+        vqmovn_s32(vrshrq_n_s32(a.Hi, kShift)));
+}
+
+static CORE_INLINE void Transpose8x8(Vec16 v[8])
+{
+    const int16x8x2_t t01 = vtrnq_s16(v[0], v[1]);
+    const int16x8x2_t t23 = vtrnq_s16(v[2], v[3]);
+    const int16x8x2_t t45 = vtrnq_s16(v[4], v[5]);
+    const int16x8x2_t t67 = vtrnq_s16(v[6], v[7]);
+
+    const int32x4x2_t u02 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[0]), vreinterpretq_s32_s16(t23.val[0]));
+    const int32x4x2_t u13 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[1]), vreinterpretq_s32_s16(t23.val[1]));
+    const int32x4x2_t u46 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[0]), vreinterpretq_s32_s16(t67.val[0]));
+    const int32x4x2_t u57 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[1]), vreinterpretq_s32_s16(t67.val[1]));
+
+    v[0] = vcombine_s16(vget_low_s16(vreinterpretq_s16_s32(u02.val[0])), vget_low_s16(vreinterpretq_s16_s32(u46.val[0])));
+    v[4] = vcombine_s16(vget_high_s16(vreinterpretq_s16_s32(u02.val[0])), vget_high_s16(vreinterpretq_s16_s32(u46.val[0])));
+    v[2] = vcombine_s16(vget_low_s16(vreinterpretq_s16_s32(u02.val[1])), vget_low_s16(vreinterpretq_s16_s32(u46.val[1])));
+    v[6] = vcombine_s16(vget_high_s16(vreinterpretq_s16_s32(u02.val[1])), vget_high_s16(vreinterpretq_s16_s32(u46.val[1])));
+    v[1] = vcombine_s16(vget_low_s16(vreinterpretq_s16_s32(u13.val[0])), vget_low_s16(vreinterpretq_s16_s32(u57.val[0])));
+    v[5] = vcombine_s16(vget_high_s16(vreinterpretq_s16_s32(u13.val[0])), vget_high_s16(vreinterpretq_s16_s32(u57.val[0])));
+    v[3] = vcombine_s16(vget_low_s16(vreinterpretq_s16_s32(u13.val[1])), vget_low_s16(vreinterpretq_s16_s32(u57.val[1])));
+    v[7] = vcombine_s16(vget_high_s16(vreinterpretq_s16_s32(u13.val[1])), vget_high_s16(vreinterpretq_s16_s32(u57.val[1])));
+}
+
+static CORE_INLINE void LoadBlock(const int16_t* coeffs, Vec16 v[8])
+{
+    for (int i = 0; i < 8; ++i) {
+        v[i] = vld1q_s16(coeffs + i * 8);
+    }
+}
+
+static CORE_INLINE void StoreSamples(const Vec16 v[8], uint8_t* dest, int stride)
+{
+    const int16x8_t center = vdupq_n_s16(128);
+    for (int i = 0; i < 8; ++i, dest += stride) {
+        vst1_u8(dest, vqmovun_s16(vqaddq_s16(v[i], center)));
+    }
+}
+
+#else // KVM_JPEG_SSE2
+
+typedef __m128i Vec16;
+
+struct Vec32
+{
+    __m128i Lo, Hi;
+};
+
+static CORE_INLINE Vec16 Add16(Vec16 a, Vec16 b)
+{
+    return _mm_add_epi16(a, b);
+}
+
+static CORE_INLINE Vec16 Sub16(Vec16 a, Vec16 b)
+{
+    return _mm_sub_epi16(a, b);
+}
+
+// a * ca + b * cb
+static CORE_INLINE Vec32 MulAdd(Vec16 a, Vec16 b, int16_t ca, int16_t cb)
+{
+    const __m128i k = _mm_set1_epi32(static_cast<int32_t>( (static_cast<uint32_t>( static_cast<uint16_t>( cb ) ) << 16) | static_cast<uint16_t>( ca ) ));
+    Vec32 r;
+    r.Lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+    r.Hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+    return r;
+}
+
+// a << kConstBits
+static CORE_INLINE Vec32 WidenScaled(Vec16 a)
+{
+    const __m128i zero = _mm_setzero_si128();
+    Vec32 r;
+    r.Lo = _mm_srai_epi32(_mm_unpacklo_epi16(zero, a), 16 - kConstBits);
+    r.Hi = _mm_srai_epi32(_mm_unpackhi_epi16(zero, a), 16 - kConstBits);
+    return r;
+}
+
+static CORE_INLINE Vec32 Add32(Vec32 a, Vec32 b)
+{
+    Vec32 r;
+    r.Lo = _mm_add_epi32(a.Lo, b.Lo);
+    r.Hi = _mm_add_epi32(a.Hi, b.Hi);
+    return r;
+}
+
+static CORE_INLINE Vec32 Sub32(Vec32 a, Vec32 b)
+{
+    Vec32 r;
+    r.Lo = _mm_sub_epi32(a.Lo, b.Lo);
+    r.Hi = _mm_sub_epi32(a.Hi, b.Hi);
+    return r;
+}
+
+// Round, shift right, and saturate to 16 bits
+template<int kShift>
+static CORE_INLINE Vec16 Descale(Vec32 a)
+{
+    const __m128i round = _mm_set1_epi32(1 << (kShift - 1));
+    return _mm_packs_epi32(
+        _mm_srai_epi32(_mm_add_epi32(a.Lo, round), kShift),
+        _mm_srai_epi32(_mm_add_epi32(a.Hi, round), kShift));
+}
+
+static CORE_INLINE void Transpose8x8(Vec16 v[8])
+{
+    const __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+    const __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    const __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+    const __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    const __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+    const __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    const __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+    const __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+
+    const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    const __m128i b2 = _mm_unpacklo_epi32(a4, a6);
+    const __m128i b3 = _mm_unpackhi_epi32(a4, a6);
+    const __m128i b4 = _mm_unpacklo_epi32(a1, a3);
+    const __m128i b5 = _mm_unpackhi_epi32(a1, a3);
+    const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm_unpacklo_epi64(b0, b2);
+    v[1] = _mm_unpackhi_epi64(b0, b2);
+    v[2] = _mm_unpacklo_epi64(b1, b3);
+    v[3] = _mm_unpackhi_epi64(b1, b3);
+    v[4] = _mm_unpacklo_epi64(b4, b6);
+    v[5] = _mm_unpackhi_epi64(b4, b6);
+    v[6] = _mm_unpacklo_epi64(b5, b7);
+    v[7] = _mm_unpackhi_epi64(b5, b7);
+}
+
+static CORE_INLINE void LoadBlock(const int16_t* coeffs, Vec16 v[8])
+{
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm_load_si128((const __m128i*)(coeffs + i * 8));
+    }
+}
+
+static CORE_INLINE void StoreSamples(const Vec16 v[8], uint8_t* dest, int stride)
+{
+    const __m128i center = _mm_set1_epi16(128);
+    for (int i = 0; i < 8; ++i, dest += stride) {
+        _mm_storel_epi64((__m128i*)dest, _mm_packus_epi16(_mm_adds_epi16(v[i], center), center));
+    }
+}
+
+#endif // KVM_JPEG_SSE2
+
+/*
+    One pass of the IDCT over 8 rows of 8 lanes: v[k] holds frequency k for
+    each lane, and on return v[i] holds sample i for each lane.
+*/
+template<int kShift>
+static CORE_INLINE void InverseDCTPass(Vec16 v[8])
+{
+    // Even part
+    const Vec32 even3 = MulAdd(v[2], v[6], FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100);
+    const Vec32 even2 = MulAdd(v[2], v[6], FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065);
+    const Vec32 even0 = WidenScaled(Add16(v[0], v[4]));
+    const Vec32 even1 = WidenScaled(Sub16(v[0], v[4]));
+
+    const Vec32 tmp10 = Add32(even0, even3);
+    const Vec32 tmp13 = Sub32(even0, even3);
+    const Vec32 tmp11 = Add32(even1, even2);
+    const Vec32 tmp12 = Sub32(even1, even2);
+
+    // Odd part
+    const Vec16 z3 = Add16(v[7], v[3]);
+    const Vec16 z4 = Add16(v[5], v[1]);
+    const Vec32 z3w = MulAdd(z3, z4, FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602);
+    const Vec32 z4w = MulAdd(z3, z4, FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644);
+
+    const Vec32 odd0 = Add32(MulAdd(v[7], v[1], FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223), z3w);
+    const Vec32 odd3 = Add32(MulAdd(v[7], v[1], -FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223), z4w);
+    const Vec32 odd1 = Add32(MulAdd(v[5], v[3], FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447), z4w);
+    const Vec32 odd2 = Add32(MulAdd(v[5], v[3], -FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447), z3w);
+
+    v[0] = Descale<kShift>(Add32(tmp10, odd3));
+    v[7] = Descale<kShift>(Sub32(tmp10, odd3));
+    v[1] = Descale<kShift>(Add32(tmp11, odd2));
+    v[6] = Descale<kShift>(Sub32(tmp11, odd2));
+    v[2] = Descale<kShift>(Add32(tmp12, odd1));
+    v[5] = Descale<kShift>(Sub32(tmp12, odd1));
+    v[3] = Descale<kShift>(Add32(tmp13, odd0));
+    v[4] = Descale<kShift>(Sub32(tmp13, odd0));
+}
+
+// Coefficients must be 16-byte aligned
+static void InverseDCT(const int16_t* coeffs, uint8_t* dest, int stride)
+{
+    Vec16 v[8];
+    LoadBlock(coeffs, v);
+
+    // Pass 1: Columns, results scaled up by 2^kPass1Bits
+    InverseDCTPass<kConstBits - kPass1Bits>(v);
+    Transpose8x8(v);
+
+    // Pass 2: Rows, descale by 2^(kConstBits+kPass1Bits+3)
+    InverseDCTPass<kConstBits + kPass1Bits + 3>(v);
+    Transpose8x8(v);
+
+    StoreSamples(v, dest, stride);
+}
+
+#else // Reference version:
+
+static void InverseDCT(const int16_t* coeffs, uint8_t* dest, int stride)
+{
+    int32_t ws[64];
+
+    // Pass 1: Columns from input, results scaled up by 2^kPass1Bits
+    for (int c = 0; c < 8; ++c)
+    {
+        const int16_t* in = coeffs + c;
+
+        // Even part
+        int32_t z2 = in[8*2];
+        int32_t z3 = in[8*6];
+        int32_t z1 = (z2 + z3) * FIX_0_541196100;
+        int32_t tmp2 = z1 - z3 * FIX_1_847759065;
+        int32_t tmp3 = z1 + z2 * FIX_0_765366865;
+
+        z2 = in[8*0];
+        z3 = in[8*4];
+        int32_t tmp0 = (z2 + z3) * (1 << kConstBits);
+        int32_t tmp1 = (z2 - z3) * (1 << kConstBits);
+
+        const int32_t tmp10 = tmp0 + tmp3;
+        const int32_t tmp13 = tmp0 - tmp3;
+        const int32_t tmp11 = tmp1 + tmp2;
+        const int32_t tmp12 = tmp1 - tmp2;
+
+        // Odd part
+        tmp0 = in[8*7];
+        tmp1 = in[8*5];
+        tmp2 = in[8*3];
+        tmp3 = in[8*1];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        int32_t z4 = tmp1 + tmp3;
+        const int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        const int shift = kConstBits - kPass1Bits;
+        const int32_t round = 1 << (shift - 1);
+        ws[8*0 + c] = (tmp10 + tmp3 + round) >> shift;
+        ws[8*7 + c] = (tmp10 - tmp3 + round) >> shift;
+        ws[8*1 + c] = (tmp11 + tmp2 + round) >> shift;
+        ws[8*6 + c] = (tmp11 - tmp2 + round) >> shift;
+        ws[8*2 + c] = (tmp12 + tmp1 + round) >> shift;
+        ws[8*5 + c] = (tmp12 - tmp1 + round) >> shift;
+        ws[8*3 + c] = (tmp13 + tmp0 + round) >> shift;
+        ws[8*4 + c] = (tmp13 - tmp0 + round) >> shift;
+    }
+
+    // Pass 2: Rows from work array, descale by 2^(kConstBits+kPass1Bits+3)
+    for (int r = 0; r < 8; ++r, dest += stride)
+    {
+        const int32_t* in = ws + r * 8;
+
+        if ((in[1] | in[2] | in[3] | in[4] | in[5] | in[6] | in[7]) == 0) {
+            const uint8_t value = ClampSample((in[0] + (1 << (kPass1Bits + 2))) >> (kPass1Bits + 3));
+            memset(dest, value, 8);
+            continue;
+        }
+
+        // Even part
+        int32_t z2 = in[2];
+        int32_t z3 = in[6];
+        int32_t z1 = (z2 + z3) * FIX_0_541196100;
+        int32_t tmp2 = z1 - z3 * FIX_1_847759065;
+        int32_t tmp3 = z1 + z2 * FIX_0_765366865;
+
+        int32_t tmp0 = (in[0] + in[4]) * (1 << kConstBits);
+        int32_t tmp1 = (in[0] - in[4]) * (1 << kConstBits);
+
+        const int32_t tmp10 = tmp0 + tmp3;
+        const int32_t tmp13 = tmp0 - tmp3;
+        const int32_t tmp11 = tmp1 + tmp2;
+        const int32_t tmp12 = tmp1 - tmp2;
+
+        // Odd part
+        tmp0 = in[7];
+        tmp1 = in[5];
+        tmp2 = in[3];
+        tmp3 = in[1];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        int32_t z4 = tmp1 + tmp3;
+        const int32_t z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        const int shift = kConstBits + kPass1Bits + 3;
+        const int32_t round = 1 << (shift - 1);
+        dest[0] = ClampSample((tmp10 + tmp3 + round) >> shift);
+        dest[7] = ClampSample((tmp10 - tmp3 + round) >> shift);
+        dest[1] = ClampSample((tmp11 + tmp2 + round) >> shift);
+        dest[6] = ClampSample((tmp11 - tmp2 + round) >> shift);
+        dest[2] = ClampSample((tmp12 + tmp1 + round) >> shift);
+        dest[5] = ClampSample((tmp12 - tmp1 + round) >> shift);
+        dest[3] = ClampSample((tmp13 + tmp0 + round) >> shift);
+        dest[4] = ClampSample((tmp13 - tmp0 + round) >> shift);
+    }
+}
+
+#endif // KVM_JPEG_NEON || KVM_JPEG_SSE2
+
+
+//------------------------------------------------------------------------------
+// Color Kernels
+
+/*
+    Convert a decoded 8x8 chroma block from 4:2:2 to 4:2:0 by averaging each
+    pair of rows, writing 4 rows of 8 samples to the destination.
+
+    This rounds the same way as the reference version of
+    ConvertYuv422toYuv420() in kvm_jpeg.cpp.
+*/
+static CORE_INLINE void AverageRowPairs(const uint8_t* block, uint8_t* dest, int stride)
+{
+#if defined(KVM_JPEG_NEON)
+    for (int i = 0; i < 4; ++i, block += 16, dest += stride) {
+        vst1_u8(dest, vrhadd_u8(vld1_u8(block), vld1_u8(block + 8)));
+    }
+#elif defined(KVM_JPEG_SSE2)
+    for (int i = 0; i < 4; ++i, block += 16, dest += stride) {
+        // Both rows are contiguous in the block
+        const __m128i rows = _mm_loadu_si128((const __m128i*)block);
+        _mm_storel_epi64((__m128i*)dest, _mm_avg_epu8(rows, _mm_srli_si128(rows, 8)));
+    }
+#else
+    for (int i = 0; i < 4; ++i, block += 16, dest += stride) {
+        for (int x = 0; x < 8; ++x) {
+            dest[x] = static_cast<uint8_t>( ((unsigned)block[x] + (unsigned)block[x + 8] + 1) >> 1 );
+        }
+    }
+#endif
+}
+
+static CORE_INLINE void FillBlock(uint8_t* dest, int stride, int rows, uint8_t value)
+{
+    for (int i = 0; i < rows; ++i, dest += stride) {
+        memset(dest, value, 8);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// BaselineJpegDecoder
+
+bool BaselineJpegDecoder::IsSupported(const JpegParser& parser) const
+{
+    if (!parser.Baseline ||
+        parser.Precision != 8 ||
+        parser.ComponentCount != 3 ||
+        parser.ScanComponentCount != 3 ||
+        parser.SpectralStart != 0 ||
+        parser.SpectralEnd != 63 ||
+        parser.SuccessiveApprox != 0 ||
+        parser.Segments.empty())
+    {
+        return false;
+    }
+
+    // Luma must be 2x1 (4:2:2) or 2x2 (4:2:0), chroma 1x1
+    const JpegComponentInfo& y = parser.Components[0];
+    if (y.H != 2 || (y.V != 1 && y.V != 2)) {
+        return false;
+    }
+    for (int i = 1; i < 3; ++i) {
+        if (parser.Components[i].H != 1 || parser.Components[i].V != 1) {
+            return false;
+        }
+    }
+
+    // Restart markers must divide the image evenly into segments
+    const int mcu_count = parser.McusPerRow * parser.McuRows;
+    int segment_count = 1;
+    if (parser.RestartInterval > 0) {
+        segment_count = (mcu_count + parser.RestartInterval - 1) / parser.RestartInterval;
+    }
+    return (int)parser.Segments.size() == segment_count;
+}
+
+bool BaselineJpegDecoder::SetupTables(const JpegParser& parser, const uint8_t* data)
+{
+    Tables = nullptr;
+
+    uint64_t hash = 0;
+    for (const JpegSegment& segment : parser.QuantTables) {
+        hash = HashBytes(data + segment.Offset, segment.Bytes, hash);
+    }
+    for (const JpegSegment& segment : parser.HuffmanTables) {
+        hash = HashBytes(data + segment.Offset, segment.Bytes, hash);
+    }
+
+    const JpegTableSet* tables = nullptr;
+    for (int i = 0; i < kJpegTableCacheSize; ++i) {
+        if (Cache[i].Valid && Cache[i].Hash == hash) {
+            tables = &Cache[i];
+            break;
+        }
+    }
+
+    if (!tables)
+    {
+        JpegTableSet& entry = Cache[NextCacheIndex];
+        NextCacheIndex = (NextCacheIndex + 1) % kJpegTableCacheSize;
+
+        if (!entry.Initialize(parser, data, hash)) {
+            return false;
+        }
+        tables = &entry;
+    }
+
+    for (int i = 0; i < parser.ComponentCount; ++i)
+    {
+        const JpegComponentInfo& info = parser.Components[i];
+        if (info.Tq > 3 || !tables->QuantDefined[info.Tq] ||
+            info.Td > 3 || !tables->DCDefined[info.Td] ||
+            info.Ta > 3 || !tables->ACDefined[info.Ta])
+        {
+            Logger.Error("JPEG component ", i, " uses an undefined table");
+            return false;
+        }
+    }
+
+    Tables = tables;
+    return true;
+}
+
+bool BaselineJpegDecoder::DecodeSegments(
+    const JpegParser& parser,
+    const uint8_t* data,
+    int first_segment,
+    int segment_count,
+    Frame& frame,
+    const JpegRowCallback& on_row)
+{
+    if (!Tables ||
+        first_segment < 0 || segment_count <= 0 ||
+        first_segment + segment_count > (int)parser.Segments.size() ||
+        frame.Format != PixelFormat::YUV420P ||
+        frame.Width < parser.McusPerRow * parser.McuWidth ||
+        frame.Height < parser.McuRows * parser.McuHeight)
+    {
+        Logger.Error("DecodeSegments: Invalid parameters");
+        return false;
+    }
+
+    // Segments reset the DC predictors and write disjoint parts of the frame,
+    // so they can be decoded in parallel.  Two threads leaves the remaining
+    // cores for the encoder and the network.
+    int failures = 0;
+#pragma omp parallel for num_threads(2) schedule(dynamic, 4) reduction(+:failures) if(segment_count >= kMinParallelSegments)
+    for (int i = 0; i < segment_count; ++i) {
+        if (!DecodeSegment(parser, data, first_segment + i, frame, on_row)) {
+            ++failures;
+        }
+    }
+
+    if (failures != 0) {
+        return false;
+    }
+
+    // Report the rows that span several segments, which no single segment
+    // could report above
+    if (on_row && parser.RestartInterval > 0)
+    {
+        const int interval = parser.RestartInterval;
+        const int mcu_count = parser.McusPerRow * parser.McuRows;
+        const int range_start = first_segment * interval;
+        int range_end = (first_segment + segment_count) * interval;
+        if (range_end > mcu_count) {
+            range_end = mcu_count;
+        }
+
+        const int first_row = (range_start + parser.McusPerRow - 1) / parser.McusPerRow;
+        for (int row = first_row; (row + 1) * parser.McusPerRow <= range_end; ++row) {
+            const int row_start = row * parser.McusPerRow;
+            const int segment_end = (row_start / interval + 1) * interval;
+            if (row_start + parser.McusPerRow > segment_end) {
+                on_row(row);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool BaselineJpegDecoder::DecodeSegment(
+    const JpegParser& parser,
+    const uint8_t* data,
+    int segment_index,
+    Frame& frame,
+    const JpegRowCallback& on_row)
+{
+    const JpegSegment& segment = parser.Segments[segment_index];
+
+    const int mcu_count = parser.McusPerRow * parser.McuRows;
+    int mcu_start = 0, mcu_end = mcu_count;
+    if (parser.RestartInterval > 0) {
+        mcu_start = segment_index * parser.RestartInterval;
+        mcu_end = mcu_start + parser.RestartInterval;
+        if (mcu_end > mcu_count) {
+            mcu_end = mcu_count;
+        }
+    }
+
+    BlockDecoder decoders[3];
+    for (int i = 0; i < 3; ++i) {
+        const JpegComponentInfo& info = parser.Components[i];
+        decoders[i].DC = &Tables->DC[info.Td];
+        decoders[i].AC = &Tables->AC[info.Ta];
+        decoders[i].Quant = Tables->Quant[info.Tq];
+        decoders[i].Predictor = 0;
+    }
+
+    // 1 for 4:2:2, 2 for 4:2:0
+    const int luma_rows = parser.Components[0].V;
+    const bool chroma_422 = (luma_rows == 1);
+
+    const int luma_stride = frame.Width;
+    const int chroma_stride = frame.Width / 2;
+
+    alignas(16) int16_t coeffs[64] = {};
+    uint8_t ac_indices[64];
+    uint8_t block[64];
+
+    BitReader reader(data + segment.Offset, segment.Bytes);
+
+    int mcu_x = mcu_start % parser.McusPerRow;
+    int mcu_y = mcu_start / parser.McusPerRow;
+
+    for (int mcu = mcu_start; mcu < mcu_end; ++mcu)
+    {
+        uint8_t* luma = frame.Planes[0] + mcu_y * parser.McuHeight * luma_stride + mcu_x * 16;
+
+        for (int v = 0; v < luma_rows; ++v) {
+            for (int h = 0; h < 2; ++h)
+            {
+                const int ac_count = DecodeBlock(reader, decoders[0], coeffs, ac_indices);
+                if (ac_count < 0) {
+                    Logger.Error("Corrupted JPEG data at MCU ", mcu);
+                    return false;
+                }
+
+                uint8_t* dest = luma + v * 8 * luma_stride + h * 8;
+                if (ac_count == 0) {
+                    FillBlock(dest, luma_stride, 8, DCOnlySample(coeffs[0]));
+                } else {
+                    InverseDCT(coeffs, dest, luma_stride);
+                    for (int i = 0; i < ac_count; ++i) {
+                        coeffs[ac_indices[i]] = 0;
+                    }
+                }
+            }
+        }
+
+        // Chroma rows in the 4:2:0 output
+        const int chroma_y = chroma_422 ? (mcu_y * 4) : (mcu_y * 8);
+
+        for (int c = 1; c <= 2; ++c)
+        {
+            const int ac_count = DecodeBlock(reader, decoders[c], coeffs, ac_indices);
+            if (ac_count < 0) {
+                Logger.Error("Corrupted JPEG data at MCU ", mcu);
+                return false;
+            }
+
+            uint8_t* dest = frame.Planes[c] + chroma_y * chroma_stride + mcu_x * 8;
+            if (LumaOnly) {
+                for (int i = 0; i < ac_count; ++i) {
+                    coeffs[ac_indices[i]] = 0;
+                }
+            } else if (ac_count == 0) {
+                FillBlock(dest, chroma_stride, chroma_422 ? 4 : 8, DCOnlySample(coeffs[0]));
+            } else {
+                if (chroma_422) {
+                    InverseDCT(coeffs, block, 8);
+                    AverageRowPairs(block, dest, chroma_stride);
+                } else {
+                    InverseDCT(coeffs, dest, chroma_stride);
+                }
+                for (int i = 0; i < ac_count; ++i) {
+                    coeffs[ac_indices[i]] = 0;
+                }
+            }
+        }
+
+        if (++mcu_x >= parser.McusPerRow) {
+            // Report the row if it was decoded entirely by this segment
+            if (on_row && mcu + 1 - parser.McusPerRow >= mcu_start) {
+                on_row(mcu_y);
+            }
+            mcu_x = 0;
+            ++mcu_y;
+        }
+    }
+
+    if (reader.Overrun()) {
+        Logger.Error("Truncated JPEG segment ", segment_index);
+        return false;
+    }
+
+    return true;
+}
+
+
+} // namespace kvm
@@ -0,0 +1,304 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_jpeg_parser.hpp"
+#include "kvm_serializer.hpp"
+#include "kvm_logger.hpp"
+
+namespace kvm {
+
+static logger::Channel Logger("JpegParser");
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+static const uint8_t kMarkerSOI = 0xd8;
+static const uint8_t kMarkerEOI = 0xd9;
+static const uint8_t kMarkerSOS = 0xda;
+static const uint8_t kMarkerDRI = 0xdd;
+static const uint8_t kMarkerDQT = 0xdb;
+static const uint8_t kMarkerDHT = 0xc4;
+static const uint8_t kMarkerRST0 = 0xd0;
+static const uint8_t kMarkerRST7 = 0xd7;
+
+
+//------------------------------------------------------------------------------
+// JpegParser
+
+bool JpegParser::Parse(const uint8_t* data, int bytes)
+{
+    Width = Height = 0;
+    Baseline = false;
+    Precision = 0;
+    ComponentCount = 0;
+    McuWidth = McuHeight = 0;
+    McusPerRow = McuRows = 0;
+    RestartInterval = 0;
+    SofOffset = -1;
+    ScanOffset = -1;
+    ScanComponentCount = 0;
+    SpectralStart = SpectralEnd = 0;
+    SuccessiveApprox = 0;
+    QuantTables.clear();
+    HuffmanTables.clear();
+    Segments.clear();
+
+    if (bytes < 4 || data[0] != 0xff || data[1] != kMarkerSOI) {
+        return false;
+    }
+
+    int offset = 2;
+    while (offset + 4 <= bytes)
+    {
+        if (data[offset] != 0xff) {
+            return false;
+        }
+        const uint8_t marker = data[offset + 1];
+        if (marker == 0xff) {
+            // Fill byte
+            ++offset;
+            continue;
+        }
+
+        const int length = ReadU16_BE(data + offset + 2);
+        if (length < 2 || offset + 2 + length > bytes) {
+            return false;
+        }
+        const uint8_t* payload = data + offset + 4;
+        const int payload_bytes = length - 2;
+
+        switch (marker)
+        {
+        case 0xc0: // Baseline DCT
+        case 0xc1: // Extended sequential DCT
+            Baseline = true;
+            // Fall-thru
+        case 0xc2: // Progressive DCT
+        case 0xc3: // Lossless
+            SofOffset = offset;
+            if (!ParseFrameHeader(payload, payload_bytes)) {
+                return false;
+            }
+            break;
+        case kMarkerDQT:
+            QuantTables.emplace_back(offset + 4, payload_bytes);
+            break;
+        case kMarkerDHT:
+            HuffmanTables.emplace_back(offset + 4, payload_bytes);
+            break;
+        case kMarkerDRI:
+            if (payload_bytes < 2) {
+                return false;
+            }
+            RestartInterval = ReadU16_BE(payload);
+            break;
+        case kMarkerSOS:
+            if (SofOffset < 0 || !ParseScanHeader(payload, payload_bytes)) {
+                return false;
+            }
+            ScanOffset = offset + 2 + length;
+            ParseScan(data, bytes);
+            return true;
+        default:
+            // Skip APPn, COM, etc
+            break;
+        }
+
+        offset += 2 + length;
+    }
+
+    return false;
+}
+
+bool JpegParser::ParseFrameHeader(const uint8_t* data, int bytes)
+{
+    if (bytes < 6) {
+        return false;
+    }
+
+    Precision = data[0];
+    Height = ReadU16_BE(data + 1);
+    Width = ReadU16_BE(data + 3);
+    ComponentCount = data[5];
+
+    if (ComponentCount <= 0 || ComponentCount > kJpegMaxComponents ||
+        bytes < 6 + ComponentCount * 3 ||
+        Width <= 0 || Height <= 0)
+    {
+        return false;
+    }
+
+    int h_max = 1, v_max = 1;
+    for (int i = 0; i < ComponentCount; ++i) {
+        const uint8_t* comp = data + 6 + i * 3;
+        auto& info = Components[i];
+        info.Id = comp[0];
+        info.H = comp[1] >> 4;
+        info.V = comp[1] & 15;
+        info.Tq = comp[2];
+        info.Td = info.Ta = 0;
+        if (info.H < 1 || info.H > 4 || info.V < 1 || info.V > 4) {
+            return false;
+        }
+        if (h_max < info.H) {
+            h_max = info.H;
+        }
+        if (v_max < info.V) {
+            v_max = info.V;
+        }
+    }
+
+    // A single-component scan is not interleaved: MCU is one 8x8 block
+    if (ComponentCount == 1) {
+        h_max = v_max = 1;
+    }
+
+    McuWidth = h_max * 8;
+    McuHeight = v_max * 8;
+    McusPerRow = (Width + McuWidth - 1) / McuWidth;
+    McuRows = (Height + McuHeight - 1) / McuHeight;
+    return true;
+}
+
+bool JpegParser::ParseScanHeader(const uint8_t* data, int bytes)
+{
+    if (bytes < 1) {
+        return false;
+    }
+
+    ScanComponentCount = data[0];
+    if (ScanComponentCount <= 0 || ScanComponentCount > ComponentCount ||
+        bytes < 1 + ScanComponentCount * 2 + 3)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < ScanComponentCount; ++i) {
+        const uint8_t* comp = data + 1 + i * 2;
+
+        int index = -1;
+        for (int j = 0; j < ComponentCount; ++j) {
+            if (Components[j].Id == comp[0]) {
+                index = j;
+                break;
+            }
+        }
+        if (index < 0) {
+            return false;
+        }
+
+        Components[index].Td = comp[1] >> 4;
+        Components[index].Ta = comp[1] & 15;
+    }
+
+    const uint8_t* params = data + 1 + ScanComponentCount * 2;
+    SpectralStart = params[0];
+    SpectralEnd = params[1];
+    SuccessiveApprox = params[2];
+    return true;
+}
+
+void JpegParser::ParseScan(const uint8_t* data, int bytes)
+{
+    int start = ScanOffset;
+    int i = start;
+
+    for (;;)
+    {
+        const uint8_t* ff = nullptr;
+        if (i < bytes) {
+            ff = (const uint8_t*)memchr(data + i, 0xff, bytes - i);
+        }
+        if (!ff) {
+            // Truncated: No EOI marker
+            i = bytes;
+            break;
+        }
+        i = static_cast<int>( ff - data );
+
+        // Skip fill bytes
+        int j = i + 1;
+        while (j < bytes && data[j] == 0xff) {
+            ++j;
+        }
+        if (j >= bytes) {
+            break;
+        }
+
+        const uint8_t next = data[j];
+        if (next == 0x00) {
+            // Stuffed zero byte
+            i = j + 1;
+            continue;
+        }
+
+        if (next >= kMarkerRST0 && next <= kMarkerRST7) {
+            Segments.emplace_back(start, i - start);
+            i = j + 1;
+            start = i;
+            continue;
+        }
+
+        // Any other marker (usually EOI) ends the scan
+        break;
+    }
+
+    Segments.emplace_back(start, i - start);
+}
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+bool WriteJpegBand(
+    const JpegParser& parser,
+    const uint8_t* data,
+    int first_segment,
+    int segment_count,
+    int band_height,
+    std::vector<uint8_t>& band)
+{
+    if (parser.SofOffset < 0 || parser.ScanOffset < 0 ||
+        first_segment < 0 || segment_count <= 0 ||
+        first_segment + segment_count > (int)parser.Segments.size() ||
+        band_height <= 0 || band_height > 0xffff)
+    {
+        Logger.Error("WriteJpegBand: Invalid parameters");
+        return false;
+    }
+
+    int total_bytes = parser.ScanOffset;
+    for (int i = 0; i < segment_count; ++i) {
+        // Segment data followed by RSTn or EOI marker
+        total_bytes += parser.Segments[first_segment + i].Bytes + 2;
+    }
+    band.resize(total_bytes);
+
+    // Copy the headers, and replace the image height in the SOF header:
+    // <FF Cn> <Length(2)> <Precision(1)> <Height(2)> ...
+    uint8_t* dest = band.data();
+    memcpy(dest, data, parser.ScanOffset);
+    WriteU16_BE(dest + parser.SofOffset + 5, static_cast<uint16_t>( band_height ));
+    dest += parser.ScanOffset;
+
+    for (int i = 0; i < segment_count; ++i)
+    {
+        const JpegSegment& segment = parser.Segments[first_segment + i];
+        memcpy(dest, data + segment.Offset, segment.Bytes);
+        dest += segment.Bytes;
+
+        // Restart markers must be numbered sequentially from RST0
+        dest[0] = 0xff;
+        if (i + 1 < segment_count) {
+            dest[1] = static_cast<uint8_t>( kMarkerRST0 + (i & 7) );
+        } else {
+            dest[1] = kMarkerEOI;
+        }
+        dest += 2;
+    }
+
+    return true;
+}
+
+
+} // namespace kvm
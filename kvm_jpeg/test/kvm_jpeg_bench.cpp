@@ -0,0 +1,403 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Benchmark the specialized JPEG decoder against turbojpeg on recorded
+    capture card frames.
+
+    Record frames from the capture card into an MJPEG file:
+
+        kvm_jpeg_bench record frames.mjpeg 300
+
+    Decode the recorded frames with each decoder and compare:
+
+        kvm_jpeg_bench frames.mjpeg
+
+    The MJPEG file is just the JPEG images concatenated, so single .jpg files
+    can also be benchmarked.
+
+    Change detection is benchmarked both with each step making its own pass
+    over the frame ("staged") and with the steps fused into a single pass over
+    each band of rows ("fused").  DRAM traffic is estimated from last-level
+    cache misses across all CPUs, which requires root or
+    kernel.perf_event_paranoid <= 0.
+*/
+
+#include "kvm_jpeg.hpp"
+#include "kvm_capture.hpp"
+#include "kvm_logger.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("JpegBench");
+
+#include <csignal>
+#include <atomic>
+#include <cstdio>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
+void SignalHandler(int)
+{
+    Terminated = true;
+}
+
+
+//------------------------------------------------------------------------------
+// Recording
+
+static int RecordFrames(const char* path, int count)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        Logger.Error("Failed to open ", path);
+        return kAppFail;
+    }
+
+    std::atomic<int> recorded = ATOMIC_VAR_INIT(0);
+
+    V4L2Capture capture;
+    if (!capture.Initialize([&](const std::shared_ptr<CameraFrame>& buffer) {
+        if (recorded >= count) {
+            return;
+        }
+        if (fwrite(buffer->Image, 1, buffer->ImageBytes, file) != (size_t)buffer->ImageBytes) {
+            Logger.Error("Failed to write frame");
+            Terminated = true;
+            return;
+        }
+        ++recorded;
+    })) {
+        Logger.Error("Failed to start capture");
+        fclose(file);
+        return kAppFail;
+    }
+
+    std::signal(SIGINT, SignalHandler);
+
+    while (!Terminated && !capture.IsError() && recorded < count) {
+        ThreadSleepForMsec(100);
+    }
+
+    capture.Shutdown();
+    fclose(file);
+
+    Logger.Info("Recorded ", recorded.load(), " frames to ", path);
+    return kAppSuccess;
+}
+
+
+//------------------------------------------------------------------------------
+// CacheMissCounter
+
+/*
+    Counts last-level cache misses on all CPUs.  Each miss reads a cache line
+    from DRAM, so this estimates the DRAM read traffic of the decoder threads
+    (plus anything else running on the system).
+*/
+class CacheMissCounter
+{
+public:
+    // Cache line size on the Raspberry Pi 4 (Cortex-A72)
+    static const int kLineBytes = 64;
+
+    CacheMissCounter()
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < cpu_count; ++cpu) {
+            const int fd = (int)syscall(__NR_perf_event_open, &attr, -1, (int)cpu, -1, 0);
+            if (fd < 0) {
+                Logger.Warn("perf_event_open failed: DRAM traffic will not be measured");
+                Close();
+                return;
+            }
+            Fds.push_back(fd);
+        }
+    }
+    ~CacheMissCounter()
+    {
+        Close();
+    }
+
+    bool IsAvailable() const
+    {
+        return !Fds.empty();
+    }
+
+    uint64_t Read() const
+    {
+        uint64_t total = 0;
+        for (int fd : Fds) {
+            uint64_t count = 0;
+            if (read(fd, &count, sizeof(count)) == (ssize_t)sizeof(count)) {
+                total += count;
+            }
+        }
+        return total;
+    }
+
+protected:
+    std::vector<int> Fds;
+
+    void Close()
+    {
+        for (int fd : Fds) {
+            close(fd);
+        }
+        Fds.clear();
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Benchmark
+
+struct JpegImage
+{
+    const uint8_t* Data;
+    int Bytes;
+};
+
+// Split concatenated JPEG images at each SOI marker
+static void SplitImages(const std::vector<uint8_t>& file, std::vector<JpegImage>& images)
+{
+    const int bytes = (int)file.size();
+    int start = -1;
+
+    for (int i = 0; i + 2 < bytes; ++i) {
+        if (file[i] == 0xff && file[i + 1] == 0xd8 && file[i + 2] == 0xff) {
+            if (start >= 0) {
+                images.push_back(JpegImage{ file.data() + start, i - start });
+            }
+            start = i;
+        }
+    }
+
+    if (start >= 0) {
+        images.push_back(JpegImage{ file.data() + start, bytes - start });
+    }
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    const long bytes = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data.resize(bytes > 0 ? bytes : 0);
+    const bool success = bytes > 0 && fread(data.data(), 1, bytes, file) == (size_t)bytes;
+    fclose(file);
+    return success;
+}
+
+// Luma plane of a decoded frame
+struct DecodedImage
+{
+    int Stride = 0;
+    std::vector<uint8_t> Luma;
+};
+
+struct BenchResult
+{
+    uint64_t TotalUsec = 0;
+    uint64_t MaxUsec = 0;
+    int Failures = 0;
+    uint64_t CacheMisses = 0;
+};
+
+static BenchResult RunDecoder(
+    const char* name,
+    const JpegDecoderSettings& settings,
+    const std::vector<JpegImage>& images,
+    int iterations,
+    const CacheMissCounter& counter,
+    std::vector<DecodedImage>* output)
+{
+    JpegDecoder decoder;
+    decoder.SetSettings(settings);
+
+    BenchResult result;
+    const uint64_t misses_start = counter.Read();
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            const uint64_t t0 = GetTimeUsec();
+            auto frame = decoder.Decompress(images[i].Data, images[i].Bytes);
+            const uint64_t dt = GetTimeUsec() - t0;
+
+            if (!frame) {
+                ++result.Failures;
+                continue;
+            }
+
+            result.TotalUsec += dt;
+            if (result.MaxUsec < dt) {
+                result.MaxUsec = dt;
+            }
+
+            // Keep the first decoded image for comparison
+            if (output && iteration == 0) {
+                DecodedImage& image = (*output)[i];
+                image.Stride = frame->Width;
+                image.Luma.assign(frame->Planes[0], frame->Planes[0] + frame->Width * frame->Height);
+            }
+
+            decoder.Release(frame);
+        }
+    }
+
+    result.CacheMisses = counter.Read() - misses_start;
+
+    const int count = (int)images.size() * iterations - result.Failures;
+    Logger.Info(name, ": avg ", count > 0 ? result.TotalUsec / 1000.f / count : 0.f,
+        " msec, max ", result.MaxUsec / 1000.f, " msec, failures ", result.Failures);
+    if (counter.IsAvailable() && count > 0) {
+        const float bytes = result.CacheMisses / (float)count * CacheMissCounter::kLineBytes;
+        Logger.Info(name, ": DRAM reads ~", bytes / 1000000.f, " MB/frame");
+    }
+    return result;
+}
+
+static int Benchmark(const char* path, int iterations)
+{
+    std::vector<uint8_t> file;
+    if (!ReadFile(path, file)) {
+        Logger.Error("Failed to read ", path);
+        return kAppFail;
+    }
+
+    std::vector<JpegImage> images;
+    SplitImages(file, images);
+    if (images.empty()) {
+        Logger.Error("No JPEG images found in ", path);
+        return kAppFail;
+    }
+
+    JpegParser parser;
+    if (parser.Parse(images[0].Data, images[0].Bytes)) {
+        Logger.Info("Benchmarking ", images.size(), " frames x ", iterations, " iterations: ",
+            parser.Width, "x", parser.Height, " Y sampling ", (int)parser.Components[0].H, "x",
+            (int)parser.Components[0].V, " restart interval ", parser.RestartInterval);
+    }
+
+    std::vector<DecodedImage> turbo_output(images.size());
+    std::vector<DecodedImage> specialized_output(images.size());
+
+    // Open the counters before OpenMP starts its worker threads
+    CacheMissCounter counter;
+
+    JpegDecoderSettings settings;
+
+    settings.Specialized = false;
+    RunDecoder("turbojpeg", settings, images, iterations, counter, &turbo_output);
+
+    settings.Specialized = true;
+    RunDecoder("specialized", settings, images, iterations, counter, &specialized_output);
+
+    settings.Specialized = false;
+    settings.Incremental = true;
+    RunDecoder("turbojpeg incremental", settings, images, iterations, counter, nullptr);
+
+    settings.Specialized = true;
+    RunDecoder("specialized incremental", settings, images, iterations, counter, nullptr);
+
+    // Luma only, for text consoles and BIOS screens
+    settings.Incremental = false;
+    settings.LumaOnly = true;
+
+    settings.Specialized = false;
+    RunDecoder("turbojpeg luma only", settings, images, iterations, counter, nullptr);
+
+    settings.Specialized = true;
+    RunDecoder("specialized luma only", settings, images, iterations, counter, nullptr);
+
+    settings.LumaOnly = false;
+
+    // Full decode plus change detection, as separate passes and fused
+    settings.DetectChanges = true;
+    for (int specialized = 0; specialized <= 1; ++specialized)
+    {
+        settings.Specialized = (specialized != 0);
+        const char* decoder_name = settings.Specialized ? "specialized" : "turbojpeg";
+
+        settings.FusedBands = false;
+        std::string name = std::string(decoder_name) + " + changes staged";
+        const BenchResult staged = RunDecoder(name.c_str(), settings, images, iterations, counter, nullptr);
+
+        settings.FusedBands = true;
+        name = std::string(decoder_name) + " + changes fused";
+        const BenchResult fused = RunDecoder(name.c_str(), settings, images, iterations, counter, nullptr);
+
+        if (staged.TotalUsec > 0) {
+            Logger.Info(decoder_name, ": Fused bands take ", fused.TotalUsec * 100.f / staged.TotalUsec,
+                "% of the staged time");
+        }
+        if (staged.CacheMisses > 0) {
+            Logger.Info(decoder_name, ": Fused bands read ", fused.CacheMisses * 100.f / staged.CacheMisses,
+                "% of the staged DRAM traffic");
+        }
+    }
+
+    // Luma uses the same IDCT so should match exactly.  Chroma may differ
+    // by rounding in the NEON 4:2:2 to 4:2:0 conversion
+    int mismatches = 0;
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        const DecodedImage& a = turbo_output[i];
+        const DecodedImage& b = specialized_output[i];
+        if (a.Luma.empty() || a.Stride != b.Stride || a.Luma.size() != b.Luma.size() ||
+            !parser.Parse(images[i].Data, images[i].Bytes))
+        {
+            ++mismatches;
+            continue;
+        }
+
+        // Compare the visible part of the padded frames
+        for (int y = 0; y < parser.Height; ++y) {
+            if (memcmp(a.Luma.data() + y * a.Stride, b.Luma.data() + y * b.Stride, parser.Width) != 0) {
+                ++mismatches;
+                break;
+            }
+        }
+    }
+    Logger.Info("Luma mismatches between decoders: ", mismatches, "/", images.size());
+
+    return mismatches == 0 ? kAppSuccess : kAppFail;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char* argv[])
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_jpeg_bench");
+
+    if (argc >= 3 && strcmp(argv[1], "record") == 0) {
+        const int count = (argc >= 4) ? atoi(argv[3]) : 300;
+        return RecordFrames(argv[2], count);
+    }
+
+    if (argc >= 2) {
+        const int iterations = (argc >= 3) ? atoi(argv[2]) : 3;
+        return Benchmark(argv[1], iterations > 0 ? iterations : 1);
+    }
+
+    Logger.Error("Usage: kvm_jpeg_bench record <file.mjpeg> [frames]");
+    Logger.Error("       kvm_jpeg_bench <file.mjpeg> [iterations]");
+    return kAppFail;
+}
@@ -0,0 +1,352 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Compare the specialized baseline decoder with turbojpeg, pixel by pixel,
+    on synthetic desktop-like images compressed by turbojpeg:
+
+    + 4:2:2 and 4:2:0, at low, high and maximum quality
+    + With and without restart markers, and with partial MCUs at the edges
+    + Incremental decoding of a frame where only part of the screen changed
+    + Hostile quantization tables decode without overflowing
+
+    Luma must match exactly, since both use the same integer IDCT.  Chroma
+    may differ by one where turbojpeg output is converted from 4:2:2 to
+    4:2:0 with truncation instead of rounding (the NEON path).
+
+        kvm_jpeg_compare_test
+*/
+
+#include "kvm_jpeg.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("JpegCompareTest");
+
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Test Images
+
+struct TestImage
+{
+    int Width = 0;
+    int Height = 0;
+    int Subsamp = TJSAMP_420;
+    std::vector<uint8_t> Planes[3];
+    int Strides[3];
+    int PlaneHeights[3];
+
+    void Allocate(int w, int h, int subsamp)
+    {
+        Width = w;
+        Height = h;
+        Subsamp = subsamp;
+        Strides[0] = w;
+        Strides[1] = Strides[2] = (w + 1) / 2;
+        PlaneHeights[0] = h;
+        PlaneHeights[1] = PlaneHeights[2] = (subsamp == TJSAMP_420) ? (h + 1) / 2 : h;
+        for (int i = 0; i < 3; ++i) {
+            Planes[i].resize(Strides[i] * PlaneHeights[i]);
+        }
+    }
+};
+
+/*
+    Gradient background, with windows of text-like glyphs that have sharp
+    edges, and a block of noise that produces large AC coefficients.
+    `seed` changes the glyphs and noise.
+*/
+static void DrawDesktop(TestImage& image, unsigned seed)
+{
+    std::mt19937 prng(seed);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const int w = image.Strides[i];
+        const int h = image.PlaneHeights[i];
+        const int sx = (i == 0) ? 1 : 2;
+        const int sy = (i == 0 || image.Subsamp == TJSAMP_422) ? 1 : 2;
+
+        for (int y = 0; y < h; ++y) {
+            uint8_t* row = image.Planes[i].data() + y * w;
+            for (int x = 0; x < w; ++x) {
+                const int px = x * sx, py = y * sy;
+                int value = (i == 0) ? (32 + px * 160 / image.Width) : (96 + i * 16 + py * 32 / image.Height);
+
+                // Text window in the middle of the screen
+                if (px >= image.Width / 8 && px < image.Width / 2 && py >= image.Height / 8 && py < image.Height / 2) {
+                    const bool glyph = ((px / 3 + py / 5 * 7 + (int)(prng() % 4)) % 5) == 0;
+                    value = (i == 0) ? (glyph ? 16 : 235) : 128;
+                }
+
+                // Noise, like a photo or video playing in a window
+                if (px >= image.Width * 5 / 8 && py >= image.Height * 5 / 8) {
+                    value = (int)(prng() % 256);
+                }
+
+                row[x] = static_cast<uint8_t>( value );
+            }
+        }
+    }
+}
+
+// Compress with turbojpeg.  If restart_rows > 0, a restart marker is
+// placed after every restart_rows MCU rows
+static bool Compress(const TestImage& image, int quality, int restart_rows, std::vector<uint8_t>& jpeg)
+{
+    if (restart_rows > 0) {
+        setenv("TJ_RESTART", std::to_string(restart_rows).c_str(), 1);
+    } else {
+        unsetenv("TJ_RESTART");
+    }
+
+    tjhandle handle = tjInitCompress();
+    if (!handle) {
+        Logger.Error("tjInitCompress failed: ", tjGetErrorStr());
+        return false;
+    }
+
+    const unsigned char* planes[3] = {
+        image.Planes[0].data(), image.Planes[1].data(), image.Planes[2].data()
+    };
+    unsigned char* output = nullptr;
+    unsigned long output_bytes = 0;
+
+    const int r = tjCompressFromYUVPlanes(handle, planes, image.Width, image.Strides, image.Height,
+        image.Subsamp, &output, &output_bytes, quality, TJFLAG_ACCURATEDCT);
+    tjDestroy(handle);
+    unsetenv("TJ_RESTART");
+
+    if (r != 0 || !output) {
+        Logger.Error("tjCompressFromYUVPlanes failed: ", tjGetErrorStr());
+        return false;
+    }
+    jpeg.assign(output, output + output_bytes);
+    tjFree(output);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Comparison
+
+struct PlaneDifference
+{
+    int MaxDifference = 0;
+    int DifferentPixels = 0;
+};
+
+static PlaneDifference ComparePlane(
+    const uint8_t* a, int a_stride,
+    const uint8_t* b, int b_stride,
+    int w, int h)
+{
+    PlaneDifference result;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            const int d = std::abs((int)a[y * a_stride + x] - (int)b[y * b_stride + x]);
+            if (d > 0) {
+                ++result.DifferentPixels;
+                if (result.MaxDifference < d) {
+                    result.MaxDifference = d;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+// Compare the visible part of two decoded YUV420P frames
+static bool CompareFrames(const Frame& turbo, const Frame& specialized, int w, int h, const std::string& name)
+{
+    if (turbo.Width != specialized.Width || turbo.Height != specialized.Height ||
+        turbo.Format != PixelFormat::YUV420P || specialized.Format != PixelFormat::YUV420P)
+    {
+        Logger.Error(name, ": Frame formats differ: ", turbo.Width, "x", turbo.Height, " vs ",
+            specialized.Width, "x", specialized.Height);
+        return false;
+    }
+
+    const PlaneDifference y = ComparePlane(
+        turbo.Planes[0], turbo.Width, specialized.Planes[0], specialized.Width, w, h);
+    bool passed = y.DifferentPixels == 0;
+
+    int chroma_max = 0;
+    for (int i = 1; i < 3; ++i) {
+        const PlaneDifference c = ComparePlane(
+            turbo.Planes[i], turbo.Width / 2, specialized.Planes[i], specialized.Width / 2,
+            (w + 1) / 2, (h + 1) / 2);
+        passed &= c.MaxDifference <= 1;
+        chroma_max = std::max(chroma_max, c.MaxDifference);
+    }
+
+    if (!passed) {
+        Logger.Error(name, ": Luma differs at ", y.DifferentPixels, " pixels (max ", y.MaxDifference,
+            "), chroma max difference ", chroma_max);
+    }
+    return passed;
+}
+
+static std::shared_ptr<Frame> Decode(JpegDecoder& decoder, const std::vector<uint8_t>& jpeg)
+{
+    return decoder.Decompress(jpeg.data(), (int)jpeg.size());
+}
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static const char* SubsampToString(int subsamp)
+{
+    return subsamp == TJSAMP_422 ? "4:2:2" : "4:2:0";
+}
+
+static void TestImages()
+{
+    const int sizes[][2] = {
+        { 1920, 1080 },
+        { 1000, 600 }, // Partial MCUs on the right and bottom edges
+    };
+    const int qualities[] = { 50, 90, 100 };
+
+    for (const auto& size : sizes) {
+        for (int subsamp : { TJSAMP_422, TJSAMP_420 }) {
+            TestImage image;
+            image.Allocate(size[0], size[1], subsamp);
+            DrawDesktop(image, 1);
+
+            for (int quality : qualities) {
+                for (int restart_rows : { 0, 1 }) {
+                    const std::string name = std::to_string(size[0]) + "x" + std::to_string(size[1]) + " " +
+                        SubsampToString(subsamp) + " q=" + std::to_string(quality) +
+                        (restart_rows ? " with restarts" : "");
+
+                    std::vector<uint8_t> jpeg;
+                    if (!Compress(image, quality, restart_rows, jpeg)) {
+                        Expect(false, name.c_str());
+                        continue;
+                    }
+
+                    JpegDecoder turbo, specialized;
+                    JpegDecoderSettings settings;
+                    settings.Specialized = false;
+                    turbo.SetSettings(settings);
+                    settings.Specialized = true;
+                    specialized.SetSettings(settings);
+
+                    auto a = Decode(turbo, jpeg);
+                    auto b = Decode(specialized, jpeg);
+                    Expect(a && b && CompareFrames(*a, *b, size[0], size[1], name), name.c_str());
+                }
+            }
+        }
+    }
+}
+
+static void TestIncremental()
+{
+    for (int subsamp : { TJSAMP_422, TJSAMP_420 })
+    {
+        const std::string name = std::string("Incremental ") + SubsampToString(subsamp);
+
+        // Second frame: Only the text window changes
+        TestImage first, second;
+        first.Allocate(1920, 1080, subsamp);
+        second.Allocate(1920, 1080, subsamp);
+        DrawDesktop(first, 1);
+        DrawDesktop(second, 2);
+        for (int i = 0; i < 3; ++i) {
+            const int rows = second.PlaneHeights[i];
+            const int noise_row = rows * 5 / 8;
+            std::copy(first.Planes[i].begin() + noise_row * first.Strides[i], first.Planes[i].end(),
+                second.Planes[i].begin() + noise_row * second.Strides[i]);
+        }
+
+        std::vector<uint8_t> jpeg1, jpeg2;
+        if (!Compress(first, 90, 1, jpeg1) || !Compress(second, 90, 1, jpeg2)) {
+            Expect(false, name.c_str());
+            continue;
+        }
+
+        JpegDecoder turbo, specialized;
+        JpegDecoderSettings settings;
+        settings.Incremental = true;
+        settings.Specialized = false;
+        turbo.SetSettings(settings);
+        settings.Specialized = true;
+        specialized.SetSettings(settings);
+
+        auto a1 = Decode(turbo, jpeg1);
+        auto b1 = Decode(specialized, jpeg1);
+        bool passed = a1 && b1;
+        if (a1) {
+            turbo.Release(a1);
+        }
+        if (b1) {
+            specialized.Release(b1);
+        }
+
+        auto a2 = Decode(turbo, jpeg2);
+        auto b2 = Decode(specialized, jpeg2);
+        passed &= a2 && b2 && CompareFrames(*a2, *b2, 1920, 1080, name);
+
+        // Only some rows should have been decoded again
+        passed &= b2 && !b2->DirtyRows.empty();
+        Expect(passed, name.c_str());
+    }
+}
+
+static void TestHostileTables()
+{
+    TestImage image;
+    image.Allocate(640, 480, TJSAMP_420);
+    DrawDesktop(image, 3);
+
+    // At quality 100 every quantizer is 1, so the coefficients are as large
+    // as they get.  Raising the quantizers to 255 afterwards makes the
+    // dequantized coefficients far larger than 16 bits
+    std::vector<uint8_t> jpeg;
+    if (!Compress(image, 100, 1, jpeg)) {
+        Expect(false, "Hostile quantization tables");
+        return;
+    }
+
+    JpegParser parser;
+    bool passed = parser.Parse(jpeg.data(), (int)jpeg.size());
+    for (const JpegSegment& segment : parser.QuantTables) {
+        for (int offset = 0; offset + 65 <= segment.Bytes; offset += 65) {
+            for (int i = 1; i <= 64; ++i) {
+                jpeg[segment.Offset + offset + i] = 255;
+            }
+        }
+    }
+
+    JpegDecoder decoder;
+    JpegDecoderSettings settings;
+    settings.Specialized = true;
+    decoder.SetSettings(settings);
+    passed &= Decode(decoder, jpeg) != nullptr;
+    Expect(passed, "Hostile quantization tables");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_jpeg_compare_test");
+
+    TestImages();
+    TestIncremental();
+    TestHostileTables();
+
+    return TestResult("JPEG compare test");
+}
@@ -19,14 +19,26 @@ int main(int argc, char* argv[])
 {
     SetCurrentThreadName("Main");
 
-    CORE_UNUSED(argc);
-    CORE_UNUSED(argv);
-
     Logger.Info("kvm_jpeg_test");
 
+    // Optional argument: Scale denominator (1, 2, 4, 8)
+    JpegDecoderSettings settings;
+    if (argc >= 2) {
+        settings.ScaleDenom = atoi(argv[1]);
+        if (!IsValidJpegScaleDenom(settings.ScaleDenom)) {
+            Logger.Error("Invalid scale denominator: ", argv[1], " (expected 1, 2, 4, 8)");
+            return kAppFail;
+        }
+    }
+    Logger.Info("Decoding at 1/", settings.ScaleDenom, " scale");
+
+    // Re-decode only changed MCU rows when the JPEG has restart markers
+    settings.Incremental = true;
+
     V4L2Capture capture;
 
     JpegDecoder decoder;
+    decoder.SetSettings(settings);
 
     if (!capture.Initialize([&](const std::shared_ptr<CameraFrame>& buffer) {
         Logger.Info("Got frame #", buffer->FrameNumber, " bytes = ", buffer->ImageBytes);
@@ -41,7 +53,18 @@ int main(int argc, char* argv[])
 
         uint64_t t1 = GetTimeUsec();
         int64_t dt = t1 - t0;
-        Logger.Info("Decoding JPEG took ", dt / 1000.f, " msec");
+        if (frame->DirtyRows.empty()) {
+            Logger.Info("Decoding JPEG took ", dt / 1000.f, " msec: ", frame->Width, "x", frame->Height, " (full image)");
+        } else {
+            int dirty_count = 0;
+            for (uint8_t dirty : frame->DirtyRows) {
+                if (dirty) {
+                    ++dirty_count;
+                }
+            }
+            Logger.Info("Decoding JPEG took ", dt / 1000.f, " msec: ", frame->Width, "x", frame->Height,
+                " (", dirty_count, "/", frame->DirtyRows.size(), " MCU rows changed)");
+        }
 
         decoder.Release(frame);
     })) {
@@ -16,6 +16,7 @@
 #include <memory>
 #include <vector>
 #include <mutex>
+#include <atomic>
 
 #include <bcm_host.h>
 #include <interface/mmal/mmal.h>
@@ -27,6 +28,113 @@
 namespace kvm {
 
 
+//------------------------------------------------------------------------------
+// Constants
+
+// Space reserved in encoder output buffers before any output is seen
+static const int kEncodedBufferInitialBytes = 256 * 1000;
+
+// Number of frames over which the largest output is tracked.
+// This should cover at least one keyframe interval
+static const int kEncodedSizeWindow = 128;
+
+// Number of buffers kept for reuse
+static const int kEncodedBufferPoolLimit = 16;
+
+// QP offsets used by BuildQpOffsetMap()
+static const int kRoiCursorQpOffset = -6; // Changed macroblocks around the mouse cursor
+static const int kRoiChangedQpOffset = -3; // Other macroblocks that changed
+
+// Radius of the region around the mouse cursor in macroblocks
+static const int kRoiCursorRadius = 4;
+
+// The region of interest is only favored when it covers at most this
+// percentage of the frame.  Larger changes like scrolling or video playback
+// are left to the rate control as usual
+static const int kRoiMaxAreaPercent = 25;
+
+
+//------------------------------------------------------------------------------
+// EncodedBufferPool
+
+/*
+    Pool of buffers for encoder output.
+
+    Buffers are handed out as shared pointers and reused once every other
+    reference is gone, so downstream stages (packetizers, file writers,
+    keyframe caches) can hold on to encoded data without copying it and
+    without racing the encoder.
+
+    Buffers reserve room for the largest output seen recently, which is
+    usually a keyframe, so appending encoder output does not reallocate.
+
+    Allocate() and OnOutputBytes() must be called from the encoder thread.
+*/
+class EncodedBufferPool
+{
+public:
+    // Returns an empty buffer
+    std::shared_ptr<std::vector<uint8_t>> Allocate();
+
+    // Record the size of the latest output, to size the buffers
+    void OnOutputBytes(int bytes);
+
+    // Number of buffers allocated outside the pool because all were in use
+    uint64_t GetOverflowCount() const
+    {
+        return OverflowCount;
+    }
+
+protected:
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> Buffers;
+    uint64_t OverflowCount = 0;
+
+    // Largest output in the current and previous window
+    int WindowMax = 0;
+    int PreviousWindowMax = 0;
+    int WindowCount = 0;
+
+    int GetReserveBytes() const;
+};
+
+
+//------------------------------------------------------------------------------
+// QpOffsetMap
+
+/*
+    Per-macroblock QP offsets relative to the QP chosen by rate control.
+    Negative offsets spend more bits on a macroblock, and positive offsets
+    spend fewer.
+*/
+struct QpOffsetMap
+{
+    int MacroblocksWide = 0;
+    int MacroblocksHigh = 0;
+
+    // One entry per 16x16 macroblock in raster order
+    std::vector<int8_t> Offsets;
+
+    // Number of macroblocks with negative offsets, and the lowest offset
+    int RoiCount = 0;
+    int MinOffset = 0;
+
+    // Resize the map and set all offsets to zero
+    void Reset(int width, int height);
+};
+
+/*
+    Build a QP offset map for the frame that favors the tiles that changed
+    since the previous frame (Frame::DirtyTiles), and most of all those
+    around the mouse cursor.  Unchanged macroblocks keep offset 0, including
+    those around the cursor, so a static screen has no region of interest.
+    Without change tracking the whole frame counts as changed.
+
+    cursor_x, cursor_y: Cursor position in pixels of the visible image, or
+    negative if the position is unknown.
+*/
+void BuildQpOffsetMap(const Frame& frame, int cursor_x, int cursor_y, QpOffsetMap& map);
+
+
 //------------------------------------------------------------------------------
 // MmalEncoder
 
@@ -43,12 +151,19 @@ namespace kvm {
 
     Larger GopSize causes slightly lower quality and longer load times,
     as clients need to wait for the next keyframe to join the video stream.
+
+    MinQuant, MaxQuant: Bounds on the H.264 QP chosen by rate control.
 */
 struct MmalEncoderSettings
 {
-    int Kbps = 5000; // 4 Mbps
+    int Kbps = 4000; // 4 Mbps
     int Framerate = 30; // From frame source settings
     int GopSize = 60; // Interval between keyframes
+    int MinQuant = 16;
+    int MaxQuant = 34;
+
+    // Returns false if any setting is out of range
+    bool IsValid() const;
 };
 
 class MmalEncoder
@@ -59,28 +174,76 @@ public:
         Shutdown();
     }
 
-    void SetSettings(const MmalEncoderSettings& settings)
-    {
-        Settings = settings;
-    }
+    /*
+        Change the settings.  Thread-safe, and may be called while encoding:
+        The new settings are applied to the running encoder before the next
+        frame.  Settings the hardware cannot change on the fly restart the
+        encoder, which starts again with a keyframe.
+
+        Returns false if the settings are invalid.
+    */
+    bool SetSettings(const MmalEncoderSettings& settings);
+
+    MmalEncoderSettings GetSettings() const;
 
     void Shutdown();
 
-    // Pointer is valid until the next Encode() call
-    uint8_t* Encode(const std::shared_ptr<Frame>& frame, bool force_keyframe, int& bytes);
+    /*
+        Returns the encoded video, which is empty if the frame produced no
+        output, or nullptr on error.
+
+        The returned buffer comes from a pool, and is not reused by later
+        Encode() calls while it is still referenced, so it can be handed to
+        other threads.
+
+        qp_map: Optional QP offsets for the frame.  The VideoCore encoder
+        does not accept per-macroblock QP through MMAL, so the map is reduced
+        to the QP ceiling for the frame: Only while the changed area is small,
+        MaxQuant is lowered by the lowest offset, and it is restored as soon
+        as the frame has no region of interest.  Unchanged macroblocks are
+        coded as skips in P-frames anyway, so the lower ceiling mostly spends
+        bits where the screen changed.  Positive offsets cannot be expressed
+        this way, so the map does not use them.
+    */
+    std::shared_ptr<std::vector<uint8_t>> Encode(
+        const std::shared_ptr<Frame>& frame,
+        bool force_keyframe,
+        const QpOffsetMap* qp_map = nullptr);
 
 protected:
+    // Settings used by the encoder thread
     MmalEncoderSettings Settings;
 
+    // Settings from SetSettings(), applied by the next Encode() call
+    mutable std::mutex SettingsLock;
+    MmalEncoderSettings NextSettings;
+    std::atomic<bool> SettingsChanged = ATOMIC_VAR_INIT(false);
+
     MMAL_WRAPPER_T* Encoder = nullptr;
     int Width = 0, Height = 0;
 
     MMAL_PORT_T* PortIn = nullptr;
     MMAL_PORT_T* PortOut = nullptr;
 
-    std::vector<uint8_t> Data;
+    EncodedBufferPool OutputPool;
+
+    // MaxQuant currently set on the encoder
+    int AppliedMaxQuant = -1;
 
     bool Initialize(int width, int height, int input_encoding);
+
+    // Set the QP ceiling for the next frame from the QP offset map
+    bool ApplyQpOffsetMap(const QpOffsetMap* qp_map);
+
+    /*
+        Set the rate control parameters on the output port.
+        If previous is provided, only the changed parameters are set.
+        Returns false if any parameter could not be set.
+    */
+    bool SetRateControl(const MmalEncoderSettings* previous);
+
+    // Pick up settings from SetSettings()
+    void UpdateSettings();
 };
 
 
@@ -0,0 +1,202 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Overload controller
+
+    Once a second the pipeline measures how it is keeping up: The average
+    time from capture to delivery, the CPU time used by the process, how busy
+    the slowest stage is from its run times, how many messages are waiting
+    in the stage queues, and how many frames were dropped.  The controller
+    turns these into a level on a ladder of cheaper settings:
+
+        Level  Frames kept  Decode scale
+          0        all          1/1
+          1        1/2          1/1
+          2        1/2          1/2
+          3        1/4          1/2
+          4        1/4          1/4
+
+    Frame rate goes first because a KVM screen is mostly text, which stays
+    readable at a low frame rate but not at a low resolution.  The encoder
+    frame rate follows the frames kept, so its rate control spends the same
+    bitrate on fewer frames.
+
+    Hysteresis: A step down takes two overloaded intervals in a row.  A step
+    up takes several quiet intervals, and only if the cost of the next level
+    is predicted to stay under the limits.  If the load comes back soon after
+    a step up, the wait before the next step up doubles, so the level does
+    not flap.
+
+    A minimum level can be set from outside, for example by the thermal
+    governor (kvm_thermal.hpp).  The level steps down to it right away, and
+    steps back up through the usual checks once the minimum is lifted.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <mutex>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Interval between controller updates
+static const uint64_t kOverloadIntervalUsec = 1000 * 1000; // 1 second
+
+// Consecutive overloaded intervals before stepping down
+static const int kOverloadStepDownIntervals = 2;
+
+// Consecutive quiet intervals before stepping up, before backoff
+static const int kOverloadStepUpIntervals = 5;
+
+// Longest wait before stepping up, as a multiple of kOverloadStepUpIntervals
+static const int kOverloadMaxStepUpBackoff = 16;
+
+// A step down this soon after a step up doubles the step up backoff
+static const uint64_t kOverloadFlapWindowUsec = 30 * 1000 * 1000; // 30 seconds
+
+// Fraction of the time the busiest stage may spend working
+static const float kOverloadMaxUtilization = 0.9f;
+
+// Messages waiting for a stage that count as a backlog
+static const int kOverloadMaxQueuedFrames = 2;
+
+struct OverloadLevel
+{
+    // Keep one of every N captured frames
+    int FrameDecimation;
+
+    // Extra JPEG decode scale, on top of VideoPipeline::SetDecodeScale()
+    int DecodeScale;
+};
+
+static const int kOverloadLevelCount = 5;
+extern const OverloadLevel kOverloadLevels[kOverloadLevelCount];
+
+// Process CPU time used by all threads
+uint64_t GetProcessCpuUsec();
+
+
+//------------------------------------------------------------------------------
+// OverloadSettings
+
+struct OverloadSettings
+{
+    bool Enabled = true;
+
+    // Average time from capture to delivery to hold
+    int TargetLatencyUsec = 100 * 1000; // 100 msec
+
+    // Process CPU usage to stay under, as a percentage of all cores
+    int CpuCeilingPercent = 75;
+
+    bool IsValid() const
+    {
+        return TargetLatencyUsec > 0 &&
+            CpuCeilingPercent > 0 && CpuCeilingPercent <= 100;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// OverloadSample
+
+// Measurements over one controller interval
+struct OverloadSample
+{
+    // Average time from capture to delivery, or 0 if no frames were delivered
+    int LatencyUsec = 0;
+
+    // Process CPU usage, as a percentage of all cores
+    float CpuPercent = 0.f;
+
+    // Fraction of the interval the busiest stage spent working
+    float Utilization = 0.f;
+
+    // Frames dropped or skipped because a stage was behind
+    int DroppedFrames = 0;
+
+    // Longest stage queue at the end of the interval
+    int QueuedFrames = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// OverloadMetrics
+
+struct OverloadMetrics
+{
+    int Level = 0;
+    int MinLevel = 0;
+    int FrameDecimation = 1;
+    int DecodeScale = 1;
+
+    int StepDownCount = 0;
+    int StepUpCount = 0;
+
+    // Latest sample
+    OverloadSample Sample;
+};
+
+
+//------------------------------------------------------------------------------
+// OverloadController
+
+class OverloadController
+{
+public:
+    // Thread-safe
+    bool SetSettings(const OverloadSettings& settings);
+    OverloadSettings GetSettings() const;
+
+    /*
+        Called once every kOverloadIntervalUsec with the measurements since
+        the previous call, from one thread.  Returns true if the level
+        changed.
+    */
+    bool Update(const OverloadSample& sample, uint64_t now_usec);
+
+    // Return to the minimum level, for example after the pipeline restarts
+    void Reset();
+
+    /*
+        Keep the level at or above min_level.  Called from the same thread
+        as Update().  Returns true if the level changed.
+    */
+    bool SetMinLevel(int min_level);
+
+    // Thread-safe
+    OverloadLevel GetLevel() const;
+    OverloadMetrics GetMetrics() const;
+
+protected:
+    mutable std::mutex Lock;
+
+    OverloadSettings Settings;
+
+    int Level = 0;
+    int MinLevel = 0;
+    int OverloadedIntervals = 0;
+    int QuietIntervals = 0;
+
+    // Multiplier for kOverloadStepUpIntervals
+    int StepUpBackoff = 1;
+    uint64_t LastStepUpUsec = 0;
+
+    int StepDownCount = 0;
+    int StepUpCount = 0;
+    OverloadSample LastSample;
+
+    // Returns a reason if the sample is over the limits, or null
+    const char* GetOverloadReason(const OverloadSample& sample) const;
+
+    // Returns true if the next level up is predicted to stay under the limits
+    bool CanStepUp(const OverloadSample& sample) const;
+};
+
+
+} // namespace kvm
@@ -0,0 +1,122 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Output frame pacing
+
+    Encoded pictures come out of the encoder as soon as they are done, and
+    keyframes take several times longer than other frames, so pictures reach
+    the browser in bursts even when they were captured at a steady rate.
+
+    FramePacer releases each picture a fixed delay after its capture time,
+    so the spacing between pictures matches the spacing between captures.
+    The delay follows the slowest recent pictures: It jumps up to the latency
+    of a slow picture and decays back down over about kPacingDelaySmoothing
+    pictures, and it never goes above the configured maximum.  A picture
+    that arrives after its release time goes out right away, and the
+    schedule skips ahead rather than holding the pictures behind it.
+
+    JitterMeter measures the interarrival jitter of delivered pictures like
+    RFC 3550, against their capture times, to compare delivery with and
+    without pacing.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Default for VideoPipelineConfig::PacingMaxDelayUsec
+static const int kDefaultPacingMaxDelayUsec = 50 * 1000; // 50 msec
+
+// Capture to arrival latency above this is from a mismatched clock
+static const uint64_t kPacingMaxLatencyUsec = 1000 * 1000; // 1 second
+
+// The pacing delay decays by 1/N of its excess per picture
+static const int kPacingDelaySmoothing = 64;
+
+// Jitter smoothing from RFC 3550
+static const int kJitterSmoothing = 16;
+
+
+//------------------------------------------------------------------------------
+// FramePacer
+
+class FramePacer
+{
+public:
+    void SetMaxDelay(uint64_t max_delay_usec)
+    {
+        MaxDelayUsec = max_delay_usec;
+    }
+
+    void Reset();
+
+    /*
+        Returns the time to release a picture captured at shutter_usec that
+        arrived at now_usec.  The result is never earlier than now_usec, or
+        later than now_usec plus the maximum delay.
+    */
+    uint64_t Schedule(uint64_t shutter_usec, uint64_t now_usec);
+
+    // Current delay from capture to release
+    uint64_t GetTargetDelayUsec() const
+    {
+        return TargetDelayUsec;
+    }
+
+    // Pictures that arrived after their release time
+    int GetLateCount() const
+    {
+        return LateCount;
+    }
+
+protected:
+    uint64_t MaxDelayUsec = kDefaultPacingMaxDelayUsec;
+    uint64_t TargetDelayUsec = 0;
+    uint64_t LastReleaseUsec = 0;
+    int LateCount = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// JitterMeter
+
+class JitterMeter
+{
+public:
+    void Reset();
+
+    // Called for each picture in delivery order
+    void OnPicture(uint64_t shutter_usec, uint64_t arrival_usec);
+
+    // Smoothed interarrival jitter
+    float GetJitterUsec() const
+    {
+        return JitterUsec;
+    }
+
+    // Largest difference between the arrival and capture spacing
+    uint64_t GetMaxDeviationUsec() const
+    {
+        return MaxDeviationUsec;
+    }
+
+    void ResetMax()
+    {
+        MaxDeviationUsec = 0;
+    }
+
+protected:
+    uint64_t LastShutterUsec = 0;
+    uint64_t LastArrivalUsec = 0;
+    float JitterUsec = 0.f;
+    uint64_t MaxDeviationUsec = 0;
+};
+
+
+} // namespace kvm
@@ -2,16 +2,27 @@
 
 /*
     Video Pipeline:
-    HDMI Capture -> JPEG Decode -> H.264 Encode -> Video Parser
+    HDMI Capture -> JPEG Decode -> Scale -> H.264 Encode -> Video Parser -> Pacing
+
+    Each decoded frame can feed several outputs, each with its own scaler
+    and encoder, to produce the video at different resolutions.
 */
 
 #pragma once
 
 #include "kvm_core.hpp"
+#include "kvm_stage.hpp"
 #include "kvm_capture.hpp"
 #include "kvm_jpeg.hpp"
+#include "kvm_scale.hpp"
 #include "kvm_encode.hpp"
 #include "kvm_video.hpp"
+#include "kvm_overload.hpp"
+#include "kvm_thermal.hpp"
+#include "kvm_pacing.hpp"
+#include "kvm_timing.hpp"
+#include "kvm_recorder.hpp"
+#include "kvm_metrics.hpp"
 
 #include <atomic>
 #include <thread>
@@ -22,103 +33,282 @@ namespace kvm {
 
 
 //------------------------------------------------------------------------------
-// PipelineNode
+// Pipeline Messages
 
-class PipelineNode
+// Captured image passed from the capture thread to the decoder
+struct CaptureMessage
 {
-public:
-    ~PipelineNode()
-    {
-        Shutdown();
-    }
-    void Initialize(const std::string& name, int max_queue_depth);
-    void Shutdown();
-
-    bool IsTerminated() const
-    {
-        return Terminated;
-    }
-
-    void Queue(std::function<void()> func);
-
-protected:
-    std::string Name;
-    int MaxQueueDepth = 0;
-
-    int Count = 0;
-    int64_t TotalUsec = 0;
-    int64_t FastestUsec = 0;
-    int64_t SlowestUsec = 0;
-
-    uint64_t LastReportUsec = 0;
+    std::shared_ptr<CameraFrame> Buffer;
+    FrameTiming Timing;
+};
 
-    mutable std::mutex Lock;
-    std::condition_variable Condition;
-    std::vector<std::function<void()>> QueuePublic;
+/*
+    Raw image passed from the decoder to the scalers and encoders.
 
-    std::vector<std::function<void()>> QueuePrivate;
+    Images are returned to their pools as soon as they are queued, and the
+    pools do not reuse them until every message referencing them is gone,
+    so one image can be passed to several outputs.
+*/
+struct RawFrameMessage
+{
+    std::shared_ptr<Frame> Image;
 
-    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
-    std::shared_ptr<std::thread> Thread;
+    uint64_t FrameNumber = 0;
+    uint64_t ShutterUsec = 0;
 
-    void Loop();
+    FrameTiming Timing;
 };
 
+// Encoded pictures are passed from the encoder to the application as
+// VideoPicture, which references the encoder output without copying it
+
 
 //------------------------------------------------------------------------------
 // PiplineStatistics
 
 /*
     Report statistics on how well we are compressing the input data
+
+    The per-frame updates are relaxed atomic adds, so the capture, decoder
+    and encoder threads do not contend for a lock.  TryReport() swaps the
+    totals out for each interval.
 */
 class PiplineStatistics
 {
 public:
     void AddInput(int bytes);
-    void AddVideo(int bytes);
+    void AddVideo(int bytes, uint64_t encode_usec);
     void OnOutputFrame();
 
+    // Input frame was not encoded because nothing changed
+    void OnSkippedFrame();
+
+    // Input frame was not processed because the next stage was full
+    void OnBackpressure();
+
+    // Video is resuming after being suspended, so the time without output
+    // frames should not be reported as a stall
+    void OnResume();
+
+    // Latest thermal status, included in the report
+    void SetThermalStatus(const ThermalStatus& status);
+
+    // Main output picture handed to the application
+    void OnDelivered(uint64_t shutter_usec);
+
+    // Whether the pacer is enabled, included in the report
+    void SetPacing(bool enabled);
+
     void TryReport();
 
 private:
-    std::mutex Lock;
-
     static const int64_t ReportIntervalUsec = 20 * 1000 * 1000; // 20 seconds
 
-    uint64_t LastReportUsec = 0;
+    // Totals for one report interval
+    struct Interval
+    {
+        uint64_t InputBytes = 0;
+        uint64_t InputCount = 0;
+
+        uint64_t VideoBytes = 0;
+        uint64_t VideoCount = 0;
+        uint64_t EncodeUsec = 0;
+
+        uint64_t SkippedCount = 0;
+        uint64_t BackpressureCount = 0;
+
+        uint64_t MaxVideoBytes = 0;
+        uint64_t MinVideoBytes = 0;
+    };
 
-    int InputBytes = 0;
-    int InputCount = 0;
+    std::atomic<uint64_t> InputBytes = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> InputCount = ATOMIC_VAR_INIT(0);
 
-    int VideoBytes = 0;
-    int VideoCount = 0;
+    std::atomic<uint64_t> VideoBytes = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> VideoCount = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> EncodeUsec = ATOMIC_VAR_INIT(0);
 
-    int MaxVideoBytes = 0;
-    int MinVideoBytes = 0;
+    std::atomic<uint64_t> SkippedCount = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> BackpressureCount = ATOMIC_VAR_INIT(0);
+
+    // 0 until the first video frame of the interval
+    std::atomic<uint64_t> MaxVideoBytes = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> MinVideoBytes = ATOMIC_VAR_INIT(0);
+
+    std::atomic<uint64_t> LastOutputFrameUsec = ATOMIC_VAR_INIT(0);
+
+    // Protects the members below
+    std::mutex Lock;
 
-    uint64_t LastOutputFrameUsec = 0;
+    uint64_t LastReportUsec = 0;
     uint64_t LastOutputReportUsec = 0;
 
-    void Report();
+    ThermalStatus Thermal;
+
+    JitterMeter DeliveryJitter;
+    bool Pacing = false;
+
+    void Report(const Interval& interval);
+};
+
+
+//------------------------------------------------------------------------------
+// PipelineMetrics
+
+/*
+    Video metrics in the process-wide registry for Prometheus to scrape.
+    Please see kvm_metrics.hpp.  Registered once by the constructor, and
+    updated from the pipeline threads without locks.
+*/
+struct PipelineMetrics
+{
+    PipelineMetrics();
+
+    // Captured frames handed to the pipeline while a viewer is connected
+    MetricCounter* CaptureFrames = nullptr;
+    MetricCounter* CaptureBytes = nullptr;
+
+    // Main output
+    MetricCounter* VideoFrames = nullptr;
+    MetricCounter* VideoBytes = nullptr;
+    MetricCounter* Keyframes = nullptr;
+    MetricHistogram* FrameBytes = nullptr;
+    MetricHistogram* KeyframeBytes = nullptr;
+    MetricGauge* Fps = nullptr;
+    MetricGauge* Kbps = nullptr;
+
+    MetricCounter* SkippedFrames = nullptr;
+    MetricCounter* DroppedFrames[(int)FlightDropReason::Count] = {};
+    MetricCounter* DecodeErrors = nullptr;
+    MetricCounter* EncodeErrors = nullptr;
+
+    MetricGauge* DecoderQueue = nullptr;
+    MetricGauge* EncoderQueue = nullptr;
+
+    // Microseconds
+    MetricHistogram* DecodeUsec = nullptr;
+    MetricHistogram* EncodeUsec = nullptr;
+    MetricHistogram* LatencyUsec = nullptr;
+
+    void OnDrop(FlightDropReason reason)
+    {
+        DroppedFrames[(int)reason]->Add();
+    }
 };
 
 
 //------------------------------------------------------------------------------
 // VideoPipeline
 
-using PiplineCallback = std::function<void(
-    uint64_t frame_number,
-    uint64_t shutter_usec,
-    const uint8_t* data,
-    int bytes)>;
+// Interval between frames encoded while the screen is not changing, so
+// that clients still see the stream is alive and can recover from loss
+static const uint64_t kIdleHeartbeatUsec = 1000 * 1000; // 1 second
+
+// Viewer count before SetViewerCount() is called: Always run the video
+static const int kViewerCountUnknown = -1;
+
+// Called with each encoded picture.  The picture keeps its buffers alive,
+// so it may be copied to hold on to the data after the callback returns
+using PiplineCallback = std::function<void(const VideoPicture& picture)>;
+
+/*
+    Stage options for the video pipeline.  The defaults give the usual
+    topology: Capture -> Decoder -> Scaler -> Encoder -> App, each on its own
+    thread, dropping new frames when a stage falls behind.  Outputs at the
+    decoded resolution bypass their scaler.
+
+    The Pacer stage between the encoder and App is disabled by default.
+    When enabled it releases pictures on a schedule from their capture
+    times, so keyframes that take longer to encode do not turn into bursts
+    at the browser.  Please see kvm_pacing.hpp.
+*/
+struct VideoPipelineConfig
+{
+    StageOptions Decoder;
+    StageOptions Scaler;
+    StageOptions Encoder;
+    StageOptions Pacer;
+    StageOptions App;
+
+    // Longest time the pacer holds a picture
+    int PacingMaxDelayUsec = kDefaultPacingMaxDelayUsec;
+
+    VideoPipelineConfig()
+    {
+        Pacer.Enabled = false;
+    }
+};
+
+// Settings for an output added with VideoPipeline::AddOutput()
+struct VideoOutputConfig
+{
+    // Output resolution, or zero to keep the decoded resolution
+    int Width = 0;
+    int Height = 0;
+
+    // Requested encoder settings.  The encoder frame rate is lowered while
+    // the overload controller drops frames
+    MmalEncoderSettings Encoder;
+};
+
+/*
+    One encoded output of the pipeline: Scaler -> Encoder -> Pacer -> App
+
+    Output 0 is the main output passed to VideoPipeline::Initialize().
+*/
+struct VideoOutput
+{
+    int Index = 0;
+    VideoOutputConfig Config;
+    PiplineCallback Callback;
+
+    GraphStage<RawFrameMessage, RawFrameMessage> ScalerStage;
+    FrameScaler Scaler;
+    FramePool ScaledPool;
+
+    GraphStage<RawFrameMessage, VideoPicture> EncoderStage;
+    MmalEncoder Encoder;
+    VideoParser Parser;
+    std::shared_ptr<std::vector<uint8_t>> VideoParameters;
+    QpOffsetMap RoiMap;
+
+    GraphStage<VideoPicture, VideoPicture> PacerStage;
+    FramePacer Pacer;
+
+    // Set after the capture device is re-opened, so clients that lost
+    // frames get a keyframe right away
+    std::atomic<bool> ForceKeyframe = ATOMIC_VAR_INIT(false);
+
+    GraphStage<VideoPicture, NoMessage> AppStage;
+};
 
 class VideoPipeline
 {
 public:
-    ~VideoPipeline()
+    VideoPipeline();
+    virtual ~VideoPipeline()
     {
         Shutdown();
     }
+
+    // Optional: Call before Initialize() to change the stage options
+    void SetConfig(const VideoPipelineConfig& config)
+    {
+        Config = config;
+    }
+
+    /*
+        Optional: Call before Initialize() to encode the video at another
+        resolution as well, for example 1280x720 next to the full 1920x1080.
+        The outputs share the capture and decoder, and each has its own
+        scaler and encoder threads.  Width and height must be even.
+
+        Returns the output index used by SetEncoderSettings(), or -1 if the
+        config is invalid.
+    */
+    int AddOutput(const VideoOutputConfig& config, PiplineCallback callback);
+
+    // Starts the pipeline, delivering the main output to the callback
     void Initialize(PiplineCallback callback);
     void Shutdown();
 
@@ -127,29 +317,234 @@ public:
         return Terminated;
     }
 
-protected:
-    PiplineCallback Callback;
+    /*
+        Decode JPEG input at 1/scale_denom of the capture resolution.
+        Valid values are 1, 2, 4, 8.  For example 1920x1080 capture produces
+        960x540 video with scale_denom = 2.  This is much cheaper than decoding
+        at full size, and also reduces the bitrate required for good quality.
 
-    V4L2Capture Capture;
-    uint64_t LastFrameNumber = 0;
+        The overload controller may scale the decoded frames down further.
+        This is thread-safe and takes effect on the next decoded frame.
+    */
+    void SetDecodeScale(int scale_denom);
 
-    PipelineNode DecoderNode;
-    JpegDecoder Decoder;
+    /*
+        Encode only the luma of the input, with neutral grey chroma.
+        Useful for BIOS screens, text consoles and installers where color
+        carries no information: Decoding is cheaper and the encoder spends
+        almost no bits on chroma.
 
-    PipelineNode EncoderNode;
-    MmalEncoder Encoder;
+        This is thread-safe and takes effect on the next decoded frame.
+    */
+    void SetLumaOnly(bool luma_only);
 
-    VideoParser Parser;
+    bool IsLumaOnly() const
+    {
+        return LumaOnly;
+    }
 
-    std::shared_ptr<std::vector<uint8_t>> VideoParameters;
+    /*
+        Decode baseline JPEGs from capture cards with BaselineJpegDecoder
+        instead of turbojpeg.  Off by default: See
+        JpegDecoderSettings::Specialized.
 
-    PipelineNode AppNode;
+        This is thread-safe and takes effect on the next decoded frame.
+    */
+    void SetSpecializedJpegDecoder(bool enabled);
+
+    bool IsSpecializedJpegDecoder() const
+    {
+        return SpecializedJpegDecoder;
+    }
+
+    /*
+        Compare each frame with the previous one, and skip encoding frames
+        where nothing changed, except for one heartbeat frame every
+        kIdleHeartbeatUsec.  The first changed frame is encoded right away,
+        so the video returns to the full frame rate as soon as the screen
+        changes.  A KVM screen is static most of the time, so this saves
+        most of the encoder CPU and bandwidth on an idle desktop.
+
+        Enabled by default.  This is thread-safe and takes effect on the
+        next decoded frame.
+    */
+    void SetVariableFrameRate(bool enabled);
+
+    /*
+        Mouse cursor position from the input reports, where x,y range from
+        0..32767 across the screen like MouseEmulator::SendReport().
+
+        With region of interest encoding, the encoder spends more bits when
+        a small part of the screen changed, most of all near the cursor,
+        which keeps text readable where the user is working.  Frames where
+        nothing or most of the screen changed are left to rate control.
+        See BuildQpOffsetMap() in kvm_encode.hpp.
+
+        Enabled by default.  These are thread-safe.
+    */
+    void SetCursorPosition(uint16_t x, uint16_t y);
+    void SetRegionOfInterest(bool enabled);
+
+    /*
+        Number of viewers receiving the video.  While this is zero the
+        pipeline is suspended: The capture device stays open so that resuming
+        is fast, but captured frames are dropped before they are decoded, so
+        the decoder and encoders sit idle.  When the count goes above zero
+        again, every output starts with a keyframe and the time to the first
+        frame is logged.
+
+        The video always runs if this is never called.  Thread-safe.
+    */
+    void SetViewerCount(int count);
+
+    bool IsSuspended() const
+    {
+        return ViewerCount == 0;
+    }
+
+    /*
+        Change the bitrate, frame rate, keyframe interval and QP bounds.
+        Please see kvm_encode.hpp for comments on these settings.
+
+        This is thread-safe and takes effect on the next encoded frame,
+        without restarting the pipeline.  Returns false if the settings are
+        invalid.
+    */
+    bool SetEncoderSettings(const MmalEncoderSettings& settings, int output = 0);
+    MmalEncoderSettings GetEncoderSettings(int output = 0) const;
+
+    /*
+        Adapt the frame rate, decode scale and encoder frame rate to the
+        load, to hold a target latency and CPU ceiling.  Every decision is
+        logged.  Please see kvm_overload.hpp for how levels are chosen.
+
+        Enabled by default.  This is thread-safe.  Returns false if the
+        settings are invalid.
+    */
+    bool SetOverloadSettings(const OverloadSettings& settings);
+
+    // Current overload level, decision counts and latest measurements
+    OverloadMetrics GetOverloadMetrics() const
+    {
+        return Overload.GetMetrics();
+    }
+
+    /*
+        Watch the SoC temperature and CPU clock, and lower the frame rate
+        and decode scale through the overload controller before the
+        firmware throttles.  Please see kvm_thermal.hpp for the states.
+
+        Enabled by default.  This is thread-safe.  Returns false if the
+        settings are invalid.
+    */
+    bool SetThermalSettings(const ThermalSettings& settings)
+    {
+        return Thermal.SetSettings(settings);
+    }
+
+    // Latest temperature, clock and throttle state
+    ThermalStatus GetThermalStatus() const
+    {
+        return Thermal.GetStatus();
+    }
+
+    /*
+        Latency percentiles of one interval of the main output, such as
+        decode time or capture to relay, since the last periodic report.
+        Please see kvm_timing.hpp for the intervals.  Thread-safe.
+    */
+    FrameIntervalSummary GetFrameTiming(FrameInterval interval) const
+    {
+        return Timings.GetSummary(interval);
+    }
+
+    /*
+        Add a keyboard or mouse report written to the HID device to the
+        flight recorder, which writes the last 30 seconds of frame and input
+        events to /dev/shm on a stall, a burst of decode failures or an
+        encoder error.  Please see kvm_recorder.hpp.  Thread-safe.
+    */
+    void RecordInput(FlightEventType type, int bytes, uint64_t write_usec, bool success)
+    {
+        Recorder.RecordInput(type, bytes, write_usec, success);
+    }
+
+protected:
+    VideoPipelineConfig Config;
+
+    V4L2Capture Capture;
+    uint64_t LastFrameNumber = 0;
+
+    PipelineGraph Graph;
+
+    GraphStage<CaptureMessage, RawFrameMessage> DecoderStage;
+    JpegDecoder Decoder;
+    std::atomic<int> DecodeScaleDenom = ATOMIC_VAR_INIT(1);
+    std::atomic<bool> LumaOnly = ATOMIC_VAR_INIT(false);
+    std::atomic<bool> SpecializedJpegDecoder = ATOMIC_VAR_INIT(false);
+    std::atomic<bool> VariableFrameRate = ATOMIC_VAR_INIT(true);
+
+    // Previous YUYV frame converted by the decoder, to detect changes
+    std::shared_ptr<Frame> PreviousRawFrame;
+
+    // Time the decoder last passed a frame to the encoder
+    uint64_t LastEncodeRequestUsec = 0;
+
+    // Set when the encoder drops a frame, so the next frame is encoded even
+    // if it matches the dropped one
+    std::atomic<bool> EncoderDroppedFrame = ATOMIC_VAR_INIT(false);
+
+    // Main output first
+    std::vector<std::unique_ptr<VideoOutput>> Outputs;
+
+    // Largest output resolution, which the decode scale must not go below
+    int MaxOutputWidth = 0;
+    int MaxOutputHeight = 0;
+
+    // Protects the requested encoder settings in each output config
+    mutable std::mutex EncoderSettingsLock;
+
+    OverloadController Overload;
+    ThermalGovernor Thermal;
+
+    // From the overload level: Keep one of every FrameDecimation captured
+    // frames, and decode at an extra 1/OverloadDecodeScale
+    std::atomic<int> FrameDecimation = ATOMIC_VAR_INIT(1);
+    std::atomic<int> OverloadDecodeScale = ATOMIC_VAR_INIT(1);
+    unsigned CaptureCounter = 0;
+
+    // Measurements since the last overload controller update
+    std::atomic<uint64_t> LatencyTotalUsec = ATOMIC_VAR_INIT(0);
+    std::atomic<int> LatencyCount = ATOMIC_VAR_INIT(0);
+    std::atomic<int> DroppedFrames = ATOMIC_VAR_INIT(0);
+    std::atomic<int> DecodedFrames = ATOMIC_VAR_INIT(0);
+    std::atomic<int> EncodedFrames = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> EncodedBytes = ATOMIC_VAR_INIT(0);
+    uint64_t LastOverloadUpdateUsec = 0;
+    uint64_t LastProcessCpuUsec = 0;
+
+    // Cursor x in the high 16 bits and y in the low 16 bits,
+    // or kCursorUnknown if no mouse input has been seen
+    static const uint32_t kCursorUnknown = 0xffffffff;
+    std::atomic<uint32_t> CursorPosition = ATOMIC_VAR_INIT(kCursorUnknown);
+    std::atomic<bool> RegionOfInterest = ATOMIC_VAR_INIT(true);
 
     std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
     std::atomic<bool> ErrorState = ATOMIC_VAR_INIT(false);
     std::shared_ptr<std::thread> Thread;
 
+    // Time of the capture failure being recovered from, or 0
+    std::atomic<uint64_t> RecoveryStartUsec = ATOMIC_VAR_INIT(0);
+
+    std::atomic<int> ViewerCount = ATOMIC_VAR_INIT(kViewerCountUnknown);
+
+    // Time the video was resumed for a new viewer, or 0
+    std::atomic<uint64_t> ResumeStartUsec = ATOMIC_VAR_INIT(0);
+
     PiplineStatistics Stats;
+    FrameTimingStats Timings;
+    FlightRecorder Recorder;
+    PipelineMetrics Metrics;
 
     // Raw format image pool
     FramePool RawPool;
@@ -157,6 +552,62 @@ protected:
     void Start();
     void Stop();
     void Loop();
+
+    // Frames queued for the decoder and the main encoder
+    int GetQueueDepth() const;
+
+    bool StartCapture();
+
+    /*
+        Re-open only the capture device, keeping the encoder and the stage
+        threads running.  This recovers from an unplugged capture card or a
+        source resolution change much faster than restarting everything.
+    */
+    bool RestartCapture();
+
+    // Configure and connect the stages from Config
+    void BuildGraph();
+
+    // Called periodically from Loop() to feed the overload controller
+    void UpdateOverload();
+    void UpdateThermal();
+    void ApplyOverloadLevel(const OverloadLevel& level);
+
+    // Apply the requested encoder settings of an output, adjusted for the
+    // overload level.  Requires EncoderSettingsLock
+    bool ApplyEncoderSettings(VideoOutput& out);
+
+    // JPEG scale denominator for the requested and overload decode scales
+    int GetDecodeScale(int width, int height) const;
+
+    // Fill in the dirty tiles of a frame converted from YUYV
+    void DetectRawChanges(const std::shared_ptr<Frame>& frame);
+
+    // Returns true if the frame should be passed to the encoder
+    bool ShouldEncode(const Frame& frame);
+
+    // Configure the stages of one output
+    void BuildOutput(VideoOutput& output);
+
+    /*
+        Encode a frame with the encoder of the output.  Returns the encoded
+        video, which is empty if the frame produced no output, or nullptr on
+        error, like MmalEncoder::Encode().
+
+        Tests override this to run the stages without the hardware encoder.
+    */
+    virtual std::shared_ptr<std::vector<uint8_t>> EncodeImage(
+        VideoOutput& out,
+        const std::shared_ptr<Frame>& frame,
+        bool force_keyframe,
+        const QpOffsetMap* qp_map);
+
+    // Stage handlers
+    void DecodeFrame(CaptureMessage& message, StageOutput<RawFrameMessage>& output);
+    void ScaleFrame(VideoOutput& out, RawFrameMessage& message, StageOutput<RawFrameMessage>& output);
+    void EncodeFrame(VideoOutput& out, RawFrameMessage& message, StageOutput<VideoPicture>& output);
+    void PaceVideo(VideoOutput& out, VideoPicture& picture, StageOutput<VideoPicture>& output);
+    void DeliverVideo(VideoOutput& out, VideoPicture& picture, StageOutput<NoMessage>& output);
 };
 
 
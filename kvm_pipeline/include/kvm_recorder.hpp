@@ -0,0 +1,231 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Flight recorder
+
+    By the time the pipeline logs "No frames produced" or the capture device
+    logs "Camera has not been producing frames", the history that explains
+    the problem is gone.  The flight recorder keeps the last
+    kFlightRecorderEvents per-frame and per-input events in memory: encoded
+    sizes, stage times, queue depths, drops, errors and HID writes.
+
+    When it sees one of these, it writes the events from the last
+    kFlightRecorderSeconds to a file on tmpfs:
+
+    + Stall: No frame delivered for kFlightStallUsec while video is wanted
+    + Decode failures: kFlightDecodeFailureBurst failures within
+      kFlightDecodeFailureWindowUsec
+    + Encoder error
+
+    Events are recorded by the pipeline and input threads, and the file is
+    written by TryPersist() from the pipeline monitor thread.  At most one
+    file is written every kFlightMinPersistIntervalUsec, and the file names
+    cycle through kFlightMaxFiles slots so tmpfs does not fill up.
+
+    kvm_flight_summary prints a summary of a file.
+
+    File format (little-endian):
+
+        <Magic(4 bytes)> <Version(4 bytes)> <Trigger(4 bytes)> <EventCount(4 bytes)>
+        <TriggerUsec(8 bytes)> <PersistUsec(8 bytes)>
+        Repeated EventCount times: <FlightEvent(kFlightEventBytes bytes)>
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_timing.hpp"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Events kept in memory.  30 seconds of video and mouse input at 125 Hz
+// fit with room to spare
+static const int kFlightRecorderEvents = 16384;
+
+// Length of the history written to a file
+static const int kFlightRecorderSeconds = 30;
+
+// tmpfs, so writing a file does not wear the SD card
+static const char* const kFlightRecorderDir = "/dev/shm";
+
+static const uint64_t kFlightStallUsec = 3 * 1000 * 1000; // 3 seconds
+static const int kFlightDecodeFailureBurst = 5;
+static const uint64_t kFlightDecodeFailureWindowUsec = 1000 * 1000; // 1 second
+static const uint64_t kFlightMinPersistIntervalUsec = 60 * 1000 * 1000; // 60 seconds
+static const int kFlightMaxFiles = 8;
+
+static const uint32_t kFlightFileMagic = 0x5246564b; // "KVFR"
+static const uint32_t kFlightFileVersion = 1;
+static const int kFlightHeaderBytes = 32;
+static const int kFlightEventBytes = 44;
+
+
+//------------------------------------------------------------------------------
+// FlightEvent
+
+enum class FlightEventType : uint8_t
+{
+    Frame,          // Picture delivered to the application
+    Drop,           // Frame dropped, with a FlightDropReason
+    DecodeError,    // Capture frame could not be decoded
+    EncodeError,    // Encoder failed
+    Keyboard,       // Keyboard report written to the HID device
+    Mouse,          // Mouse report written to the HID device
+
+    Count
+};
+
+const char* FlightEventTypeToString(FlightEventType type);
+
+enum class FlightDropReason : uint8_t
+{
+    Decimated,      // Overload controller keeps only some captured frames
+    Backpressure,   // Decoder skipped a frame no output could take in time
+    EncoderBusy,    // Scaler skipped a frame the encoder could not take in time
+    ScalerQueue,    // Scaler queue was full
+    EncoderQueue,   // Encoder queue was full
+
+    Count
+};
+
+const char* FlightDropReasonToString(FlightDropReason reason);
+
+struct FlightEvent
+{
+    // GetTimeUsec() when the event was recorded
+    uint64_t TimeUsec = 0;
+
+    // Frame number from the capture device, or 0 for input events
+    uint64_t FrameId = 0;
+
+    FlightEventType Type = FlightEventType::Frame;
+
+    // Frame: 1 for keyframes.  Drop: FlightDropReason.
+    // Keyboard and Mouse: 1 if the write failed
+    uint8_t Detail = 0;
+
+    // Frames queued for the decoder and main encoder
+    uint16_t QueueDepth = 0;
+
+    // Frame: Picture bytes.  DecodeError: Capture bytes.
+    // Keyboard and Mouse: Report bytes
+    uint32_t Bytes = 0;
+
+    // Frame: Stage times, or 0 if unknown
+    uint32_t CaptureQueueUsec = 0;  // Capture -> Dequeue
+    uint32_t DecodeUsec = 0;        // Decode start -> end
+    uint32_t EncodeUsec = 0;        // Encode start -> end
+    uint32_t DeliveryUsec = 0;      // Encode end -> Relay
+
+    // Frame: Capture -> Relay.  Keyboard and Mouse: Time to write the report
+    uint32_t LatencyUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// FlightRecord
+
+enum class FlightTrigger : uint32_t
+{
+    None,
+    Stall,
+    DecodeFailures,
+    EncoderError,
+
+    Count
+};
+
+const char* FlightTriggerToString(FlightTrigger trigger);
+
+// Contents of a flight recorder file
+struct FlightRecord
+{
+    FlightTrigger Trigger = FlightTrigger::None;
+    uint64_t TriggerUsec = 0;
+    uint64_t PersistUsec = 0;
+
+    // Oldest first
+    std::vector<FlightEvent> Events;
+};
+
+bool WriteFlightRecord(const std::string& path, const FlightRecord& record);
+bool ReadFlightRecord(const std::string& path, FlightRecord& record);
+
+
+//------------------------------------------------------------------------------
+// FlightRecorder
+
+class FlightRecorder
+{
+public:
+    FlightRecorder();
+
+    // Thread-safe: Picture delivered to the application
+    void RecordFrame(const FrameTiming& timing, int bytes, bool keyframe, int queue_depth);
+
+    // Thread-safe: Frame dropped before it was delivered
+    void RecordDrop(FlightDropReason reason, uint64_t frame_id, int queue_depth);
+
+    // Thread-safe: Triggers a dump on a burst of failures
+    void RecordDecodeError(uint64_t frame_id, int bytes);
+
+    // Thread-safe: Triggers a dump
+    void RecordEncodeError(uint64_t frame_id);
+
+    // Thread-safe: Keyboard or Mouse report written to the HID device
+    void RecordInput(FlightEventType type, int bytes, uint64_t write_usec, bool success);
+
+    // Trigger a dump if no frame was delivered for kFlightStallUsec while
+    // active.  The stall timer starts over while inactive
+    void CheckStall(uint64_t now_usec, bool active);
+
+    // Ask for a dump.  Ignored if a dump is already pending
+    void Trigger(FlightTrigger trigger);
+
+    // Thread-safe: True if a dump is waiting for TryPersist()
+    bool IsTriggered() const;
+
+    // If a dump was triggered, write it to dir and return its path.
+    // Otherwise, or if the last dump was too recent, returns an empty string
+    std::string TryPersist(const std::string& dir = kFlightRecorderDir);
+
+    // Thread-safe: Events recorded since the given time, oldest first
+    void GetEvents(uint64_t since_usec, std::vector<FlightEvent>& events) const;
+
+private:
+    mutable std::mutex Lock;
+
+    std::vector<FlightEvent> Events;
+    uint64_t EventCount = 0;
+
+    // Ring of recent decode failure times
+    uint64_t DecodeFailureUsec[kFlightDecodeFailureBurst] = {};
+    unsigned DecodeFailureCount = 0;
+
+    // Stall detection
+    uint64_t LastFrameUsec = 0;
+    uint64_t ActiveStartUsec = 0;
+    bool StallTriggered = false;
+
+    FlightTrigger PendingTrigger = FlightTrigger::None;
+    uint64_t PendingTriggerUsec = 0;
+
+    // Only accessed by TryPersist()
+    uint64_t LastPersistUsec = 0;
+    unsigned NextFileSlot = 0;
+    FlightRecord PersistRecord;
+
+    void Record(const FlightEvent& event);
+    void TriggerLocked(FlightTrigger trigger, uint64_t now_usec);
+};
+
+
+} // namespace kvm
@@ -0,0 +1,651 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Pipeline stage graph
+
+    A pipeline is a graph of stages connected by typed messages.  Each stage
+    has a handler that takes one input message and pushes any number of
+    output messages to the stages connected downstream.  Connecting stages
+    with mismatched message types does not compile.
+
+    StageOptions select how each stage runs:
+
+    + Placement: On its own thread behind a lock-free queue, or inline on the
+      thread of the upstream stage, which suits cheap stages like taps.
+    + Policy: What happens to new messages when the stage falls behind.
+    + Enabled: Disabled stages pass their input straight to the stages
+      downstream, without a thread or a queue, so optional stages cost
+      nothing while they are off.  Only stages with the same input and
+      output type can be bypassed like this.
+
+    Threaded stages use a single-producer queue, so each one must be fed from
+    a single upstream thread.  Messages pushed to a stage that is not running
+    are dropped, so buffers are not stranded in a queue nobody drains.
+
+    Backpressure: Each stage publishes its queue occupancy and its expected
+    service time (a moving average of its run time).  Before doing expensive
+    work, a stage can ask its outputs with CanAccept() whether the result
+    would be queued or dropped, and skip the work if it would be dropped.
+    Under overload the pipeline then runs at a lower frame rate instead of
+    spending CPU on frames that never ship.
+
+    PipelineGraph starts and stops a set of stages together.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_queue.hpp"
+#include "kvm_histogram.hpp"
+
+#include <atomic>
+#include <type_traits>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Maximum number of messages waiting for each stage
+static const int kPipelineQueueDepth = 4;
+
+// Ring buffer size, leaving room for DropOldest to overfill the queue
+static const int kPipelineQueueCapacity = kPipelineQueueDepth * 2;
+
+// Weight of the latest run time in the expected service time, as 1/N
+static const int kServiceTimeSmoothing = 8;
+
+enum class QueuePolicy
+{
+    DropNewest, // Drop incoming messages while the queue is full
+    DropOldest, // Drop the oldest queued messages to make room
+    LatestWins, // Only process the most recent message, dropping older ones
+    Block,      // Wait in the producer until there is room
+};
+
+const char* QueuePolicyToString(QueuePolicy policy);
+
+enum class StagePlacement
+{
+    Thread, // Dedicated thread behind a queue
+    Inline, // Runs on the thread that pushes to it
+};
+
+struct StageOptions
+{
+    QueuePolicy Policy = QueuePolicy::DropNewest;
+    StagePlacement Placement = StagePlacement::Thread;
+    bool Enabled = true;
+};
+
+
+//------------------------------------------------------------------------------
+// PipelineStageStats
+
+/*
+    Timing for one pipeline stage, reported periodically:
+    Handoff is the time from queueing a message until the stage starts on it,
+    and Run is the time the stage spends processing it.  Both are kept in
+    histograms so the report includes p99 as well as the average and max.
+*/
+class PipelineStageStats
+{
+public:
+    void Reset(const std::string& name, QueuePolicy policy);
+
+    // Called from the stage thread
+    void OnMessage(uint64_t queued_usec, uint64_t start_usec, uint64_t end_usec);
+
+    // Called from either thread
+    void OnDrop();
+
+protected:
+    std::string Name;
+    QueuePolicy Policy = QueuePolicy::DropNewest;
+
+    int Count = 0;
+    int64_t TotalUsec = 0;
+    int64_t FastestUsec = 0;
+    int64_t SlowestUsec = 0;
+
+    int64_t TotalHandoffUsec = 0;
+    int64_t SlowestHandoffUsec = 0;
+
+    LatencyHistogram RunHistogram;
+    LatencyHistogram HandoffHistogram;
+
+    std::atomic<int> DropCount = ATOMIC_VAR_INIT(0);
+
+    uint64_t LastReportUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// PipelineStage
+
+/*
+    Thread that processes messages of type T from one producer thread.
+
+    Messages are passed through a lock-free ring buffer, and the stage thread
+    sleeps on a futex while the ring is empty.  The handler is set once at
+    startup, so passing a message does not allocate or lock anything.
+
+    Dropped messages are passed to the optional `dropped` handler, so any
+    buffers they hold can be returned to their pools.
+*/
+template<typename T>
+class PipelineStage
+{
+public:
+    ~PipelineStage()
+    {
+        Shutdown();
+    }
+
+    void Initialize(
+        const std::string& name,
+        std::function<void(T&)> handler,
+        QueuePolicy policy = QueuePolicy::DropNewest,
+        std::function<void(T&)> dropped = nullptr)
+    {
+        Name = name;
+        Handler = handler;
+        Dropped = dropped;
+        Policy = policy;
+        Stats.Reset(name, policy);
+
+        Terminated = false;
+        Thread = std::make_shared<std::thread>(&PipelineStage::Loop, this);
+    }
+
+    void Shutdown()
+    {
+        Terminated = true;
+        Wake.Signal();
+        SpaceWake.Signal();
+        JoinThread(Thread);
+
+        // A push that saw the stage running may still be queueing its
+        // message, so wait for it before the drain instead of stranding it
+        while (ActivePushes > 0) {
+            SpaceWake.Signal();
+            std::this_thread::yield();
+        }
+
+        // Release anything left in the queue
+        Slot slot;
+        while (Queue.Pop(slot)) {
+            Discard(slot.Message);
+        }
+    }
+
+    bool IsTerminated() const
+    {
+        return Terminated;
+    }
+
+    /*
+        Queue a message for the stage thread.  Must always be called from the
+        same producer thread, or serialized by the caller.
+
+        Returns false if the message was dropped, because the stage fell too
+        far behind or is shut down.
+    */
+    bool Push(T&& message)
+    {
+        ++ActivePushes;
+        const bool queued = Enqueue(message);
+        --ActivePushes;
+        return queued;
+    }
+
+    /*
+        Returns true if a message pushed after delay_usec would be queued,
+        judging by the queue occupancy and the expected service time.
+        Only DropNewest drops new messages, so other policies always accept.
+        Called from the producer thread.
+    */
+    bool CanAccept(uint64_t delay_usec) const
+    {
+        if (Policy != QueuePolicy::DropNewest) {
+            return true;
+        }
+
+        const int queued = Queue.Size();
+        if (queued < kPipelineQueueDepth) {
+            return true;
+        }
+
+        const uint32_t service_usec = ServiceUsec;
+        if (service_usec == 0) {
+            return false;
+        }
+
+        // Messages the stage will finish while the producer works
+        const uint64_t drained = delay_usec / service_usec;
+        return static_cast<int64_t>( queued ) - static_cast<int64_t>( drained ) < kPipelineQueueDepth;
+    }
+
+    // Number of messages waiting for the stage
+    int GetQueuedCount() const
+    {
+        return Queue.Size();
+    }
+
+    // Expected time to process one message, or 0 if unknown
+    uint32_t GetServiceUsec() const
+    {
+        return ServiceUsec;
+    }
+
+protected:
+    struct Slot
+    {
+        T Message;
+        uint64_t QueuedUsec = 0;
+    };
+
+    std::string Name;
+    std::function<void(T&)> Handler;
+    std::function<void(T&)> Dropped;
+    QueuePolicy Policy = QueuePolicy::DropNewest;
+
+    SpscQueue<Slot, kPipelineQueueCapacity> Queue;
+
+    // Signalled when a message is queued
+    WakeEvent Wake;
+
+    // Signalled when a message is dequeued, for QueuePolicy::Block
+    WakeEvent SpaceWake;
+
+    PipelineStageStats Stats;
+
+    // Moving average of the handler run time, written by the stage thread
+    std::atomic<uint32_t> ServiceUsec = ATOMIC_VAR_INIT(0);
+
+    // True until Initialize() and after Shutdown()
+    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(true);
+    std::shared_ptr<std::thread> Thread;
+
+    // Number of Push() calls in progress, which Shutdown() waits for
+    std::atomic<int> ActivePushes = ATOMIC_VAR_INIT(0);
+
+    bool Enqueue(T& message)
+    {
+        if (Terminated) {
+            Discard(message);
+            return false;
+        }
+
+        // DropOldest may overfill the queue, and the stage thread trims it
+        const int limit = (Policy == QueuePolicy::DropOldest) ? kPipelineQueueCapacity : kPipelineQueueDepth;
+
+        while (Queue.Size() >= limit)
+        {
+            if (Policy != QueuePolicy::Block || Terminated) {
+                Drop(message);
+                return false;
+            }
+            SpaceWake.Wait(100);
+        }
+
+        Slot slot;
+        slot.Message = std::move(message);
+        slot.QueuedUsec = GetTimeUsec();
+
+        if (!Queue.Push(std::move(slot))) {
+            Drop(slot.Message);
+            return false;
+        }
+        Wake.Signal();
+        return true;
+    }
+
+    void UpdateServiceTime(uint64_t run_usec)
+    {
+        const uint32_t previous = ServiceUsec;
+        const uint32_t latest = static_cast<uint32_t>( run_usec );
+        if (previous == 0) {
+            ServiceUsec = latest;
+        } else {
+            ServiceUsec = static_cast<uint32_t>(
+                (previous * (uint64_t)(kServiceTimeSmoothing - 1) + latest) / kServiceTimeSmoothing );
+        }
+    }
+
+    void Drop(T& message)
+    {
+        Stats.OnDrop();
+        Discard(message);
+    }
+
+    // Release a message without counting it as dropped
+    void Discard(T& message)
+    {
+        if (Dropped) {
+            Dropped(message);
+        }
+        message = T();
+    }
+
+    // Pop the next message to process according to the policy
+    bool PopNext(Slot& slot)
+    {
+        if (!Queue.Pop(slot)) {
+            return false;
+        }
+
+        if (Policy == QueuePolicy::LatestWins) {
+            Slot newer;
+            while (Queue.Pop(newer)) {
+                Drop(slot.Message);
+                slot = std::move(newer);
+            }
+        }
+        else if (Policy == QueuePolicy::DropOldest) {
+            while (Queue.Size() >= kPipelineQueueDepth) {
+                Drop(slot.Message);
+                Queue.Pop(slot);
+            }
+        }
+
+        if (Policy == QueuePolicy::Block) {
+            SpaceWake.Signal();
+        }
+        return true;
+    }
+
+    void Loop()
+    {
+        SetCurrentThreadName(Name.c_str());
+
+        Slot slot;
+        while (!Terminated)
+        {
+            if (!PopNext(slot)) {
+                Wake.Wait(100);
+                continue;
+            }
+
+            const uint64_t t0 = GetTimeUsec();
+
+            Handler(slot.Message);
+
+            const uint64_t t1 = GetTimeUsec();
+
+            // Release references held by the message before sleeping
+            slot.Message = T();
+
+            UpdateServiceTime(t1 - t0);
+            Stats.OnMessage(slot.QueuedUsec, t0, t1);
+        }
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Stage Connections
+
+// Output type of stages that do not produce messages
+struct NoMessage
+{
+};
+
+// Receives messages of type T
+template<typename T>
+class StageInput
+{
+public:
+    virtual ~StageInput()
+    {
+    }
+
+    virtual void Push(T&& message) = 0;
+
+    // Returns true if a message pushed after delay_usec would not be dropped
+    virtual bool CanAccept(uint64_t delay_usec) const = 0;
+};
+
+// Sends messages of type T to every connected stage
+template<typename T>
+class StageOutput
+{
+public:
+    void Connect(StageInput<T>* next)
+    {
+        Next.push_back(next);
+    }
+
+    void Disconnect()
+    {
+        Next.clear();
+    }
+
+    bool IsConnected() const
+    {
+        return !Next.empty();
+    }
+
+    /*
+        Returns true if any connected stage would accept a message pushed
+        after delay_usec, so work producing the message is not wasted.
+    */
+    bool CanAccept(uint64_t delay_usec) const
+    {
+        if (Next.empty()) {
+            return true;
+        }
+        for (const StageInput<T>* next : Next) {
+            if (next->CanAccept(delay_usec)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Push(T&& message)
+    {
+        const size_t count = Next.size();
+        if (count == 0) {
+            return;
+        }
+
+        // Each extra stage gets a copy, which for shared_ptr messages only
+        // adds a reference
+        for (size_t i = 0; i + 1 < count; ++i) {
+            T copy = message;
+            Next[i]->Push(std::move(copy));
+        }
+        Next[count - 1]->Push(std::move(message));
+    }
+
+protected:
+    std::vector<StageInput<T>*> Next;
+};
+
+
+//------------------------------------------------------------------------------
+// GraphStage
+
+// Log that a stage was configured disabled but cannot be bypassed
+void WarnStageNotBypassable(const std::string& name);
+
+class GraphStageBase
+{
+public:
+    virtual ~GraphStageBase()
+    {
+    }
+
+    virtual const std::string& GetName() const = 0;
+    virtual void Start() = 0;
+    virtual void Stop() = 0;
+};
+
+// Forward a message from a bypassed stage when the types match
+template<typename T>
+inline bool BypassStage(T& message, StageOutput<T>& output)
+{
+    output.Push(std::move(message));
+    return true;
+}
+template<typename In, typename Out>
+inline bool BypassStage(In& /*message*/, StageOutput<Out>& /*output*/)
+{
+    return false;
+}
+
+template<typename In, typename Out>
+class GraphStage : public GraphStageBase, public StageInput<In>
+{
+public:
+    typedef std::function<void(In& input, StageOutput<Out>& output)> HandlerT;
+    typedef std::function<void(In& input)> DroppedT;
+
+    ~GraphStage()
+    {
+        Stop();
+    }
+
+    // Set up the stage before connecting it or starting the graph
+    void Configure(
+        const std::string& name,
+        const StageOptions& options,
+        HandlerT handler,
+        DroppedT dropped = nullptr)
+    {
+        Name = name;
+        Options = options;
+        Handler = handler;
+        Dropped = dropped;
+        Output.Disconnect();
+
+        if (!Options.Enabled && !std::is_same<In, Out>::value) {
+            // Input cannot be forwarded as output: Keep the stage running
+            WarnStageNotBypassable(name);
+            Options.Enabled = true;
+        }
+    }
+
+    // Send the output of this stage to the next stage
+    template<typename NextOut>
+    void Connect(GraphStage<Out, NextOut>& next)
+    {
+        Output.Connect(&next);
+    }
+
+    const std::string& GetName() const override
+    {
+        return Name;
+    }
+
+    bool IsEnabled() const
+    {
+        return Options.Enabled;
+    }
+
+    void Start() override
+    {
+        if (Options.Enabled && Options.Placement == StagePlacement::Thread) {
+            Worker.Initialize(Name, [this](In& message) {
+                Handler(message, Output);
+            }, Options.Policy, Dropped);
+        }
+        Running = true;
+    }
+
+    void Stop() override
+    {
+        Running = false;
+        Worker.Shutdown();
+    }
+
+    bool IsRunning() const
+    {
+        return Running;
+    }
+
+    // Messages pushed while the stage is stopped are dropped
+    void Push(In&& message) override
+    {
+        if (!Running) {
+            if (Dropped) {
+                Dropped(message);
+            }
+            message = In();
+        } else if (!Options.Enabled) {
+            BypassStage(message, Output);
+        } else if (Options.Placement == StagePlacement::Inline) {
+            Handler(message, Output);
+        } else {
+            Worker.Push(std::move(message));
+        }
+    }
+
+    bool CanAccept(uint64_t delay_usec) const override
+    {
+        // Bypassed and inline stages hand messages straight downstream
+        if (!Options.Enabled || Options.Placement == StagePlacement::Inline) {
+            return Output.CanAccept(delay_usec);
+        }
+        return Worker.CanAccept(delay_usec);
+    }
+
+    // Expected time for the stage thread to process one message, or 0
+    uint32_t GetServiceUsec() const
+    {
+        return Worker.GetServiceUsec();
+    }
+
+    // Number of messages waiting for the stage thread
+    int GetQueuedCount() const
+    {
+        return Worker.GetQueuedCount();
+    }
+
+protected:
+    std::string Name;
+    StageOptions Options;
+    HandlerT Handler;
+    DroppedT Dropped;
+
+    StageOutput<Out> Output;
+    PipelineStage<In> Worker;
+
+    std::atomic<bool> Running = ATOMIC_VAR_INIT(false);
+};
+
+
+//------------------------------------------------------------------------------
+// PipelineGraph
+
+/*
+    Starts and stops a set of stages together.
+
+    Add stages from upstream to downstream: Start() starts them in reverse
+    order so every consumer is running before its producer, and Stop() stops
+    them in order so producers stop before their consumers.
+*/
+class PipelineGraph
+{
+public:
+    void Add(GraphStageBase* stage)
+    {
+        Stages.push_back(stage);
+    }
+
+    void Clear()
+    {
+        Stages.clear();
+    }
+
+    void Start();
+    void Stop();
+
+protected:
+    std::vector<GraphStageBase*> Stages;
+};
+
+
+} // namespace kvm
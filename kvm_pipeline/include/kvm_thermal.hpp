@@ -0,0 +1,151 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Thermal governor
+
+    A fanless Raspberry Pi 4 decoding 1080p30 around the clock heats up until
+    the firmware throttles the ARM clock at 80 C, and then every stage slows
+    down at once.  The governor reads the SoC temperature and CPU clock from
+    sysfs and sets a minimum level for the overload controller (see
+    kvm_overload.hpp) before the firmware steps in:
+
+        State      Enter at                     Minimum level
+        Normal     -                            0
+        Warm       WarmMillidegrees             1 (half frame rate)
+        Hot        HotMillidegrees              2 (and half decode scale)
+        Throttled  Firmware reports throttling  3 (quarter frame rate)
+
+    States step back down one at a time once the temperature is
+    HysteresisMillidegrees below the threshold and the state has been held
+    for kThermalHoldUsec.  The overload controller then restores quality
+    as its own load checks allow.
+
+    Throttling is read from the firmware get_throttled file when it exists.
+    Otherwise the CPU clock below its maximum counts as throttling, but only
+    while Warm or hotter, because an idle CPU also clocks down.
+
+    The sysfs paths are settings, so tests can point them at fake files.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+
+#include <mutex>
+#include <string>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Interval between sysfs reads
+static const uint64_t kThermalIntervalUsec = 2 * 1000 * 1000; // 2 seconds
+
+// Shortest time in a state before stepping down
+static const uint64_t kThermalHoldUsec = 30 * 1000 * 1000; // 30 seconds
+
+enum class ThermalState
+{
+    Unknown,   // Temperature cannot be read
+    Normal,
+    Warm,
+    Hot,
+    Throttled,
+};
+
+const char* ThermalStateToString(ThermalState state);
+
+
+//------------------------------------------------------------------------------
+// ThermalSettings
+
+struct ThermalSettings
+{
+    bool Enabled = true;
+
+    // SoC temperature in millidegrees C
+    std::string TemperaturePath = "/sys/class/thermal/thermal_zone0/temp";
+
+    // Current and maximum CPU clock in KHz
+    std::string CurrentFreqPath = "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+    std::string MaxFreqPath = "/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq";
+
+    // Raspberry Pi firmware throttle flags in hex, if available
+    std::string ThrottledPath = "/sys/devices/platform/soc/soc:firmware/get_throttled";
+
+    int WarmMillidegrees = 70000;
+    int HotMillidegrees = 75000;
+    int HysteresisMillidegrees = 5000;
+
+    bool IsValid() const
+    {
+        return WarmMillidegrees < HotMillidegrees && HysteresisMillidegrees >= 0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// ThermalStatus
+
+struct ThermalStatus
+{
+    ThermalState State = ThermalState::Unknown;
+
+    // Latest readings, or -1 if unavailable
+    int TemperatureMillidegrees = -1;
+    int CurrentFreqKhz = -1;
+    int MaxFreqKhz = -1;
+
+    // Throttling reported by the firmware or inferred from the clock
+    bool Throttled = false;
+
+    // Lowest overload level allowed in this state
+    int MinOverloadLevel = 0;
+
+    // Number of times the state went up, since startup
+    int StepUpCount = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// ThermalGovernor
+
+class ThermalGovernor
+{
+public:
+    // Thread-safe
+    bool SetSettings(const ThermalSettings& settings);
+    ThermalSettings GetSettings() const;
+
+    /*
+        Reads sysfs every kThermalIntervalUsec, from one thread.
+        Returns true if the minimum overload level changed.
+    */
+    bool Update(uint64_t now_usec);
+
+    // Thread-safe
+    ThermalStatus GetStatus() const;
+
+protected:
+    mutable std::mutex Lock;
+
+    ThermalSettings Settings;
+    ThermalStatus Status;
+
+    uint64_t LastReadUsec = 0;
+    uint64_t StateStartUsec = 0;
+
+    // Log missing files only once
+    bool ReportedMissing = false;
+
+    // Returns the state the readings call for, ignoring hysteresis
+    ThermalState GetTargetState(int temperature, bool throttled) const;
+
+    // Returns true if the temperature is far enough below the state threshold
+    bool CanLeaveState(ThermalState state, int temperature, bool throttled) const;
+};
+
+
+} // namespace kvm
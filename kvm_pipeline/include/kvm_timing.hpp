@@ -0,0 +1,133 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Per-frame timing
+
+    Each captured frame carries a FrameTiming record through the pipeline
+    messages, and every stage stamps the times it handled the frame:
+
+        Capture     Shutter time reported by the capture device
+        Dequeue     Capture thread received the frame from the device
+        Decode      Decoder thread started and finished the frame
+        Encode      Encoder thread started and finished the frame
+        Parse       Encoder output was split into pictures
+        Packetize   Application callback started, which packetizes the
+                    picture for RTP
+        Relay       Application callback returned, after relaying every
+                    packet to the viewers
+
+    The decoder, encoder, parser and application callback also record the
+    CPU time their thread spent on the frame (CLOCK_THREAD_CPUTIME_ID).
+    A wall time much longer than the CPU time means the thread was waiting,
+    for the hardware encoder or for a CPU core.
+
+    FrameTimingStats collects the delivered records into a LatencyHistogram
+    per interval, and logs p50/p90/p99/max for each one periodically.
+*/
+
+#pragma once
+
+#include "kvm_core.hpp"
+#include "kvm_histogram.hpp"
+
+#include <mutex>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+// CPU time used by the calling thread
+uint64_t GetThreadCpuUsec();
+
+
+//------------------------------------------------------------------------------
+// FrameTiming
+
+struct FrameTiming
+{
+    // Frame number from the capture device
+    uint64_t FrameId = 0;
+
+    // Wall times from GetTimeUsec(), or 0 if the frame did not get there
+    uint64_t CaptureUsec = 0;
+    uint64_t DequeueUsec = 0;
+    uint64_t DecodeStartUsec = 0;
+    uint64_t DecodeEndUsec = 0;
+    uint64_t EncodeStartUsec = 0;
+    uint64_t EncodeEndUsec = 0;
+    uint64_t ParseEndUsec = 0;
+    uint64_t PacketizeUsec = 0;
+    uint64_t RelayUsec = 0;
+
+    // Thread CPU times
+    uint32_t DecodeCpuUsec = 0;
+    uint32_t EncodeCpuUsec = 0;
+    uint32_t ParseCpuUsec = 0;
+    uint32_t PacketizeCpuUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// FrameTimingStats
+
+enum class FrameInterval
+{
+    CaptureQueue,   // Capture -> Dequeue
+    DecodeQueue,    // Dequeue -> Decode start
+    Decode,         // Decode start -> end
+    DecodeCpu,
+    EncodeQueue,    // Decode end -> Encode start, including the scaler
+    Encode,         // Encode start -> end
+    EncodeCpu,
+    Parse,          // Encode end -> Parse end
+    ParseCpu,
+    DeliveryQueue,  // Parse end -> Packetize, including the pacer
+    Packetize,      // Packetize -> Relay
+    PacketizeCpu,
+    EndToEnd,       // Capture -> Relay
+
+    Count
+};
+
+const char* FrameIntervalToString(FrameInterval interval);
+
+struct FrameIntervalSummary
+{
+    uint64_t Count = 0;
+    uint64_t P50Usec = 0;
+    uint64_t P90Usec = 0;
+    uint64_t P99Usec = 0;
+    uint64_t MaxUsec = 0;
+};
+
+// Capture times further than this from the pipeline clock are ignored
+static const uint64_t kFrameTimingMaxCaptureUsec = 10 * 1000 * 1000; // 10 seconds
+
+class FrameTimingStats
+{
+public:
+    // Thread-safe: Add a delivered frame
+    void Record(const FrameTiming& timing);
+
+    // Thread-safe: Summary since the last report
+    FrameIntervalSummary GetSummary(FrameInterval interval) const;
+
+    // Log a summary of each interval every kReportIntervalUsec
+    void TryReport(uint64_t now_usec);
+
+    void Reset();
+
+private:
+    static const uint64_t kReportIntervalUsec = 20 * 1000 * 1000; // 20 seconds
+
+    mutable std::mutex Lock;
+    LatencyHistogram Histograms[(int)FrameInterval::Count];
+    uint64_t LastReportUsec = 0;
+
+    void RecordInterval(FrameInterval interval, uint64_t start_usec, uint64_t end_usec);
+};
+
+
+} // namespace kvm
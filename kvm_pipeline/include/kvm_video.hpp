@@ -7,8 +7,12 @@
 #pragma once
 
 #include "kvm_serializer.hpp"
+#include "kvm_timing.hpp"
 
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace kvm {
 
@@ -19,13 +23,63 @@ namespace kvm {
 // Parses buffer for 00 00 01 start codes
 int FindAnnexBStart(const uint8_t* data, int bytes);
 
-using NaluCallback = std::function<void(uint8_t* data, int bytes)>;
+// Skip the 00 00 01 or 00 00 00 01 start code at the front of a NAL unit
+void SkipAnnexBStart(const uint8_t*& data, int& bytes);
 
-// Invoke the callback for each Annex B NALU for H.264/H.265 video
+static const int kAnnexBPrefixBytes = 3;
+
+/*
+    Invoke callback(data, bytes) for each Annex B NALU for H.264/H.265 video.
+    The callback is a template parameter so that lambdas are called directly
+    rather than through a std::function, which may allocate.
+*/
+template<typename F>
 int EnumerateAnnexBNalus(
     uint8_t* data,
     int bytes,
-    NaluCallback callback);
+    F callback)
+{
+    int nalu_count = 0;
+    int last_offset = -kAnnexBPrefixBytes;
+
+    for (;;)
+    {
+        const int next_start = last_offset + kAnnexBPrefixBytes;
+        int nal_offset = FindAnnexBStart(data + next_start, bytes - next_start);
+
+        if (nal_offset < 0) {
+            break;
+        }
+        nal_offset += next_start;
+
+        if (last_offset >= 0)
+        {
+            uint8_t* nal_data = data + last_offset + kAnnexBPrefixBytes;
+            int nal_bytes = nal_offset - last_offset - kAnnexBPrefixBytes;
+
+            // Check for extra 00
+            if (nal_data[nal_bytes - 1] == 0) {
+                nal_bytes--;
+            }
+
+            callback(nal_data, nal_bytes);
+            ++nalu_count;
+        }
+
+        last_offset = nal_offset;
+    }
+
+    if (last_offset >= 0)
+    {
+        uint8_t* nal_data = data + last_offset + kAnnexBPrefixBytes;
+        const int nal_bytes = bytes - last_offset - kAnnexBPrefixBytes;
+
+        callback(nal_data, nal_bytes);
+        ++nalu_count;
+    }
+
+    return nalu_count;
+}
 
 // Read ExpGolomb format from H.264/HEVC
 unsigned ReadExpGolomb(ReadBitStream& bs);
@@ -54,11 +108,58 @@ static const int kMaxCopyRangesPerPicture = 16;
 struct PictureRanges
 {
     bool Keyframe = false;
-    std::vector<CopyRange> Ranges;
+    CopyRange Ranges[kMaxCopyRangesPerPicture];
     int RangeCount = 0;
     int TotalBytes = 0;
 };
 
+/*
+    Encoded picture as a list of byte ranges (scatter-gather).
+
+    Instead of copying the picture into its own buffer, the ranges point
+    into shared buffers that stay alive as long as the picture does:
+    The parameter sets (SPS, PPS) sent before keyframes, and the encoder
+    output holding the slices.  Each range is one Annex B NAL unit including
+    its start code, so writing out the ranges in order gives an Annex B
+    stream.
+*/
+struct VideoPicture
+{
+    uint64_t FrameNumber = 0;
+    uint64_t ShutterUsec = 0;
+    bool Keyframe = false;
+
+    // Parameter sets to send before the picture, or null
+    std::shared_ptr<std::vector<uint8_t>> Parameters;
+
+    // Encoder output that the slice ranges point into
+    std::shared_ptr<std::vector<uint8_t>> Buffer;
+
+    CopyRange Slices[kMaxCopyRangesPerPicture];
+    int SliceCount = 0;
+    int SliceBytes = 0;
+
+    // Times each stage handled the frame
+    FrameTiming Timing;
+
+    int TotalBytes() const
+    {
+        return SliceBytes + (Parameters ? (int)Parameters->size() : 0);
+    }
+
+    // Call func(data, bytes) for the parameters and then each slice
+    template<typename F>
+    void ForEachRange(F func) const
+    {
+        if (Parameters && !Parameters->empty()) {
+            func(Parameters->data(), (int)Parameters->size());
+        }
+        for (int i = 0; i < SliceCount; ++i) {
+            func(Slices[i].Ptr, Slices[i].Bytes);
+        }
+    }
+};
+
 struct VideoParser
 {
     int NalUnitCount = 0;
@@ -81,6 +182,13 @@ struct VideoParser
         uint8_t* data,
         int bytes);
 
+    /*
+        Copy the parameter sets into params.  The buffer is left alone if it
+        already holds the same bytes, and reused if nothing else references
+        it, so repeated keyframes with unchanged parameters do not allocate.
+    */
+    void CopyParameters(std::shared_ptr<std::vector<uint8_t>>& params) const;
+
 protected:
     void ParseNalUnitH264(uint8_t* data, int bytes);
     void ParseNalUnitHEVC(uint8_t* data, int bytes);
@@ -110,11 +218,13 @@ public:
 
     RtpPayloader();
 
+    /*
+        Packetize a picture.  The encoded data is read directly from the
+        picture's ranges and copied once, into each datagram.
+    */
     void WrapH264Rtp(
-        uint64_t shutter_usec,
-        const uint8_t* data,
-        int bytes,
-        RtpCallback callback);
+        const VideoPicture& picture,
+        const RtpCallback& callback);
 
     std::string GenerateSDP() const;
 
@@ -125,6 +235,13 @@ protected:
 
     mutable std::mutex Lock;
     std::vector<uint8_t> SPS, PPS;
+
+    // Wrap one NAL unit without its start code
+    void WrapNalu(
+        uint32_t pts,
+        const uint8_t* nalu_data,
+        int nalu_bytes,
+        const RtpCallback& callback);
 };
 
 
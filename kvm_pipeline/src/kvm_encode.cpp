@@ -2,11 +2,17 @@
 
 #include "kvm_encode.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_metrics.hpp"
+
+#include <algorithm>
 
 namespace kvm {
 
 static logger::Channel Logger("Encode");
 
+static MetricCounter* BufferOverflows = GetMetricsRegistry().GetCounter("kvm_encoded_buffer_overflows_total",
+    "Encoder output buffers allocated outside the pool because all were in use");
+
 
 //------------------------------------------------------------------------------
 // Tools
@@ -61,9 +67,305 @@ static const char* mmalErrStr(int error)
 }
 
 
+//------------------------------------------------------------------------------
+// EncodedBufferPool
+
+int EncodedBufferPool::GetReserveBytes() const
+{
+    int bytes = WindowMax > PreviousWindowMax ? WindowMax : PreviousWindowMax;
+    if (bytes <= 0) {
+        return kEncodedBufferInitialBytes;
+    }
+
+    // Leave some headroom and round up to 4 KB
+    bytes += bytes / 4;
+    return (bytes + 4095) & ~4095;
+}
+
+void EncodedBufferPool::OnOutputBytes(int bytes)
+{
+    if (WindowMax < bytes) {
+        WindowMax = bytes;
+    }
+    if (++WindowCount >= kEncodedSizeWindow) {
+        PreviousWindowMax = WindowMax;
+        WindowMax = 0;
+        WindowCount = 0;
+    }
+}
+
+std::shared_ptr<std::vector<uint8_t>> EncodedBufferPool::Allocate()
+{
+    const size_t reserve_bytes = static_cast<size_t>( GetReserveBytes() );
+
+    std::shared_ptr<std::vector<uint8_t>> buffer;
+
+    // Find a buffer that no one else is holding.  Only this thread hands out
+    // references, so a use count of 1 cannot go back up behind our back
+    for (auto& pooled : Buffers) {
+        if (IsOnlyReference(pooled)) {
+            buffer = pooled;
+            break;
+        }
+    }
+
+    if (!buffer) {
+        buffer = std::make_shared<std::vector<uint8_t>>();
+        if ((int)Buffers.size() < kEncodedBufferPoolLimit) {
+            Buffers.push_back(buffer);
+        } else {
+            // Happens on every frame while a consumer holds on to buffers,
+            // so only the first one is logged
+            if (OverflowCount++ == 0) {
+                Logger.Warn("All ", kEncodedBufferPoolLimit,
+                    " encoded buffers are in use: Allocating more. Counted in kvm_encoded_buffer_overflows_total");
+            }
+            BufferOverflows->Add();
+        }
+    }
+
+    buffer->clear();
+    if (buffer->capacity() < reserve_bytes) {
+        buffer->reserve(reserve_bytes);
+    }
+    return buffer;
+}
+
+
+//------------------------------------------------------------------------------
+// QpOffsetMap
+
+void QpOffsetMap::Reset(int width, int height)
+{
+    MacroblocksWide = (width + 15) / 16;
+    MacroblocksHigh = (height + 15) / 16;
+    Offsets.assign(MacroblocksWide * MacroblocksHigh, 0);
+    RoiCount = 0;
+    MinOffset = 0;
+}
+
+// Returns true if any tile overlapping the macroblock changed
+static bool IsMacroblockChanged(const Frame& frame, int mb_x, int mb_y)
+{
+    const int row_height = frame.DirtyRowHeight;
+    const int row_count = static_cast<int>( frame.DirtyRows.size() );
+
+    const int first_row = mb_y * 16 / row_height;
+    int last_row = (mb_y * 16 + 15) / row_height;
+    if (last_row >= row_count) {
+        last_row = row_count - 1;
+    }
+
+    for (int row = first_row; row <= last_row; ++row) {
+        if (!frame.DirtyRows[row]) {
+            continue;
+        }
+        // Tiles are the same width as macroblocks
+        if (frame.DirtyTiles.empty() || mb_x >= frame.DirtyTilesWide) {
+            return true;
+        }
+        if (frame.DirtyTiles[row * frame.DirtyTilesWide + mb_x]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BuildQpOffsetMap(const Frame& frame, int cursor_x, int cursor_y, QpOffsetMap& map)
+{
+    map.Reset(frame.Width, frame.Height);
+
+    // Without change tracking the whole frame is treated as changed
+    if (frame.DirtyRows.empty() || frame.DirtyRowHeight <= 0) {
+        std::fill(map.Offsets.begin(), map.Offsets.end(), static_cast<int8_t>( kRoiChangedQpOffset ));
+    } else {
+        int8_t* offsets = map.Offsets.data();
+        for (int mb_y = 0; mb_y < map.MacroblocksHigh; ++mb_y) {
+            for (int mb_x = 0; mb_x < map.MacroblocksWide; ++mb_x) {
+                *offsets++ = IsMacroblockChanged(frame, mb_x, mb_y) ? kRoiChangedQpOffset : 0;
+            }
+        }
+    }
+
+    // Changed macroblocks near the cursor are where the user is working
+    if (cursor_x >= 0 && cursor_y >= 0)
+    {
+        const int center_x = cursor_x / 16, center_y = cursor_y / 16;
+        const int x0 = std::max(0, center_x - kRoiCursorRadius);
+        const int x1 = std::min(map.MacroblocksWide - 1, center_x + kRoiCursorRadius);
+        const int y0 = std::max(0, center_y - kRoiCursorRadius);
+        const int y1 = std::min(map.MacroblocksHigh - 1, center_y + kRoiCursorRadius);
+
+        for (int mb_y = y0; mb_y <= y1; ++mb_y) {
+            for (int mb_x = x0; mb_x <= x1; ++mb_x) {
+                int8_t& offset = map.Offsets[mb_y * map.MacroblocksWide + mb_x];
+                if (offset != 0) {
+                    offset = kRoiCursorQpOffset;
+                }
+            }
+        }
+    }
+
+    for (int8_t offset : map.Offsets) {
+        if (offset < 0) {
+            ++map.RoiCount;
+            if (offset < map.MinOffset) {
+                map.MinOffset = offset;
+            }
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MmalEncoderSettings
+
+bool MmalEncoderSettings::IsValid() const
+{
+    return Kbps >= 100 && Kbps <= 25000 &&
+        Framerate >= 1 && Framerate <= 120 &&
+        GopSize >= 1 &&
+        MinQuant >= 0 && MaxQuant <= 51 && MinQuant <= MaxQuant;
+}
+
+
 //------------------------------------------------------------------------------
 // MmalEncoder
 
+bool MmalEncoder::SetSettings(const MmalEncoderSettings& settings)
+{
+    if (!settings.IsValid()) {
+        Logger.Error("Invalid encoder settings: Kbps=", settings.Kbps, " Framerate=", settings.Framerate,
+            " GopSize=", settings.GopSize, " Quant=", settings.MinQuant, "..", settings.MaxQuant);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> locker(SettingsLock);
+    NextSettings = settings;
+    SettingsChanged = true;
+    return true;
+}
+
+MmalEncoderSettings MmalEncoder::GetSettings() const
+{
+    std::lock_guard<std::mutex> locker(SettingsLock);
+    if (SettingsChanged) {
+        return NextSettings;
+    }
+    return Settings;
+}
+
+void MmalEncoder::UpdateSettings()
+{
+    const MmalEncoderSettings previous = Settings;
+    {
+        std::lock_guard<std::mutex> locker(SettingsLock);
+        Settings = NextSettings;
+        SettingsChanged = false;
+    }
+
+    if (!Encoder) {
+        return; // Applied by Initialize()
+    }
+
+    Logger.Info("Updating encoder settings: Kbps=", Settings.Kbps, " Framerate=", Settings.Framerate,
+        " GopSize=", Settings.GopSize, " Quant=", Settings.MinQuant, "..", Settings.MaxQuant);
+
+    if (!SetRateControl(&previous)) {
+        Logger.Warn("Encoder settings cannot be changed while running: Restarting encoder");
+        Shutdown();
+    }
+}
+
+bool MmalEncoder::SetRateControl(const MmalEncoderSettings* previous)
+{
+    int r;
+
+    if (!previous || previous->Kbps != Settings.Kbps)
+    {
+        // Bitrate
+        r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_BIT_RATE, Settings.Kbps * 1000);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_BIT_RATE failed: ", mmalErrStr(r));
+            return false;
+        }
+
+        // Peak Bitrate
+        // TBD: Not sure if this is used or not
+        r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE, Settings.Kbps * 1000);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE failed: ", mmalErrStr(r));
+            return false;
+        }
+    }
+
+    // The initial frame rate is set by the port format
+    if (previous && previous->Framerate != Settings.Framerate)
+    {
+        MMAL_PARAMETER_FRAME_RATE_T rate{};
+        rate.hdr.id = MMAL_PARAMETER_VIDEO_FRAME_RATE;
+        rate.hdr.size = sizeof(rate);
+        rate.frame_rate.num = Settings.Framerate;
+        rate.frame_rate.den = 1;
+        r = mmal_port_parameter_set(PortOut, &rate.hdr);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set PortOut MMAL_PARAMETER_VIDEO_FRAME_RATE failed: ", mmalErrStr(r));
+            return false;
+        }
+    }
+
+    if (!previous || previous->GopSize != Settings.GopSize)
+    {
+        r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_INTRAPERIOD, Settings.GopSize);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_INTRAPERIOD failed: ", mmalErrStr(r));
+            return false;
+        }
+    }
+
+    if (!previous || previous->MinQuant != Settings.MinQuant || previous->MaxQuant != Settings.MaxQuant)
+    {
+        r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, Settings.MinQuant);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT failed: ", mmalErrStr(r));
+            return false;
+        }
+        r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, Settings.MaxQuant);
+        if (r != MMAL_SUCCESS) {
+            Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT failed: ", mmalErrStr(r));
+            return false;
+        }
+        AppliedMaxQuant = Settings.MaxQuant;
+    }
+
+    return true;
+}
+
+bool MmalEncoder::ApplyQpOffsetMap(const QpOffsetMap* qp_map)
+{
+    int max_quant = Settings.MaxQuant;
+
+    if (qp_map && qp_map->RoiCount > 0)
+    {
+        const int total = qp_map->MacroblocksWide * qp_map->MacroblocksHigh;
+        if (qp_map->RoiCount * 100 <= total * kRoiMaxAreaPercent) {
+            max_quant = std::max(Settings.MinQuant, Settings.MaxQuant + qp_map->MinOffset);
+        }
+    }
+
+    if (max_quant == AppliedMaxQuant) {
+        return true;
+    }
+
+    const int r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, max_quant);
+    if (r != MMAL_SUCCESS) {
+        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT failed: ", mmalErrStr(r));
+        return false;
+    }
+    AppliedMaxQuant = max_quant;
+    return true;
+}
+
 bool MmalEncoder::Initialize(int width, int height, int input_encoding)
 {
     ScopedFunction fail_scope([this]() {
@@ -166,12 +468,6 @@ bool MmalEncoder::Initialize(int width, int height, int input_encoding)
         return false;
     }
 
-    r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_INTRAPERIOD, Settings.GopSize);
-    if (r != MMAL_SUCCESS) {
-        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_INTRAPERIOD failed: ", mmalErrStr(r));
-        return false;
-    }
-
     // MMAL_VIDEO_NALUNITFORMAT_STARTCODES
     // MMAL_VIDEO_NALUNITFORMAT_NALUNITPERBUFFER
     r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_NALUNITFORMAT, MMAL_VIDEO_NALUNITFORMAT_STARTCODES);
@@ -240,19 +536,8 @@ bool MmalEncoder::Initialize(int width, int height, int input_encoding)
     }
 #endif
 
-    // Bitrate
-    // TBD: Not sure if this is used or not
-    r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_BIT_RATE, Settings.Kbps * 1000); // 4 Mbps
-    if (r != MMAL_SUCCESS) {
-        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_BIT_RATE failed: ", mmalErrStr(r));
-        return false;
-    }
-
-    // Peak Bitrate
-    // TBD: Not sure if this is used or not
-    r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE, Settings.Kbps * 1000); // 4 Mbps
-    if (r != MMAL_SUCCESS) {
-        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE failed: ", mmalErrStr(r));
+    // Bitrate, keyframe interval and QP bounds
+    if (!SetRateControl(nullptr)) {
         return false;
     }
 
@@ -295,17 +580,6 @@ bool MmalEncoder::Initialize(int width, int height, int input_encoding)
     //fail |= mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_QP_P, 1);
     //fail |= mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_RC_SLICE_DQUANT, 1);
 
-    r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, 16);
-    if (r != MMAL_SUCCESS) {
-        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT failed: ", mmalErrStr(r));
-        return false;
-    }
-    r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, 34);
-    if (r != MMAL_SUCCESS) {
-        Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT failed: ", mmalErrStr(r));
-        return false;
-    }
-
     r = mmal_port_parameter_set_uint32(PortOut, MMAL_PARAMETER_VIDEO_ENCODE_FRAME_LIMIT_BITS, 1000000);
     if (r != MMAL_SUCCESS) {
         Logger.Error("mmal_port_parameter_set_uint32 PortOut MMAL_PARAMETER_VIDEO_ENCODE_FRAME_LIMIT_BITS failed: ", mmalErrStr(r));
@@ -401,8 +675,22 @@ void MmalEncoder::Shutdown()
     }
 }
 
-uint8_t* MmalEncoder::Encode(const std::shared_ptr<Frame>& frame, bool force_keyframe, int& bytes)
+std::shared_ptr<std::vector<uint8_t>> MmalEncoder::Encode(
+    const std::shared_ptr<Frame>& frame,
+    bool force_keyframe,
+    const QpOffsetMap* qp_map)
 {
+    if (SettingsChanged) {
+        UpdateSettings();
+    }
+
+    // If input resolution changed (e.g. decoder scale was changed):
+    if (Encoder && (frame->Width != Width || frame->Height != Height)) {
+        Logger.Info("Input resolution changed from ", Width, "x", Height, " to ",
+            frame->Width, "x", frame->Height, ": Restarting encoder");
+        Shutdown();
+    }
+
     if (!Encoder) {
         int input_encoding = 0;
         if (frame->Format == PixelFormat::YUV420P) {
@@ -425,6 +713,10 @@ uint8_t* MmalEncoder::Encode(const std::shared_ptr<Frame>& frame, bool force_key
         Logger.Info("MMAL encoder initialized");
     }
 
+    if (!ApplyQpOffsetMap(qp_map)) {
+        return nullptr;
+    }
+
     int r;
 
     if (force_keyframe) {
@@ -435,7 +727,8 @@ uint8_t* MmalEncoder::Encode(const std::shared_ptr<Frame>& frame, bool force_key
         }
     }
 
-    Data.resize(0);
+    std::shared_ptr<std::vector<uint8_t>> output = OutputPool.Allocate();
+    std::vector<uint8_t>& data = *output;
 
     bool eos = false, sent = false;
 
@@ -484,9 +777,9 @@ uint8_t* MmalEncoder::Encode(const std::shared_ptr<Frame>& frame, bool force_key
 
         //Logger.Info("Read video bytes: ", out->length);
 
-        size_t previous_bytes = Data.size();
-        Data.resize(previous_bytes + out->length);
-        memcpy(Data.data() + previous_bytes, out->data, out->length);
+        // Append without zero-filling first.  The pool reserves enough
+        // space that this does not reallocate
+        data.insert(data.end(), out->data, out->data + out->length);
 
         mmal_buffer_header_release(out);
     }
@@ -496,8 +789,8 @@ uint8_t* MmalEncoder::Encode(const std::shared_ptr<Frame>& frame, bool force_key
         Logger.Warn("mmal_port_flush failed: ", mmalErrStr(r));
     }
 
-    bytes = (int)Data.size();
-    return Data.data();
+    OutputPool.OnOutputBytes((int)data.size());
+    return output;
 }
 
 
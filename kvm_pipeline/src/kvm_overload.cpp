@@ -0,0 +1,234 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_overload.hpp"
+#include "kvm_logger.hpp"
+
+#include <ctime>
+
+namespace kvm {
+
+static logger::Channel Logger("Overload");
+
+const OverloadLevel kOverloadLevels[kOverloadLevelCount] = {
+    { 1, 1 },
+    { 2, 1 },
+    { 2, 2 },
+    { 4, 2 },
+    { 4, 4 },
+};
+
+uint64_t GetProcessCpuUsec()
+{
+#if defined(__linux__)
+    timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+#else // __linux__
+    return static_cast<uint64_t>( std::clock() ) * 1000000 / CLOCKS_PER_SEC;
+#endif // __linux__
+}
+
+
+//------------------------------------------------------------------------------
+// OverloadController
+
+bool OverloadController::SetSettings(const OverloadSettings& settings)
+{
+    if (!settings.IsValid()) {
+        Logger.Error("Invalid overload settings: TargetLatencyUsec=", settings.TargetLatencyUsec,
+            " CpuCeilingPercent=", settings.CpuCeilingPercent);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Settings = settings;
+    Logger.Info("Overload controller ", settings.Enabled ? "enabled" : "disabled",
+        ": target latency=", settings.TargetLatencyUsec / 1000.f, " msec, CPU ceiling=",
+        settings.CpuCeilingPercent, "%");
+    return true;
+}
+
+OverloadSettings OverloadController::GetSettings() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return Settings;
+}
+
+void OverloadController::Reset()
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    Level = MinLevel;
+    OverloadedIntervals = 0;
+    QuietIntervals = 0;
+    StepUpBackoff = 1;
+    LastStepUpUsec = 0;
+}
+
+bool OverloadController::SetMinLevel(int min_level)
+{
+    if (min_level < 0) {
+        min_level = 0;
+    } else if (min_level >= kOverloadLevelCount) {
+        min_level = kOverloadLevelCount - 1;
+    }
+
+    std::lock_guard<std::mutex> locker(Lock);
+    if (MinLevel == min_level) {
+        return false;
+    }
+    Logger.Info("Minimum level set to ", min_level);
+    MinLevel = min_level;
+    QuietIntervals = 0;
+
+    if (Level >= MinLevel) {
+        return false;
+    }
+    Level = MinLevel;
+    ++StepDownCount;
+
+    const OverloadLevel& level = kOverloadLevels[Level];
+    Logger.Info("Stepping down to level ", Level, " (1/", level.FrameDecimation, " frames, 1/",
+        level.DecodeScale, " decode scale) for the minimum level");
+    return true;
+}
+
+OverloadLevel OverloadController::GetLevel() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return kOverloadLevels[Level];
+}
+
+OverloadMetrics OverloadController::GetMetrics() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    OverloadMetrics metrics;
+    metrics.Level = Level;
+    metrics.MinLevel = MinLevel;
+    metrics.FrameDecimation = kOverloadLevels[Level].FrameDecimation;
+    metrics.DecodeScale = kOverloadLevels[Level].DecodeScale;
+    metrics.StepDownCount = StepDownCount;
+    metrics.StepUpCount = StepUpCount;
+    metrics.Sample = LastSample;
+    return metrics;
+}
+
+const char* OverloadController::GetOverloadReason(const OverloadSample& sample) const
+{
+    if (sample.DroppedFrames > 0) {
+        return "dropped frames";
+    }
+    if (sample.Utilization > kOverloadMaxUtilization) {
+        return "stage busy";
+    }
+    if (sample.QueuedFrames >= kOverloadMaxQueuedFrames) {
+        return "queue backlog";
+    }
+    if (sample.LatencyUsec > Settings.TargetLatencyUsec) {
+        return "latency";
+    }
+    if (sample.CpuPercent > Settings.CpuCeilingPercent) {
+        return "CPU";
+    }
+    return nullptr;
+}
+
+bool OverloadController::CanStepUp(const OverloadSample& sample) const
+{
+    if (Level <= MinLevel) {
+        return false;
+    }
+
+    // Leave room for the latency to grow with the frame size
+    if (sample.LatencyUsec > Settings.TargetLatencyUsec * 3 / 4) {
+        return false;
+    }
+
+    // Cost of the next level up relative to this one: More frames, and
+    // more pixels in each frame
+    const OverloadLevel& current = kOverloadLevels[Level];
+    const OverloadLevel& next = kOverloadLevels[Level - 1];
+    const float frames = current.FrameDecimation / (float)next.FrameDecimation;
+    const float scale = current.DecodeScale / (float)next.DecodeScale;
+    const float cost = frames * scale * scale;
+
+    return sample.CpuPercent * cost <= Settings.CpuCeilingPercent &&
+        sample.Utilization * cost <= kOverloadMaxUtilization;
+}
+
+bool OverloadController::Update(const OverloadSample& sample, uint64_t now_usec)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    LastSample = sample;
+
+    if (!Settings.Enabled) {
+        if (Level != MinLevel) {
+            Logger.Info("Overload controller disabled: Returning to level ", MinLevel);
+            Level = MinLevel;
+            return true;
+        }
+        return false;
+    }
+
+    const char* reason = GetOverloadReason(sample);
+    if (reason) {
+        QuietIntervals = 0;
+        ++OverloadedIntervals;
+    } else {
+        OverloadedIntervals = 0;
+        if (CanStepUp(sample)) {
+            ++QuietIntervals;
+        } else {
+            QuietIntervals = 0;
+        }
+    }
+
+    const int previous = Level;
+
+    if (OverloadedIntervals >= kOverloadStepDownIntervals && Level + 1 < kOverloadLevelCount)
+    {
+        // Back off stepping up again if the last step up did not hold
+        if (LastStepUpUsec != 0 && now_usec - LastStepUpUsec < kOverloadFlapWindowUsec) {
+            StepUpBackoff *= 2;
+            if (StepUpBackoff > kOverloadMaxStepUpBackoff) {
+                StepUpBackoff = kOverloadMaxStepUpBackoff;
+            }
+        } else {
+            StepUpBackoff = 1;
+        }
+
+        ++Level;
+        ++StepDownCount;
+        OverloadedIntervals = 0;
+    }
+    else if (QuietIntervals >= kOverloadStepUpIntervals * StepUpBackoff)
+    {
+        --Level;
+        ++StepUpCount;
+        QuietIntervals = 0;
+        LastStepUpUsec = now_usec;
+    }
+
+    if (Level == previous) {
+        return false;
+    }
+
+    const OverloadLevel& level = kOverloadLevels[Level];
+    if (Level > previous) {
+        Logger.Info("Stepping down to level ", Level, " (1/", level.FrameDecimation, " frames, 1/",
+            level.DecodeScale, " decode scale) due to ", reason, ": latency=", sample.LatencyUsec / 1000.f,
+            " msec cpu=", sample.CpuPercent, "% utilization=", sample.Utilization * 100.f,
+            "% dropped=", sample.DroppedFrames, " queued=", sample.QueuedFrames, ", next step up after ",
+            kOverloadStepUpIntervals * StepUpBackoff, " quiet intervals");
+    } else {
+        Logger.Info("Stepping up to level ", Level, " (1/", level.FrameDecimation, " frames, 1/",
+            level.DecodeScale, " decode scale): latency=", sample.LatencyUsec / 1000.f,
+            " msec cpu=", sample.CpuPercent, "% utilization=", sample.Utilization * 100.f, "%");
+    }
+    return true;
+}
+
+
+} // namespace kvm
@@ -0,0 +1,89 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_pacing.hpp"
+
+#include <algorithm>
+
+namespace kvm {
+
+
+//------------------------------------------------------------------------------
+// FramePacer
+
+void FramePacer::Reset()
+{
+    TargetDelayUsec = 0;
+    LastReleaseUsec = 0;
+    LateCount = 0;
+}
+
+uint64_t FramePacer::Schedule(uint64_t shutter_usec, uint64_t now_usec)
+{
+    // Pass through pictures without a usable capture time
+    if (shutter_usec == 0 || shutter_usec > now_usec ||
+        now_usec - shutter_usec > kPacingMaxLatencyUsec)
+    {
+        return now_usec;
+    }
+
+    const uint64_t latency_usec = now_usec - shutter_usec;
+
+    // Jump up to slow pictures and decay back down
+    if (latency_usec > TargetDelayUsec) {
+        TargetDelayUsec = std::min(latency_usec, MaxDelayUsec);
+    } else {
+        TargetDelayUsec -= (TargetDelayUsec - latency_usec) / kPacingDelaySmoothing;
+    }
+
+    uint64_t release_usec = shutter_usec + TargetDelayUsec;
+    if (release_usec < now_usec) {
+        // Behind schedule: Skip ahead instead of queueing
+        ++LateCount;
+        release_usec = now_usec;
+    }
+
+    // Keep pictures in order and the delay bounded
+    if (release_usec < LastReleaseUsec) {
+        release_usec = std::max(LastReleaseUsec, now_usec);
+    }
+    if (release_usec > now_usec + MaxDelayUsec) {
+        release_usec = now_usec + MaxDelayUsec;
+    }
+
+    LastReleaseUsec = release_usec;
+    return release_usec;
+}
+
+
+//------------------------------------------------------------------------------
+// JitterMeter
+
+void JitterMeter::Reset()
+{
+    LastShutterUsec = 0;
+    LastArrivalUsec = 0;
+    JitterUsec = 0.f;
+    MaxDeviationUsec = 0;
+}
+
+void JitterMeter::OnPicture(uint64_t shutter_usec, uint64_t arrival_usec)
+{
+    if (LastArrivalUsec != 0 && shutter_usec >= LastShutterUsec)
+    {
+        const int64_t arrival_delta = (int64_t)(arrival_usec - LastArrivalUsec);
+        const int64_t shutter_delta = (int64_t)(shutter_usec - LastShutterUsec);
+        const int64_t d = arrival_delta - shutter_delta;
+        const uint64_t deviation = static_cast<uint64_t>( d < 0 ? -d : d );
+
+        JitterUsec += (deviation - JitterUsec) / kJitterSmoothing;
+        if (MaxDeviationUsec < deviation) {
+            MaxDeviationUsec = deviation;
+        }
+    }
+
+    LastShutterUsec = shutter_usec;
+    LastArrivalUsec = arrival_usec;
+}
+
+
+} // namespace kvm
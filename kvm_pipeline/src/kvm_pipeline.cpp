@@ -2,116 +2,165 @@
 
 #include "kvm_pipeline.hpp"
 #include "kvm_logger.hpp"
+#include "kvm_trace.hpp"
+
+#include <algorithm>
+#include <chrono>
 
 namespace kvm {
 
 static logger::Channel Logger("Pipeline");
 
+// Delay between attempts to re-open the capture device
+static const int kCaptureRetryMinMsec = 100;
+static const int kCaptureRetryMaxMsec = 1000;
 
-//------------------------------------------------------------------------------
-// PipelineNode
-
-void PipelineNode::Initialize(const std::string& name, int max_queue_depth)
-{
-    Name = name;
-    MaxQueueDepth = max_queue_depth;
+// Capture to delivery latency above this is from a mismatched clock
+static const int64_t kMaxLatencyUsec = 10 * 1000 * 1000;
 
-    Count = 0;
-    TotalUsec = 0;
-    LastReportUsec = 0;
 
-    Terminated = false;
-    Thread = std::make_shared<std::thread>(&PipelineNode::Loop, this);
-}
-
-void PipelineNode::Shutdown()
+//------------------------------------------------------------------------------
+// PipelineMetrics
+
+// Label values for kvm_video_dropped_frames_total
+static const char* kDropReasonLabels[(int)FlightDropReason::Count] = {
+    "decimated",
+    "backpressure",
+    "encoder_busy",
+    "scaler_queue",
+    "encoder_queue",
+};
+
+PipelineMetrics::PipelineMetrics()
 {
-    Terminated = true;
-    {
-        std::unique_lock<std::mutex> locker(Lock);
-        Condition.notify_all();
+    MetricsRegistry& registry = GetMetricsRegistry();
+
+    CaptureFrames = registry.GetCounter("kvm_capture_frames_total",
+        "Frames captured while a viewer is connected");
+    CaptureBytes = registry.GetCounter("kvm_capture_bytes_total",
+        "Bytes of captured frames while a viewer is connected");
+
+    VideoFrames = registry.GetCounter("kvm_video_frames_total",
+        "Pictures produced by the main encoder");
+    VideoBytes = registry.GetCounter("kvm_video_bytes_total",
+        "Bytes produced by the main encoder");
+    Keyframes = registry.GetCounter("kvm_video_keyframes_total",
+        "Keyframes produced by the main encoder");
+    FrameBytes = registry.GetHistogram("kvm_video_frame_bytes",
+        "Size of encoded frames");
+    KeyframeBytes = registry.GetHistogram("kvm_video_keyframe_bytes",
+        "Size of encoded keyframes");
+    Fps = registry.GetGauge("kvm_video_fps",
+        "Encoded frames per second over the last overload interval");
+    Kbps = registry.GetGauge("kvm_video_kbps",
+        "Encoded kilobits per second over the last overload interval");
+
+    SkippedFrames = registry.GetCounter("kvm_video_skipped_frames_total",
+        "Frames not encoded because the screen did not change");
+    for (int i = 0; i < (int)FlightDropReason::Count; ++i) {
+        DroppedFrames[i] = registry.GetCounter("kvm_video_dropped_frames_total",
+            "Frames dropped before delivery",
+            std::string("reason=\"") + kDropReasonLabels[i] + "\"");
     }
-    JoinThread(Thread);
-
-    QueuePrivate.clear();
-    QueuePublic.clear();
+    DecodeErrors = registry.GetCounter("kvm_decode_errors_total",
+        "Captured frames that failed to decode");
+    EncodeErrors = registry.GetCounter("kvm_encode_errors_total",
+        "Encoder failures, each of which restarts the pipeline");
+
+    DecoderQueue = registry.GetGauge("kvm_queue_depth",
+        "Frames waiting for a pipeline stage", "stage=\"decoder\"");
+    EncoderQueue = registry.GetGauge("kvm_queue_depth",
+        "Frames waiting for a pipeline stage", "stage=\"encoder\"");
+
+    DecodeUsec = registry.GetHistogram("kvm_decode_seconds",
+        "Time to decode a captured frame", "", 1e-6);
+    EncodeUsec = registry.GetHistogram("kvm_encode_seconds",
+        "Time to encode a frame on the main output", "", 1e-6);
+    LatencyUsec = registry.GetHistogram("kvm_end_to_end_seconds",
+        "Capture to delivery latency of the main output", "", 1e-6);
 }
 
-void PipelineNode::Queue(std::function<void()> func)
+
+//------------------------------------------------------------------------------
+// VideoPipeline
+
+VideoPipeline::VideoPipeline()
 {
-    std::unique_lock<std::mutex> locker(Lock);
-    if ((int)QueuePublic.size() >= MaxQueueDepth) {
-        Logger.Error(Name, ": Fell too far behind. Dropping incoming frame!");
-        return;
-    }
-    QueuePublic.push_back(func);
-    Condition.notify_all();
+    // Main output at the decoded resolution
+    Outputs.push_back(std::unique_ptr<VideoOutput>(new VideoOutput));
 }
 
-void PipelineNode::Loop()
+int VideoPipeline::AddOutput(const VideoOutputConfig& config, PiplineCallback callback)
 {
-    SetCurrentThreadName(Name.c_str());
-
-    while (!Terminated)
+    if (config.Width < 0 || config.Height < 0 ||
+        config.Width % 2 != 0 || config.Height % 2 != 0 ||
+        (config.Width == 0) != (config.Height == 0))
     {
-        {
-            // unique_lock used since QueueCondition.wait requires it
-            std::unique_lock<std::mutex> locker(Lock);
-
-            if (QueuePublic.empty() && !Terminated) {
-                Condition.wait(locker);
-            }
+        Logger.Error("AddOutput: Invalid resolution ", config.Width, "x", config.Height);
+        return -1;
+    }
 
-            std::swap(QueuePublic, QueuePrivate);
-        }
+    std::unique_ptr<VideoOutput> output(new VideoOutput);
+    output->Index = static_cast<int>( Outputs.size() );
+    output->Config = config;
+    output->Callback = callback;
+    if (!output->Encoder.SetSettings(config.Encoder)) {
+        return -1;
+    }
 
-        for (auto& func : QueuePrivate)
-        {
-            if (Terminated) {
-                break;
-            }
+    MaxOutputWidth = std::max(MaxOutputWidth, config.Width);
+    MaxOutputHeight = std::max(MaxOutputHeight, config.Height);
 
-            const uint64_t t0 = GetTimeUsec();
+    Logger.Info("Added output ", output->Index, ": ", config.Width, "x", config.Height,
+        " at ", config.Encoder.Kbps, " Kbps");
 
-            func();
+    Outputs.push_back(std::move(output));
+    return Outputs.back()->Index;
+}
 
-            const uint64_t t1 = GetTimeUsec();
-            const int64_t dt = t1 - t0;
+bool VideoPipeline::SetEncoderSettings(const MmalEncoderSettings& settings, int output)
+{
+    if (output < 0 || output >= (int)Outputs.size()) {
+        Logger.Error("SetEncoderSettings: Invalid output ", output);
+        return false;
+    }
 
-            if (Count == 0) {
-                FastestUsec = SlowestUsec = dt;
-                LastReportUsec = t1;
-            } else if (FastestUsec > dt) {
-                FastestUsec = dt;
-            } else if (SlowestUsec < dt) {
-                SlowestUsec = dt;
-            }
-            ++Count;
-            TotalUsec += dt;
-
-            const int64_t report_interval_usec = 20 * 1000 * 1000;
-            if (t1 - LastReportUsec > report_interval_usec) {
-                Logger.Info(Name, ": ", Count, " frames, avg=",
-                    TotalUsec / (float)Count / 1000.f, ", min=",
-                    FastestUsec / 1000.f, ", max=", SlowestUsec / 1000.f, " (msec)");
-
-                Count = 0;
-                TotalUsec = 0;
-                LastReportUsec = t1;
-            }
-        }
+    std::lock_guard<std::mutex> locker(EncoderSettingsLock);
+    VideoOutput& out = *Outputs[output];
+    const MmalEncoderSettings previous = out.Config.Encoder;
+    out.Config.Encoder = settings;
+    if (!ApplyEncoderSettings(out)) {
+        out.Config.Encoder = previous;
+        return false;
+    }
+    return true;
+}
 
-        QueuePrivate.clear();
+MmalEncoderSettings VideoPipeline::GetEncoderSettings(int output) const
+{
+    if (output < 0 || output >= (int)Outputs.size()) {
+        return MmalEncoderSettings();
     }
+
+    std::lock_guard<std::mutex> locker(EncoderSettingsLock);
+    return Outputs[output]->Config.Encoder;
 }
 
+bool VideoPipeline::ApplyEncoderSettings(VideoOutput& out)
+{
+    MmalEncoderSettings settings = out.Config.Encoder;
+    settings.Framerate = std::max(1, settings.Framerate / FrameDecimation);
+    return out.Encoder.SetSettings(settings);
+}
 
-//------------------------------------------------------------------------------
-// VideoPipeline
+bool VideoPipeline::SetOverloadSettings(const OverloadSettings& settings)
+{
+    return Overload.SetSettings(settings);
+}
 
 void VideoPipeline::Initialize(PiplineCallback callback)
 {
-    Callback = callback;
+    Outputs[0]->Callback = callback;
 
     Terminated = false;
     Thread = std::make_shared<std::thread>(&VideoPipeline::Loop, this);
@@ -125,10 +174,45 @@ void VideoPipeline::Loop()
 
     int consecutive_waits = 0;
 
+    uint64_t next_capture_retry_msec = 0;
+    int capture_retry_msec = kCaptureRetryMinMsec;
+
     while (!Terminated)
     {
-        if (ErrorState || Capture.IsError()) {
-            Logger.Info("Capture failure: Stopping pipeline!");
+        // Write the recent frame history before recovering from an error
+        Recorder.CheckStall(GetTimeUsec(), !IsSuspended());
+        Recorder.TryPersist();
+
+        // Capture failures only need the capture device to be re-opened
+        if (!ErrorState && Capture.IsError()) {
+            const uint64_t now_msec = GetTimeMsec();
+            if (RecoveryStartUsec == 0) {
+                Logger.Info("Capture failure: Re-opening capture device");
+                RecoveryStartUsec = GetTimeUsec();
+                next_capture_retry_msec = now_msec;
+                capture_retry_msec = kCaptureRetryMinMsec;
+            }
+
+            if (now_msec >= next_capture_retry_msec) {
+                if (RestartCapture()) {
+                    Logger.Info("Capture device re-opened after ",
+                        (GetTimeUsec() - RecoveryStartUsec) / 1000.f, " msec");
+                } else {
+                    // Retry quickly at first, then back off while unplugged
+                    next_capture_retry_msec = now_msec + capture_retry_msec;
+                    capture_retry_msec *= 2;
+                    if (capture_retry_msec > kCaptureRetryMaxMsec) {
+                        capture_retry_msec = kCaptureRetryMaxMsec;
+                    }
+                }
+            }
+        }
+
+        if (ErrorState) {
+            Logger.Info("Pipeline failure: Stopping pipeline!");
+            if (RecoveryStartUsec == 0) {
+                RecoveryStartUsec = GetTimeUsec();
+            }
             Stop();
 
             uint64_t t1 = GetTimeMsec();
@@ -159,15 +243,33 @@ void VideoPipeline::Loop()
                 break;
             }
 
-            Logger.Info("Capture failure: Restarting pipeline!");
+            Logger.Info("Pipeline failure: Restarting pipeline!");
             Start();
 
             t0 = GetTimeMsec();
         }
 
-        Stats.TryReport();
+        if (!IsSuspended()) {
+            Stats.TryReport();
+            Timings.TryReport(GetTimeUsec());
+        }
+
+        // Write the timeline if a dump was requested with a signal
+        TryWriteRequestedTrace();
+
+        UpdateThermal();
+
+        // Measure only while frames are flowing
+        if (IsSuspended() || Capture.IsError() || ErrorState) {
+            LastOverloadUpdateUsec = 0;
+        } else {
+            UpdateOverload();
+        }
+
+        Metrics.DecoderQueue->Set(DecoderStage.GetQueuedCount());
+        Metrics.EncoderQueue->Set(Outputs[0]->EncoderStage.GetQueuedCount());
 
-        ThreadSleepForMsec(100);
+        ThreadSleepForMsec(Capture.IsError() ? 20 : 100);
     }
 
     Stop();
@@ -179,6 +281,164 @@ void VideoPipeline::Shutdown()
     JoinThread(Thread);
 }
 
+void VideoPipeline::SetDecodeScale(int scale_denom)
+{
+    if (!IsValidJpegScaleDenom(scale_denom)) {
+        Logger.Error("SetDecodeScale: Invalid scale_denom=", scale_denom);
+        return;
+    }
+    Logger.Info("Decode scale set to 1/", scale_denom);
+    DecodeScaleDenom = scale_denom;
+}
+
+void VideoPipeline::SetLumaOnly(bool luma_only)
+{
+    Logger.Info("Luma only ", luma_only ? "enabled" : "disabled");
+    LumaOnly = luma_only;
+}
+
+void VideoPipeline::SetSpecializedJpegDecoder(bool enabled)
+{
+    Logger.Info("Specialized JPEG decoder ", enabled ? "enabled" : "disabled");
+    SpecializedJpegDecoder = enabled;
+}
+
+void VideoPipeline::SetVariableFrameRate(bool enabled)
+{
+    Logger.Info("Variable frame rate ", enabled ? "enabled" : "disabled");
+    VariableFrameRate = enabled;
+}
+
+void VideoPipeline::SetCursorPosition(uint16_t x, uint16_t y)
+{
+    CursorPosition = (static_cast<uint32_t>( x ) << 16) | y;
+}
+
+void VideoPipeline::SetViewerCount(int count)
+{
+    const int previous = ViewerCount.exchange(count);
+
+    if (count == 0 && previous != 0) {
+        Logger.Info("No viewers: Suspending video");
+    }
+    else if (count > 0 && previous == 0) {
+        Logger.Info("Viewer joined: Resuming video");
+        ResumeStartUsec = GetTimeUsec();
+        Stats.OnResume();
+        for (auto& output : Outputs) {
+            output->ForceKeyframe = true;
+        }
+    }
+}
+
+void VideoPipeline::UpdateOverload()
+{
+    const uint64_t now_usec = GetTimeUsec();
+    const uint64_t cpu_usec = GetProcessCpuUsec();
+
+    const uint64_t interval_usec = now_usec - LastOverloadUpdateUsec;
+    if (LastOverloadUpdateUsec != 0 && interval_usec < kOverloadIntervalUsec) {
+        return;
+    }
+
+    const uint64_t latency_total_usec = LatencyTotalUsec.exchange(0);
+    const int latency_count = LatencyCount.exchange(0);
+    const int dropped = DroppedFrames.exchange(0);
+    const int decoded = DecodedFrames.exchange(0);
+    const int encoded = EncodedFrames.exchange(0);
+    const uint64_t encoded_bytes = EncodedBytes.exchange(0);
+
+    // Start a new measurement after a pause
+    if (LastOverloadUpdateUsec == 0) {
+        LastOverloadUpdateUsec = now_usec;
+        LastProcessCpuUsec = cpu_usec;
+        return;
+    }
+
+    OverloadSample sample;
+    if (latency_count > 0) {
+        sample.LatencyUsec = static_cast<int>( latency_total_usec / latency_count );
+    }
+
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    sample.CpuPercent = (cpu_usec - LastProcessCpuUsec) * 100.f / (float)(interval_usec * cores);
+
+    // Run time of the decoder and the main encoder over the interval
+    const VideoOutput& main_output = *Outputs[0];
+    const uint64_t decoder_usec = (uint64_t)DecoderStage.GetServiceUsec() * decoded;
+    const uint64_t encoder_usec = (uint64_t)main_output.EncoderStage.GetServiceUsec() * encoded;
+    sample.Utilization = std::max(decoder_usec, encoder_usec) / (float)interval_usec;
+
+    sample.DroppedFrames = dropped;
+
+    TraceCounter("Video kbps", (int64_t)(encoded_bytes * 8 * 1000 / interval_usec));
+    Metrics.Fps->Set(encoded * 1000000. / interval_usec);
+    Metrics.Kbps->Set(encoded_bytes * 8000. / interval_usec);
+    TraceCounter("Dropped frames", dropped);
+
+    sample.QueuedFrames = DecoderStage.GetQueuedCount();
+    for (auto& output : Outputs) {
+        sample.QueuedFrames = std::max(sample.QueuedFrames, output->EncoderStage.GetQueuedCount());
+    }
+
+    LastOverloadUpdateUsec = now_usec;
+    LastProcessCpuUsec = cpu_usec;
+
+    if (Overload.Update(sample, now_usec)) {
+        ApplyOverloadLevel(Overload.GetLevel());
+    }
+}
+
+int VideoPipeline::GetQueueDepth() const
+{
+    return DecoderStage.GetQueuedCount() + Outputs[0]->EncoderStage.GetQueuedCount();
+}
+
+void VideoPipeline::UpdateThermal()
+{
+    const bool changed = Thermal.Update(GetTimeUsec());
+
+    const ThermalStatus status = Thermal.GetStatus();
+    Stats.SetThermalStatus(status);
+
+    if (changed && Overload.SetMinLevel(status.MinOverloadLevel)) {
+        ApplyOverloadLevel(Overload.GetLevel());
+    }
+}
+
+void VideoPipeline::ApplyOverloadLevel(const OverloadLevel& level)
+{
+    FrameDecimation = level.FrameDecimation;
+    OverloadDecodeScale = level.DecodeScale;
+
+    std::lock_guard<std::mutex> locker(EncoderSettingsLock);
+    for (auto& output : Outputs) {
+        ApplyEncoderSettings(*output);
+    }
+}
+
+int VideoPipeline::GetDecodeScale(int width, int height) const
+{
+    int scale_denom = DecodeScaleDenom * OverloadDecodeScale;
+    while (scale_denom > 1 && !IsValidJpegScaleDenom(scale_denom)) {
+        scale_denom /= 2;
+    }
+
+    // Do not decode smaller than the scaled outputs
+    while (scale_denom > 1 &&
+        (width / scale_denom < MaxOutputWidth || height / scale_denom < MaxOutputHeight))
+    {
+        scale_denom /= 2;
+    }
+    return scale_denom;
+}
+
+void VideoPipeline::SetRegionOfInterest(bool enabled)
+{
+    Logger.Info("Region of interest encoding ", enabled ? "enabled" : "disabled");
+    RegionOfInterest = enabled;
+}
+
 static void ConvertYUYVtoYUV420(std::shared_ptr<CameraFrame> input, std::shared_ptr<Frame> output)
 {
     uint8_t* dst_y_row = output->Planes[0];
@@ -229,141 +489,521 @@ static void ConvertYUYVtoYUV420(std::shared_ptr<CameraFrame> input, std::shared_
         dst_u_row += w/2;
         dst_v_row += w/2;
     }
+
+    output->NeutralChroma = false;
+}
+
+static void ConvertYUYVtoLuma(std::shared_ptr<CameraFrame> input, std::shared_ptr<Frame> output)
+{
+    uint8_t* dst_y_row = output->Planes[0];
+    const uint8_t* src = input->Image;
+
+    // The output is padded up to a multiple of the macroblock size, but the
+    // input only has the visible pixels.  The padding is cropped off by the
+    // encoder, so it is left as-is
+    const int src_row_bytes = input->Format.RowBytes;
+    const int w = std::min(std::min(output->Width, input->Format.Width), src_row_bytes / 2);
+    const int h = std::min(output->Height, input->Format.Height);
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            dst_y_row[x] = src[x * 2];
+        }
+        src += src_row_bytes;
+        dst_y_row += output->Width;
+    }
+
+    // Only written once per frame allocation
+    output->SetNeutralChroma();
+}
+
+void VideoPipeline::BuildGraph()
+{
+    DecoderStage.Configure("Decoder", Config.Decoder,
+        [this](CaptureMessage& message, StageOutput<RawFrameMessage>& output) {
+            DecodeFrame(message, output);
+        });
+
+    // Upstream to downstream
+    Graph.Clear();
+    Graph.Add(&DecoderStage);
+
+    for (auto& output : Outputs) {
+        BuildOutput(*output);
+        DecoderStage.Connect(output->ScalerStage);
+
+        Graph.Add(&output->ScalerStage);
+        Graph.Add(&output->EncoderStage);
+        Graph.Add(&output->PacerStage);
+        Graph.Add(&output->AppStage);
+    }
+
+    Stats.SetPacing(Config.Pacer.Enabled);
+}
+
+void VideoPipeline::BuildOutput(VideoOutput& out)
+{
+    // Stage names of extra outputs end with the output index
+    std::string suffix;
+    if (out.Index > 0) {
+        suffix = std::to_string(out.Index);
+    }
+
+    // Outputs at the decoded resolution pass frames straight to the encoder
+    StageOptions scaler_options = Config.Scaler;
+    if (out.Config.Width <= 0) {
+        scaler_options.Enabled = false;
+    }
+
+    VideoOutput* output = &out;
+    out.ScalerStage.Configure("Scaler" + suffix, scaler_options,
+        [this, output](RawFrameMessage& message, StageOutput<RawFrameMessage>& next) {
+            ScaleFrame(*output, message, next);
+        },
+        [this](RawFrameMessage& message) {
+            EncoderDroppedFrame = true;
+            ++DroppedFrames;
+            Recorder.RecordDrop(FlightDropReason::ScalerQueue, message.FrameNumber, GetQueueDepth());
+            Metrics.OnDrop(FlightDropReason::ScalerQueue);
+        });
+    out.EncoderStage.Configure("Encoder" + suffix, Config.Encoder,
+        [this, output](RawFrameMessage& message, StageOutput<VideoPicture>& next) {
+            EncodeFrame(*output, message, next);
+        },
+        [this](RawFrameMessage& message) {
+            EncoderDroppedFrame = true;
+            ++DroppedFrames;
+            Recorder.RecordDrop(FlightDropReason::EncoderQueue, message.FrameNumber, GetQueueDepth());
+            Metrics.OnDrop(FlightDropReason::EncoderQueue);
+        });
+    out.PacerStage.Configure("Pacer" + suffix, Config.Pacer,
+        [this, output](VideoPicture& picture, StageOutput<VideoPicture>& next) {
+            PaceVideo(*output, picture, next);
+        });
+    out.AppStage.Configure("App" + suffix, Config.App,
+        [this, output](VideoPicture& picture, StageOutput<NoMessage>& next) {
+            DeliverVideo(*output, picture, next);
+        });
+
+    out.Pacer.Reset();
+    out.Pacer.SetMaxDelay(Config.PacingMaxDelayUsec);
+
+    out.ScalerStage.Connect(out.EncoderStage);
+    out.EncoderStage.Connect(out.PacerStage);
+    out.PacerStage.Connect(out.AppStage);
 }
 
 void VideoPipeline::Start()
 {
-    const int max_queue_depth = 4;
-    DecoderNode.Initialize("Decoder", max_queue_depth);
-    EncoderNode.Initialize("Encoder", max_queue_depth);
-    AppNode.Initialize("App", max_queue_depth);
+    BuildGraph();
+    Graph.Start();
 
-    // Please see kvm_encode.hpp for comments on these settings
-    MmalEncoderSettings settings;
-    settings.Kbps = 4000;
-    settings.Framerate = 30;
-    settings.GopSize = 60; // This affects the keyframe size
-    Encoder.SetSettings(settings);
+    ErrorState = !StartCapture();
+}
 
-    bool capture_okay = Capture.Initialize([this](const std::shared_ptr<CameraFrame>& buffer)
+bool VideoPipeline::StartCapture()
+{
+    return Capture.Initialize([this](const std::shared_ptr<CameraFrame>& buffer)
     {
-        DecoderNode.Queue([this, buffer]()
-        {
-            //Logger.Info("Got frame #", buffer->FrameNumber, " bytes = ", buffer->ImageBytes);
+        // Return the buffer to the capture device right away while nobody
+        // is watching
+        if (IsSuspended()) {
+            return;
+        }
 
-            uint64_t frame_number = buffer->FrameNumber;
-            uint64_t shutter_usec = buffer->ShutterUsec;
+        Metrics.CaptureFrames->Add();
+        Metrics.CaptureBytes->Add(buffer->ImageBytes);
 
-            if (LastFrameNumber > 0 && frame_number - LastFrameNumber != 1) {
-                Logger.Warn("Camera skipped ", frame_number - LastFrameNumber, " frames");
-            }
+        // Keep one of every FrameDecimation frames while overloaded
+        const int decimation = FrameDecimation;
+        if (decimation > 1 && ++CaptureCounter % decimation != 0) {
+            Recorder.RecordDrop(FlightDropReason::Decimated, buffer->FrameNumber, GetQueueDepth());
+            Metrics.OnDrop(FlightDropReason::Decimated);
+            return;
+        }
 
-            std::shared_ptr<Frame> frame;
+        CaptureMessage message;
+        message.Buffer = buffer;
+        message.Timing.FrameId = buffer->FrameNumber;
+        message.Timing.CaptureUsec = buffer->ShutterUsec;
+        message.Timing.DequeueUsec = GetTimeUsec();
+        DecoderStage.Push(std::move(message));
+    });
+}
 
-            if (buffer->Format.Format == PixelFormat::JPEG) {
-                frame = Decoder.Decompress(buffer->Image, buffer->ImageBytes);
-                if (!frame) {
-                    // Note that JPEG decode failures happen a lot when plugged into USB2 ports,
-                    // so this is not a critical error.
-                    Logger.Error("Failed to decode JPEG");
-                    return;
-                }
-            } else {
-                frame = RawPool.Allocate(buffer->Format.Width, buffer->Format.Height, PixelFormat::YUV420P);
+bool VideoPipeline::RestartCapture()
+{
+    // Frames still queued for the decoder are processed or dropped by the
+    // running stages, which releases their capture buffers
+    Capture.Shutdown();
 
-                if (buffer->Format.Format == PixelFormat::YUYV) {
-                    // YUYV format is not supported by video encoder so we need to convert to YUV420
-                    ConvertYUYVtoYUV420(buffer, frame);
-                } else {
-                    Logger.Error("FIXME: Unsupported copy for raw pixel format");
-                    return;
-                }
+    if (!StartCapture()) {
+        return false;
+    }
+
+    for (auto& output : Outputs) {
+        output->ForceKeyframe = true;
+    }
+    return true;
+}
+
+void VideoPipeline::DecodeFrame(CaptureMessage& message, StageOutput<RawFrameMessage>& output)
+{
+    const std::shared_ptr<CameraFrame>& buffer = message.Buffer;
+    message.Timing.DecodeStartUsec = GetTimeUsec();
+    const uint64_t cpu_start_usec = GetThreadCpuUsec();
+
+    TraceScope trace_scope("Decode");
+    TraceCounter("Decoder queue", DecoderStage.GetQueuedCount());
+
+    //Logger.Info("Got frame #", buffer->FrameNumber, " bytes = ", buffer->ImageBytes);
+
+    uint64_t frame_number = buffer->FrameNumber;
+    uint64_t shutter_usec = buffer->ShutterUsec;
+
+    if (LastFrameNumber > 0 && frame_number - LastFrameNumber != 1) {
+        Logger.Warn("Camera skipped ", frame_number - LastFrameNumber, " frames");
+    }
+
+    // Skip decoding if no output could take the frame by the time it is
+    // decoded, rather than decoding it only to have it dropped
+    if (!output.CanAccept(DecoderStage.GetServiceUsec())) {
+        Stats.OnBackpressure();
+        ++DroppedFrames;
+        Recorder.RecordDrop(FlightDropReason::Backpressure, frame_number, GetQueueDepth());
+        Metrics.OnDrop(FlightDropReason::Backpressure);
+        return;
+    }
+
+    std::shared_ptr<Frame> frame;
+
+    if (buffer->Format.Format == PixelFormat::JPEG) {
+        JpegDecoderSettings decoder_settings;
+        decoder_settings.ScaleDenom = GetDecodeScale(buffer->Format.Width, buffer->Format.Height);
+        decoder_settings.Incremental = true;
+        decoder_settings.Specialized = SpecializedJpegDecoder;
+        decoder_settings.LumaOnly = LumaOnly;
+        decoder_settings.DetectChanges = VariableFrameRate;
+        Decoder.SetSettings(decoder_settings);
+
+        frame = Decoder.Decompress(buffer->Image, buffer->ImageBytes);
+        if (!frame) {
+            // Note that JPEG decode failures happen a lot when plugged into USB2 ports,
+            // so this is not a critical error.
+            Logger.Error("Failed to decode JPEG");
+            TraceInstant("Decode failed");
+            Recorder.RecordDecodeError(frame_number, buffer->ImageBytes);
+            Metrics.DecodeErrors->Add();
+            return;
+        }
+    } else {
+        frame = RawPool.Allocate(buffer->Format.Width, buffer->Format.Height, PixelFormat::YUV420P);
+
+        if (buffer->Format.Format == PixelFormat::YUYV) {
+            // YUYV format is not supported by video encoder so we need to convert to YUV420
+            if (LumaOnly) {
+                ConvertYUYVtoLuma(buffer, frame);
+            } else {
+                ConvertYUYVtoYUV420(buffer, frame);
             }
+        } else {
+            Logger.Error("FIXME: Unsupported copy for raw pixel format");
+            return;
+        }
 
-            Stats.AddInput(buffer->ImageBytes);
+        DetectRawChanges(frame);
+    }
 
-            PixelFormat pf = buffer->Format.Format;
+    Stats.AddInput(buffer->ImageBytes);
+    ++DecodedFrames;
+    Metrics.DecodeUsec->Record(GetTimeUsec() - message.Timing.DecodeStartUsec);
+
+    if (ShouldEncode(*frame)) {
+        RawFrameMessage raw;
+        raw.Image = frame;
+        raw.FrameNumber = frame_number;
+        raw.ShutterUsec = shutter_usec;
+        raw.Timing = message.Timing;
+        raw.Timing.DecodeEndUsec = GetTimeUsec();
+        raw.Timing.DecodeCpuUsec = static_cast<uint32_t>( GetThreadCpuUsec() - cpu_start_usec );
+        output.Push(std::move(raw));
+    } else {
+        Stats.OnSkippedFrame();
+        Metrics.SkippedFrames->Add();
+    }
 
-            EncoderNode.Queue([this, pf, frame, frame_number, shutter_usec]()
-            {
-                int bytes = 0;
-                uint8_t* data = Encoder.Encode(frame, false, bytes);
-                if (!data) {
-                    Logger.Error("Encoder.Encode failed");
-                    ErrorState = true;
-                    return;
-                }
-                if (bytes == 0) {
-                    // No image in frame
-                    return;
-                }
-                if (pf == PixelFormat::JPEG) {
-                    Decoder.Release(frame);
-                } else {
-                    RawPool.Release(frame);
-                }
+    // The pool reuses the frame once the outputs are done with it
+    if (buffer->Format.Format == PixelFormat::JPEG) {
+        Decoder.Release(frame);
+    } else {
+        RawPool.Release(frame);
+    }
+}
 
-                Stats.AddVideo(bytes);
+void VideoPipeline::DetectRawChanges(const std::shared_ptr<Frame>& frame)
+{
+    const std::shared_ptr<Frame> prev = PreviousRawFrame;
 
-                // Parse the video into pictures and parameters
-                Parser.Reset();
-                Parser.ParseVideo(false, data, bytes);
+    // Keep this frame to compare with the next one.
+    // The pool does not reuse it while it is referenced here
+    PreviousRawFrame = VariableFrameRate ? frame : nullptr;
 
-                if (Parser.Pictures.empty()) {
-                    Logger.Error("Video output does not include a picture: bytes=", bytes);
-                    //Logger.Error("Dump: ", HexDump(data, bytes > 128 ? 128 : bytes));
-                    return;
-                }
+    if (!VariableFrameRate || !prev ||
+        prev->Width != frame->Width ||
+        prev->Height != frame->Height)
+    {
+        frame->SetAllDirty();
+        return;
+    }
 
-                if (Parser.Pictures.size() > 1) {
-                    Logger.Warn("Video output includes ", Parser.Pictures.size(), " pictures");
-                }
+    frame->ClearDirtyTiles(kDirtyTileWidth);
+    const int rows = static_cast<int>( frame->DirtyRows.size() );
+    for (int row = 0; row < rows; ++row) {
+        DiffFrameTileRow(*prev, *frame, row);
+    }
+}
 
-                if (!Parser.Parameters.empty()) {
-                    VideoParameters = std::make_shared<std::vector<uint8_t>>(Parser.TotalParameterBytes);
+bool VideoPipeline::ShouldEncode(const Frame& frame)
+{
+    const uint64_t now_usec = GetTimeUsec();
 
-                    uint8_t* dest = VideoParameters->data();
-                    for (auto& range : Parser.Parameters) {
-                        memcpy(dest, range.Ptr, range.Bytes);
-                        dest += range.Bytes;
-                    }
-                }
+    bool changed = frame.IsChanged() || EncoderDroppedFrame.exchange(false);
+    for (auto& output : Outputs) {
+        changed |= output->ForceKeyframe;
+    }
 
-                for (auto& picture : Parser.Pictures)
-                {
-                    //Logger.Info("Picture: slices=", picture.Ranges.size(), " bytes=", picture.TotalBytes);
+    if (VariableFrameRate && !changed &&
+        now_usec - LastEncodeRequestUsec < kIdleHeartbeatUsec)
+    {
+        return false;
+    }
 
-                    const bool is_keyframe = picture.Keyframe && VideoParameters;
+    LastEncodeRequestUsec = now_usec;
+    return true;
+}
 
-                    int video_frame_bytes = picture.TotalBytes;
-                    if (is_keyframe) {
-                        video_frame_bytes += VideoParameters->size();
-                    }
+void VideoPipeline::ScaleFrame(VideoOutput& out, RawFrameMessage& message, StageOutput<RawFrameMessage>& output)
+{
+    const Frame& frame = *message.Image;
 
-                    auto video_frame = std::make_shared<std::vector<uint8_t>>(video_frame_bytes);
-                    uint8_t* dest = video_frame->data();
+    TraceScope trace_scope("Scale");
 
-                    if (is_keyframe) {
-                        memcpy(dest, VideoParameters->data(), VideoParameters->size());
-                        dest += VideoParameters->size();
-                    }
+    if (!output.CanAccept(out.ScalerStage.GetServiceUsec())) {
+        // Make sure the next frame is encoded even if it did not change
+        EncoderDroppedFrame = true;
+        ++DroppedFrames;
+        Recorder.RecordDrop(FlightDropReason::EncoderBusy, message.FrameNumber, GetQueueDepth());
+        Metrics.OnDrop(FlightDropReason::EncoderBusy);
+        return;
+    }
 
-                    for (auto& range : picture.Ranges) {
-                        memcpy(dest, range.Ptr, range.Bytes);
-                        dest += range.Bytes;
-                    }
+    if (frame.VisibleWidth == out.Config.Width && frame.VisibleHeight == out.Config.Height) {
+        // Already at the output resolution
+        output.Push(std::move(message));
+        return;
+    }
 
-                    AppNode.Queue([this, frame_number, shutter_usec, video_frame]() {
-                        Callback(frame_number, shutter_usec, video_frame->data(), video_frame->size());
-                    });
+    std::shared_ptr<Frame> scaled = out.ScaledPool.Allocate(out.Config.Width, out.Config.Height, frame.Format);
+    if (!scaled) {
+        return;
+    }
 
-                    Stats.OnOutputFrame();
-                }
-            });
-        });
-    });
+    if (out.Scaler.Scale(frame, *scaled)) {
+        // Change tracking is for the decoded resolution
+        scaled->SetAllDirty();
+
+        message.Image = scaled;
+        output.Push(std::move(message));
+    }
 
-    ErrorState = !capture_okay;
+    // Hand it back once it is written and queued: The pool only reuses it
+    // after the encoder drops its reference (IsOnlyReference)
+    out.ScaledPool.Release(scaled);
+}
+
+void VideoPipeline::EncodeFrame(VideoOutput& out, RawFrameMessage& message, StageOutput<VideoPicture>& output)
+{
+    const std::shared_ptr<Frame>& frame = message.Image;
+    FrameTiming& timing = message.Timing;
+    timing.EncodeStartUsec = GetTimeUsec();
+    uint64_t cpu_start_usec = GetThreadCpuUsec();
+
+    TraceScope trace_scope("Encode");
+
+    const bool force_keyframe = out.ForceKeyframe && out.ForceKeyframe.exchange(false);
+
+    const QpOffsetMap* qp_map = nullptr;
+    if (RegionOfInterest) {
+        // Convert the cursor position from 0..32767 across the screen to
+        // pixels of the visible image, not including the frame padding
+        int cursor_x = -1, cursor_y = -1;
+        const uint32_t cursor = CursorPosition;
+        if (cursor != kCursorUnknown) {
+            cursor_x = static_cast<int>( (cursor >> 16) * frame->VisibleWidth / 32768 );
+            cursor_y = static_cast<int>( (cursor & 0xffff) * frame->VisibleHeight / 32768 );
+        }
+
+        BuildQpOffsetMap(*frame, cursor_x, cursor_y, out.RoiMap);
+        qp_map = &out.RoiMap;
+    }
+
+    const uint64_t t0 = GetTimeUsec();
+    std::shared_ptr<std::vector<uint8_t>> data = EncodeImage(out, frame, force_keyframe, qp_map);
+    const uint64_t encode_usec = GetTimeUsec() - t0;
+    timing.EncodeEndUsec = t0 + encode_usec;
+    const uint64_t cpu_encoded_usec = GetThreadCpuUsec();
+    timing.EncodeCpuUsec = static_cast<uint32_t>( cpu_encoded_usec - cpu_start_usec );
+    cpu_start_usec = cpu_encoded_usec;
+    if (!data) {
+        Logger.Error("Encoder.Encode failed");
+        Recorder.RecordEncodeError(message.FrameNumber);
+        Metrics.EncodeErrors->Add();
+        ErrorState = true;
+        return;
+    }
+    const int bytes = (int)data->size();
+    if (bytes == 0) {
+        // No image in frame
+        return;
+    }
+    // Statistics are for the main output
+    const bool main_output = out.Index == 0;
+    if (main_output) {
+        Stats.AddVideo(bytes, encode_usec);
+        ++EncodedFrames;
+        EncodedBytes += bytes;
+
+        Metrics.VideoBytes->Add(bytes);
+        Metrics.FrameBytes->Record(bytes);
+        Metrics.EncodeUsec->Record(encode_usec);
+
+        TraceCounter("Encoder queue", out.EncoderStage.GetQueuedCount());
+        TraceCounter("Encoded bytes", bytes);
+    }
+
+    // Parse the video into pictures and parameters
+    VideoParser& parser = out.Parser;
+    parser.Reset();
+    parser.ParseVideo(false, data->data(), bytes);
+
+    if (parser.Pictures.empty()) {
+        Logger.Error("Video output does not include a picture: bytes=", bytes);
+        //Logger.Error("Dump: ", HexDump(data, bytes > 128 ? 128 : bytes));
+        return;
+    }
+
+    if (parser.Pictures.size() > 1) {
+        Logger.Warn("Video output includes ", parser.Pictures.size(), " pictures");
+    }
+
+    if (!parser.Parameters.empty()) {
+        parser.CopyParameters(out.VideoParameters);
+    }
+
+    timing.ParseEndUsec = GetTimeUsec();
+    timing.ParseCpuUsec = static_cast<uint32_t>( GetThreadCpuUsec() - cpu_start_usec );
+
+    for (auto& picture : parser.Pictures)
+    {
+        //Logger.Info("Picture: slices=", picture.RangeCount, " bytes=", picture.TotalBytes);
+
+        if (picture.RangeCount <= 0) {
+            continue;
+        }
+
+        // Reference the slices in the encoder output instead of copying them
+        VideoPicture video;
+        video.FrameNumber = message.FrameNumber;
+        video.ShutterUsec = message.ShutterUsec;
+        video.Keyframe = picture.Keyframe;
+        if (picture.Keyframe) {
+            video.Parameters = out.VideoParameters;
+        }
+        video.Buffer = data;
+        for (int i = 0; i < picture.RangeCount; ++i) {
+            video.Slices[video.SliceCount++] = picture.Ranges[i];
+        }
+        video.SliceBytes = picture.TotalBytes;
+        video.Timing = timing;
+        output.Push(std::move(video));
+
+        if (main_output) {
+            Stats.OnOutputFrame();
+            Metrics.VideoFrames->Add();
+            if (picture.Keyframe) {
+                TraceInstant("Keyframe");
+                Metrics.Keyframes->Add();
+                Metrics.KeyframeBytes->Record(picture.TotalBytes);
+            }
+        }
+    }
+
+    if (RecoveryStartUsec != 0) {
+        const uint64_t start_usec = RecoveryStartUsec.exchange(0);
+        if (start_usec != 0) {
+            Logger.Info("Video resumed ", (GetTimeUsec() - start_usec) / 1000.f, " msec after capture failure");
+        }
+    }
+    if (ResumeStartUsec != 0) {
+        const uint64_t start_usec = ResumeStartUsec.exchange(0);
+        if (start_usec != 0) {
+            Logger.Info("First frame ", (GetTimeUsec() - start_usec) / 1000.f, " msec after resuming for a viewer");
+        }
+    }
+}
+
+std::shared_ptr<std::vector<uint8_t>> VideoPipeline::EncodeImage(
+    VideoOutput& out,
+    const std::shared_ptr<Frame>& frame,
+    bool force_keyframe,
+    const QpOffsetMap* qp_map)
+{
+    return out.Encoder.Encode(frame, force_keyframe, qp_map);
+}
+
+void VideoPipeline::PaceVideo(VideoOutput& out, VideoPicture& picture, StageOutput<VideoPicture>& output)
+{
+    TraceScope trace_scope("Pace");
+
+    const uint64_t now_usec = GetTimeUsec();
+    const uint64_t release_usec = out.Pacer.Schedule(picture.ShutterUsec, now_usec);
+    if (release_usec > now_usec) {
+        std::this_thread::sleep_for(std::chrono::microseconds(release_usec - now_usec));
+    }
+    output.Push(std::move(picture));
+}
+
+void VideoPipeline::DeliverVideo(VideoOutput& out, VideoPicture& picture, StageOutput<NoMessage>& /*output*/)
+{
+    TraceScope trace_scope("Deliver");
+
+    // The application callback packetizes the picture and relays it
+    picture.Timing.PacketizeUsec = GetTimeUsec();
+    const uint64_t cpu_start_usec = GetThreadCpuUsec();
+
+    if (out.Callback) {
+        out.Callback(picture);
+    }
+
+    picture.Timing.RelayUsec = GetTimeUsec();
+    picture.Timing.PacketizeCpuUsec = static_cast<uint32_t>( GetThreadCpuUsec() - cpu_start_usec );
+
+    if (out.Index == 0) {
+        Stats.OnDelivered(picture.ShutterUsec);
+        Timings.Record(picture.Timing);
+        Recorder.RecordFrame(picture.Timing, picture.TotalBytes(), picture.Keyframe, GetQueueDepth());
+    }
+
+    // Capture to delivery latency of the main output for the overload
+    // controller.  Ignore timestamps from another clock
+    if (out.Index == 0 && picture.ShutterUsec != 0) {
+        const int64_t latency_usec = (int64_t)(GetTimeUsec() - picture.ShutterUsec);
+        if (latency_usec > 0 && latency_usec < kMaxLatencyUsec) {
+            LatencyTotalUsec += latency_usec;
+            ++LatencyCount;
+            Metrics.LatencyUsec->Record(latency_usec);
+        }
+    }
 }
 
 void VideoPipeline::Stop()
@@ -372,19 +1012,17 @@ void VideoPipeline::Stop()
     Capture.Stop();
 
     Logger.Info("Stopping encoder...");
-    Encoder.Shutdown();
+    for (auto& output : Outputs) {
+        output->Encoder.Shutdown();
+    }
 
     Logger.Info("Capture shutdown...");
     Capture.Shutdown();
 
-    Logger.Info("DecoderNode shutdown...");
-    DecoderNode.Shutdown();
-
-    Logger.Info("EncoderNode shutdown...");
-    EncoderNode.Shutdown();
+    Graph.Stop();
 
-    Logger.Info("AppNode shutdown...");
-    AppNode.Shutdown();
+    PreviousRawFrame = nullptr;
+    LastEncodeRequestUsec = 0;
 
     Logger.Info("Video pipeline stopped");
 }
@@ -395,31 +1033,76 @@ void VideoPipeline::Stop()
 
 void PiplineStatistics::AddInput(int bytes)
 {
-    std::lock_guard<std::mutex> locker(Lock);
-    InputBytes += bytes;
-    InputCount++;
+    InputBytes.fetch_add(bytes, std::memory_order_relaxed);
+    InputCount.fetch_add(1, std::memory_order_relaxed);
 }
 
-void PiplineStatistics::AddVideo(int bytes)
+void PiplineStatistics::AddVideo(int bytes, uint64_t encode_usec)
 {
-    std::lock_guard<std::mutex> locker(Lock);
-    VideoBytes += bytes;
-    VideoCount++;
-    if (MaxVideoBytes == 0 || bytes > MaxVideoBytes) {
-        MaxVideoBytes = bytes;
+    const uint64_t video_bytes = static_cast<uint64_t>( bytes );
+
+    VideoBytes.fetch_add(video_bytes, std::memory_order_relaxed);
+    VideoCount.fetch_add(1, std::memory_order_relaxed);
+    EncodeUsec.fetch_add(encode_usec, std::memory_order_relaxed);
+
+    uint64_t max_bytes = MaxVideoBytes.load(std::memory_order_relaxed);
+    while (max_bytes == 0 || video_bytes > max_bytes) {
+        if (MaxVideoBytes.compare_exchange_weak(max_bytes, video_bytes, std::memory_order_relaxed)) {
+            break;
+        }
     }
-    if (MinVideoBytes == 0 || bytes < MinVideoBytes) {
-        MinVideoBytes = bytes;
+    uint64_t min_bytes = MinVideoBytes.load(std::memory_order_relaxed);
+    while (min_bytes == 0 || video_bytes < min_bytes) {
+        if (MinVideoBytes.compare_exchange_weak(min_bytes, video_bytes, std::memory_order_relaxed)) {
+            break;
+        }
     }
 }
 
-void PiplineStatistics::OnOutputFrame()
+void PiplineStatistics::OnSkippedFrame()
+{
+    SkippedCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PiplineStatistics::OnBackpressure()
+{
+    BackpressureCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PiplineStatistics::OnResume()
 {
     std::lock_guard<std::mutex> locker(Lock);
-    if (LastOutputFrameUsec == 0) {
+    const uint64_t now_usec = GetTimeUsec();
+    if (LastOutputFrameUsec != 0) {
+        LastOutputFrameUsec = now_usec;
+    }
+    LastOutputReportUsec = now_usec;
+}
+
+void PiplineStatistics::SetThermalStatus(const ThermalStatus& status)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    Thermal = status;
+}
+
+void PiplineStatistics::OnDelivered(uint64_t shutter_usec)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    DeliveryJitter.OnPicture(shutter_usec, GetTimeUsec());
+}
+
+void PiplineStatistics::SetPacing(bool enabled)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    Pacing = enabled;
+    DeliveryJitter.Reset();
+}
+
+void PiplineStatistics::OnOutputFrame()
+{
+    if (LastOutputFrameUsec.exchange(GetTimeUsec(), std::memory_order_relaxed) == 0) {
         Logger.Info("Success: Got first encoded frame from video pipeline");
     }
-    LastOutputFrameUsec = GetTimeUsec();
 }
 
 void PiplineStatistics::TryReport()
@@ -428,15 +1111,17 @@ void PiplineStatistics::TryReport()
     uint64_t now_usec = GetTimeUsec();
 
     {
-        // Warn if more than a second passes with no output video frames
-        const int64_t warn_usec = 1000 * 1000;
+        // Warn if no output video frames arrive for longer than the idle
+        // heartbeat interval allows
+        const int64_t warn_usec = 2 * kIdleHeartbeatUsec;
 
-        int64_t dt = now_usec - LastOutputFrameUsec;
+        const uint64_t last_output_usec = LastOutputFrameUsec.load(std::memory_order_relaxed);
+        int64_t dt = now_usec - last_output_usec;
         if (dt > warn_usec) {
             int64_t report_dt = now_usec - LastOutputReportUsec;
             const int64_t report_interval_usec = 2 * 1000 * 1000;
             if (report_dt >= report_interval_usec) {
-                if (LastOutputFrameUsec == 0) {
+                if (last_output_usec == 0) {
                     Logger.Warn("Warning: No frames produced yet");
                 } else {
                     Logger.Warn("Warning: No frames produced in ", (dt / 1000.f), " msec");
@@ -449,40 +1134,80 @@ void PiplineStatistics::TryReport()
     int64_t dt = now_usec - LastReportUsec;
 
     if (dt >= ReportIntervalUsec) {
-        if (LastReportUsec != 0) {
-            Report();
-        }
+        Interval interval;
+        interval.InputBytes = InputBytes.exchange(0, std::memory_order_relaxed);
+        interval.InputCount = InputCount.exchange(0, std::memory_order_relaxed);
+
+        interval.VideoBytes = VideoBytes.exchange(0, std::memory_order_relaxed);
+        interval.VideoCount = VideoCount.exchange(0, std::memory_order_relaxed);
+        interval.EncodeUsec = EncodeUsec.exchange(0, std::memory_order_relaxed);
 
-        InputBytes = 0;
-        InputCount = 0;
+        interval.SkippedCount = SkippedCount.exchange(0, std::memory_order_relaxed);
+        interval.BackpressureCount = BackpressureCount.exchange(0, std::memory_order_relaxed);
 
-        VideoBytes = 0;
-        VideoCount = 0;
+        interval.MaxVideoBytes = MaxVideoBytes.exchange(0, std::memory_order_relaxed);
+        interval.MinVideoBytes = MinVideoBytes.exchange(0, std::memory_order_relaxed);
 
-        MaxVideoBytes = 0;
-        MinVideoBytes = 0;
+        if (LastReportUsec != 0) {
+            Report(interval);
+        }
 
+        DeliveryJitter.ResetMax();
         LastReportUsec = now_usec;
     }
 }
 
-void PiplineStatistics::Report()
+void PiplineStatistics::Report(const Interval& interval)
 {
-    if (InputCount <= 0 || VideoCount <= 0) {
-        Logger.Info("Statistics: ", InputCount, " input frames, ", VideoCount, " video frames");
+    if (Thermal.State != ThermalState::Unknown) {
+        Logger.Info("Thermal: ", Thermal.TemperatureMillidegrees / 1000.f, " C, clock ",
+            Thermal.CurrentFreqKhz / 1000, "/", Thermal.MaxFreqKhz / 1000, " MHz, state=",
+            ThermalStateToString(Thermal.State), Thermal.Throttled ? " (throttled)" : "",
+            ", minimum overload level ", Thermal.MinOverloadLevel);
+    }
+
+    if (interval.InputCount == 0 || interval.VideoCount == 0) {
+        Logger.Info("Statistics: ", interval.InputCount, " input frames, ", interval.VideoCount, " video frames");
         return;
     }
 
-    const float avg_input = InputBytes / 1000.f / InputCount;
-    const float avg_video = VideoBytes / 1000.f / VideoCount;
+    const float avg_input = interval.InputBytes / 1000.f / interval.InputCount;
+    const float avg_video = interval.VideoBytes / 1000.f / interval.VideoCount;
 
     float ratio = 0.f;
     if (avg_video > 0.00001f) {
         ratio = avg_input / avg_video;
     }
 
-    Logger.Info("Statistics: ", InputCount, " input frames [", avg_input, " KB (avg)], ",
-        VideoCount, " video frames [avg=", avg_video, " min=", MinVideoBytes/1000.f, " max=", MaxVideoBytes/1000.f, " KB], compression ratio = ", ratio, ":1");
+    Logger.Info("Statistics: ", interval.InputCount, " input frames [", avg_input, " KB (avg)], ",
+        interval.VideoCount, " video frames [avg=", avg_video, " min=", interval.MinVideoBytes/1000.f,
+        " max=", interval.MaxVideoBytes/1000.f, " KB], compression ratio = ", ratio, ":1");
+
+    Logger.Info("Delivery jitter (pacing ", Pacing ? "on" : "off", "): avg=",
+        DeliveryJitter.GetJitterUsec() / 1000.f, " msec, max=",
+        DeliveryJitter.GetMaxDeviationUsec() / 1000.f, " msec");
+
+    if (interval.BackpressureCount > 0) {
+        Logger.Info("Backpressure: Skipped decoding ", interval.BackpressureCount, " of ",
+            interval.InputCount + interval.BackpressureCount,
+            " captured frames because the encoder was behind");
+    }
+
+    if (interval.SkippedCount > 0)
+    {
+        // Estimate what the skipped frames would have cost: An unchanged
+        // frame encodes to about the smallest frame seen in the interval
+        const float seconds = ReportIntervalUsec / 1000000.f;
+        const float avg_encode_msec = interval.EncodeUsec / 1000.f / interval.VideoCount;
+        const float saved_msec_per_sec = interval.SkippedCount * avg_encode_msec / seconds;
+        const float saved_kbps = interval.SkippedCount * (float)interval.MinVideoBytes * 8.f / 1000.f / seconds;
+        const float video_kbps = interval.VideoBytes * 8.f / 1000.f / seconds;
+
+        Logger.Info("Variable frame rate: Skipped ", interval.SkippedCount, " of ", interval.InputCount,
+            " unchanged frames (", interval.SkippedCount * 100.f / interval.InputCount, "%), saving about ",
+            saved_msec_per_sec, " msec/sec of encoder time and ", saved_kbps,
+            " kbps (sent ", video_kbps, " kbps)");
+    }
 }
 
 
@@ -0,0 +1,382 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_recorder.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_serializer.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+namespace kvm {
+
+static logger::Channel Logger("FlightRecorder");
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+const char* FlightEventTypeToString(FlightEventType type)
+{
+    static_assert((int)FlightEventType::Count == 6, "Update this switch");
+    switch (type)
+    {
+    case FlightEventType::Frame: return "Frame";
+    case FlightEventType::Drop: return "Drop";
+    case FlightEventType::DecodeError: return "Decode error";
+    case FlightEventType::EncodeError: return "Encode error";
+    case FlightEventType::Keyboard: return "Keyboard";
+    case FlightEventType::Mouse: return "Mouse";
+    default: break;
+    }
+    return "Unknown";
+}
+
+const char* FlightDropReasonToString(FlightDropReason reason)
+{
+    static_assert((int)FlightDropReason::Count == 5, "Update this switch");
+    switch (reason)
+    {
+    case FlightDropReason::Decimated: return "Decimated";
+    case FlightDropReason::Backpressure: return "Backpressure";
+    case FlightDropReason::EncoderBusy: return "Encoder busy";
+    case FlightDropReason::ScalerQueue: return "Scaler queue full";
+    case FlightDropReason::EncoderQueue: return "Encoder queue full";
+    default: break;
+    }
+    return "Unknown";
+}
+
+const char* FlightTriggerToString(FlightTrigger trigger)
+{
+    static_assert((int)FlightTrigger::Count == 4, "Update this switch");
+    switch (trigger)
+    {
+    case FlightTrigger::None: return "None";
+    case FlightTrigger::Stall: return "Stall";
+    case FlightTrigger::DecodeFailures: return "Decode failures";
+    case FlightTrigger::EncoderError: return "Encoder error";
+    default: break;
+    }
+    return "Unknown";
+}
+
+// Clamp an interval to 32 bits, or 0 if either end is unknown
+static uint32_t GetIntervalUsec(uint64_t start_usec, uint64_t end_usec)
+{
+    if (start_usec == 0 || end_usec < start_usec) {
+        return 0;
+    }
+    const uint64_t interval = end_usec - start_usec;
+    return interval > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>( interval );
+}
+
+static uint16_t ClampQueueDepth(int depth)
+{
+    if (depth < 0) {
+        return 0;
+    }
+    return depth > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>( depth );
+}
+
+
+//------------------------------------------------------------------------------
+// FlightRecord
+
+bool WriteFlightRecord(const std::string& path, const FlightRecord& record)
+{
+    const int count = static_cast<int>( record.Events.size() );
+    std::vector<uint8_t> buffer(kFlightHeaderBytes + count * kFlightEventBytes);
+
+    WriteByteStream stream(buffer.data(), (int)buffer.size());
+    stream.Write32_LE(kFlightFileMagic);
+    stream.Write32_LE(kFlightFileVersion);
+    stream.Write32_LE(static_cast<uint32_t>( record.Trigger ));
+    stream.Write32_LE(static_cast<uint32_t>( count ));
+    stream.Write64_LE(record.TriggerUsec);
+    stream.Write64_LE(record.PersistUsec);
+
+    for (const FlightEvent& event : record.Events) {
+        stream.Write64_LE(event.TimeUsec);
+        stream.Write64_LE(event.FrameId);
+        stream.Write8(static_cast<uint8_t>( event.Type ));
+        stream.Write8(event.Detail);
+        stream.Write16_LE(event.QueueDepth);
+        stream.Write32_LE(event.Bytes);
+        stream.Write32_LE(event.CaptureQueueUsec);
+        stream.Write32_LE(event.DecodeUsec);
+        stream.Write32_LE(event.EncodeUsec);
+        stream.Write32_LE(event.DeliveryUsec);
+        stream.Write32_LE(event.LatencyUsec);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        Logger.Error("Failed to open ", path);
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>( buffer.data() ), stream.WrittenBytes);
+    file.close();
+    if (!file) {
+        Logger.Error("Failed to write ", path);
+        return false;
+    }
+    return true;
+}
+
+bool ReadFlightRecord(const std::string& path, FlightRecord& record)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        Logger.Error("Failed to open ", path);
+        return false;
+    }
+    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    if (buffer.size() < (size_t)kFlightHeaderBytes) {
+        Logger.Error("File too short: ", path);
+        return false;
+    }
+
+    ReadByteStream stream(buffer.data(), (int)buffer.size());
+    const uint32_t magic = stream.Read32_LE();
+    const uint32_t version = stream.Read32_LE();
+    if (magic != kFlightFileMagic || version != kFlightFileVersion) {
+        Logger.Error("Not a flight recorder file: ", path);
+        return false;
+    }
+    const uint32_t trigger = stream.Read32_LE();
+    const uint32_t count = stream.Read32_LE();
+    record.TriggerUsec = stream.Read64_LE();
+    record.PersistUsec = stream.Read64_LE();
+    record.Trigger = trigger < (uint32_t)FlightTrigger::Count ? (FlightTrigger)trigger : FlightTrigger::None;
+
+    if ((uint64_t)stream.Remaining() < (uint64_t)count * kFlightEventBytes) {
+        Logger.Error("File truncated: ", path);
+        return false;
+    }
+
+    record.Events.resize(count);
+    for (FlightEvent& event : record.Events) {
+        event.TimeUsec = stream.Read64_LE();
+        event.FrameId = stream.Read64_LE();
+        event.Type = static_cast<FlightEventType>( stream.Read8() );
+        event.Detail = stream.Read8();
+        event.QueueDepth = stream.Read16_LE();
+        event.Bytes = stream.Read32_LE();
+        event.CaptureQueueUsec = stream.Read32_LE();
+        event.DecodeUsec = stream.Read32_LE();
+        event.EncodeUsec = stream.Read32_LE();
+        event.DeliveryUsec = stream.Read32_LE();
+        event.LatencyUsec = stream.Read32_LE();
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// FlightRecorder
+
+FlightRecorder::FlightRecorder()
+{
+    // Allocated once so recording an event never allocates
+    Events.resize(kFlightRecorderEvents);
+}
+
+void FlightRecorder::Record(const FlightEvent& event)
+{
+    Events[EventCount % kFlightRecorderEvents] = event;
+    ++EventCount;
+}
+
+void FlightRecorder::RecordFrame(const FrameTiming& timing, int bytes, bool keyframe, int queue_depth)
+{
+    FlightEvent event;
+    event.TimeUsec = GetTimeUsec();
+    event.FrameId = timing.FrameId;
+    event.Type = FlightEventType::Frame;
+    event.Detail = keyframe ? 1 : 0;
+    event.QueueDepth = ClampQueueDepth(queue_depth);
+    event.Bytes = static_cast<uint32_t>( bytes );
+
+    // Capture times from another clock are left out
+    uint64_t capture_usec = timing.CaptureUsec;
+    if (capture_usec > timing.DequeueUsec ||
+        timing.DequeueUsec - capture_usec > kFrameTimingMaxCaptureUsec)
+    {
+        capture_usec = 0;
+    }
+    event.CaptureQueueUsec = GetIntervalUsec(capture_usec, timing.DequeueUsec);
+    event.DecodeUsec = GetIntervalUsec(timing.DecodeStartUsec, timing.DecodeEndUsec);
+    event.EncodeUsec = GetIntervalUsec(timing.EncodeStartUsec, timing.EncodeEndUsec);
+    event.DeliveryUsec = GetIntervalUsec(timing.EncodeEndUsec, timing.RelayUsec);
+    event.LatencyUsec = GetIntervalUsec(capture_usec, timing.RelayUsec);
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Record(event);
+    LastFrameUsec = event.TimeUsec;
+    StallTriggered = false;
+}
+
+void FlightRecorder::RecordDrop(FlightDropReason reason, uint64_t frame_id, int queue_depth)
+{
+    FlightEvent event;
+    event.TimeUsec = GetTimeUsec();
+    event.FrameId = frame_id;
+    event.Type = FlightEventType::Drop;
+    event.Detail = static_cast<uint8_t>( reason );
+    event.QueueDepth = ClampQueueDepth(queue_depth);
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Record(event);
+}
+
+void FlightRecorder::RecordDecodeError(uint64_t frame_id, int bytes)
+{
+    FlightEvent event;
+    event.TimeUsec = GetTimeUsec();
+    event.FrameId = frame_id;
+    event.Type = FlightEventType::DecodeError;
+    event.Bytes = static_cast<uint32_t>( bytes );
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Record(event);
+
+    DecodeFailureUsec[DecodeFailureCount % kFlightDecodeFailureBurst] = event.TimeUsec;
+    ++DecodeFailureCount;
+
+    // The next slot holds the oldest of the last kFlightDecodeFailureBurst failures
+    const uint64_t oldest_usec = DecodeFailureUsec[DecodeFailureCount % kFlightDecodeFailureBurst];
+    if (DecodeFailureCount >= (unsigned)kFlightDecodeFailureBurst &&
+        event.TimeUsec - oldest_usec <= kFlightDecodeFailureWindowUsec)
+    {
+        TriggerLocked(FlightTrigger::DecodeFailures, event.TimeUsec);
+    }
+}
+
+void FlightRecorder::RecordEncodeError(uint64_t frame_id)
+{
+    FlightEvent event;
+    event.TimeUsec = GetTimeUsec();
+    event.FrameId = frame_id;
+    event.Type = FlightEventType::EncodeError;
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Record(event);
+    TriggerLocked(FlightTrigger::EncoderError, event.TimeUsec);
+}
+
+void FlightRecorder::RecordInput(FlightEventType type, int bytes, uint64_t write_usec, bool success)
+{
+    FlightEvent event;
+    event.TimeUsec = GetTimeUsec();
+    event.Type = type;
+    event.Detail = success ? 0 : 1;
+    event.Bytes = static_cast<uint32_t>( bytes );
+    event.LatencyUsec = write_usec > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>( write_usec );
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Record(event);
+}
+
+void FlightRecorder::CheckStall(uint64_t now_usec, bool active)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    if (!active) {
+        ActiveStartUsec = 0;
+        StallTriggered = false;
+        return;
+    }
+    if (ActiveStartUsec == 0) {
+        ActiveStartUsec = now_usec;
+    }
+
+    // Measure from the last frame, or from when video was first wanted
+    const uint64_t since_usec = std::max(LastFrameUsec, ActiveStartUsec);
+    if (!StallTriggered && now_usec > since_usec && now_usec - since_usec >= kFlightStallUsec) {
+        // Once per stall: Re-armed by the next frame
+        StallTriggered = true;
+        TriggerLocked(FlightTrigger::Stall, now_usec);
+    }
+}
+
+void FlightRecorder::Trigger(FlightTrigger trigger)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    TriggerLocked(trigger, GetTimeUsec());
+}
+
+bool FlightRecorder::IsTriggered() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return PendingTrigger != FlightTrigger::None;
+}
+
+void FlightRecorder::TriggerLocked(FlightTrigger trigger, uint64_t now_usec)
+{
+    if (PendingTrigger != FlightTrigger::None) {
+        return;
+    }
+    PendingTrigger = trigger;
+    PendingTriggerUsec = now_usec;
+}
+
+void FlightRecorder::GetEvents(uint64_t since_usec, std::vector<FlightEvent>& events) const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    events.clear();
+    const uint64_t oldest = EventCount > (uint64_t)kFlightRecorderEvents ? EventCount - kFlightRecorderEvents : 0;
+    for (uint64_t i = oldest; i < EventCount; ++i) {
+        const FlightEvent& event = Events[i % kFlightRecorderEvents];
+        if (event.TimeUsec >= since_usec) {
+            events.push_back(event);
+        }
+    }
+}
+
+std::string FlightRecorder::TryPersist(const std::string& dir)
+{
+    FlightTrigger trigger;
+    uint64_t trigger_usec;
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        trigger = PendingTrigger;
+        trigger_usec = PendingTriggerUsec;
+        PendingTrigger = FlightTrigger::None;
+    }
+    if (trigger == FlightTrigger::None) {
+        return std::string();
+    }
+
+    const uint64_t now_usec = GetTimeUsec();
+    if (LastPersistUsec != 0 && now_usec - LastPersistUsec < kFlightMinPersistIntervalUsec) {
+        Logger.Warn("Skipped flight recorder dump for ", FlightTriggerToString(trigger),
+            ": Last dump was ", (now_usec - LastPersistUsec) / 1000000, " seconds ago");
+        return std::string();
+    }
+    LastPersistUsec = now_usec;
+
+    const uint64_t window_usec = (uint64_t)kFlightRecorderSeconds * 1000 * 1000;
+    PersistRecord.Trigger = trigger;
+    PersistRecord.TriggerUsec = trigger_usec;
+    PersistRecord.PersistUsec = now_usec;
+    GetEvents(now_usec > window_usec ? now_usec - window_usec : 0, PersistRecord.Events);
+
+    std::ostringstream path;
+    path << dir << "/kvm_flight_" << NextFileSlot << ".bin";
+    NextFileSlot = (NextFileSlot + 1) % kFlightMaxFiles;
+
+    if (!WriteFlightRecord(path.str(), PersistRecord)) {
+        return std::string();
+    }
+
+    Logger.Warn(FlightTriggerToString(trigger), ": Wrote ", PersistRecord.Events.size(),
+        " flight recorder events to ", path.str());
+    return path.str();
+}
+
+
+} // namespace kvm
@@ -0,0 +1,132 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_stage.hpp"
+#include "kvm_logger.hpp"
+
+namespace kvm {
+
+static logger::Channel Logger("Stage");
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+const char* QueuePolicyToString(QueuePolicy policy)
+{
+    switch (policy)
+    {
+    case QueuePolicy::DropNewest: return "DropNewest";
+    case QueuePolicy::DropOldest: return "DropOldest";
+    case QueuePolicy::LatestWins: return "LatestWins";
+    case QueuePolicy::Block: return "Block";
+    default: break;
+    }
+    return "Unknown";
+}
+
+
+//------------------------------------------------------------------------------
+// PipelineStageStats
+
+void PipelineStageStats::Reset(const std::string& name, QueuePolicy policy)
+{
+    Name = name;
+    Policy = policy;
+    DropCount = 0;
+
+    Count = 0;
+    TotalUsec = 0;
+    TotalHandoffUsec = 0;
+    SlowestHandoffUsec = 0;
+    RunHistogram.Reset();
+    HandoffHistogram.Reset();
+    LastReportUsec = 0;
+}
+
+void PipelineStageStats::OnMessage(uint64_t queued_usec, uint64_t start_usec, uint64_t end_usec)
+{
+    const int64_t dt = end_usec - start_usec;
+    const int64_t handoff = start_usec - queued_usec;
+
+    if (Count == 0) {
+        FastestUsec = SlowestUsec = dt;
+        LastReportUsec = end_usec;
+    } else {
+        if (FastestUsec > dt) {
+            FastestUsec = dt;
+        }
+        if (SlowestUsec < dt) {
+            SlowestUsec = dt;
+        }
+    }
+    ++Count;
+    TotalUsec += dt;
+
+    TotalHandoffUsec += handoff;
+    if (SlowestHandoffUsec < handoff) {
+        SlowestHandoffUsec = handoff;
+    }
+
+    RunHistogram.Record(dt > 0 ? dt : 0);
+    HandoffHistogram.Record(handoff > 0 ? handoff : 0);
+
+    const int64_t report_interval_usec = 20 * 1000 * 1000;
+    if (end_usec - LastReportUsec > report_interval_usec) {
+        Logger.Info(Name, ": ", Count, " frames, avg=",
+            TotalUsec / (float)Count / 1000.f, ", min=",
+            FastestUsec / 1000.f, ", p99=", RunHistogram.GetPercentile(99.f) / 1000.f,
+            ", max=", SlowestUsec / 1000.f,
+            " (msec) handoff avg=", TotalHandoffUsec / (float)Count,
+            ", p99=", HandoffHistogram.GetPercentile(99.f),
+            ", max=", SlowestHandoffUsec, " (usec) dropped=", DropCount.exchange(0));
+
+        Count = 0;
+        TotalUsec = 0;
+        TotalHandoffUsec = 0;
+        SlowestHandoffUsec = 0;
+        RunHistogram.Reset();
+        HandoffHistogram.Reset();
+        LastReportUsec = end_usec;
+    }
+}
+
+void PipelineStageStats::OnDrop()
+{
+    ++DropCount;
+
+    // Skipping to the latest message is expected for LatestWins
+    if (Policy != QueuePolicy::LatestWins) {
+        Logger.Error(Name, ": Fell too far behind. Dropping frame! policy=", QueuePolicyToString(Policy));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// GraphStage
+
+void WarnStageNotBypassable(const std::string& name)
+{
+    Logger.Warn(name, ": Cannot be disabled because its input and output types differ. Keeping it enabled");
+}
+
+
+//------------------------------------------------------------------------------
+// PipelineGraph
+
+void PipelineGraph::Start()
+{
+    for (size_t i = Stages.size(); i-- > 0;) {
+        Stages[i]->Start();
+    }
+}
+
+void PipelineGraph::Stop()
+{
+    for (GraphStageBase* stage : Stages) {
+        Logger.Info(stage->GetName(), " shutdown...");
+        stage->Stop();
+    }
+}
+
+
+} // namespace kvm
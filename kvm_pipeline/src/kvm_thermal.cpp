@@ -0,0 +1,196 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_thermal.hpp"
+#include "kvm_logger.hpp"
+
+#include <fstream>
+
+namespace kvm {
+
+static logger::Channel Logger("Thermal");
+
+// get_throttled bits: Frequency capped, currently throttled, soft limit
+static const unsigned kFirmwareThrottledMask = 0x2 | 0x4 | 0x8;
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+const char* ThermalStateToString(ThermalState state)
+{
+    switch (state)
+    {
+    case ThermalState::Unknown: return "Unknown";
+    case ThermalState::Normal: return "Normal";
+    case ThermalState::Warm: return "Warm";
+    case ThermalState::Hot: return "Hot";
+    case ThermalState::Throttled: return "Throttled";
+    default: break;
+    }
+    return "Unknown";
+}
+
+static int GetMinOverloadLevel(ThermalState state)
+{
+    switch (state)
+    {
+    case ThermalState::Warm: return 1;
+    case ThermalState::Hot: return 2;
+    case ThermalState::Throttled: return 3;
+    default: break;
+    }
+    return 0;
+}
+
+static bool ReadDecimal(const std::string& path, int& value)
+{
+    std::ifstream file(path);
+    return file && (file >> value);
+}
+
+static bool ReadHex(const std::string& path, unsigned& value)
+{
+    std::ifstream file(path);
+    return file && (file >> std::hex >> value);
+}
+
+
+//------------------------------------------------------------------------------
+// ThermalGovernor
+
+bool ThermalGovernor::SetSettings(const ThermalSettings& settings)
+{
+    if (!settings.IsValid()) {
+        Logger.Error("Invalid thermal settings: Warm=", settings.WarmMillidegrees,
+            " Hot=", settings.HotMillidegrees, " Hysteresis=", settings.HysteresisMillidegrees);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> locker(Lock);
+    Settings = settings;
+    LastReadUsec = 0;
+    ReportedMissing = false;
+    return true;
+}
+
+ThermalSettings ThermalGovernor::GetSettings() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return Settings;
+}
+
+ThermalStatus ThermalGovernor::GetStatus() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return Status;
+}
+
+ThermalState ThermalGovernor::GetTargetState(int temperature, bool throttled) const
+{
+    if (throttled) {
+        return ThermalState::Throttled;
+    }
+    if (temperature >= Settings.HotMillidegrees) {
+        return ThermalState::Hot;
+    }
+    if (temperature >= Settings.WarmMillidegrees) {
+        return ThermalState::Warm;
+    }
+    return ThermalState::Normal;
+}
+
+bool ThermalGovernor::CanLeaveState(ThermalState state, int temperature, bool throttled) const
+{
+    switch (state)
+    {
+    case ThermalState::Warm:
+        return temperature < Settings.WarmMillidegrees - Settings.HysteresisMillidegrees;
+    case ThermalState::Hot:
+        return temperature < Settings.HotMillidegrees - Settings.HysteresisMillidegrees;
+    case ThermalState::Throttled:
+        return !throttled && temperature < Settings.HotMillidegrees - Settings.HysteresisMillidegrees;
+    default: break;
+    }
+    return true;
+}
+
+bool ThermalGovernor::Update(uint64_t now_usec)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    if (LastReadUsec != 0 && now_usec - LastReadUsec < kThermalIntervalUsec) {
+        return false;
+    }
+    LastReadUsec = now_usec;
+
+    const int previous_level = Status.MinOverloadLevel;
+
+    if (!Settings.Enabled) {
+        Status = ThermalStatus();
+        return previous_level != 0;
+    }
+
+    int temperature = -1;
+    if (!ReadDecimal(Settings.TemperaturePath, temperature)) {
+        if (!ReportedMissing) {
+            Logger.Warn("Cannot read temperature from ", Settings.TemperaturePath, ": Thermal governor inactive");
+            ReportedMissing = true;
+        }
+        Status.State = ThermalState::Unknown;
+        Status.TemperatureMillidegrees = -1;
+        Status.MinOverloadLevel = 0;
+        return previous_level != 0;
+    }
+    ReportedMissing = false;
+
+    int current_khz = -1, max_khz = -1;
+    ReadDecimal(Settings.CurrentFreqPath, current_khz);
+    ReadDecimal(Settings.MaxFreqPath, max_khz);
+
+    bool throttled = false;
+    unsigned flags = 0;
+    if (ReadHex(Settings.ThrottledPath, flags)) {
+        throttled = (flags & kFirmwareThrottledMask) != 0;
+    } else if (current_khz > 0 && max_khz > 0 && current_khz < max_khz) {
+        // An idle CPU clocks down too, so only trust this when warm
+        throttled = temperature >= Settings.WarmMillidegrees;
+    }
+
+    Status.TemperatureMillidegrees = temperature;
+    Status.CurrentFreqKhz = current_khz;
+    Status.MaxFreqKhz = max_khz;
+    Status.Throttled = throttled;
+
+    const ThermalState current = Status.State;
+    const ThermalState target = GetTargetState(temperature, throttled);
+
+    ThermalState next = current;
+    if (current == ThermalState::Unknown || target > current) {
+        // Step up right away, before the firmware throttles
+        next = target;
+    } else if (target < current &&
+        now_usec - StateStartUsec >= kThermalHoldUsec &&
+        CanLeaveState(current, temperature, throttled))
+    {
+        // Step down one state at a time
+        next = static_cast<ThermalState>( static_cast<int>( current ) - 1 );
+    }
+
+    if (next != current) {
+        if (next > current && current != ThermalState::Unknown) {
+            ++Status.StepUpCount;
+        }
+        Status.State = next;
+        Status.MinOverloadLevel = GetMinOverloadLevel(next);
+        StateStartUsec = now_usec;
+
+        Logger.Info("Thermal state ", ThermalStateToString(current), " -> ", ThermalStateToString(next),
+            ": temperature=", temperature / 1000.f, " C clock=", current_khz / 1000, "/", max_khz / 1000,
+            " MHz throttled=", throttled, " minimum overload level=", Status.MinOverloadLevel);
+    }
+
+    return Status.MinOverloadLevel != previous_level;
+}
+
+
+} // namespace kvm
@@ -0,0 +1,147 @@
+// Copyright 2020 Christopher A. Taylor
+
+#include "kvm_timing.hpp"
+#include "kvm_logger.hpp"
+
+#include <time.h>
+
+namespace kvm {
+
+static logger::Channel Logger("FrameTiming");
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+uint64_t GetThreadCpuUsec()
+{
+    timespec ts{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+
+//------------------------------------------------------------------------------
+// FrameTimingStats
+
+const char* FrameIntervalToString(FrameInterval interval)
+{
+    static_assert((int)FrameInterval::Count == 13, "Update this switch");
+    switch (interval)
+    {
+    case FrameInterval::CaptureQueue: return "Capture queue";
+    case FrameInterval::DecodeQueue: return "Decode queue";
+    case FrameInterval::Decode: return "Decode";
+    case FrameInterval::DecodeCpu: return "Decode CPU";
+    case FrameInterval::EncodeQueue: return "Encode queue";
+    case FrameInterval::Encode: return "Encode";
+    case FrameInterval::EncodeCpu: return "Encode CPU";
+    case FrameInterval::Parse: return "Parse";
+    case FrameInterval::ParseCpu: return "Parse CPU";
+    case FrameInterval::DeliveryQueue: return "Delivery queue";
+    case FrameInterval::Packetize: return "Packetize";
+    case FrameInterval::PacketizeCpu: return "Packetize CPU";
+    case FrameInterval::EndToEnd: return "End to end";
+    default: break;
+    }
+    return "Unknown";
+}
+
+void FrameTimingStats::RecordInterval(FrameInterval interval, uint64_t start_usec, uint64_t end_usec)
+{
+    if (start_usec == 0 || end_usec < start_usec) {
+        return;
+    }
+    Histograms[(int)interval].Record(end_usec - start_usec);
+}
+
+void FrameTimingStats::Record(const FrameTiming& timing)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    // Capture times come from the device clock, so skip any that are
+    // clearly from another clock
+    uint64_t capture_usec = timing.CaptureUsec;
+    if (capture_usec > timing.DequeueUsec ||
+        timing.DequeueUsec - capture_usec > kFrameTimingMaxCaptureUsec)
+    {
+        capture_usec = 0;
+    }
+
+    RecordInterval(FrameInterval::CaptureQueue, capture_usec, timing.DequeueUsec);
+    RecordInterval(FrameInterval::DecodeQueue, timing.DequeueUsec, timing.DecodeStartUsec);
+    RecordInterval(FrameInterval::Decode, timing.DecodeStartUsec, timing.DecodeEndUsec);
+    RecordInterval(FrameInterval::EncodeQueue, timing.DecodeEndUsec, timing.EncodeStartUsec);
+    RecordInterval(FrameInterval::Encode, timing.EncodeStartUsec, timing.EncodeEndUsec);
+    RecordInterval(FrameInterval::Parse, timing.EncodeEndUsec, timing.ParseEndUsec);
+    RecordInterval(FrameInterval::DeliveryQueue, timing.ParseEndUsec, timing.PacketizeUsec);
+    RecordInterval(FrameInterval::Packetize, timing.PacketizeUsec, timing.RelayUsec);
+    RecordInterval(FrameInterval::EndToEnd, capture_usec, timing.RelayUsec);
+
+    if (timing.DecodeEndUsec != 0) {
+        Histograms[(int)FrameInterval::DecodeCpu].Record(timing.DecodeCpuUsec);
+    }
+    if (timing.EncodeEndUsec != 0) {
+        Histograms[(int)FrameInterval::EncodeCpu].Record(timing.EncodeCpuUsec);
+    }
+    if (timing.ParseEndUsec != 0) {
+        Histograms[(int)FrameInterval::ParseCpu].Record(timing.ParseCpuUsec);
+    }
+    if (timing.RelayUsec != 0) {
+        Histograms[(int)FrameInterval::PacketizeCpu].Record(timing.PacketizeCpuUsec);
+    }
+}
+
+FrameIntervalSummary FrameTimingStats::GetSummary(FrameInterval interval) const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    const LatencyHistogram& histogram = Histograms[(int)interval];
+
+    FrameIntervalSummary summary;
+    summary.Count = histogram.GetCount();
+    summary.P50Usec = histogram.GetPercentile(50.f);
+    summary.P90Usec = histogram.GetPercentile(90.f);
+    summary.P99Usec = histogram.GetPercentile(99.f);
+    summary.MaxUsec = histogram.GetMax();
+    return summary;
+}
+
+void FrameTimingStats::TryReport(uint64_t now_usec)
+{
+    if (LastReportUsec == 0) {
+        LastReportUsec = now_usec;
+        return;
+    }
+    if (now_usec - LastReportUsec < kReportIntervalUsec) {
+        return;
+    }
+    LastReportUsec = now_usec;
+
+    for (int i = 0; i < (int)FrameInterval::Count; ++i) {
+        const FrameInterval interval = static_cast<FrameInterval>( i );
+        const FrameIntervalSummary summary = GetSummary(interval);
+        if (summary.Count == 0) {
+            continue;
+        }
+        Logger.Info(FrameIntervalToString(interval), ": p50=", summary.P50Usec / 1000.f,
+            " p90=", summary.P90Usec / 1000.f, " p99=", summary.P99Usec / 1000.f,
+            " max=", summary.MaxUsec / 1000.f, " (msec) frames=", summary.Count);
+    }
+
+    Reset();
+}
+
+void FrameTimingStats::Reset()
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    for (auto& histogram : Histograms) {
+        histogram.Reset();
+    }
+}
+
+
+} // namespace kvm
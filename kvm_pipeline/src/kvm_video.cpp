@@ -31,50 +31,16 @@ int FindAnnexBStart(const uint8_t* data, int bytes)
     return -1;
 }
 
-static const int kAnnexBPrefixBytes = 3;
-
-int EnumerateAnnexBNalus(uint8_t* data, int bytes, NaluCallback callback)
+void SkipAnnexBStart(const uint8_t*& data, int& bytes)
 {
-    int nalu_count = 0;
-    int last_offset = -kAnnexBPrefixBytes;
-
-    for (;;)
-    {
-        const int next_start = last_offset + kAnnexBPrefixBytes;
-        int nal_offset = FindAnnexBStart(data + next_start, bytes - next_start);
-
-        if (nal_offset < 0) {
-            break;
-        }
-        nal_offset += next_start;
-
-        if (last_offset >= 0)
-        {
-            uint8_t* nal_data = data + last_offset + kAnnexBPrefixBytes;
-            int nal_bytes = nal_offset - last_offset - kAnnexBPrefixBytes;
-
-            // Check for extra 00
-            if (nal_data[nal_bytes - 1] == 0) {
-                nal_bytes--;
-            }
-
-            callback(nal_data, nal_bytes);
-            ++nalu_count;
-        }
-
-        last_offset = nal_offset;
+    int zeroes = 0;
+    while (zeroes < bytes && zeroes < 3 && data[zeroes] == 0) {
+        ++zeroes;
     }
-
-    if (last_offset >= 0)
-    {
-        uint8_t* nal_data = data + last_offset + kAnnexBPrefixBytes;
-        const int nal_bytes = bytes - last_offset - kAnnexBPrefixBytes;
-
-        callback(nal_data, nal_bytes);
-        ++nalu_count;
+    if (zeroes >= 2 && zeroes < bytes && data[zeroes] == 1) {
+        data += zeroes + 1;
+        bytes -= zeroes + 1;
     }
-
-    return nalu_count;
 }
 
 unsigned ReadExpGolomb(ReadBitStream& bs)
@@ -131,7 +97,7 @@ void VideoParser::AppendSlice(uint8_t* ptr, int bytes, bool new_picture, bool ke
         return;
     }
 
-    picture.Ranges.emplace_back(ptr, bytes);
+    picture.Ranges[picture.RangeCount++] = CopyRange(ptr, bytes);
     picture.TotalBytes += bytes;
     picture.Keyframe = keyframe;
 }
@@ -141,22 +107,48 @@ void VideoParser::ParseVideo(
     uint8_t* data,
     int bytes)
 {
-    NaluCallback nalu_callback;
     if (is_hevc_else_h264) {
-        nalu_callback = [this](uint8_t* data, int bytes) {
-            ParseNalUnitHEVC(data, bytes);
-        };
+        NalUnitCount += EnumerateAnnexBNalus(data, bytes,
+            [this](uint8_t* nalu_data, int nalu_bytes) {
+                ParseNalUnitHEVC(nalu_data, nalu_bytes);
+            });
     }
     else {
-        nalu_callback = [this](uint8_t* data, int bytes) {
-            ParseNalUnitH264(data, bytes);
-        };
+        NalUnitCount += EnumerateAnnexBNalus(data, bytes,
+            [this](uint8_t* nalu_data, int nalu_bytes) {
+                ParseNalUnitH264(nalu_data, nalu_bytes);
+            });
+    }
+}
+
+void VideoParser::CopyParameters(std::shared_ptr<std::vector<uint8_t>>& params) const
+{
+    if (params && (int)params->size() == TotalParameterBytes) {
+        const uint8_t* src = params->data();
+        bool same = true;
+        for (auto& range : Parameters) {
+            if (memcmp(src, range.Ptr, range.Bytes) != 0) {
+                same = false;
+                break;
+            }
+            src += range.Bytes;
+        }
+        if (same) {
+            return;
+        }
+    }
+
+    // Pictures still in flight keep the old parameters
+    if (!IsOnlyReference(params)) {
+        params = std::make_shared<std::vector<uint8_t>>();
     }
+    params->resize(TotalParameterBytes);
 
-    NalUnitCount += EnumerateAnnexBNalus(
-        data,
-        bytes,
-        nalu_callback);
+    uint8_t* dest = params->data();
+    for (auto& range : Parameters) {
+        memcpy(dest, range.Ptr, range.Bytes);
+        dest += range.Bytes;
+    }
 }
 
 void VideoParser::ParseNalUnitH264(uint8_t* data, int bytes)
@@ -315,85 +307,109 @@ RtpPayloader::RtpPayloader()
 }
 
 void RtpPayloader::WrapH264Rtp(
-    uint64_t shutter_usec,
-    const uint8_t* data,
-    int bytes,
-    RtpCallback callback)
+    const VideoPicture& picture,
+    const RtpCallback& callback)
 {
-    const uint32_t pts = static_cast<uint32_t>( shutter_usec * 9 / 100 );
-
-    EnumerateAnnexBNalus((uint8_t*)data, bytes, [&](uint8_t* nalu_data, int nalu_bytes) {
-        const int nal_ref_idc = (nalu_data[0] >> 5) & 3;
-        const int nal_unit_type = nalu_data[0] & 0x1f;
+    const uint32_t pts = static_cast<uint32_t>( picture.ShutterUsec * 9 / 100 );
+
+    // Parameter sets are small and only sent with keyframes, so they are
+    // split into NAL units by scanning for start codes
+    if (picture.Parameters && !picture.Parameters->empty()) {
+        EnumerateAnnexBNalus(picture.Parameters->data(), (int)picture.Parameters->size(),
+            [&](uint8_t* nalu_data, int nalu_bytes) {
+                WrapNalu(pts, nalu_data, nalu_bytes, callback);
+            });
+    }
 
-        if (nal_unit_type == 7) {
-            std::lock_guard<std::mutex> locker(Lock);
-            SPS.resize(nalu_bytes);
-            memcpy(SPS.data(), nalu_data, nalu_bytes);
-        }
-        if (nal_unit_type == 8) {
-            std::lock_guard<std::mutex> locker(Lock);
-            PPS.resize(nalu_bytes);
-            memcpy(PPS.data(), nalu_data, nalu_bytes);
-        }
+    // Each slice range is already one NAL unit
+    for (int i = 0; i < picture.SliceCount; ++i) {
+        const uint8_t* nalu_data = picture.Slices[i].Ptr;
+        int nalu_bytes = picture.Slices[i].Bytes;
+        SkipAnnexBStart(nalu_data, nalu_bytes);
+        WrapNalu(pts, nalu_data, nalu_bytes, callback);
+    }
+}
 
-        // M=1 if this is an access unit
-        const bool marked = nal_unit_type >= 1 && nal_unit_type <= 5;
+void RtpPayloader::WrapNalu(
+    uint32_t pts,
+    const uint8_t* nalu_data,
+    int nalu_bytes,
+    const RtpCallback& callback)
+{
+    if (nalu_bytes < 1) {
+        return;
+    }
 
-        uint8_t* dest = Datagram;
+    const int nal_ref_idc = (nalu_data[0] >> 5) & 3;
+    const int nal_unit_type = nalu_data[0] & 0x1f;
 
-        if (nalu_bytes + kRtpBytes <= kDatagramBytes) {
-            WriteRtpHeader(
-                dest,
-                marked,
-                NextSequence++,
-                pts,
-                SSRC);
-            memcpy(dest + kRtpBytes, nalu_data, nalu_bytes);
-            callback(dest, kRtpBytes + nalu_bytes);
-            return;
-        }
+    if (nal_unit_type == 7) {
+        std::lock_guard<std::mutex> locker(Lock);
+        SPS.resize(nalu_bytes);
+        memcpy(SPS.data(), nalu_data, nalu_bytes);
+    }
+    if (nal_unit_type == 8) {
+        std::lock_guard<std::mutex> locker(Lock);
+        PPS.resize(nalu_bytes);
+        memcpy(PPS.data(), nalu_data, nalu_bytes);
+    }
 
-        const int kFuOverhead = kRtpBytes + 2; // FU-A overhead
+    // M=1 if this is an access unit
+    const bool marked = nal_unit_type >= 1 && nal_unit_type <= 5;
 
-        const uint8_t* src = nalu_data + 1;
-        int remaining = nalu_bytes - 1;
+    uint8_t* dest = Datagram;
 
-        bool first = true;
-        while (remaining > 0) {
-            int frag_bytes = kDatagramBytes - kFuOverhead;
-            const bool last = remaining <= frag_bytes;
-            if (last) {
-                frag_bytes = remaining;
-            }
+    if (nalu_bytes + kRtpBytes <= kDatagramBytes) {
+        WriteRtpHeader(
+            dest,
+            marked,
+            NextSequence++,
+            pts,
+            SSRC);
+        memcpy(dest + kRtpBytes, nalu_data, nalu_bytes);
+        callback(dest, kRtpBytes + nalu_bytes);
+        return;
+    }
 
-            WriteRtpHeader(
-                dest,
-                marked && last,
-                NextSequence++,
-                pts,
-                SSRC);
+    const int kFuOverhead = kRtpBytes + 2; // FU-A overhead
 
-            dest[kRtpBytes] = static_cast<uint8_t>( 28 | (nal_ref_idc << 5) );
+    const uint8_t* src = nalu_data + 1;
+    int remaining = nalu_bytes - 1;
 
-            uint8_t fu = static_cast<uint8_t>( nal_unit_type );
-            if (first) {
-                fu |= 0x80;
-            }
-            if (last) {
-                fu |= 0x40;
-            }
-            dest[kRtpBytes + 1] = fu;
+    bool first = true;
+    while (remaining > 0) {
+        int frag_bytes = kDatagramBytes - kFuOverhead;
+        const bool last = remaining <= frag_bytes;
+        if (last) {
+            frag_bytes = remaining;
+        }
 
-            memcpy(dest + kFuOverhead, src, frag_bytes);
+        WriteRtpHeader(
+            dest,
+            marked && last,
+            NextSequence++,
+            pts,
+            SSRC);
 
-            callback(dest, kFuOverhead + frag_bytes);
+        dest[kRtpBytes] = static_cast<uint8_t>( 28 | (nal_ref_idc << 5) );
 
-            src += frag_bytes;
-            remaining -= frag_bytes;
-            first = false;
+        uint8_t fu = static_cast<uint8_t>( nal_unit_type );
+        if (first) {
+            fu |= 0x80;
+        }
+        if (last) {
+            fu |= 0x40;
         }
-    });
+        dest[kRtpBytes + 1] = fu;
+
+        memcpy(dest + kFuOverhead, src, frag_bytes);
+
+        callback(dest, kFuOverhead + frag_bytes);
+
+        src += frag_bytes;
+        remaining -= frag_bytes;
+        first = false;
+    }
 }
 
 std::string RtpPayloader::GenerateSDP() const
@@ -0,0 +1,378 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Check that frames do not allocate memory once the pipeline is warmed up.
+
+    Global operator new is replaced with one that counts calls.  The real
+    VideoPipeline stages run without the capture and encoder hardware:
+
+        Capture (test thread) -> Decoder -> Scaler -> Encoder -> Pacer -> App
+
+    + Capture: Captured YUYV frames come from a BlockPool through
+      std::allocate_shared like V4L2Capture, and are pushed to the decoder.
+    + Decoder: Converts them to YUV420P in the raw FramePool and detects
+      changes from the previous frame.
+    + Scaler: The main output keeps the decoded resolution, and a second
+      output scales into its own FramePool.
+    + Encoder: A stub encoder writes a canned H.264 access unit into buffers
+      from an EncodedBufferPool, with a keyframe every few frames.  The real
+      handler builds the QP offset map, parses the output and builds the
+      VideoPictures that reference it.
+    + Pacer and App: Pace the pictures, record the statistics, timings and
+      flight recorder events, and packetize the main output for RTP.
+
+    The warm-up holds the App callbacks until every queue is full, which is
+    the most frames that can be in flight at once, so the pools reach their
+    largest size.  After that, any allocation during the measured frames
+    fails the test.
+
+        kvm_alloc_test
+*/
+
+#include "kvm_pipeline.hpp"
+#include "kvm_pool.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("AllocTest");
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+
+//------------------------------------------------------------------------------
+// Allocation counter
+
+static std::atomic<uint64_t> AllocationCount = ATOMIC_VAR_INIT(0);
+
+void* operator new(size_t bytes)
+{
+    ++AllocationCount;
+    void* ptr = std::malloc(bytes ? bytes : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t bytes)
+{
+    return operator new(bytes);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*bytes*/) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t /*bytes*/) noexcept
+{
+    std::free(ptr);
+}
+
+
+//------------------------------------------------------------------------------
+// Canned encoder output
+
+static const uint8_t kParameters[] = {
+    0, 0, 1, 0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8, // SPS
+    0, 0, 1, 0x68, 0xce, 0x0f, 0xc8, // PPS
+};
+
+// Slice with first_mb_in_slice = 0
+static const uint8_t kSliceHeader[] = { 0x88, 0x84, 0x00, 0x33 };
+
+static const int kSliceBytes = 3000;
+
+static void WriteSlice(std::vector<uint8_t>& buffer, bool keyframe)
+{
+    const uint8_t start[] = { 0, 0, 0, 1, (uint8_t)(keyframe ? 0x65 : 0x41) };
+    buffer.insert(buffer.end(), start, start + sizeof(start));
+    buffer.insert(buffer.end(), kSliceHeader, kSliceHeader + sizeof(kSliceHeader));
+    buffer.resize(buffer.size() + kSliceBytes, 0x55);
+}
+
+
+//------------------------------------------------------------------------------
+// Test pipeline
+
+static const int kWarmupFrames = 100;
+static const int kMeasuredFrames = 1000;
+static const int kKeyframeInterval = 10;
+
+static const int kCaptureWidth = 64;
+static const int kCaptureHeight = 48;
+static const int kScaledWidth = 32;
+static const int kScaledHeight = 24;
+
+// Captured images, each with different content so every frame changes
+static const int kCaptureImageCount = 4;
+
+typedef BlockPool<sizeof(CameraFrame) + 64, 16> TestCameraFramePool;
+static TestCameraFramePool CameraPool;
+
+class TestPipeline : public VideoPipeline
+{
+public:
+    std::atomic<int> CapturedCount = ATOMIC_VAR_INIT(0);
+    std::atomic<int> DeliveredCount = ATOMIC_VAR_INIT(0);
+    std::atomic<int> ScaledCount = ATOMIC_VAR_INIT(0);
+    std::atomic<int> PacketCount = ATOMIC_VAR_INIT(0);
+
+    // While set, the App callbacks wait, which backs up every stage
+    std::atomic<bool> Stalled = ATOMIC_VAR_INIT(false);
+
+    TestPipeline()
+    {
+        // Deliver every frame, so the counts show none were lost
+        VideoPipelineConfig config;
+        config.Decoder.Policy = QueuePolicy::Block;
+        config.Scaler.Policy = QueuePolicy::Block;
+        config.Encoder.Policy = QueuePolicy::Block;
+        config.Pacer.Policy = QueuePolicy::Block;
+        config.Pacer.Enabled = true;
+        config.App.Policy = QueuePolicy::Block;
+        SetConfig(config);
+
+        VideoOutputConfig scaled;
+        scaled.Width = kScaledWidth;
+        scaled.Height = kScaledHeight;
+        AddOutput(scaled, [this](const VideoPicture& /*picture*/) {
+            WaitWhileStalled();
+            ++ScaledCount;
+        });
+
+        Outputs[0]->Callback = [this](const VideoPicture& picture) {
+            WaitWhileStalled();
+            Payloader.WrapH264Rtp(picture, OnPacket);
+            ++DeliveredCount;
+        };
+        OnPacket = [this](const uint8_t* /*data*/, int bytes) {
+            if (bytes > 0) {
+                ++PacketCount;
+            }
+        };
+
+        const int row_bytes = kCaptureWidth * 2;
+        for (int i = 0; i < kCaptureImageCount; ++i) {
+            Images[i].resize(row_bytes * kCaptureHeight);
+            for (size_t j = 0; j < Images[i].size(); ++j) {
+                Images[i][j] = static_cast<uint8_t>( (j * (i + 3)) >> 2 );
+            }
+        }
+    }
+
+    // Runs the stages without the capture loop
+    void StartStages()
+    {
+        BuildGraph();
+        Graph.Start();
+    }
+
+    void StopStages()
+    {
+        Graph.Stop();
+        PreviousRawFrame = nullptr;
+    }
+
+    // Capture thread
+    void Capture(uint64_t frame_number)
+    {
+        std::shared_ptr<CameraFrame> buffer = std::allocate_shared<CameraFrame>(
+            PoolAllocator<CameraFrame, TestCameraFramePool>(&CameraPool));
+        std::vector<uint8_t>& image = Images[frame_number % kCaptureImageCount];
+        buffer->FrameNumber = frame_number;
+        buffer->ShutterUsec = GetTimeUsec();
+        buffer->Image = image.data();
+        buffer->ImageBytes = static_cast<unsigned>( image.size() );
+        buffer->Format.Format = PixelFormat::YUYV;
+        buffer->Format.Width = kCaptureWidth;
+        buffer->Format.RowBytes = kCaptureWidth * 2;
+        buffer->Format.Height = kCaptureHeight;
+        LastCaptured = buffer;
+
+        CaptureMessage message;
+        message.Buffer = buffer;
+        message.Timing.FrameId = frame_number;
+        message.Timing.CaptureUsec = buffer->ShutterUsec;
+        message.Timing.DequeueUsec = GetTimeUsec();
+        DecoderStage.Push(std::move(message));
+        ++CapturedCount;
+    }
+
+    // True once every captured frame has been released
+    bool CapturedReleased() const
+    {
+        return LastCaptured.expired();
+    }
+
+    uint64_t GetEncodedOverflows() const
+    {
+        return EncodedPools[0].GetOverflowCount() + EncodedPools[1].GetOverflowCount();
+    }
+
+protected:
+    std::vector<uint8_t> Images[kCaptureImageCount];
+    std::weak_ptr<CameraFrame> LastCaptured;
+
+    // Encoder threads
+    EncodedBufferPool EncodedPools[2];
+    uint64_t EncodedCount[2] = {};
+
+    // App thread
+    RtpPayloader Payloader;
+    RtpCallback OnPacket;
+
+    void WaitWhileStalled()
+    {
+        while (Stalled) {
+            ThreadSleepForMsec(1);
+        }
+    }
+
+    // Stub for MmalEncoder::Encode()
+    std::shared_ptr<std::vector<uint8_t>> EncodeImage(
+        VideoOutput& out,
+        const std::shared_ptr<Frame>& /*frame*/,
+        bool force_keyframe,
+        const QpOffsetMap* /*qp_map*/) override
+    {
+        EncodedBufferPool& pool = EncodedPools[out.Index];
+        const bool keyframe = force_keyframe || EncodedCount[out.Index]++ % kKeyframeInterval == 0;
+
+        std::shared_ptr<std::vector<uint8_t>> data = pool.Allocate();
+        if (keyframe) {
+            data->insert(data->end(), kParameters, kParameters + sizeof(kParameters));
+        }
+        WriteSlice(*data, keyframe);
+
+        pool.OnOutputBytes((int)data->size());
+        return data;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static void WaitForDelivery(TestPipeline& pipeline, int count)
+{
+    while (pipeline.DeliveredCount < count || pipeline.ScaledCount < count) {
+        ThreadSleepForMsec(1);
+    }
+}
+
+// Pass frames through the pipeline, pausing after every burst_frames
+static void CaptureFrames(TestPipeline& pipeline, uint64_t& frame_number, int count, int burst_frames)
+{
+    for (int i = 0; i < count; ++i) {
+        pipeline.Capture(++frame_number);
+        if (i % burst_frames == burst_frames - 1) {
+            ThreadSleepForMsec(1);
+        }
+    }
+}
+
+static void RunFrames(TestPipeline& pipeline, uint64_t& frame_number, int count, int burst_frames)
+{
+    const int expected = pipeline.DeliveredCount + count;
+    CaptureFrames(pipeline, frame_number, count, burst_frames);
+    WaitForDelivery(pipeline, expected);
+}
+
+static void TestSteadyState()
+{
+    TestPipeline pipeline;
+    pipeline.StartStages();
+
+    // Warm up with delivery stalled, until capture blocks on the full queues
+    uint64_t frame_number = 0;
+    pipeline.Stalled = true;
+    std::thread capture_thread(CaptureFrames, std::ref(pipeline), std::ref(frame_number),
+        kWarmupFrames, kWarmupFrames);
+    int captured = -1;
+    while (captured != pipeline.CapturedCount) {
+        captured = pipeline.CapturedCount;
+        ThreadSleepForMsec(100);
+    }
+    Expect(captured < kWarmupFrames, "Stalled delivery fills the queues");
+    pipeline.Stalled = false;
+    capture_thread.join();
+    WaitForDelivery(pipeline, kWarmupFrames);
+
+    // Nothing else may log while measuring
+    logger::Flush();
+    ThreadSleepForMsec(10);
+
+    const uint64_t allocations_before = AllocationCount;
+    RunFrames(pipeline, frame_number, kMeasuredFrames, 4);
+    const uint64_t allocations = AllocationCount - allocations_before;
+
+    const int packets = pipeline.PacketCount;
+    pipeline.StopStages();
+
+    Logger.Info("Steady state: ", allocations, " allocations in ", kMeasuredFrames,
+        " frames, ", packets, " RTP packets, camera pool fallbacks: ", CameraPool.GetFallbackCount(),
+        ", encoded buffer overflows: ", pipeline.GetEncodedOverflows());
+
+    Expect(allocations == 0, "Frames do not allocate memory in steady state");
+    Expect(packets > 0, "Pictures are packetized");
+    Expect(CameraPool.GetFallbackCount() == 0, "Captured frames fit in the pool");
+    Expect(pipeline.GetEncodedOverflows() == 0, "Encoded buffers fit in the pool");
+    Expect(pipeline.CapturedReleased(), "Captured frames are released");
+}
+
+static void TestParameterReuse()
+{
+    std::vector<uint8_t> data;
+    data.insert(data.end(), kParameters, kParameters + sizeof(kParameters));
+    WriteSlice(data, true);
+
+    VideoParser parser;
+    parser.Reset();
+    parser.ParseVideo(false, data.data(), (int)data.size());
+
+    std::shared_ptr<std::vector<uint8_t>> params;
+    parser.CopyParameters(params);
+    const std::vector<uint8_t>* first = params.get();
+
+    // Unchanged parameters keep the same buffer
+    parser.CopyParameters(params);
+    Expect(params.get() == first && params->size() == sizeof(kParameters) &&
+        memcmp(params->data(), kParameters, sizeof(kParameters)) == 0, "Unchanged parameters keep the buffer");
+
+    // Changed parameters still referenced by a picture get a new buffer
+    std::shared_ptr<std::vector<uint8_t>> in_flight = params;
+    data[4] ^= 1;
+    parser.CopyParameters(params);
+    Expect(params.get() != first && (*params)[4] == data[4] && (*in_flight)[4] == kParameters[4],
+        "Changed parameters in flight get a new buffer");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_alloc_test");
+
+    TestParameterReuse();
+    TestSteadyState();
+
+    return TestResult("Allocation test");
+}
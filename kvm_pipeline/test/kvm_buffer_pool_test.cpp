@@ -0,0 +1,181 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test buffer reuse in EncodedBufferPool and FramePool:
+
+    + Buffers are reused once every other reference is gone
+    + Buffers still referenced elsewhere are not handed out again
+    + Buffers released on another thread are reused as soon as the thread
+      drops its reference, without waiting for the thread to exit
+    + When every pooled buffer is in use, new buffers are allocated outside
+      the pool and counted, and the pool is reused once they are released
+
+        kvm_buffer_pool_test
+*/
+
+#include "kvm_encode.hpp"
+#include "kvm_frame.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("BufferPoolTest");
+
+
+//------------------------------------------------------------------------------
+// EncodedBufferPool
+
+static void TestEncodedReuse()
+{
+    EncodedBufferPool pool;
+
+    auto first = pool.Allocate();
+    const std::vector<uint8_t>* first_ptr = first.get();
+
+    // Still held: Must get a different buffer
+    auto second = pool.Allocate();
+    Expect(second && second.get() != first_ptr, "Held encoded buffer is not reused");
+
+    first.reset();
+    auto third = pool.Allocate();
+    Expect(third.get() == first_ptr && third->empty(), "Released encoded buffer is reused empty");
+}
+
+static void TestEncodedCrossThread()
+{
+    EncodedBufferPool pool;
+
+    std::atomic<bool> passed = ATOMIC_VAR_INIT(true);
+    for (int i = 0; i < 100; ++i)
+    {
+        auto buffer = pool.Allocate();
+        const std::vector<uint8_t>* ptr = buffer.get();
+        buffer->push_back(static_cast<uint8_t>( i ));
+
+        // Consumer thread reads the buffer and drops the last other reference
+        std::thread consumer([&passed](std::shared_ptr<std::vector<uint8_t>> held, uint8_t expected) {
+            if (held->size() != 1 || (*held)[0] != expected) {
+                passed = false;
+            }
+        }, buffer, static_cast<uint8_t>( i ));
+        buffer.reset();
+
+        // Reuse it as soon as the consumer is done with it
+        for (;;) {
+            auto reused = pool.Allocate();
+            if (reused.get() == ptr) {
+                reused->push_back(0);
+                break;
+            }
+            std::this_thread::yield();
+        }
+        consumer.join();
+    }
+    Expect(passed, "Encoded buffer released on another thread is reused");
+}
+
+static void TestEncodedExhaustion()
+{
+    EncodedBufferPool pool;
+
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> held;
+    for (int i = 0; i < kEncodedBufferPoolLimit; ++i) {
+        held.push_back(pool.Allocate());
+    }
+    Expect(pool.GetOverflowCount() == 0, "No overflow while the pool has room");
+
+    // Every pooled buffer is in use
+    auto extra1 = pool.Allocate();
+    auto extra2 = pool.Allocate();
+    bool distinct = extra1 && extra2 && extra1 != extra2;
+    for (auto& buffer : held) {
+        distinct &= buffer != extra1 && buffer != extra2;
+    }
+    Expect(distinct && pool.GetOverflowCount() == 2, "Exhausted pool allocates and counts extra buffers");
+
+    // Extra buffers are not kept by the pool
+    std::weak_ptr<std::vector<uint8_t>> extra_weak = extra1;
+    extra1.reset();
+    Expect(extra_weak.expired(), "Extra buffer is freed when released");
+
+    // Pooled buffers are reused after release
+    const std::vector<uint8_t>* released_ptr = held[3].get();
+    held[3].reset();
+    auto reused = pool.Allocate();
+    Expect(reused.get() == released_ptr && pool.GetOverflowCount() == 2, "Pool is reused after exhaustion");
+}
+
+
+//------------------------------------------------------------------------------
+// FramePool
+
+static void TestFrameReuse()
+{
+    FramePool pool;
+
+    auto frame = pool.Allocate(640, 360, PixelFormat::YUV420P);
+    const Frame* frame_ptr = frame.get();
+
+    // Released to the pool but still held, like the scaled frames queued
+    // for the encoder, or the previous frame kept to detect changes
+    pool.Release(frame);
+    auto other = pool.Allocate(640, 360, PixelFormat::YUV420P);
+    Expect(other && other.get() != frame_ptr, "Held frame is not reused");
+
+    frame.reset();
+    auto reused = pool.Allocate(640, 360, PixelFormat::YUV420P);
+    Expect(reused.get() == frame_ptr, "Released frame is reused");
+}
+
+static void TestFrameCrossThread()
+{
+    FramePool pool;
+
+    std::atomic<bool> passed = ATOMIC_VAR_INIT(true);
+    for (int i = 0; i < 100; ++i)
+    {
+        auto frame = pool.Allocate(64, 64, PixelFormat::YUV420P);
+        const Frame* frame_ptr = frame.get();
+        frame->Planes[0][0] = static_cast<uint8_t>( i );
+        pool.Release(frame);
+
+        std::thread consumer([&passed](std::shared_ptr<Frame> held, uint8_t expected) {
+            if (held->Planes[0][0] != expected) {
+                passed = false;
+            }
+        }, frame, static_cast<uint8_t>( i ));
+        frame.reset();
+
+        // Reuse it as soon as the consumer is done with it.  Frames
+        // allocated meanwhile are not released, so they are not candidates
+        for (;;) {
+            auto reused = pool.Allocate(64, 64, PixelFormat::YUV420P);
+            if (reused.get() == frame_ptr) {
+                reused->Planes[0][0] = 0;
+                break;
+            }
+            std::this_thread::yield();
+        }
+        consumer.join();
+    }
+    Expect(passed, "Frame released on another thread is reused");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_buffer_pool_test");
+
+    TestEncodedReuse();
+    TestEncodedCrossThread();
+    TestEncodedExhaustion();
+    TestFrameReuse();
+    TestFrameCrossThread();
+
+    return TestResult("Buffer pool test");
+}
@@ -66,19 +66,19 @@ int main(int argc, char* argv[])
 
         bool keyframe = false; //buffer->FrameNumber % 2 == 0;
 
-        int bytes = 0;
-        uint8_t* data = encoder.Encode(frame, keyframe, bytes);
+        auto data = encoder.Encode(frame, keyframe);
 
         t1 = GetTimeUsec();
         dt = t1 - t0;
-        Logger.Info("Encoding H264 took ", dt / 1000.f, " msec: ", bytes, " bytes");
 
         if (!data) {
             Logger.Error("Encode failed");
             return;
         }
 
-        file.write((char*)data, bytes);
+        Logger.Info("Encoding H264 took ", dt / 1000.f, " msec: ", data->size(), " bytes");
+
+        file.write((const char*)data->data(), data->size());
     })) {
         Logger.Error("Failed to start capture");
         return kAppFail;
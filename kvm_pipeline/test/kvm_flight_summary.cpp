@@ -0,0 +1,226 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Summarize a flight recorder file written by the video pipeline:
+
+        kvm_flight_summary /dev/shm/kvm_flight_0.bin [last events to list]
+
+    Prints what triggered the dump, frame rate and sizes, stage time
+    percentiles, drops by reason, queue depths, the longest gap between
+    frames, input writes, and the last few events before the trigger.
+*/
+
+#include "kvm_recorder.hpp"
+#include "kvm_logger.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("FlightSummary");
+
+#include <cstdlib>
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+// Seconds from the trigger, negative before it
+static float RelativeSeconds(uint64_t time_usec, uint64_t trigger_usec)
+{
+    return ((int64_t)time_usec - (int64_t)trigger_usec) / 1000000.f;
+}
+
+static void LogHistogram(const char* name, const LatencyHistogram& histogram)
+{
+    if (histogram.GetCount() == 0) {
+        return;
+    }
+    Logger.Info("  ", name, ": p50=", histogram.GetPercentile(50.f) / 1000.f,
+        " p99=", histogram.GetPercentile(99.f) / 1000.f,
+        " max=", histogram.GetMax() / 1000.f, " msec");
+}
+
+static void LogEvent(const FlightEvent& event, uint64_t trigger_usec)
+{
+    const float t = RelativeSeconds(event.TimeUsec, trigger_usec);
+
+    switch (event.Type)
+    {
+    case FlightEventType::Frame:
+        Logger.Info("  ", t, " s: Frame #", event.FrameId, event.Detail ? " (keyframe)" : "",
+            " bytes=", event.Bytes, " queued=", event.QueueDepth,
+            " decode=", event.DecodeUsec / 1000.f, " encode=", event.EncodeUsec / 1000.f,
+            " latency=", event.LatencyUsec / 1000.f, " msec");
+        break;
+    case FlightEventType::Drop:
+        Logger.Info("  ", t, " s: Drop #", event.FrameId, " ",
+            FlightDropReasonToString((FlightDropReason)event.Detail), " queued=", event.QueueDepth);
+        break;
+    case FlightEventType::DecodeError:
+        Logger.Info("  ", t, " s: Decode error #", event.FrameId, " bytes=", event.Bytes);
+        break;
+    case FlightEventType::EncodeError:
+        Logger.Info("  ", t, " s: Encode error #", event.FrameId);
+        break;
+    case FlightEventType::Keyboard:
+    case FlightEventType::Mouse:
+        Logger.Info("  ", t, " s: ", FlightEventTypeToString(event.Type),
+            event.Detail ? " write FAILED" : " write", " in ", event.LatencyUsec / 1000.f, " msec");
+        break;
+    default:
+        Logger.Info("  ", t, " s: Unknown event ", (int)event.Type);
+        break;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        Logger.Info("Usage: kvm_flight_summary <file> [last events to list]");
+        return kAppFail;
+    }
+    const int list_count = argc >= 3 ? atoi(argv[2]) : 20;
+
+    FlightRecord record;
+    if (!ReadFlightRecord(argv[1], record)) {
+        return kAppFail;
+    }
+
+    const uint64_t trigger_usec = record.TriggerUsec;
+    const std::vector<FlightEvent>& events = record.Events;
+
+    Logger.Info("Trigger: ", FlightTriggerToString(record.Trigger),
+        ", written ", (record.PersistUsec - trigger_usec) / 1000.f, " msec later");
+    if (events.empty()) {
+        Logger.Info("No events recorded");
+        return kAppSuccess;
+    }
+    Logger.Info("Events: ", events.size(), " from ", RelativeSeconds(events.front().TimeUsec, trigger_usec),
+        " to ", RelativeSeconds(events.back().TimeUsec, trigger_usec), " seconds");
+
+    int type_counts[(int)FlightEventType::Count] = {};
+    int drop_counts[(int)FlightDropReason::Count] = {};
+    int input_failures = 0;
+    int max_queue_depth = 0;
+
+    uint64_t frame_bytes = 0, keyframe_bytes = 0;
+    uint32_t max_frame_bytes = 0;
+    int keyframes = 0;
+    uint64_t first_frame_usec = 0, last_frame_usec = 0;
+    uint64_t longest_gap_usec = 0, longest_gap_end_usec = 0;
+
+    LatencyHistogram capture_queue, decode, encode, delivery, latency, input_write;
+
+    for (const FlightEvent& event : events)
+    {
+        if ((int)event.Type < (int)FlightEventType::Count) {
+            type_counts[(int)event.Type]++;
+        }
+        if (event.QueueDepth > max_queue_depth) {
+            max_queue_depth = event.QueueDepth;
+        }
+
+        if (event.Type == FlightEventType::Frame) {
+            frame_bytes += event.Bytes;
+            if (event.Bytes > max_frame_bytes) {
+                max_frame_bytes = event.Bytes;
+            }
+            if (event.Detail) {
+                ++keyframes;
+                keyframe_bytes += event.Bytes;
+            }
+
+            if (first_frame_usec == 0) {
+                first_frame_usec = event.TimeUsec;
+            } else if (event.TimeUsec - last_frame_usec > longest_gap_usec) {
+                longest_gap_usec = event.TimeUsec - last_frame_usec;
+                longest_gap_end_usec = event.TimeUsec;
+            }
+            last_frame_usec = event.TimeUsec;
+
+            // Zero means the time is unknown
+            if (event.CaptureQueueUsec) {
+                capture_queue.Record(event.CaptureQueueUsec);
+            }
+            if (event.DecodeUsec) {
+                decode.Record(event.DecodeUsec);
+            }
+            if (event.EncodeUsec) {
+                encode.Record(event.EncodeUsec);
+            }
+            if (event.DeliveryUsec) {
+                delivery.Record(event.DeliveryUsec);
+            }
+            if (event.LatencyUsec) {
+                latency.Record(event.LatencyUsec);
+            }
+        }
+        else if (event.Type == FlightEventType::Drop) {
+            if (event.Detail < (int)FlightDropReason::Count) {
+                drop_counts[event.Detail]++;
+            }
+        }
+        else if (event.Type == FlightEventType::Keyboard || event.Type == FlightEventType::Mouse) {
+            input_write.Record(event.LatencyUsec);
+            input_failures += event.Detail ? 1 : 0;
+        }
+    }
+
+    const int frames = type_counts[(int)FlightEventType::Frame];
+    Logger.Info("Frames: ", frames);
+    if (frames > 0) {
+        const uint64_t span_usec = last_frame_usec - first_frame_usec;
+        if (span_usec > 0) {
+            Logger.Info("  ", (frames - 1) * 1000000.f / span_usec, " FPS, ",
+                frame_bytes * 8 / 1000.f / (span_usec / 1000000.f), " kbps");
+        }
+        Logger.Info("  Bytes: avg=", frame_bytes / frames, " max=", max_frame_bytes);
+        if (keyframes > 0) {
+            Logger.Info("  Keyframes: ", keyframes, " avg bytes=", keyframe_bytes / keyframes);
+        }
+        LogHistogram("Capture queue", capture_queue);
+        LogHistogram("Decode", decode);
+        LogHistogram("Encode", encode);
+        LogHistogram("Delivery", delivery);
+        LogHistogram("End to end", latency);
+
+        Logger.Info("  Last frame ", RelativeSeconds(last_frame_usec, trigger_usec), " seconds from the trigger");
+        if (longest_gap_usec > 0) {
+            Logger.Info("  Longest gap: ", longest_gap_usec / 1000.f, " msec, ending ",
+                RelativeSeconds(longest_gap_end_usec, trigger_usec), " seconds from the trigger");
+        }
+    }
+
+    Logger.Info("Max queue depth: ", max_queue_depth);
+
+    Logger.Info("Drops: ", type_counts[(int)FlightEventType::Drop]);
+    for (int i = 0; i < (int)FlightDropReason::Count; ++i) {
+        if (drop_counts[i] > 0) {
+            Logger.Info("  ", FlightDropReasonToString((FlightDropReason)i), ": ", drop_counts[i]);
+        }
+    }
+
+    Logger.Info("Decode errors: ", type_counts[(int)FlightEventType::DecodeError]);
+    Logger.Info("Encode errors: ", type_counts[(int)FlightEventType::EncodeError]);
+
+    Logger.Info("Input: keyboard=", type_counts[(int)FlightEventType::Keyboard],
+        " mouse=", type_counts[(int)FlightEventType::Mouse], " failed=", input_failures);
+    LogHistogram("HID write", input_write);
+
+    // Events leading up to the trigger
+    size_t end = 0;
+    while (end < events.size() && events[end].TimeUsec <= trigger_usec) {
+        ++end;
+    }
+    const size_t start = end > (size_t)list_count ? end - list_count : 0;
+    if (start < end) {
+        Logger.Info("Last ", end - start, " events before the trigger:");
+        for (size_t i = start; i < end; ++i) {
+            LogEvent(events[i], trigger_usec);
+        }
+    }
+
+    return kAppSuccess;
+}
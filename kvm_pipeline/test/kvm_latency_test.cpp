@@ -0,0 +1,223 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Measure keyboard input latency while the video pipeline is running.
+
+    This drives the same path as the Janus plugin: A "Client" thread stands
+    in for the Janus thread that delivers data-channel messages, and queues
+    a keyboard report every millisecond for the plugin-owned "Input" thread,
+    which parses it with InputTransport and writes it to the USB HID gadget.
+    Each report is timed from queueing until its write returns.
+
+    The reports release all keys, so the host sees no key presses.
+
+    This is run twice with the full video pipeline running: first with the
+    default scheduling for every thread, then with the thread policies from
+    KVM_THREAD_POLICY (see kvm_thread.hpp), or a default layout that gives
+    input a realtime core and isolates the decoder on two cores:
+
+        sudo kvm_latency_test [seconds]
+
+    Requires the USB gadget to be set up (/dev/hidg0), and a capture device.
+    Realtime scheduling requires root or CAP_SYS_NICE.
+*/
+
+#include "kvm_pipeline.hpp"
+#include "kvm_thread.hpp"
+#include "kvm_transport.hpp"
+#include "kvm_logger.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("LatencyTest");
+
+#include <csignal>
+#include <atomic>
+#include <algorithm>
+#include <time.h>
+
+std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
+void SignalHandler(int)
+{
+    Terminated = true;
+}
+
+// Used if KVM_THREAD_POLICY is not set
+static const char* kDefaultPolicy =
+    "Input sched=fifo prio=90 cpus=0;"
+    "Capture cpus=1; Encoder cpus=1; App cpus=1;"
+    "Decoder cpus=2,3";
+
+// Report interval, like a USB HID poll
+static const int kInputIntervalUsec = 1000;
+
+
+//------------------------------------------------------------------------------
+// Input Path
+
+// Reports as received from a client, with the time they were queued
+struct InputReports
+{
+    std::vector<uint8_t> Data;
+    uint64_t QueuedUsec = 0;
+};
+
+struct InputSamples
+{
+    // Time from queueing each report until its write returned
+    std::vector<int> TotalUsec;
+
+    // Time the write itself took
+    std::vector<int> WriteUsec;
+
+    unsigned WriteErrors = 0;
+};
+
+/*
+    Queue a keyboard report with no keys pressed every kInputIntervalUsec
+    for the input thread, in the format the browser sends:
+    <ID> <Count=1> <ModifierKeys=0>
+*/
+static void RunClientThread(int seconds, PipelineStage<InputReports>& input_node)
+{
+    SetCurrentThreadName("Client");
+
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    const int count = seconds * 1000000 / kInputIntervalUsec;
+
+    for (int i = 0; i < count && !Terminated; ++i)
+    {
+        next.tv_nsec += kInputIntervalUsec * 1000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            ++next.tv_sec;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+
+        InputReports reports;
+        reports.Data.push_back(static_cast<uint8_t>( i + 1 ));
+        reports.Data.push_back(1);
+        reports.Data.push_back(0);
+        reports.QueuedUsec = GetTimeUsec();
+        input_node.Push(std::move(reports));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Test
+
+struct LatencyResult
+{
+    int Median = 0;
+    int P99 = 0;
+    int Max = 0;
+};
+
+static LatencyResult Summarize(std::vector<int>& samples)
+{
+    LatencyResult result;
+    if (!samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        const size_t count = samples.size();
+        result.Median = samples[count / 2];
+        result.P99 = samples[count * 99 / 100];
+        result.Max = samples[count - 1];
+    }
+    return result;
+}
+
+static LatencyResult RunPhase(const char* name, int seconds, KeyboardEmulator& keyboard)
+{
+    std::atomic<unsigned> frames = ATOMIC_VAR_INIT(0);
+
+    VideoPipeline pipeline;
+    pipeline.Initialize([&](const VideoPicture& /*picture*/) {
+        ++frames;
+    });
+
+    // Let the pipeline reach full load before measuring
+    ThreadSleepForMsec(2000);
+
+    InputSamples samples;
+    samples.TotalUsec.reserve(seconds * 1000000 / kInputIntervalUsec);
+    samples.WriteUsec.reserve(seconds * 1000000 / kInputIntervalUsec);
+
+    InputTransport transport;
+    transport.Keyboard = &keyboard;
+    transport.OnReportWritten = [&](bool /*is_mouse*/, int /*bytes*/, uint64_t write_usec, bool success) {
+        samples.WriteUsec.push_back(static_cast<int>( write_usec ));
+        if (!success) {
+            ++samples.WriteErrors;
+        }
+    };
+
+    PipelineStage<InputReports> input_node;
+    input_node.Initialize("Input", [&](InputReports& reports) {
+        transport.ParseReports(reports.Data.data(), (int)reports.Data.size());
+        samples.TotalUsec.push_back(static_cast<int>( GetTimeUsec() - reports.QueuedUsec ));
+    }, QueuePolicy::Block);
+
+    std::thread client_thread(RunClientThread, seconds, std::ref(input_node));
+    client_thread.join();
+
+    // Let the input thread finish the queued reports
+    ThreadSleepForMsec(100);
+    input_node.Shutdown();
+
+    pipeline.Shutdown();
+
+    const size_t count = samples.TotalUsec.size();
+    const LatencyResult total = Summarize(samples.TotalUsec);
+    const LatencyResult write = Summarize(samples.WriteUsec);
+
+    Logger.Info(name, ": keyboard report latency median=", total.Median, " usec p99=", total.P99,
+        " usec max=", total.Max, " usec, of which the HID write median=", write.Median, " usec p99=",
+        write.P99, " usec max=", write.Max, " usec (", count, " reports, ", samples.WriteErrors,
+        " write errors, ", frames, " video frames)");
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_latency_test");
+
+    const int seconds = (argc >= 2) ? std::max(1, atoi(argv[1])) : 20;
+
+    std::signal(SIGINT, SignalHandler);
+
+    KeyboardEmulator keyboard;
+    if (!keyboard.Initialize()) {
+        Logger.Error("Keyboard initialization failed: Set up the USB gadget first");
+        return kAppFail;
+    }
+
+    ClearThreadPolicies();
+    const LatencyResult baseline = RunPhase("Default scheduling", seconds, keyboard);
+
+    if (Terminated) {
+        return kAppFail;
+    }
+
+    const char* spec = getenv(kThreadPolicyEnv);
+    if (!ParseThreadPolicies(spec ? spec : kDefaultPolicy)) {
+        Logger.Error("Invalid thread policy");
+        return kAppFail;
+    }
+    Logger.Info("Thread policy: ", spec ? spec : kDefaultPolicy);
+
+    const LatencyResult pinned = RunPhase("Thread policy", seconds, keyboard);
+
+    Logger.Info("Keyboard report latency (usec): default median=", baseline.Median, " p99=", baseline.P99,
+        " max=", baseline.Max, ", thread policy median=", pinned.Median, " p99=", pinned.P99,
+        " max=", pinned.Max);
+    if (baseline.P99 > 0) {
+        Logger.Info("p99 input latency with the thread policy is ",
+            pinned.P99 * 100.f / baseline.P99, "% of default scheduling");
+    }
+
+    return kAppSuccess;
+}
@@ -0,0 +1,119 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the overload controller against a simulated pipeline, one sample
+    per simulated second:
+
+    + Load it can handle at level 1 steps down once and holds there
+    + Heavier load steps down further and holds
+    + Light load steps back up to level 0
+    + A cost model that misleads the step up prediction flaps with a
+      growing backoff, instead of once every few seconds
+
+        kvm_overload_test
+*/
+
+#include "kvm_overload.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("OverloadTest");
+
+
+//------------------------------------------------------------------------------
+// Simulation
+
+// Cost of each level relative to level 0, as the controller predicts it
+static float LevelCost(int level)
+{
+    const OverloadLevel& l = kOverloadLevels[level];
+    return 1.f / (l.FrameDecimation * l.DecodeScale * l.DecodeScale);
+}
+
+struct SimulationResult
+{
+    int Level = 0;
+    int LevelChanges = 0;
+};
+
+/*
+    Run for the given number of seconds where the busiest stage would be
+    `load` busy at level 0.  If `level0_penalty` is above 1, level 0 costs
+    that much more than the controller predicts.
+*/
+static SimulationResult Simulate(
+    OverloadController& controller,
+    uint64_t& now_usec,
+    int seconds,
+    float load,
+    float level0_penalty = 1.f)
+{
+    SimulationResult result;
+
+    for (int i = 0; i < seconds; ++i)
+    {
+        const int level = controller.GetMetrics().Level;
+
+        float utilization = load * LevelCost(level);
+        if (level == 0) {
+            utilization *= level0_penalty;
+        }
+
+        OverloadSample sample;
+        sample.Utilization = utilization > 1.f ? 1.f : utilization;
+        sample.DroppedFrames = utilization > 1.f ? 1 : 0;
+        sample.LatencyUsec = 50 * 1000;
+        sample.CpuPercent = 10.f;
+
+        now_usec += kOverloadIntervalUsec;
+        if (controller.Update(sample, now_usec)) {
+            ++result.LevelChanges;
+        }
+    }
+
+    result.Level = controller.GetMetrics().Level;
+    return result;
+}
+
+static void ExpectResult(bool condition, const char* name, const SimulationResult& result)
+{
+    Logger.Info(name, ": level=", result.Level, " changes=", result.LevelChanges);
+    Expect(condition, name);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_overload_test");
+
+    uint64_t now_usec = 1000 * 1000;
+
+    OverloadController controller;
+
+    SimulationResult result = Simulate(controller, now_usec, 60, 1.5f);
+    ExpectResult(result.Level == 1 && result.LevelChanges == 1, "1.5x load", result);
+
+    result = Simulate(controller, now_usec, 60, 3.f);
+    ExpectResult(result.Level == 2 && result.LevelChanges == 1, "3x load", result);
+
+    result = Simulate(controller, now_usec, 60, 0.4f);
+    ExpectResult(result.Level == 0 && result.LevelChanges == 2, "0.4x load", result);
+
+    // Level 1 looks like it has room for level 0, but level 0 overloads.
+    // Without backoff this would change level about 85 times in 5 minutes
+    controller.Reset();
+    result = Simulate(controller, now_usec, 300, 0.8f, 2.f);
+    ExpectResult(result.LevelChanges <= 16, "Flapping", result);
+
+    const OverloadMetrics metrics = controller.GetMetrics();
+    Logger.Info("Metrics: level=", metrics.Level, " step downs=", metrics.StepDownCount,
+        " step ups=", metrics.StepUpCount);
+
+    return TestResult("Overload controller test");
+}
@@ -0,0 +1,117 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Measure the jitter the browser sees with and without output pacing, on
+    a simulated 30 FPS stream where P-frames take 12-20 msec to encode and
+    every 30th frame is a keyframe that takes 45 msec:
+
+    + Without pacing, pictures are delivered when the encoder finishes.
+    + With pacing, FramePacer picks the release time.
+
+    Also checks that the pacer never holds a picture longer than its maximum
+    delay, and that it releases pictures right away when the encoder falls
+    far behind instead of queueing them.
+
+        kvm_pacing_test
+*/
+
+#include "kvm_pacing.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("PacingTest");
+
+#include <random>
+
+
+//------------------------------------------------------------------------------
+// Simulation
+
+static const uint64_t kFrameIntervalUsec = 33333;
+static const int kFrameCount = 3000;
+static const int kKeyframeInterval = 30;
+
+// Encode time of a frame, with a slow stretch in the middle of the run
+static uint64_t GetEncodeUsec(int frame, std::mt19937& prng)
+{
+    if (frame >= kFrameCount / 2 && frame < kFrameCount / 2 + 10) {
+        return 100 * 1000;
+    }
+    if (frame % kKeyframeInterval == 0) {
+        return 45 * 1000;
+    }
+    std::uniform_int_distribution<int> dist(12000, 20000);
+    return dist(prng);
+}
+
+struct PacingResult
+{
+    // Smoothed jitter averaged over the run
+    float JitterUsec = 0.f;
+    uint64_t MaxDeviationUsec = 0;
+    uint64_t MaxHoldUsec = 0;
+    int Late = 0;
+};
+
+static PacingResult Simulate(bool pacing)
+{
+    std::mt19937 prng(1);
+    FramePacer pacer;
+    JitterMeter jitter;
+    PacingResult result;
+
+    // The encoder handles one frame at a time
+    uint64_t encoder_free_usec = 0;
+    double jitter_total_usec = 0.;
+
+    for (int i = 0; i < kFrameCount; ++i)
+    {
+        const uint64_t shutter_usec = 1000000 + i * kFrameIntervalUsec;
+        const uint64_t start_usec = std::max(shutter_usec, encoder_free_usec);
+        const uint64_t done_usec = start_usec + GetEncodeUsec(i, prng);
+        encoder_free_usec = done_usec;
+
+        uint64_t delivery_usec = done_usec;
+        if (pacing) {
+            delivery_usec = pacer.Schedule(shutter_usec, done_usec);
+            result.MaxHoldUsec = std::max(result.MaxHoldUsec, delivery_usec - done_usec);
+        }
+        jitter.OnPicture(shutter_usec, delivery_usec);
+        jitter_total_usec += jitter.GetJitterUsec();
+    }
+
+    result.JitterUsec = static_cast<float>( jitter_total_usec / kFrameCount );
+    result.MaxDeviationUsec = jitter.GetMaxDeviationUsec();
+    result.Late = pacer.GetLateCount();
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_pacing_test");
+
+    const PacingResult unpaced = Simulate(false);
+    const PacingResult paced = Simulate(true);
+
+    Logger.Info("Without pacing: jitter avg=", unpaced.JitterUsec / 1000.f,
+        " msec, max=", unpaced.MaxDeviationUsec / 1000.f, " msec");
+    Logger.Info("With pacing: jitter avg=", paced.JitterUsec / 1000.f,
+        " msec, max=", paced.MaxDeviationUsec / 1000.f, " msec, longest hold=",
+        paced.MaxHoldUsec / 1000.f, " msec, late pictures=", paced.Late);
+
+    Expect(paced.JitterUsec * 2.f <= unpaced.JitterUsec,
+        "Pacing at least halves the jitter");
+    Expect(paced.MaxHoldUsec <= (uint64_t)kDefaultPacingMaxDelayUsec,
+        "Pacer holds pictures no longer than the maximum delay");
+    Expect(paced.Late != 0,
+        "Slow stretch is released late instead of queued");
+
+    return TestResult("Pacing test");
+}
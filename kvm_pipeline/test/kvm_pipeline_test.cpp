@@ -3,6 +3,11 @@
 /*
     Test the video pipleine:
     Camera -> JPEG decode -> Encode -> Video Parse
+
+    Writes the video to output.h264.  Optionally also encodes a scaled
+    output, for example 1280x720, into output_1280x720.h264:
+
+        kvm_pipeline_test [width height]
 */
 
 #include "kvm_pipeline.hpp"
@@ -13,6 +18,7 @@ static logger::Channel Logger("kvm_pipeline");
 
 #include <exception>
 #include <fstream>
+#include <cstdlib>
 
 #include <csignal>
 #include <atomic>
@@ -26,9 +32,6 @@ int main(int argc, char* argv[])
 {
     SetCurrentThreadName("Main");
 
-    CORE_UNUSED(argc);
-    CORE_UNUSED(argv);
-
     Logger.Info("kvm_pipeline_test");
 
     VideoPipeline pipeline;
@@ -39,14 +42,36 @@ int main(int argc, char* argv[])
         return kAppFail;
     }
 
-    pipeline.Initialize([&](
-        uint64_t frame_number,
-        uint64_t shutter_usec,
-        const uint8_t* data,
-        int bytes
-    ) {
-        Logger.Info("Writing frame ", frame_number, " time=", shutter_usec, " bytes=", bytes);
-        file.write((const char*)data, bytes);
+    std::ofstream scaled_file;
+    if (argc >= 3)
+    {
+        VideoOutputConfig config;
+        config.Width = atoi(argv[1]);
+        config.Height = atoi(argv[2]);
+
+        const std::string scaled_path = "output_" + std::to_string(config.Width) + "x" + std::to_string(config.Height) + ".h264";
+        scaled_file.open(scaled_path);
+        if (!scaled_file) {
+            Logger.Error("Failed to open output file: ", scaled_path);
+            return kAppFail;
+        }
+
+        const int index = pipeline.AddOutput(config, [&](const VideoPicture& picture) {
+            picture.ForEachRange([&](const uint8_t* data, int bytes) {
+                scaled_file.write((const char*)data, bytes);
+            });
+        });
+        if (index < 0) {
+            Logger.Error("Invalid output resolution");
+            return kAppFail;
+        }
+    }
+
+    pipeline.Initialize([&](const VideoPicture& picture) {
+        Logger.Info("Writing frame ", picture.FrameNumber, " time=", picture.ShutterUsec, " bytes=", picture.TotalBytes());
+        picture.ForEachRange([&](const uint8_t* data, int bytes) {
+            file.write((const char*)data, bytes);
+        });
     });
     ScopedFunction pipeline_scope([&]() {
         pipeline.Shutdown();
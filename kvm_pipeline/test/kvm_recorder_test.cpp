@@ -0,0 +1,222 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the flight recorder:
+
+    + Only the latest kFlightRecorderEvents events are kept
+    + A burst of decode failures triggers a dump, but spaced failures do not
+    + An encoder error triggers a dump
+    + A stall triggers one dump, and only while video is wanted
+    + A dump reads back the same events, and dumps are rate limited
+
+        kvm_recorder_test
+*/
+
+#include "kvm_recorder.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("RecorderTest");
+
+#include <cstdio>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static FrameTiming MakeTiming(uint64_t frame_id)
+{
+    const uint64_t t = GetTimeUsec();
+
+    FrameTiming timing;
+    timing.FrameId = frame_id;
+    timing.CaptureUsec = t - 30000;
+    timing.DequeueUsec = t - 28000;
+    timing.DecodeStartUsec = t - 27000;
+    timing.DecodeEndUsec = t - 20000;
+    timing.EncodeStartUsec = t - 19000;
+    timing.EncodeEndUsec = t - 8000;
+    timing.PacketizeUsec = t - 2000;
+    timing.RelayUsec = t;
+    return timing;
+}
+
+static void TestRing()
+{
+    FlightRecorder recorder;
+    for (int i = 0; i < kFlightRecorderEvents + 100; ++i) {
+        recorder.RecordDrop(FlightDropReason::Backpressure, i, 2);
+    }
+
+    std::vector<FlightEvent> events;
+    recorder.GetEvents(0, events);
+    bool passed = events.size() == (size_t)kFlightRecorderEvents;
+    passed &= !events.empty() && events.front().FrameId == 100;
+    passed &= !events.empty() && events.back().FrameId == (uint64_t)kFlightRecorderEvents + 99;
+    Expect(passed, "Ring keeps the latest events");
+
+    recorder.GetEvents(GetTimeUsec() + 1000000, events);
+    Expect(events.empty(), "Events filtered by time");
+}
+
+static void TestDecodeFailures()
+{
+    FlightRecorder spaced;
+    for (int i = 0; i < kFlightDecodeFailureBurst * 2; ++i) {
+        spaced.RecordDecodeError(i, 1000);
+        if (i % (kFlightDecodeFailureBurst - 1) == kFlightDecodeFailureBurst - 2) {
+            ThreadSleepForMsec(kFlightDecodeFailureWindowUsec / 1000 + 50);
+        }
+    }
+    Expect(!spaced.IsTriggered(), "Spaced decode failures do not trigger");
+
+    FlightRecorder burst;
+    for (int i = 0; i < kFlightDecodeFailureBurst - 1; ++i) {
+        burst.RecordDecodeError(i, 1000);
+    }
+    bool passed = !burst.IsTriggered();
+    burst.RecordDecodeError(100, 1000);
+    passed &= burst.IsTriggered();
+
+    char dir[] = "/tmp/kvm_recorder_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        Expect(false, "Create temporary directory");
+        return;
+    }
+    const std::string path = burst.TryPersist(dir);
+    passed &= !path.empty();
+
+    FlightRecord record;
+    passed &= ReadFlightRecord(path, record);
+    passed &= record.Trigger == FlightTrigger::DecodeFailures;
+    passed &= record.Events.size() == (size_t)kFlightDecodeFailureBurst;
+    passed &= !record.Events.empty() && record.Events.back().Type == FlightEventType::DecodeError;
+
+    std::remove(path.c_str());
+    rmdir(dir);
+    Expect(passed, "Burst of decode failures triggers a dump");
+}
+
+static void TestEncoderError()
+{
+    char dir[] = "/tmp/kvm_recorder_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        Expect(false, "Create temporary directory");
+        return;
+    }
+
+    FlightRecorder recorder;
+    for (int i = 0; i < 30; ++i) {
+        recorder.RecordFrame(MakeTiming(i), 5000 + i, i == 0, i % 3);
+        recorder.RecordInput(i % 2 ? FlightEventType::Mouse : FlightEventType::Keyboard, 8, 150 + i, i != 7);
+    }
+    recorder.RecordDrop(FlightDropReason::EncoderQueue, 30, 4);
+    recorder.RecordEncodeError(31);
+
+    const std::string path = recorder.TryPersist(dir);
+
+    std::vector<FlightEvent> expected;
+    recorder.GetEvents(0, expected);
+
+    FlightRecord record;
+    bool passed = !path.empty() && ReadFlightRecord(path, record);
+    passed &= record.Trigger == FlightTrigger::EncoderError;
+    passed &= record.TriggerUsec != 0 && record.PersistUsec >= record.TriggerUsec;
+    passed &= record.Events.size() == expected.size() && expected.size() == 62;
+    for (size_t i = 0; passed && i < expected.size(); ++i) {
+        const FlightEvent& a = record.Events[i];
+        const FlightEvent& b = expected[i];
+        passed &= a.TimeUsec == b.TimeUsec && a.FrameId == b.FrameId && a.Type == b.Type;
+        passed &= a.Detail == b.Detail && a.QueueDepth == b.QueueDepth && a.Bytes == b.Bytes;
+        passed &= a.CaptureQueueUsec == b.CaptureQueueUsec && a.DecodeUsec == b.DecodeUsec;
+        passed &= a.EncodeUsec == b.EncodeUsec && a.DeliveryUsec == b.DeliveryUsec;
+        passed &= a.LatencyUsec == b.LatencyUsec;
+    }
+    Expect(passed, "Encoder error dump reads back");
+
+    const FlightEvent& frame = record.Events.empty() ? FlightEvent() : record.Events[0];
+    passed = frame.Type == FlightEventType::Frame && frame.Detail == 1 && frame.Bytes == 5000;
+    passed &= frame.CaptureQueueUsec == 2000 && frame.DecodeUsec == 7000 && frame.EncodeUsec == 11000;
+    passed &= frame.DeliveryUsec == 8000 && frame.LatencyUsec == 30000;
+    Expect(passed, "Frame event stage times");
+
+    // Another error right away is not written
+    recorder.RecordEncodeError(32);
+    passed = recorder.IsTriggered() && recorder.TryPersist(dir).empty() && !recorder.IsTriggered();
+    Expect(passed, "Dumps are rate limited");
+
+    std::remove(path.c_str());
+    rmdir(dir);
+}
+
+static void TestStall()
+{
+    FlightRecorder recorder;
+    const uint64_t t0 = GetTimeUsec();
+
+    // Not triggered while suspended
+    recorder.CheckStall(t0, false);
+    recorder.CheckStall(t0 + kFlightStallUsec * 2, false);
+    bool passed = !recorder.IsTriggered();
+
+    // The stall timer starts when video is wanted
+    recorder.CheckStall(t0 + kFlightStallUsec * 3, true);
+    recorder.CheckStall(t0 + kFlightStallUsec * 4 - 1, true);
+    passed &= !recorder.IsTriggered();
+    Expect(passed, "No stall while suspended or before the timeout");
+
+    char dir[] = "/tmp/kvm_recorder_test_XXXXXX";
+    if (!mkdtemp(dir)) {
+        Expect(false, "Create temporary directory");
+        return;
+    }
+    recorder.CheckStall(t0 + kFlightStallUsec * 4, true);
+    const std::string path = recorder.TryPersist(dir);
+    FlightRecord record;
+    passed = !path.empty() && ReadFlightRecord(path, record) && record.Trigger == FlightTrigger::Stall;
+    Expect(passed, "Stall triggers a dump");
+    std::remove(path.c_str());
+
+    // Once per stall
+    FlightRecorder once;
+    once.CheckStall(t0, true);
+    once.CheckStall(t0 + kFlightStallUsec, true);
+    passed = once.IsTriggered();
+    const std::string once_path = once.TryPersist(dir);
+    passed &= !once_path.empty();
+    std::remove(once_path.c_str());
+    once.CheckStall(t0 + kFlightStallUsec * 2, true);
+    passed &= !once.IsTriggered();
+
+    // A frame re-arms it
+    once.RecordFrame(MakeTiming(1), 1000, false, 0);
+    const uint64_t frame_usec = GetTimeUsec();
+    once.CheckStall(frame_usec + kFlightStallUsec / 2, true);
+    passed &= !once.IsTriggered();
+    once.CheckStall(frame_usec + kFlightStallUsec, true);
+    passed &= once.IsTriggered();
+    Expect(passed, "Stall triggers once until frames resume");
+
+    rmdir(dir);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_recorder_test");
+
+    TestRing();
+    TestDecodeFailures();
+    TestEncoderError();
+    TestStall();
+
+    return TestResult("Recorder test");
+}
@@ -0,0 +1,142 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the region of interest QP offset map from BuildQpOffsetMap():
+
+    + A static screen has no region of interest, even with the cursor known
+    + Changed macroblocks are favored, and more so near the cursor
+    + Unchanged macroblocks near the cursor keep offset 0
+    + Without change tracking the whole frame counts as changed
+    + The cursor region is clipped at the edges of the frame
+
+        kvm_roi_test
+*/
+
+#include "kvm_encode.hpp"
+#include "kvm_frame.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("RoiTest");
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static int CountOffsets(const QpOffsetMap& map, int offset)
+{
+    int count = 0;
+    for (int8_t value : map.Offsets) {
+        if (value == offset) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+// Mark one 16x16 macroblock as changed
+static void MarkChanged(Frame& frame, int mb_x, int mb_y)
+{
+    const int row = mb_y * 16 / frame.DirtyRowHeight;
+    frame.DirtyRows[row] = 1;
+    frame.DirtyTiles[row * frame.DirtyTilesWide + mb_x] = 1;
+}
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static void TestStatic(FramePool& pool)
+{
+    auto frame = pool.Allocate(1920, 1080, PixelFormat::YUV420P);
+    frame->ClearDirtyTiles(kDirtyTileWidth);
+
+    QpOffsetMap map;
+    BuildQpOffsetMap(*frame, 960, 540, map);
+
+    Expect(map.MacroblocksWide == 120 && map.MacroblocksHigh == 68, "Map covers the padded frame");
+    Expect(map.RoiCount == 0 && map.MinOffset == 0 &&
+        CountOffsets(map, 0) == (int)map.Offsets.size(), "Static screen has no region of interest");
+}
+
+static void TestChanged(FramePool& pool)
+{
+    auto frame = pool.Allocate(1920, 1080, PixelFormat::YUV420P);
+    frame->ClearDirtyTiles(kDirtyTileWidth);
+
+    // Typing under the cursor at macroblock (60, 33), and a clock far away
+    MarkChanged(*frame, 60, 33);
+    MarkChanged(*frame, 61, 33);
+    MarkChanged(*frame, 119, 0);
+
+    QpOffsetMap map;
+    BuildQpOffsetMap(*frame, 60 * 16 + 8, 33 * 16 + 8, map);
+
+    const int w = map.MacroblocksWide;
+    Expect(map.Offsets[33 * w + 60] == kRoiCursorQpOffset &&
+        map.Offsets[33 * w + 61] == kRoiCursorQpOffset, "Changed macroblocks near the cursor");
+    Expect(map.Offsets[0 * w + 119] == kRoiChangedQpOffset, "Changed macroblock away from the cursor");
+    Expect(map.Offsets[33 * w + 62] == 0 && map.Offsets[30 * w + 60] == 0,
+        "Unchanged macroblocks near the cursor keep offset 0");
+    Expect(map.RoiCount == 3 && map.MinOffset == kRoiCursorQpOffset &&
+        CountOffsets(map, 0) == (int)map.Offsets.size() - 3, "Only changed macroblocks are counted");
+}
+
+static void TestNoTracking(FramePool& pool)
+{
+    auto frame = pool.Allocate(1280, 720, PixelFormat::YUV420P);
+    frame->SetAllDirty();
+
+    QpOffsetMap map;
+    BuildQpOffsetMap(*frame, -1, -1, map);
+    const int total = (int)map.Offsets.size();
+    Expect(map.RoiCount == total && CountOffsets(map, kRoiChangedQpOffset) == total,
+        "Without change tracking the whole frame is changed");
+
+    BuildQpOffsetMap(*frame, 640, 360, map);
+    const int side = kRoiCursorRadius * 2 + 1;
+    Expect(map.RoiCount == total && CountOffsets(map, kRoiCursorQpOffset) == side * side,
+        "Cursor region within a fully changed frame");
+}
+
+static void TestEdges(FramePool& pool)
+{
+    // 1080 visible rows in 1088 padded rows: The cursor at the bottom right
+    // corner of the screen is in the last visible macroblock
+    auto frame = pool.Allocate(1920, 1080, PixelFormat::YUV420P);
+    frame->SetAllDirty();
+    Expect(frame->Height == 1088 && frame->VisibleWidth == 1920 && frame->VisibleHeight == 1080,
+        "Frame keeps the visible size");
+
+    const int cursor_x = 32767 * frame->VisibleWidth / 32768;
+    const int cursor_y = 32767 * frame->VisibleHeight / 32768;
+
+    QpOffsetMap map;
+    BuildQpOffsetMap(*frame, cursor_x, cursor_y, map);
+
+    const int w = map.MacroblocksWide;
+    const int cropped_side = kRoiCursorRadius + 1;
+    Expect(map.Offsets[67 * w + 119] == kRoiCursorQpOffset &&
+        CountOffsets(map, kRoiCursorQpOffset) == cropped_side * cropped_side,
+        "Cursor region is clipped at the frame edges");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_roi_test");
+
+    FramePool pool;
+    TestStatic(pool);
+    TestChanged(pool);
+    TestNoTracking(pool);
+    TestEdges(pool);
+
+    return TestResult("Region of interest test");
+}
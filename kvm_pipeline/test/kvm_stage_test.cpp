@@ -0,0 +1,389 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the pipeline stage queues and graph connections:
+
+    + Each queue policy processes and drops the expected messages, in order,
+      while the stage thread is held up
+    + A producer blocked by QueuePolicy::Block wakes when the stage takes a
+      message, and when the stage shuts down
+    + Disabled stages forward their input, inline stages run on the pushing
+      thread, and outputs fan out to every connected stage
+    + CanAccept() reports backpressure through inline and bypassed stages
+    + Messages pushed to a stopped stage are released, not stranded
+
+        kvm_stage_test
+*/
+
+#include "kvm_stage.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("StageTest");
+
+#include <mutex>
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+// Wait up to timeout_msec for condition() to become true
+template<typename F>
+static bool WaitFor(F condition, int timeout_msec = 2000)
+{
+    const uint64_t deadline_usec = GetTimeUsec() + timeout_msec * 1000;
+    while (!condition()) {
+        if (GetTimeUsec() > deadline_usec) {
+            return false;
+        }
+        ThreadSleepForMsec(1);
+    }
+    return true;
+}
+
+// Records the messages a stage processes and drops
+struct MessageLog
+{
+    std::mutex Lock;
+    std::vector<int> Processed;
+    std::vector<int> Dropped;
+
+    void OnProcessed(int message)
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Processed.push_back(message);
+    }
+
+    void OnDropped(int message)
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Dropped.push_back(message);
+    }
+
+    int GetProcessedCount()
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        return static_cast<int>( Processed.size() );
+    }
+
+    bool Matches(const std::vector<int>& processed, const std::vector<int>& dropped)
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        return Processed == processed && Dropped == dropped;
+    }
+};
+
+/*
+    PipelineStage<int> whose handler holds up the stage thread until Open,
+    so the test can fill the queue behind the message it is working on.
+*/
+struct GatedStage
+{
+    MessageLog Log;
+    std::atomic<bool> Open = ATOMIC_VAR_INIT(false);
+
+    // Declared last so it shuts down before the log goes away
+    PipelineStage<int> Stage;
+
+    void Initialize(QueuePolicy policy)
+    {
+        Stage.Initialize(QueuePolicyToString(policy), [this](int& message) {
+            Log.OnProcessed(message);
+            while (!Open && !Stage.IsTerminated()) {
+                ThreadSleepForMsec(1);
+            }
+        }, policy, [this](int& message) {
+            Log.OnDropped(message);
+        });
+    }
+
+    // Push message 0 and wait until the stage thread is held up on it
+    bool Hold()
+    {
+        Open = false;
+        const int count = Log.GetProcessedCount();
+        Stage.Push(0);
+        return WaitFor([this, count]() { return Log.GetProcessedCount() > count; });
+    }
+
+    // Push messages first..last, returning how many were accepted
+    int PushRange(int first, int last)
+    {
+        int accepted = 0;
+        for (int i = first; i <= last; ++i) {
+            if (Stage.Push(int(i))) {
+                ++accepted;
+            }
+        }
+        return accepted;
+    }
+
+    // Let the stage thread run and wait until the queue is empty
+    bool Release(int expected_count)
+    {
+        Open = true;
+        return WaitFor([this, expected_count]() {
+            return Log.GetProcessedCount() >= expected_count && Stage.GetQueuedCount() == 0;
+        });
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Queue Policies
+
+static void TestDropNewest()
+{
+    GatedStage gated;
+    gated.Initialize(QueuePolicy::DropNewest);
+
+    Expect(gated.Hold(), "DropNewest: Stage thread holds message 0");
+    const int accepted = gated.PushRange(1, 8);
+    Expect(accepted == kPipelineQueueDepth, "DropNewest: Push accepts a full queue and no more");
+    Expect(!gated.Stage.CanAccept(0), "DropNewest: CanAccept is false while the queue is full");
+
+    Expect(gated.Release(5), "DropNewest: Queue drains");
+    Expect(gated.Log.Matches({ 0, 1, 2, 3, 4 }, { 5, 6, 7, 8 }),
+        "DropNewest: Oldest messages processed in order, newest dropped");
+    Expect(gated.Stage.CanAccept(0), "DropNewest: CanAccept once drained");
+
+    gated.Stage.Shutdown();
+}
+
+static void TestDropOldest()
+{
+    GatedStage gated;
+    gated.Initialize(QueuePolicy::DropOldest);
+
+    // Push fills past the queue depth, and the stage thread trims it
+    Expect(gated.Hold(), "DropOldest: Stage thread holds message 0");
+    const int accepted = gated.PushRange(1, kPipelineQueueCapacity);
+    Expect(accepted == kPipelineQueueCapacity, "DropOldest: Push accepts up to the ring capacity");
+    Expect(!gated.Stage.Push(kPipelineQueueCapacity + 1), "DropOldest: Push drops once the ring is full");
+    Expect(gated.Stage.CanAccept(0), "DropOldest: CanAccept is always true");
+
+    Expect(gated.Release(5), "DropOldest: Queue drains");
+    Expect(gated.Log.Matches({ 0, 5, 6, 7, 8 }, { 9, 1, 2, 3, 4 }),
+        "DropOldest: Newest messages processed in order, oldest dropped");
+
+    gated.Stage.Shutdown();
+}
+
+static void TestLatestWins()
+{
+    GatedStage gated;
+    gated.Initialize(QueuePolicy::LatestWins);
+
+    Expect(gated.Hold(), "LatestWins: Stage thread holds message 0");
+    const int accepted = gated.PushRange(1, 3);
+    Expect(accepted == 3, "LatestWins: Push accepts while there is room");
+
+    Expect(gated.Release(2), "LatestWins: Queue drains");
+    Expect(gated.Log.Matches({ 0, 3 }, { 1, 2 }),
+        "LatestWins: Only the latest queued message is processed");
+
+    gated.Stage.Shutdown();
+}
+
+static void TestBlock()
+{
+    GatedStage gated;
+    gated.Initialize(QueuePolicy::Block);
+
+    Expect(gated.Hold(), "Block: Stage thread holds message 0");
+    const int accepted = gated.PushRange(1, kPipelineQueueDepth);
+    Expect(accepted == kPipelineQueueDepth, "Block: Push fills the queue");
+
+    // The next push waits for the stage thread to take a message
+    std::atomic<int> result = ATOMIC_VAR_INIT(-1);
+    std::thread producer([&gated, &result]() {
+        result = gated.Stage.Push(kPipelineQueueDepth + 1) ? 1 : 0;
+    });
+    ThreadSleepForMsec(50);
+    Expect(result == -1, "Block: Push waits while the queue is full");
+
+    const uint64_t t0 = GetTimeUsec();
+    gated.Open = true;
+    const bool woke = WaitFor([&result]() { return result != -1; });
+    const uint64_t wake_usec = GetTimeUsec() - t0;
+    producer.join();
+    Logger.Info("Blocked push woke after ", wake_usec, " usec");
+    Expect(woke && result == 1, "Block: Push wakes and queues when the stage takes a message");
+
+    Expect(gated.Release(kPipelineQueueDepth + 2), "Block: Queue drains");
+    Expect(gated.Log.Matches({ 0, 1, 2, 3, 4, 5 }, {}),
+        "Block: Every message processed in order, none dropped");
+
+    // Shutdown wakes a producer blocked on a full queue
+    Expect(gated.Hold(), "Block: Stage thread holds another message");
+    gated.PushRange(1, kPipelineQueueDepth);
+
+    result = -1;
+    std::thread blocked([&gated, &result]() {
+        result = gated.Stage.Push(-1) ? 1 : 0;
+    });
+    ThreadSleepForMsec(50);
+    Expect(result == -1, "Block: Push waits again while the queue is full");
+
+    gated.Stage.Shutdown();
+    Expect(WaitFor([&result]() { return result != -1; }, 1000) && result == 0,
+        "Block: Shutdown wakes the producer and drops its message");
+    blocked.join();
+    Expect(gated.Stage.GetQueuedCount() == 0, "Block: Shutdown releases the queued messages");
+}
+
+
+//------------------------------------------------------------------------------
+// Graph Connections
+
+typedef GraphStage<int, int> IntStage;
+typedef GraphStage<int, NoMessage> IntSink;
+
+// Configure an inline sink that logs what it receives on the pushing thread
+static void ConfigureSink(IntSink& sink, const char* name, MessageLog& log, std::thread::id& thread_id)
+{
+    StageOptions options;
+    options.Placement = StagePlacement::Inline;
+    sink.Configure(name, options, [&log, &thread_id](int& message, StageOutput<NoMessage>& /*output*/) {
+        thread_id = std::this_thread::get_id();
+        log.OnProcessed(message);
+    }, [&log](int& message) {
+        log.OnDropped(message);
+    });
+}
+
+static void TestBypassAndFanOut()
+{
+    MessageLog log_a, log_b;
+    std::thread::id thread_a, thread_b;
+
+    IntSink sink_a, sink_b;
+    ConfigureSink(sink_a, "SinkA", log_a, thread_a);
+    ConfigureSink(sink_b, "SinkB", log_b, thread_b);
+
+    // Disabled stage that would negate its input if it ran
+    IntStage bypassed;
+    StageOptions disabled;
+    disabled.Enabled = false;
+    bypassed.Configure("Bypassed", disabled, [](int& message, StageOutput<int>& output) {
+        output.Push(-message);
+    });
+    Expect(!bypassed.IsEnabled(), "Stage with matching types can be disabled");
+
+    bypassed.Connect(sink_a);
+    bypassed.Connect(sink_b);
+
+    PipelineGraph graph;
+    graph.Add(&bypassed);
+    graph.Add(&sink_a);
+    graph.Add(&sink_b);
+    graph.Start();
+
+    bypassed.Push(7);
+    bypassed.Push(8);
+
+    Expect(log_a.Matches({ 7, 8 }, {}) && log_b.Matches({ 7, 8 }, {}),
+        "Bypassed stage forwards its input to every connected stage");
+    Expect(thread_a == std::this_thread::get_id() && thread_b == std::this_thread::get_id(),
+        "Inline stages run on the pushing thread");
+
+    graph.Stop();
+
+    bypassed.Push(9);
+    sink_a.Push(10);
+    Expect(log_a.Matches({ 7, 8 }, { 10 }) && log_b.Matches({ 7, 8 }, {}),
+        "Stopped stages release pushed messages");
+}
+
+static void TestCanAccept()
+{
+    // Threaded sink held up on its first message
+    MessageLog log;
+    std::atomic<bool> open = ATOMIC_VAR_INIT(false);
+    IntSink sink;
+    sink.Configure("Sink", StageOptions(), [&log, &open, &sink](int& message, StageOutput<NoMessage>& /*output*/) {
+        log.OnProcessed(message);
+        while (!open && sink.IsRunning()) {
+            ThreadSleepForMsec(1);
+        }
+    }, [&log](int& message) {
+        log.OnDropped(message);
+    });
+
+    // Inline stage in front of it, which asks downstream before working
+    IntStage tap;
+    StageOptions inline_options;
+    inline_options.Placement = StagePlacement::Inline;
+    tap.Configure("Tap", inline_options, [](int& message, StageOutput<int>& output) {
+        if (output.CanAccept(0)) {
+            output.Push(std::move(message));
+        }
+    });
+    tap.Connect(sink);
+
+    PipelineGraph graph;
+    graph.Add(&tap);
+    graph.Add(&sink);
+    graph.Start();
+
+    Expect(tap.CanAccept(0), "CanAccept through an inline stage with an idle sink");
+
+    tap.Push(0);
+    Expect(WaitFor([&log]() { return log.GetProcessedCount() > 0; }), "Sink holds message 0");
+    for (int i = 1; i <= kPipelineQueueDepth; ++i) {
+        tap.Push(int(i));
+    }
+    Expect(!tap.CanAccept(0), "CanAccept is false through an inline stage with a full sink");
+
+    // Skipped by the tap instead of queued and dropped by the sink
+    tap.Push(kPipelineQueueDepth + 1);
+    Expect(sink.GetQueuedCount() == kPipelineQueueDepth, "Full sink queue unchanged");
+
+    open = true;
+    Expect(WaitFor([&log, &sink]() {
+        return log.GetProcessedCount() == kPipelineQueueDepth + 1 && sink.GetQueuedCount() == 0;
+    }), "Sink drains");
+    Expect(tap.CanAccept(0), "CanAccept once the sink drains");
+    Expect(log.Matches({ 0, 1, 2, 3, 4 }, {}), "Tap skipped the message instead of the sink dropping it");
+
+    // A second, idle sink makes the fan-out accept again
+    open = false;
+    tap.Push(0);
+    Expect(WaitFor([&log]() { return log.GetProcessedCount() > kPipelineQueueDepth + 1; }), "Sink holds another message");
+    for (int i = 1; i <= kPipelineQueueDepth; ++i) {
+        tap.Push(int(i));
+    }
+    Expect(!tap.CanAccept(0), "Single full sink does not accept");
+
+    MessageLog idle_log;
+    std::thread::id idle_thread;
+    IntSink idle;
+    ConfigureSink(idle, "Idle", idle_log, idle_thread);
+    idle.Start();
+    tap.Connect(idle);
+    Expect(tap.CanAccept(0), "Fan-out accepts if any connected stage accepts");
+
+    graph.Stop();
+    idle.Stop();
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_stage_test");
+
+    TestDropNewest();
+    TestDropOldest();
+    TestLatestWins();
+    TestBlock();
+    TestBypassAndFanOut();
+    TestCanAccept();
+
+    return TestResult("Stage test");
+}
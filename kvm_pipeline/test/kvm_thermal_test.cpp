@@ -0,0 +1,215 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the thermal governor against fake sysfs files in a temporary
+    directory, with simulated time:
+
+    + Missing files leave the governor inactive
+    + Heating up steps the state up right away
+    + Cooling down steps back one state at a time, after the hold time and
+      only below the hysteresis band
+    + Without the firmware throttle file, a low CPU clock only counts as
+      throttling while warm
+    + The minimum level holds the overload controller down, and lifting it
+      lets the controller step back up
+
+        kvm_thermal_test
+*/
+
+#include "kvm_thermal.hpp"
+#include "kvm_overload.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("ThermalTest");
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+
+
+//------------------------------------------------------------------------------
+// Fake sysfs
+
+struct FakeSysfs
+{
+    std::string Dir;
+
+    bool Create()
+    {
+        char path[] = "/tmp/kvm_thermal_test_XXXXXX";
+        if (!mkdtemp(path)) {
+            return false;
+        }
+        Dir = path;
+        return true;
+    }
+
+    ~FakeSysfs()
+    {
+        if (Dir.empty()) {
+            return;
+        }
+        for (const char* name : { "temp", "cur_freq", "max_freq", "get_throttled" }) {
+            std::remove(Path(name).c_str());
+        }
+        rmdir(Dir.c_str());
+    }
+
+    std::string Path(const char* name) const
+    {
+        return Dir + "/" + name;
+    }
+
+    void Write(const char* name, const std::string& value) const
+    {
+        std::ofstream file(Path(name));
+        file << value << "\n";
+    }
+
+    void Remove(const char* name) const
+    {
+        std::remove(Path(name).c_str());
+    }
+
+    ThermalSettings GetSettings() const
+    {
+        ThermalSettings settings;
+        settings.TemperaturePath = Path("temp");
+        settings.CurrentFreqPath = Path("cur_freq");
+        settings.MaxFreqPath = Path("max_freq");
+        settings.ThrottledPath = Path("get_throttled");
+        return settings;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+static void ExpectState(const ThermalGovernor& governor, ThermalState state, const char* name)
+{
+    const ThermalStatus status = governor.GetStatus();
+    Logger.Info(name, ": state=", ThermalStateToString(status.State),
+        " expected=", ThermalStateToString(state), " temperature=", status.TemperatureMillidegrees,
+        " min level=", status.MinOverloadLevel);
+    Expect(status.State == state, name);
+}
+
+// Advance simulated time, reading the fake files at every interval
+static void Run(ThermalGovernor& governor, uint64_t& now_usec, uint64_t duration_usec)
+{
+    const uint64_t end_usec = now_usec + duration_usec;
+    while (now_usec < end_usec) {
+        now_usec += kThermalIntervalUsec;
+        governor.Update(now_usec);
+    }
+}
+
+static void TestGovernor(const FakeSysfs& sysfs)
+{
+    ThermalGovernor governor;
+    governor.SetSettings(sysfs.GetSettings());
+    uint64_t now_usec = 1000 * 1000;
+
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Unknown, "Missing files");
+
+    sysfs.Write("max_freq", "1500000");
+    sysfs.Write("cur_freq", "1500000");
+    sysfs.Write("get_throttled", "0");
+
+    sysfs.Write("temp", "60000");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Normal, "60 C");
+
+    sysfs.Write("temp", "72000");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Warm, "72 C");
+
+    sysfs.Write("temp", "77000");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Hot, "77 C");
+
+    sysfs.Write("get_throttled", "e0004");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Throttled, "Firmware throttling");
+
+    // Not throttling any more, but still too warm to leave the state
+    sysfs.Write("get_throttled", "e0000");
+    sysfs.Write("temp", "71000");
+    Run(governor, now_usec, kThermalHoldUsec * 2);
+    ExpectState(governor, ThermalState::Throttled, "Hysteresis at 71 C");
+
+    // Steps down one state per hold time
+    sysfs.Write("temp", "64000");
+    Run(governor, now_usec, kThermalHoldUsec);
+    ExpectState(governor, ThermalState::Hot, "Cooling after one hold time");
+    Run(governor, now_usec, kThermalHoldUsec * 3);
+    ExpectState(governor, ThermalState::Normal, "Cooled down");
+
+    // Low clock at idle temperatures is the CPU governor, not throttling
+    sysfs.Remove("get_throttled");
+    sysfs.Write("cur_freq", "600000");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Normal, "Idle clock at 64 C");
+
+    sysfs.Write("temp", "72000");
+    Run(governor, now_usec, kThermalIntervalUsec);
+    ExpectState(governor, ThermalState::Throttled, "Low clock at 72 C");
+
+    Logger.Info("Thermal state went up ", governor.GetStatus().StepUpCount, " times");
+}
+
+static void TestMinLevel()
+{
+    OverloadController controller;
+    uint64_t now_usec = 1000 * 1000;
+
+    controller.SetMinLevel(2);
+    bool passed = controller.GetMetrics().Level == 2;
+
+    // Quiet samples do not step up past the minimum level
+    OverloadSample quiet;
+    quiet.Utilization = 0.01f;
+    quiet.CpuPercent = 1.f;
+    for (int i = 0; i < kOverloadStepUpIntervals * 4; ++i) {
+        now_usec += kOverloadIntervalUsec;
+        controller.Update(quiet, now_usec);
+    }
+    passed &= controller.GetMetrics().Level == 2;
+
+    // Once lifted, the level steps back up
+    controller.SetMinLevel(0);
+    for (int i = 0; i < kOverloadStepUpIntervals * 4; ++i) {
+        now_usec += kOverloadIntervalUsec;
+        controller.Update(quiet, now_usec);
+    }
+    passed &= controller.GetMetrics().Level == 0;
+
+    Expect(passed, "Minimum overload level");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_thermal_test");
+
+    FakeSysfs sysfs;
+    if (!sysfs.Create()) {
+        Logger.Error("Failed to create temporary directory");
+        return kAppFail;
+    }
+
+    TestGovernor(sysfs);
+    TestMinLevel();
+
+    return TestResult("Thermal governor test");
+}
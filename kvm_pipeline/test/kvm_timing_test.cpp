@@ -0,0 +1,195 @@
+// Copyright 2020 Christopher A. Taylor
+
+/*
+    Test the latency histograms and per-frame timing:
+
+    + Percentiles of known distributions are within the bucket precision
+    + Merged histograms match one histogram of all the values
+    + FrameTimingStats splits frame records into the expected intervals,
+      and ignores capture times from another clock
+    + Thread CPU time only counts time the thread was running
+
+        kvm_timing_test
+*/
+
+#include "kvm_timing.hpp"
+#include "kvm_logger.hpp"
+#include "kvm_test.hpp"
+using namespace kvm;
+
+static logger::Channel Logger("TimingTest");
+
+#include <random>
+
+
+//------------------------------------------------------------------------------
+// Tests
+
+// True if value is within the bucket precision of expected
+static bool IsNear(uint64_t value, uint64_t expected)
+{
+    const uint64_t tolerance = expected / kHistogramSubBuckets + 1;
+    return value + tolerance >= expected && value <= expected + tolerance;
+}
+
+static void TestBuckets()
+{
+    bool passed = true;
+    int last_bucket = 0;
+    for (uint64_t value = 0; value < 1000000; ++value) {
+        const int bucket = GetHistogramBucket(value);
+        passed &= bucket == last_bucket || bucket == last_bucket + 1;
+        passed &= GetHistogramBucketLow(bucket) <= value && value <= GetHistogramBucketHigh(bucket);
+        last_bucket = bucket;
+    }
+    passed &= GetHistogramBucket(UINT64_C(1) << 40) == kHistogramBucketCount - 1;
+    Expect(passed, "Buckets are contiguous and hold their values");
+}
+
+static void TestPercentiles()
+{
+    LatencyHistogram uniform;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        uniform.Record(value);
+    }
+
+    bool passed = uniform.GetCount() == 100000;
+    passed &= IsNear(uniform.GetPercentile(50.f), 50000);
+    passed &= IsNear(uniform.GetPercentile(90.f), 90000);
+    passed &= IsNear(uniform.GetPercentile(99.f), 99000);
+    passed &= uniform.GetPercentile(100.f) == 100000;
+    passed &= uniform.GetMin() == 1 && uniform.GetMax() == 100000;
+    Expect(passed, "Uniform percentiles");
+
+    // Mostly 5 msec with one spike of 60 msec in every 100 frames
+    LatencyHistogram spiky;
+    for (int i = 0; i < 10000; ++i) {
+        spiky.Record(i % 100 == 99 ? 60000 : 5000);
+    }
+    passed = IsNear(spiky.GetPercentile(50.f), 5000);
+    passed &= IsNear(spiky.GetPercentile(98.f), 5000);
+    passed &= spiky.GetPercentile(99.5f) == 60000;
+    passed &= spiky.GetMax() == 60000;
+    Logger.Info("Spiky: mean=", spiky.GetMean(), " p50=", spiky.GetPercentile(50.f),
+        " p99.5=", spiky.GetPercentile(99.5f), " (usec)");
+    Expect(passed, "Rare spikes show up in the tail percentiles");
+
+    LatencyHistogram empty;
+    Expect(empty.GetPercentile(99.f) == 0 && empty.GetMax() == 0, "Empty histogram");
+}
+
+static void TestMerge()
+{
+    std::mt19937 prng(1);
+    std::exponential_distribution<double> dist(1. / 8000.);
+
+    LatencyHistogram all, a, b;
+    for (int i = 0; i < 20000; ++i) {
+        const uint64_t value = static_cast<uint64_t>( dist(prng) );
+        all.Record(value);
+        (i % 3 == 0 ? a : b).Record(value);
+    }
+    a.Merge(b);
+
+    bool passed = a.GetCount() == all.GetCount() && a.GetMax() == all.GetMax() && a.GetMin() == all.GetMin();
+    for (float p : { 50.f, 90.f, 99.f, 99.9f }) {
+        passed &= a.GetPercentile(p) == all.GetPercentile(p);
+    }
+    Expect(passed, "Merged histograms");
+}
+
+static void TestFrameTiming()
+{
+    FrameTimingStats stats;
+
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t t = 10000000 + i * 33333;
+
+        FrameTiming timing;
+        timing.FrameId = i;
+        timing.CaptureUsec = t;
+        timing.DequeueUsec = t + 2000;
+        timing.DecodeStartUsec = t + 2100;
+        timing.DecodeEndUsec = t + 10100; // 8 msec decode
+        timing.DecodeCpuUsec = 7500;
+        timing.EncodeStartUsec = t + 10300;
+        timing.EncodeEndUsec = t + (i % 50 == 0 ? 55300 : 22300); // Keyframes take 45 msec
+        timing.EncodeCpuUsec = 500;
+        timing.ParseEndUsec = timing.EncodeEndUsec + 100;
+        timing.PacketizeUsec = timing.ParseEndUsec + 200;
+        timing.RelayUsec = timing.PacketizeUsec + 400;
+
+        // Some frames have a capture time from another clock
+        if (i % 10 == 5) {
+            timing.CaptureUsec = 1;
+        }
+        stats.Record(timing);
+    }
+
+    const FrameIntervalSummary decode = stats.GetSummary(FrameInterval::Decode);
+    bool passed = decode.Count == 1000 && IsNear(decode.P50Usec, 8000) && decode.MaxUsec == 8000;
+    Expect(passed, "Decode interval");
+
+    const FrameIntervalSummary decode_cpu = stats.GetSummary(FrameInterval::DecodeCpu);
+    Expect(decode_cpu.Count == 1000 && IsNear(decode_cpu.P50Usec, 7500), "Decode CPU time");
+
+    const FrameIntervalSummary encode = stats.GetSummary(FrameInterval::Encode);
+    passed = IsNear(encode.P50Usec, 12000) && IsNear(encode.P99Usec, 45000) && encode.MaxUsec == 45000;
+    Expect(passed, "Encode keyframes in p99");
+
+    const FrameIntervalSummary capture = stats.GetSummary(FrameInterval::CaptureQueue);
+    const FrameIntervalSummary end_to_end = stats.GetSummary(FrameInterval::EndToEnd);
+    passed = capture.Count == 900 && end_to_end.Count == 900;
+    passed &= IsNear(end_to_end.P50Usec, 23000) && end_to_end.MaxUsec == 56000;
+    Logger.Info("End to end: p50=", end_to_end.P50Usec, " p90=", end_to_end.P90Usec,
+        " p99=", end_to_end.P99Usec, " max=", end_to_end.MaxUsec, " (usec)");
+    Expect(passed, "End to end skips capture times from another clock");
+
+    // Frames dropped before encoding have no encoder times
+    FrameTiming dropped;
+    dropped.DequeueUsec = 1000;
+    dropped.DecodeStartUsec = 2000;
+    stats.Record(dropped);
+    Expect(stats.GetSummary(FrameInterval::Encode).Count == 1000, "Missing times are skipped");
+
+    stats.Reset();
+    Expect(stats.GetSummary(FrameInterval::Decode).Count == 0, "Reset");
+}
+
+static void TestThreadCpu()
+{
+    const uint64_t wall_start = GetTimeUsec();
+    const uint64_t cpu_start = GetThreadCpuUsec();
+    ThreadSleepForMsec(50);
+    const uint64_t sleep_cpu = GetThreadCpuUsec() - cpu_start;
+
+    volatile uint64_t sum = 0;
+    while (GetTimeUsec() - wall_start < 100 * 1000) {
+        for (int i = 0; i < 1000; ++i) {
+            sum += i;
+        }
+    }
+    const uint64_t busy_cpu = GetThreadCpuUsec() - cpu_start - sleep_cpu;
+
+    Logger.Info("Thread CPU: sleeping=", sleep_cpu, " busy=", busy_cpu, " (usec)");
+    Expect(sleep_cpu < 10 * 1000 && busy_cpu > 5 * 1000, "Thread CPU time");
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main()
+{
+    SetCurrentThreadName("Main");
+
+    Logger.Info("kvm_timing_test");
+
+    TestBuckets();
+    TestPercentiles();
+    TestMerge();
+    TestFrameTiming();
+    TestThreadCpu();
+
+    return TestResult("Timing test");
+}